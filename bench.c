@@ -0,0 +1,656 @@
+/** Benchmark senza interfaccia: avvia un server e
+ * più peer sull'interfaccia di loopback, riempie i
+ * registri dei giorni passati con entry generate e
+ * riproduce un carico di comandi add e get.
+ *
+ * Al termine riporta sullo standard output, in
+ * formato JSON, throughput, latenza delle query,
+ * tasso di successo della cache delle risposte e
+ * traffico del protocollo FLOODING per query,
+ * separato da quello di push e sincronizzazione.
+ * Le stampe dei peer sono scartate, gli errori e
+ * l'avanzamento vanno sullo standard error.
+ */
+#define _GNU_SOURCE /* per realpath */
+#include "peer-src/peer_instance.h"
+#include "peer-src/peer_entries_manager.h"
+#include "peer-src/peer_query.h"
+#include "peer-src/peer_tcp.h"
+#include "commons.h"
+#include "register.h"
+#include "time_utils.h"
+#include "unified_io.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define ARGNAMES "DS_porta> <numero_peer"
+
+/* massimo numero di peer avviabili */
+#define BENCH_MAX_PEERS 4096
+/* massimo numero di client concorrenti */
+#define BENCH_MAX_CLIENTS 64
+
+/** Parametri predefiniti del carico, modificabili
+ * da riga di comando.
+ */
+#ifndef BENCH_SEED_DAYS
+#define BENCH_SEED_DAYS 30
+#endif
+
+#ifndef BENCH_SEED_ENTRIES
+#define BENCH_SEED_ENTRIES 4
+#endif
+
+#ifndef BENCH_OPERATIONS
+#define BENCH_OPERATIONS 200
+#endif
+
+#ifndef BENCH_GET_PERCENT
+#define BENCH_GET_PERCENT 80
+#endif
+
+#ifndef BENCH_MAX_SPAN
+#define BENCH_MAX_SPAN 7
+#endif
+
+#define BENCH_DS_PATH "./ds"
+
+/** Tentativi di avvio di ciascun peer, a distanza
+ * di BENCH_RETRY_DELAY millisecondi: il server
+ * potrebbe non essere ancora in ascolto e la porta
+ * UDP scelta dal sistema potrebbe non essere libera
+ * per il TCP.
+ */
+#define BENCH_START_ATTEMPTS 10
+#define BENCH_RETRY_DELAY 200
+
+/** Secondi di attesa, tra l'avvio dell'ultimo peer
+ * e l'inizio del carico, perché le connessioni tra
+ * vicini si stabilizzino.
+ */
+#ifndef BENCH_SETTLE
+#define BENCH_SETTLE 2
+#endif
+
+/* parametri del benchmark */
+struct bench_config
+{
+    int dsPort;
+    int peers;
+    int seedDays;
+    int seedEntries;
+    int operations;
+    int getPercent;
+    int maxSpan;
+    int clients;
+    unsigned int seed;
+    char dsPath[PATH_MAX];
+};
+
+/* misure raccolte da un client */
+struct bench_client
+{
+    pthread_t tid;
+    unsigned int seed;
+    int operations;
+    /* latenze delle get, in microsecondi */
+    double* latencies;
+    size_t gets, adds, failed;
+};
+
+/* contatori sommati su tutti i peer */
+struct bench_counters
+{
+    struct answer_cache_stats cache;
+    struct tcp_traffic_stats traffic;
+};
+
+static struct bench_config CONFIG;
+
+/* peer avviati */
+static struct peer_instance** INSTANCES;
+static int INSTANCESnumber;
+
+void usageHelp(const char* p)
+{
+    printf("Usage:\n\t%s [opzioni] <" ARGNAMES ">\n", p);
+    printf("Opzioni:\n");
+    printf("\t-d <giorni>\tgiorni passati con entry generate (%d)\n", BENCH_SEED_DAYS);
+    printf("\t-e <entry>\tentry generate per peer e giorno (%d)\n", BENCH_SEED_ENTRIES);
+    printf("\t-n <op>\t\toperazioni del carico (%d)\n", BENCH_OPERATIONS);
+    printf("\t-g <%%>\t\tpercentuale di get nel carico (%d)\n", BENCH_GET_PERCENT);
+    printf("\t-w <giorni>\tmassima ampiezza dell'intervallo delle get (%d)\n", BENCH_MAX_SPAN);
+    printf("\t-c <client>\tclient che eseguono il carico in parallelo (1)\n");
+    printf("\t-s <seme>\tseme del generatore pseudocasuale (1)\n");
+    printf("\t-D <percorso>\teseguibile del server (" BENCH_DS_PATH ")\n");
+    printf("\t-C <cartella>\tcartella in cui server e peer salvano i file\n");
+
+    exit(EXIT_FAILURE);
+}
+
+/* millisecondi trascorsi dall'istante indicato */
+static double elapsedMs(const struct timespec* start)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+        errExit("*** clock_gettime ***\n");
+
+    return (double)(now.tv_sec - start->tv_sec)*1e3
+        + (double)(now.tv_nsec - start->tv_nsec)/1e6;
+}
+
+static void sleepMs(long ms)
+{
+    struct timespec t;
+
+    t.tv_sec = ms / 1000;
+    t.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&t, &t) != 0)
+        ;
+}
+
+/** Avvia il server come processo figlio, senza
+ * terminale e con l'output scartato.
+ *
+ * Restituisce il pid del figlio.
+ */
+static pid_t startServer(void)
+{
+    char portStr[8];
+    pid_t pid;
+    int devNull;
+
+    sprintf(portStr, "%d", CONFIG.dsPort);
+
+    pid = fork();
+    if (pid == -1)
+        errExit("*** fork ***\n");
+    if (pid != 0)
+        return pid;
+
+    devNull = open("/dev/null", O_RDWR);
+    if (devNull == -1
+        || dup2(devNull, STDIN_FILENO) == -1
+        || dup2(devNull, STDOUT_FILENO) == -1
+        || dup2(devNull, STDERR_FILENO) == -1)
+        _exit(EXIT_FAILURE);
+    execl(CONFIG.dsPath, CONFIG.dsPath, portStr, (char*)NULL);
+    _exit(EXIT_FAILURE);
+}
+
+/* termina il server e ne attende la fine */
+static void stopServer(pid_t pid)
+{
+    int status;
+
+    if (kill(pid, SIGTERM) != 0)
+        errExit("*** kill ***\n");
+    if (waitpid(pid, &status, 0) != pid)
+        errExit("*** waitpid ***\n");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        fprintf(stderr, "Il server è terminato in modo anomalo\n");
+}
+
+static void startPeers(void)
+{
+    char portStr[8];
+    int i, attempt;
+
+    sprintf(portStr, "%d", CONFIG.dsPort);
+
+    for (i = 0; i < INSTANCESnumber; ++i)
+    {
+        for (attempt = 0; attempt != BENCH_START_ATTEMPTS && INSTANCES[i] == NULL; ++attempt)
+        {
+            if (attempt != 0)
+                sleepMs(BENCH_RETRY_DELAY);
+            INSTANCES[i] = peer_instance_start(0, "127.0.0.1", portStr);
+        }
+        if (INSTANCES[i] == NULL)
+            errExit("*** Errore avvio del peer %d ***\n", i);
+    }
+}
+
+/** Riempie i registri degli ultimi CONFIG.seedDays
+ * giorni conclusi del peer corrente con entry
+ * generate e firmate dal peer stesso.
+ */
+static void seedRegisters(int signature, unsigned int* seed)
+{
+    struct e_register* R;
+    struct entry* E;
+    struct tm last, date;
+    int d, e;
+
+    last = lastRegisterClosed();
+    for (d = 0; d < CONFIG.seedDays; ++d)
+    {
+        date = time_date_sub(&last, d);
+        R = register_create_date(NULL, signature, &date);
+        if (R == NULL)
+            errExit("*** register_create_date ***\n");
+        for (e = 0; e < CONFIG.seedEntries; ++e)
+        {
+            E = register_new_entry_date(NULL, rand_r(seed) % 2 ? SWAB : NEW_CASE,
+                1 + rand_r(seed) % 100, signature, &date);
+            if (E == NULL || register_add_entry(R, E) != 0)
+                errExit("*** register_add_entry ***\n");
+            register_free_entry(E);
+        }
+        if (mergeRegisterContent(R) == -1)
+            errExit("*** mergeRegisterContent ***\n");
+        register_destroy(R);
+    }
+}
+
+/* somma i contatori di tutti i peer */
+static void readCounters(struct bench_counters* C)
+{
+    struct answer_cache_stats cache;
+    struct tcp_traffic_stats traffic;
+    int i;
+
+    memset(C, 0, sizeof(struct bench_counters));
+    for (i = 0; i < INSTANCESnumber; ++i)
+    {
+        peer_context_set(peer_instance_context(INSTANCES[i]));
+        getAnswerCacheStats(&cache);
+        TCPgetTrafficStats(&traffic);
+        C->cache.hits += cache.hits;
+        C->cache.misses += cache.misses;
+        C->cache.evictions += cache.evictions;
+        C->cache.cached += cache.cached;
+        C->cache.composed += cache.composed;
+        C->cache.fromNeighbours += cache.fromNeighbours;
+        C->cache.flooded += cache.flooded;
+        C->traffic.messages += traffic.messages;
+        C->traffic.bytes += traffic.bytes;
+        C->traffic.floodMessages += traffic.floodMessages;
+        C->traffic.floodBytes += traffic.floodBytes;
+        C->traffic.reqDataMessages += traffic.reqDataMessages;
+        C->traffic.reqDataBytes += traffic.reqDataBytes;
+        C->traffic.pushMessages += traffic.pushMessages;
+        C->traffic.pushBytes += traffic.pushBytes;
+        C->traffic.syncMessages += traffic.syncMessages;
+        C->traffic.syncBytes += traffic.syncBytes;
+    }
+    peer_context_set(NULL);
+}
+
+/** Esegue una get casuale sui giorni riempiti da
+ * seedRegisters per conto del peer corrente.
+ *
+ * Restituisce 0 in caso di successo e -1 in caso
+ * di errore.
+ */
+static int benchGet(unsigned int* seed)
+{
+    enum aggregation_type aggregation;
+    struct tm last, oldest, begin, end;
+    struct query query;
+    struct answer* ans;
+    int span;
+
+    last = lastRegisterClosed();
+    oldest = time_date_sub(&last, CONFIG.seedDays-1);
+    end = time_date_sub(&last, rand_r(seed) % CONFIG.seedDays);
+    span = 1 + rand_r(seed) % CONFIG.maxSpan;
+    begin = time_date_sub(&end, span-1);
+    if (time_date_cmp(&begin, &oldest) < 0)
+        begin = oldest;
+
+    /* una variazione richiede almeno due giorni */
+    aggregation = rand_r(seed) % 2 ? AGGREGATION_SUM : AGGREGATION_DIFF;
+    if (time_date_cmp(&begin, &end) == 0)
+        aggregation = AGGREGATION_SUM;
+
+    if (buildQuery(&query, aggregation, rand_r(seed) % 2 ? SWAB : NEW_CASE, &begin, &end) != 0)
+        return -1;
+
+    ans = calcEntryQuery(&query);
+    if (ans == NULL)
+        return -1;
+    releaseCachedAnswer(ans);
+
+    return 0;
+}
+
+/* come add ma senza stampe */
+static int benchAdd(unsigned int* seed)
+{
+    struct entry* E;
+    int ans;
+
+    E = register_new_entry(NULL, rand_r(seed) % 2 ? SWAB : NEW_CASE, 1 + rand_r(seed) % 10, 0);
+    if (E == NULL)
+        return -1;
+    ans = addEntryToCurrent(E);
+    register_free_entry(E);
+
+    return ans;
+}
+
+/** Funzione dei client: esegue le operazioni
+ * assegnate, ciascuna per conto di un peer
+ * scelto a caso.
+ */
+static void* CLIENT(void* args)
+{
+    struct bench_client* client;
+    struct peer_instance* inst;
+    struct timespec start;
+    int i;
+
+    client = (struct bench_client*)args;
+    for (i = 0; i < client->operations; ++i)
+    {
+        inst = INSTANCES[rand_r(&client->seed) % INSTANCESnumber];
+        if (!peer_instance_running(inst))
+        {
+            ++client->failed;
+            continue;
+        }
+        peer_context_set(peer_instance_context(inst));
+        if ((int)(rand_r(&client->seed) % 100) < CONFIG.getPercent)
+        {
+            if (clock_gettime(CLOCK_MONOTONIC, &start) != 0)
+                errExit("*** clock_gettime ***\n");
+            if (benchGet(&client->seed) != 0)
+                ++client->failed;
+            else
+                client->latencies[client->gets++] = elapsedMs(&start)*1e3;
+        }
+        else if (benchAdd(&client->seed) != 0)
+            ++client->failed;
+        else
+            ++client->adds;
+        peer_context_set(NULL);
+    }
+
+    return NULL;
+}
+
+static int cmpDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* percentile p (tra 0 e 100) di un array ordinato */
+static double percentile(const double* v, size_t n, double p)
+{
+    size_t rank;
+
+    if (n == 0)
+        return 0;
+    rank = (size_t)(p/100.0*(double)n + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+
+    return v[rank-1];
+}
+
+/* rapporto che vale 0 se il denominatore è nullo */
+static double ratio(double num, double den)
+{
+    return den != 0 ? num/den : 0;
+}
+
+static void printReport(FILE* out, struct bench_client* clients, double elapsed,
+    const struct bench_counters* before, const struct bench_counters* after)
+{
+    double* latencies;
+    double sum;
+    size_t gets, adds, failed, i, j;
+    unsigned long hits, misses, cached, composed, neighbours, flooded, answered;
+    unsigned long floodMsg, floodBytes, reqMsg, reqBytes, msg, bytes;
+    unsigned long pushMsg, pushBytes, syncMsg, syncBytes;
+
+    gets = adds = failed = 0;
+    for (i = 0; i != (size_t)CONFIG.clients; ++i)
+    {
+        gets += clients[i].gets;
+        adds += clients[i].adds;
+        failed += clients[i].failed;
+    }
+    latencies = malloc((gets+1)*sizeof(double));
+    if (latencies == NULL)
+        errExit("*** malloc ***\n");
+    sum = 0;
+    for (i = 0, gets = 0; i != (size_t)CONFIG.clients; ++i)
+        for (j = 0; j != clients[i].gets; ++j)
+        {
+            latencies[gets++] = clients[i].latencies[j];
+            sum += clients[i].latencies[j];
+        }
+    qsort(latencies, gets, sizeof(double), &cmpDouble);
+
+    hits = after->cache.hits - before->cache.hits;
+    misses = after->cache.misses - before->cache.misses;
+    cached = after->cache.cached - before->cache.cached;
+    composed = after->cache.composed - before->cache.composed;
+    neighbours = after->cache.fromNeighbours - before->cache.fromNeighbours;
+    flooded = after->cache.flooded - before->cache.flooded;
+    answered = cached + composed + neighbours + flooded;
+    floodMsg = after->traffic.floodMessages - before->traffic.floodMessages;
+    floodBytes = after->traffic.floodBytes - before->traffic.floodBytes;
+    reqMsg = after->traffic.reqDataMessages - before->traffic.reqDataMessages;
+    reqBytes = after->traffic.reqDataBytes - before->traffic.reqDataBytes;
+    pushMsg = after->traffic.pushMessages - before->traffic.pushMessages;
+    pushBytes = after->traffic.pushBytes - before->traffic.pushBytes;
+    syncMsg = after->traffic.syncMessages - before->traffic.syncMessages;
+    syncBytes = after->traffic.syncBytes - before->traffic.syncBytes;
+    msg = after->traffic.messages - before->traffic.messages;
+    bytes = after->traffic.bytes - before->traffic.bytes;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"peers\": %d,\n", INSTANCESnumber);
+    fprintf(out, "  \"clients\": %d,\n", CONFIG.clients);
+    fprintf(out, "  \"seed\": %u,\n", CONFIG.seed);
+    fprintf(out, "  \"seed_days\": %d,\n", CONFIG.seedDays);
+    fprintf(out, "  \"seed_entries_per_day\": %d,\n", CONFIG.seedEntries);
+    fprintf(out, "  \"operations\": %d,\n", CONFIG.operations);
+    fprintf(out, "  \"adds\": %lu,\n", (unsigned long)adds);
+    fprintf(out, "  \"gets\": %lu,\n", (unsigned long)gets);
+    fprintf(out, "  \"failed\": %lu,\n", (unsigned long)failed);
+    fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed/1e3);
+    fprintf(out, "  \"throughput_ops_s\": %.2f,\n", ratio((double)(adds+gets), elapsed/1e3));
+    fprintf(out, "  \"get_latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+        ratio(sum, (double)gets), percentile(latencies, gets, 50),
+        percentile(latencies, gets, 99), gets != 0 ? latencies[gets-1] : 0);
+    /* hit_rate considera le sole get, lookup_hit_rate
+     * anche le ricerche fatte per conto dei vicini */
+    fprintf(out, "  \"cache\": {\"hit_rate\": %.4f, \"cached\": %lu, \"composed\": %lu, "
+        "\"from_neighbours\": %lu, \"flooded\": %lu, \"lookups\": %lu, \"lookup_hit_rate\": %.4f},\n",
+        ratio((double)(cached+composed), (double)answered), cached, composed, neighbours, flooded,
+        hits+misses, ratio((double)hits, (double)(hits+misses)));
+    fprintf(out, "  \"flooding\": {\"messages\": %lu, \"bytes\": %lu, "
+        "\"messages_per_query\": %.2f, \"bytes_per_query\": %.1f},\n",
+        floodMsg, floodBytes, ratio((double)floodMsg, (double)gets),
+        ratio((double)floodBytes, (double)gets));
+    fprintf(out, "  \"req_data\": {\"messages\": %lu, \"bytes\": %lu, "
+        "\"messages_per_query\": %.2f, \"bytes_per_query\": %.1f},\n",
+        reqMsg, reqBytes, ratio((double)reqMsg, (double)gets),
+        ratio((double)reqBytes, (double)gets));
+    /* push e sincronizzazione non dipendono dalle query */
+    fprintf(out, "  \"push\": {\"messages\": %lu, \"bytes\": %lu},\n", pushMsg, pushBytes);
+    fprintf(out, "  \"sync\": {\"messages\": %lu, \"bytes\": %lu},\n", syncMsg, syncBytes);
+    fprintf(out, "  \"traffic\": {\"messages\": %lu, \"bytes\": %lu}\n", msg, bytes);
+    fprintf(out, "}\n");
+    fflush(out);
+
+    free(latencies);
+}
+
+static void parseArgs(int argc, char* argv[])
+{
+    char path[PATH_MAX];
+    const char* dir;
+    int opt;
+
+    CONFIG.seedDays = BENCH_SEED_DAYS;
+    CONFIG.seedEntries = BENCH_SEED_ENTRIES;
+    CONFIG.operations = BENCH_OPERATIONS;
+    CONFIG.getPercent = BENCH_GET_PERCENT;
+    CONFIG.maxSpan = BENCH_MAX_SPAN;
+    CONFIG.clients = 1;
+    CONFIG.seed = 1;
+    strcpy(CONFIG.dsPath, BENCH_DS_PATH);
+    dir = NULL;
+
+    while ((opt = getopt(argc, argv, "d:e:n:g:w:c:s:D:C:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            CONFIG.seedDays = argParseIntRange(optarg, "giorni", 1, MERKLE_DAYS);
+            break;
+        case 'e':
+            CONFIG.seedEntries = argParseIntRange(optarg, "entry", 0, 1<<16);
+            break;
+        case 'n':
+            CONFIG.operations = argParseIntRange(optarg, "op", 0, INT_MAX);
+            break;
+        case 'g':
+            CONFIG.getPercent = argParseIntRange(optarg, "%", 0, 100);
+            break;
+        case 'w':
+            CONFIG.maxSpan = argParseIntRange(optarg, "giorni", 1, MERKLE_DAYS);
+            break;
+        case 'c':
+            CONFIG.clients = argParseIntRange(optarg, "client", 1, BENCH_MAX_CLIENTS);
+            break;
+        case 's':
+            CONFIG.seed = (unsigned int)argParseIntRange(optarg, "seme", 0, INT_MAX);
+            break;
+        case 'D':
+            if (strlen(optarg) >= sizeof(CONFIG.dsPath))
+                usageHelp(argv[0]);
+            strcpy(CONFIG.dsPath, optarg);
+            break;
+        case 'C':
+            dir = optarg;
+            break;
+        default:
+            usageHelp(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+        usageHelp(argv[0]);
+
+    CONFIG.dsPort = argParseIntRange(argv[optind], "DS_porta", 1, (1<<16)-1);
+    CONFIG.peers = argParseIntRange(argv[optind+1], "numero_peer", 1, BENCH_MAX_PEERS);
+
+    /* il percorso del server resta valido dopo chdir */
+    if (realpath(CONFIG.dsPath, path) == NULL)
+        errExit("*** Server non trovato: %s ***\n", CONFIG.dsPath);
+    strcpy(CONFIG.dsPath, path);
+    if (dir != NULL && chdir(dir) != 0)
+        errExit("*** Impossibile usare la cartella %s ***\n", dir);
+}
+
+int main(int argc, char* argv[])
+{
+    struct bench_client* clients;
+    struct bench_counters before, after;
+    struct timespec start;
+    unsigned int seed;
+    double elapsed;
+    FILE* report;
+    pid_t server;
+    int i, devNull, reportFd;
+
+    parseArgs(argc, argv);
+    peer_instance_reserve(CONFIG.peers);
+
+    /* il rapporto è l'unica cosa scritta sullo
+     * standard output, il resto è scartato */
+    fflush(stdout);
+    devNull = open("/dev/null", O_WRONLY);
+    if (devNull == -1 || (reportFd = dup(STDOUT_FILENO)) == -1
+        || (report = fdopen(reportFd, "w")) == NULL
+        || dup2(devNull, STDOUT_FILENO) == -1)
+        errExit("*** Errore nella redirezione dello standard output ***\n");
+    close(devNull);
+
+    INSTANCESnumber = CONFIG.peers;
+    INSTANCES = calloc((size_t)INSTANCESnumber, sizeof(struct peer_instance*));
+    clients = calloc((size_t)CONFIG.clients, sizeof(struct bench_client));
+    if (INSTANCES == NULL || clients == NULL)
+        errExit("*** calloc ***\n");
+
+    if (unified_io_init() == -1)
+        errExit("*** Errore attivazione sottosistema di I/O ***\n");
+    /* senza main_loop nessuno svuoterebbe la coda */
+    unified_io_set_mode(UNIFIED_IO_SYNC_MODE);
+    unified_io_set_quiet(1);
+
+    server = startServer();
+    startPeers();
+    fprintf(stderr, "Avviati il server e %d peer\n", INSTANCESnumber);
+
+    seed = CONFIG.seed;
+    for (i = 0; i < INSTANCESnumber; ++i)
+    {
+        peer_context_set(peer_instance_context(INSTANCES[i]));
+        seedRegisters(peer_instance_port(INSTANCES[i]), &seed);
+    }
+    peer_context_set(NULL);
+    fprintf(stderr, "Generati %d giorni di registri per peer\n", CONFIG.seedDays);
+
+    sleep(BENCH_SETTLE);
+
+    for (i = 0; i < CONFIG.clients; ++i)
+    {
+        clients[i].seed = CONFIG.seed + (unsigned int)i + 1;
+        clients[i].operations = CONFIG.operations / CONFIG.clients
+            + (i < CONFIG.operations % CONFIG.clients);
+        clients[i].latencies = malloc(((size_t)clients[i].operations+1)*sizeof(double));
+        if (clients[i].latencies == NULL)
+            errExit("*** malloc ***\n");
+    }
+
+    readCounters(&before);
+    if (clock_gettime(CLOCK_MONOTONIC, &start) != 0)
+        errExit("*** clock_gettime ***\n");
+    for (i = 0; i < CONFIG.clients; ++i)
+        if (pthread_create(&clients[i].tid, NULL, &CLIENT, (void*)&clients[i]) != 0)
+            errExit("*** pthread_create ***\n");
+    for (i = 0; i < CONFIG.clients; ++i)
+        if (pthread_join(clients[i].tid, NULL) != 0)
+            errExit("*** pthread_join ***\n");
+    elapsed = elapsedMs(&start);
+    readCounters(&after);
+    fprintf(stderr, "Carico completato in %.3fs\n", elapsed/1e3);
+
+    printReport(report, clients, elapsed, &before, &after);
+
+    for (i = 0; i < INSTANCESnumber; ++i)
+        if (peer_instance_stop(INSTANCES[i]) == -1)
+            errExit("*** Errore terminazione del peer [%d] ***\n", peer_instance_port(INSTANCES[i]));
+    stopServer(server);
+
+    for (i = 0; i < CONFIG.clients; ++i)
+        free(clients[i].latencies);
+    free(clients);
+    free(INSTANCES);
+
+    if (unified_io_close() == -1)
+        errExit("*** Errore terminazione sottosistema IO ***\n");
+    fclose(report);
+
+    return EXIT_SUCCESS;
+}
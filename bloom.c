@@ -0,0 +1,121 @@
+#include "bloom.h"
+
+/* finalizzatore di murmur3 */
+static uint32_t bloom_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/** Calcola le due hash da cui si ricavano,
+ * per double hashing, le BLOOM_HASHES
+ * posizioni dell'elemento.
+ */
+static void bloom_hashes(uint32_t seed, uint32_t key, uint32_t* h1, uint32_t* h2)
+{
+    *h1 = bloom_mix(key ^ seed);
+    *h2 = bloom_mix(key + seed*0x9e3779b9u) | 1;
+}
+
+size_t bloom_words(size_t n)
+{
+    size_t bits = n*BLOOM_BITS_PER_ELEMENT;
+
+    return bits == 0 ? 1 : (bits+31)/32;
+}
+
+size_t bloom_words_pow2(size_t n)
+{
+    size_t words = bloom_words(n), ans = 1;
+
+    while (ans < words)
+        ans <<= 1;
+    return ans;
+}
+
+int bloom_add(uint32_t* words, size_t nWords, uint32_t seed, uint32_t key)
+{
+    uint32_t h1, h2, bit;
+    size_t nBits = nWords*32;
+    int i;
+
+    if (words == NULL || nWords == 0)
+        return -1;
+
+    bloom_hashes(seed, key, &h1, &h2);
+    for (i = 0; i != BLOOM_HASHES; ++i)
+    {
+        bit = (uint32_t)((h1 + (uint32_t)i*h2) % nBits);
+        words[bit/32] |= (uint32_t)1 << (bit%32);
+    }
+
+    return 0;
+}
+
+int bloom_has(const uint32_t* words, size_t nWords, uint32_t seed, uint32_t key)
+{
+    uint32_t h1, h2, bit;
+    size_t nBits = nWords*32;
+    int i;
+
+    if (words == NULL || nWords == 0)
+        return -1;
+
+    bloom_hashes(seed, key, &h1, &h2);
+    for (i = 0; i != BLOOM_HASHES; ++i)
+    {
+        bit = (uint32_t)((h1 + (uint32_t)i*h2) % nBits);
+        if (!(words[bit/32] & ((uint32_t)1 << (bit%32))))
+            return 0;
+    }
+
+    return 1;
+}
+
+int bloom_merge(uint32_t* dst, size_t dstWords, const uint32_t* src, size_t srcWords)
+{
+    size_t i;
+
+    if (dst == NULL || src == NULL || dstWords == 0 || srcWords == 0
+        || (dstWords & (dstWords-1)) != 0 || (srcWords & (srcWords-1)) != 0)
+        return -1;
+
+    /* la posizione di un bit è il valore hash modulo
+     * la dimensione: con potenze di due basta fare
+     * l'or delle parole che si sovrappongono */
+    if (srcWords >= dstWords)
+        for (i = 0; i != srcWords; ++i)
+            dst[i & (dstWords-1)] |= src[i];
+    else
+        for (i = 0; i != dstWords; ++i)
+            dst[i] |= src[i & (srcWords-1)];
+
+    return 0;
+}
+
+double bloom_fp_rate(const uint32_t* words, size_t nWords)
+{
+    size_t i, set = 0;
+    uint32_t w;
+    double fill, ans = 1.0;
+    int k;
+
+    if (words == NULL || nWords == 0)
+        return -1;
+
+    for (i = 0; i != nWords; ++i)
+        for (w = words[i]; w != 0; w &= w-1)
+            ++set;
+
+    /* un elemento è un falso positivo se tutti
+     * i suoi BLOOM_HASHES bit sono accesi */
+    fill = (double)set/(double)(nWords*32);
+    for (k = 0; k != BLOOM_HASHES; ++k)
+        ans *= fill;
+
+    return ans;
+}
@@ -0,0 +1,64 @@
+/** Filtro di Bloom su interi a 32 bit.
+ * Permette di descrivere in poco spazio un
+ * insieme di firme: bloom_has non sbaglia mai
+ * sugli elementi inseriti ma può dare dei
+ * falsi positivi (circa 1% con i parametri
+ * predefiniti).
+ *
+ * Il filtro è un semplice array di parole a
+ * 32 bit così da poter essere trasmesso in
+ * rete senza conversioni ulteriori; chi lo
+ * legge deve usare lo stesso seme usato da
+ * chi lo ha generato.
+ */
+
+#ifndef BLOOM
+#define BLOOM
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/** Bit del filtro per elemento atteso.
+ */
+#ifndef BLOOM_BITS_PER_ELEMENT
+#define BLOOM_BITS_PER_ELEMENT 10
+#endif
+
+/** Numero di funzioni hash usate per
+ * ciascun elemento.
+ */
+#ifndef BLOOM_HASHES
+#define BLOOM_HASHES 7
+#endif
+
+/* numero di parole necessarie per n elementi */
+size_t bloom_words(size_t n);
+
+/* come bloom_words ma arrotondato a una potenza di due */
+size_t bloom_words_pow2(size_t n);
+
+/* inserimento e test di appartenenza */
+int bloom_add(uint32_t* words, size_t nWords, uint32_t seed, uint32_t key);
+int bloom_has(const uint32_t* words, size_t nWords, uint32_t seed, uint32_t key);
+
+/** Aggiunge a dst gli elementi di src anche se i
+ * due filtri hanno dimensioni diverse, purché
+ * entrambe potenze di due: un filtro più grande
+ * è ripiegato su quello più piccolo, uno più
+ * piccolo è replicato. In nessun caso si
+ * introducono falsi negativi.
+ *
+ * Restituisce 0 in caso di successo e -1 in
+ * caso di errore.
+ */
+int bloom_merge(uint32_t* dst, size_t dstWords, const uint32_t* src, size_t srcWords);
+
+/** Stima la probabilità che il filtro dia un
+ * falso positivo su un elemento non inserito,
+ * in base alla frazione dei bit accesi.
+ *
+ * Restituisce -1 in caso di errore.
+ */
+double bloom_fp_rate(const uint32_t* words, size_t nWords);
+
+#endif
@@ -1,4 +1,4 @@
-#define _GNU_SOURCE /* per i mutex ricorsivi */
+#define _GNU_SOURCE /* per pthread_rwlock_t */
 
 #include "ds_peers.h"
 #include "../rb_tree.h"
@@ -8,6 +8,10 @@
 #include "../unified_io.h"
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 
 /** Struttura che sarà usata per
  * mantenere i dati associati ad
@@ -24,23 +28,499 @@ struct peer
     /* dati da fornire al chiamante per i messaggi
      * costituiscono un sunto del resto del contenuto */
     struct peer_data toSend;
+    /* ID dei vicini comunicati per ultimi al peer
+     * e numero dell'ultimo MESSAGES_TOPOLOGY_UPDATE */
+    uint32_t knownIDs[MAX_NEIGHBOUR_NUMBER];
+    uint16_t knownLen;
+    uint32_t topologySeq;
+    /* non nullo se ricaricato da file e non
+     * ancora confermato dal peer stesso */
+    int unverified;
 };
 
+/** Valore di knownLen che indica che i vicini
+ * noti al peer sono sconosciuti: il prossimo
+ * peers_topology_updates glieli invia di
+ * sicuro.
+ */
+#define UNKNOWN_NEIGHBOURS ((uint16_t)0xFFFF)
+
 
 /** Le operazioni gestite da qui vanno
- * gestite utilizzando dei mutex per
+ * gestite utilizzando un lock per
  * evitare disastri a causa
  * dell'interazione tra il thread
- * principale e quello a gestione del
+ * principale e quelli a gestione del
  * sottosistema UDP.
+ *
+ * Le sole letture (ad esempio la ricerca
+ * dei vicini per un MESSAGES_CHECK_REQ)
+ * possono procedere in parallelo, per
+ * questo guard è un lock lettori/scrittori.
+ * Un thread che lo possiede può acquisirlo
+ * di nuovo, come lettore o come scrittore
+ * se già lo era: guardDepth e guardWriter
+ * tengono traccia di quanto già posseduto.
  */
-
-pthread_mutex_t guard = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static pthread_rwlock_t guard = PTHREAD_RWLOCK_INITIALIZER;
+static __thread int guardDepth;
+static __thread int guardWriter;
 struct rb_tree* tree;
 /* serve per assegnare un id progressivo a ciascun
  * peer si connetta alla rete */
 uint32_t counterID;
 
+/** Parametri dell'overlay: ogni peer è vicino
+ * di tutti quelli che distano, nell'ordine
+ * circolare delle porte, al più nearest
+ * posizioni e, se fingers è non nullo, di
+ * quelli che distano una potenza di due
+ * (alla maniera dei finger di Chord).
+ *
+ * La relazione è simmetrica per costruzione,
+ * condizione necessaria perché i peer possano
+ * validare le richieste di connessione dei
+ * vicini, e il diametro della rete cresce come
+ * O(log N) invece che come N/2 dell'anello.
+ */
+static int nearest = DS_OVERLAY_NEAREST;
+static int fingers = DS_OVERLAY_FINGERS;
+
+/** Non nullo se, dall'ultima invocazione di
+ * peers_topology_updates, sono stati aggiunti
+ * o rimossi dei peer.
+ */
+static int topologyDirty;
+
+/** Numero di peer ricaricati da file non ancora
+ * confermati. Dopo peers_restore può solo
+ * diminuire, perciò è leggibile senza lock
+ * come indicazione.
+ */
+static volatile int unverifiedCount;
+
+/** Persistenza del registro dei peer, perché
+ * un DS riavviato dopo una terminazione
+ * anomala ritrovi la rete senza che tutti i
+ * peer debbano ripetere il boot.
+ *
+ * I file si trovano nella cartella corrente:
+ *  "porta".peers
+ * è un'istantanea del registro, formata da
+ * un oggetto struct registry_header seguito
+ * da un record per ogni peer, mentre
+ *  "porta".journal
+ * contiene i record delle aggiunte e delle
+ * rimozioni successive all'istantanea.
+ * Tutti i campi sono in network order.
+ *
+ * Al caricamento il journal è applicato
+ * all'istantanea, che viene poi riscritta
+ * mentre il journal viene svuotato; lo
+ * stesso accade quando il journal supera
+ * DS_JOURNAL_MAX record. Riapplicare un
+ * record è innocuo, perciò un'interruzione
+ * tra i due passi non fa danni.
+ *
+ * REGISTRYjournal è NULL se la persistenza
+ * non è attiva.
+ */
+#define REGISTRY_FILE_FORMAT "%d.peers"
+#define REGISTRY_JOURNAL_FORMAT "%d.journal"
+#define REGISTRY_MAGIC 0x44535052 /* "DSPR" */
+
+struct registry_header
+{
+    uint32_t magic;
+    uint32_t counterID;
+    /* epoch dell'esecuzione che l'ha scritto */
+    uint32_t epoch;
+    uint32_t count;
+} __attribute__ ((packed));
+
+enum registry_op
+{
+    REGISTRY_ADD = 1,
+    REGISTRY_REMOVE
+};
+
+struct registry_record
+{
+    uint8_t op;
+    uint16_t port;
+    /* i campi seguenti solo per REGISTRY_ADD */
+    uint32_t requestPid;
+    uint32_t id;
+    struct ns_host_addr ns_addr;
+    struct ns_host_addr ns_tcp;
+} __attribute__ ((packed));
+
+static FILE* REGISTRYjournal;
+static char REGISTRYfile[32];
+static char REGISTRYjournalFile[32];
+/* record presenti nel journal */
+static size_t REGISTRYrecords;
+/** Identifica l'esecuzione corrente del DS,
+ * cresce a ogni riavvio.
+ */
+static uint32_t REGISTRYepoch;
+
+/** Copia ordinata (per porta) dei peer presenti
+ * nell'albero, ricostruita solo quando questo
+ * è stato modificato, così che la posizione
+ * di ciascun peer sia ottenibile senza
+ * scorrere ogni volta tutto l'albero.
+ */
+static struct peer** sorted;
+static long int* sortedKeys;
+static size_t sortedLen;
+static int sortedValid;
+
+/** Funzione ausiliaria per la ricostruzione
+ * di sorted.
+ */
+static void fill_sorted(long int key, void* value, void* base)
+{
+    size_t* i = (size_t*)base;
+
+    sortedKeys[*i] = key;
+    sorted[(*i)++] = (struct peer*)value;
+}
+
+/** Ricostruisce, se necessario, sorted.
+ *
+ * Va invocata possedendo guard.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+static int refresh_sorted(void)
+{
+    ssize_t size;
+    size_t i = 0;
+    struct peer** tmp;
+    long int* tmpKeys;
+
+    if (sortedValid)
+        return 0;
+
+    size = rb_tree_size(tree);
+    if (size == -1)
+        return -1;
+
+    tmp = realloc(sorted, (size_t)(size ? size : 1)*sizeof(struct peer*));
+    if (tmp == NULL)
+        return -1;
+    sorted = tmp;
+    tmpKeys = realloc(sortedKeys, (size_t)(size ? size : 1)*sizeof(long int));
+    if (tmpKeys == NULL)
+        return -1;
+    sortedKeys = tmpKeys;
+
+    /* rb_tree_accumulate visita le chiavi in ordine */
+    if (rb_tree_accumulate(tree, &fill_sorted, (void*)&i) == -1)
+        return -1;
+    sortedLen = i;
+    sortedValid = 1;
+
+    return 0;
+}
+
+/** Segnala che l'albero è stato modificato.
+ */
+static void invalidate_sorted(void)
+{
+    sortedValid = 0;
+}
+
+/** Acquisisce guard come scrittore, se writer
+ * non è nullo, o come lettore.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore, ad esempio se un
+ * lettore prova a diventare scrittore.
+ */
+static int guard_lock(int writer)
+{
+    if (guardDepth > 0)
+    {
+        if (writer && !guardWriter)
+            return -1;
+        ++guardDepth;
+        return 0;
+    }
+
+    if ((writer ? pthread_rwlock_wrlock(&guard) : pthread_rwlock_rdlock(&guard)) != 0)
+        return -1;
+    guardWriter = writer;
+    guardDepth = 1;
+
+    return 0;
+}
+
+/** Rilascia guard. L'ultimo rilascio di uno
+ * scrittore ricostruisce sorted, così che i
+ * lettori, che non possono modificarlo, lo
+ * trovino sempre aggiornato.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+static int guard_unlock(void)
+{
+    int err = 0;
+
+    if (guardDepth == 0)
+        return -1;
+    if (--guardDepth > 0)
+        return 0;
+
+    if (guardWriter && tree != NULL && refresh_sorted() != 0)
+        err = -1;
+    if (pthread_rwlock_unlock(&guard) != 0)
+        err = -1;
+
+    return err;
+}
+
+/** Fornisce il numero massimo di vicini che
+ * l'overlay descritto può assegnare a un peer,
+ * considerando che le porte sono al più 2^16.
+ */
+static int overlay_max_degree(int near, int fing)
+{
+    int d, ans = near;
+
+    if (fing)
+        for (d = 1; d <= (1<<15); d <<= 1)
+            if (d > near)
+                ++ans;
+
+    return 2*ans;
+}
+
+/** Alloca e inizializza un oggetto struct peer.
+ *
+ * Restituisce NULL in caso di errore.
+ */
+static struct peer* peer_new(uint32_t requestPid, uint32_t id, uint16_t port,
+            const struct ns_host_addr* ns_addr,
+            const struct ns_host_addr* ns_tcp)
+{
+    struct peer* ans;
+
+    ans = (struct peer*)malloc(sizeof(struct peer));
+    if (ans == NULL)
+        return NULL;
+
+    ans->requestPid = requestPid;
+    ans->id = id;
+    ans->ns_addr = *ns_addr;
+    ans->ns_tcp = *ns_tcp;
+    /* inizializza l'oggetto per i messaggi */
+    peer_data_init(&ans->toSend, id, port, ns_tcp);
+    ans->topologySeq = 0;
+    ans->knownLen = 0;
+    ans->unverified = 0;
+
+    return ans;
+}
+
+/** Prepara il record che descrive un'operazione
+ * sul registro; p è ignorato per REGISTRY_REMOVE.
+ */
+static void registry_fill(struct registry_record* r, enum registry_op op,
+            long int key, const struct peer* p)
+{
+    memset(r, 0, sizeof(struct registry_record));
+    r->op = (uint8_t)op;
+    r->port = htons((uint16_t)key);
+    if (op == REGISTRY_ADD)
+    {
+        r->requestPid = htonl(p->requestPid);
+        r->id = htonl(p->id);
+        r->ns_addr = p->ns_addr;
+        r->ns_tcp = p->ns_tcp;
+    }
+}
+
+/** Applica al registro un record letto da file.
+ * Va invocata possedendo guard come scrittore.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * se il record non è valido.
+ */
+static int registry_apply(const struct registry_record* r)
+{
+    struct peer* p;
+    uint16_t port;
+    uint32_t id;
+
+    port = ntohs(r->port);
+    switch (r->op)
+    {
+    case REGISTRY_ADD:
+        id = ntohl(r->id);
+        p = peer_new(ntohl(r->requestPid), id, port, &r->ns_addr, &r->ns_tcp);
+        if (p == NULL || rb_tree_set(tree, (long int)port, (void*)p) == -1)
+        {
+            free(p);
+            return -1;
+        }
+        if (id > counterID)
+            counterID = id;
+        return 0;
+
+    case REGISTRY_REMOVE:
+        /* può non esserci più */
+        rb_tree_remove(tree, (long int)port, NULL);
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+/** Dati per la scrittura dell'istantanea
+ * con rb_tree_accumulate.
+ */
+struct registry_writer
+{
+    FILE* fout;
+    int err;
+};
+
+static void registry_write_peer(long int key, void* value, void* base)
+{
+    struct registry_writer* w = (struct registry_writer*)base;
+    struct registry_record r;
+
+    registry_fill(&r, REGISTRY_ADD, key, (struct peer*)value);
+    if (!w->err && fwrite(&r, sizeof(r), 1, w->fout) != 1)
+        w->err = 1;
+}
+
+/** Disattiva la persistenza dopo un errore.
+ */
+static void registry_disable(const char* filename)
+{
+    unified_io_push(UNIFIED_IO_ERROR, "Cannot write \"%s\", peer persistence disabled", filename);
+    if (REGISTRYjournal != NULL)
+        fclose(REGISTRYjournal);
+    REGISTRYjournal = NULL;
+}
+
+/** Riscrive l'istantanea con il contenuto
+ * attuale del registro e svuota il journal.
+ * Va invocata possedendo guard come scrittore.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore, nel qual caso la
+ * persistenza viene disattivata.
+ */
+static int registry_compact(void)
+{
+    char tmpname[40];
+    struct registry_header h;
+    struct registry_writer w;
+    ssize_t size;
+
+    sprintf(tmpname, "%s.tmp", REGISTRYfile);
+    w.fout = fopen(tmpname, "w");
+    if (w.fout == NULL)
+    {
+        registry_disable(tmpname);
+        return -1;
+    }
+    w.err = 0;
+
+    size = rb_tree_size(tree);
+    h.magic = htonl(REGISTRY_MAGIC);
+    h.counterID = htonl(counterID);
+    h.epoch = htonl(REGISTRYepoch);
+    h.count = htonl((uint32_t)(size == -1 ? 0 : size));
+    if (size == -1 || fwrite(&h, sizeof(h), 1, w.fout) != 1
+        || rb_tree_accumulate(tree, &registry_write_peer, (void*)&w) == -1)
+        w.err = 1;
+    /* fsync perché l'istantanea sostituisce il journal */
+    if (fflush(w.fout) != 0 || fsync(fileno(w.fout)) != 0)
+        w.err = 1;
+    if (fclose(w.fout) != 0 || w.err || rename(tmpname, REGISTRYfile) != 0)
+    {
+        unlink(tmpname);
+        registry_disable(REGISTRYfile);
+        return -1;
+    }
+
+    /* ora il journal si può svuotare */
+    if (REGISTRYjournal != NULL)
+        fclose(REGISTRYjournal);
+    REGISTRYjournal = fopen(REGISTRYjournalFile, "w");
+    if (REGISTRYjournal == NULL)
+    {
+        registry_disable(REGISTRYjournalFile);
+        return -1;
+    }
+    REGISTRYrecords = 0;
+
+    return 0;
+}
+
+/** Aggiunge un record al journal, se la
+ * persistenza è attiva, e lo compatta quando
+ * diventa troppo lungo.
+ * Va invocata possedendo guard come scrittore.
+ */
+static void registry_append(enum registry_op op, long int key, const struct peer* p)
+{
+    struct registry_record r;
+
+    if (REGISTRYjournal == NULL)
+        return;
+
+    registry_fill(&r, op, key, p);
+    /* fflush perché sopravviva anche a una terminazione anomala */
+    if (fwrite(&r, sizeof(r), 1, REGISTRYjournal) != 1 || fflush(REGISTRYjournal) != 0)
+    {
+        registry_disable(REGISTRYjournalFile);
+        return;
+    }
+
+    if (++REGISTRYrecords >= DS_JOURNAL_MAX)
+        registry_compact();
+}
+
+/** Legge da fin i record, al più max, e li
+ * applica al registro. Un record troncato o
+ * non valido termina la lettura.
+ *
+ * Restituisce il numero di record applicati.
+ */
+static size_t registry_load_records(FILE* fin, size_t max)
+{
+    struct registry_record r;
+    size_t n = 0;
+
+    while (n != max && fread(&r, sizeof(r), 1, fin) == 1
+        && registry_apply(&r) == 0)
+        ++n;
+
+    return n;
+}
+
+/** Segna come non confermato un peer appena
+ * ricaricato.
+ */
+static void registry_mark_unverified(long int key, void* value)
+{
+    struct peer* p = (struct peer*)value;
+
+    (void)key;
+    p->unverified = 1;
+    p->knownLen = UNKNOWN_NEIGHBOURS;
+    ++unverifiedCount;
+}
+
 int peers_init(void)
 {
     if (tree != NULL)
@@ -49,7 +529,9 @@ int peers_init(void)
     tree = rb_tree_init(NULL);
     counterID = 0;
     rb_tree_set_cleanup_f(tree, &free);
-    return 0;
+    /* i lettori lo trovano già pronto */
+    invalidate_sorted();
+    return refresh_sorted();
 }
 
 int peers_clear(void)
@@ -60,12 +542,26 @@ int peers_clear(void)
     /* questo sistema strano di
      * locking è usato per evitare
      * interferenze con l'altro thread */
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(1) != 0)
         return -1;
 
+    /* l'ultima istantanea, poi chiude il journal */
+    if (REGISTRYjournal != NULL && registry_compact() == 0)
+    {
+        fclose(REGISTRYjournal);
+        REGISTRYjournal = NULL;
+    }
+    unverifiedCount = 0;
+
     rb_tree_destroy(tree);
     tree = NULL;
-    if (pthread_mutex_unlock(&guard) != 0)
+    free(sorted);
+    free(sortedKeys);
+    sorted = NULL;
+    sortedKeys = NULL;
+    sortedLen = 0;
+    invalidate_sorted();
+    if (guard_unlock() != 0)
         return -1;
 
     return 0;
@@ -92,6 +588,76 @@ make_peer_data_form_peer(const struct peer* P)
     return ans;
 }
 
+int peers_set_overlay(int near, int fing)
+{
+    if (near < 1 || overlay_max_degree(near, fing) > MAX_NEIGHBOUR_NUMBER)
+        return -1;
+
+    if (guard_lock(1) != 0)
+        return -1;
+
+    nearest = near;
+    fingers = fing;
+
+    if (guard_unlock() != 0)
+        return -1;
+
+    return 0;
+}
+
+/** Funzione ausiliaria per l'implementazione di
+ * peers_find_neighbours: aggiunge ai vicini quelli
+ * che distano d posizioni, in entrambi i versi,
+ * dal peer in posizione pos.
+ */
+static void add_neighbours_at(size_t pos, size_t d,
+            const struct peer_data** neighbours,
+            uint16_t* length)
+{
+    size_t prev, next;
+
+    prev = (pos + sortedLen - d) % sortedLen;
+    next = (pos + d) % sortedLen;
+
+    neighbours[(*length)++] = &sorted[prev]->toSend;
+    /* con d == N/2 i due coincidono */
+    if (next != prev)
+        neighbours[(*length)++] = &sorted[next]->toSend;
+}
+
+/** Trova i vicini del peer in posizione pos
+ * di sorted, che deve essere aggiornato.
+ */
+static void neighbours_of(size_t pos,
+            const struct peer_data** neighbours,
+            uint16_t* length)
+{
+    size_t d;
+
+    /* prima il predecessore e il successore, poi gli altri */
+    *length = 0;
+    for (d = 1; d <= (size_t)nearest && 2*d <= sortedLen; ++d)
+        add_neighbours_at(pos, d, neighbours, length);
+    /* finger alle distanze potenze di due */
+    for (d = 1; fingers && 2*d <= sortedLen; d <<= 1)
+        if (d > (size_t)nearest)
+            add_neighbours_at(pos, d, neighbours, length);
+}
+
+/** Memorizza nel peer gli ID dei vicini
+ * che gli sono stati comunicati.
+ */
+static void remember_neighbours(struct peer* p,
+            const struct peer_data** neighbours,
+            uint16_t length)
+{
+    uint16_t i;
+
+    for (i = 0; i != length; ++i)
+        p->knownIDs[i] = neighbours[i]->ID;
+    p->knownLen = length;
+}
+
 /* si limita a trovare i soli vicini */
 int
 peers_find_neighbours(
@@ -99,86 +665,36 @@ peers_find_neighbours(
         const struct peer_data** neighbours,
         uint16_t* length)
 {
-    long int peerKey; /* chiave del vicinos */
-    struct peer* peerValue; /* vicino */
+    size_t lo, hi, mid, pos;
 
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(0) != 0)
         return -1;
 
     /* controllo valori ed esistenza elemento */
-    if (tree == NULL || rb_tree_get(tree, key, NULL) != 0)
+    if (tree == NULL || rb_tree_get(tree, key, NULL) != 0 || refresh_sorted() != 0)
     {
-        if (pthread_mutex_unlock(&guard) != 0)
+        if (guard_unlock() != 0)
             errExit("*** peers_find_neighbours double fault [pthread_mutex_unlock] ***\n");
         return -1;
     }
 
-    /* ricerca dei vicini */
-    switch (rb_tree_size(tree))
+    /* ricerca binaria della posizione del peer */
+    lo = 0; hi = sortedLen;
+    while (hi - lo > 1)
     {
-    case -1:
-        /* errore */
-        if (pthread_mutex_unlock(&guard) != 0)
-            errExit("*** peers_find_neighbours double fault[pthread_mutex_unlock] ***\n");
-
-        return -1;
-
-    case 0:
-        /* qui non dovrebbe mai poter arrivare */
-        errExit("*** peers_find_neighbours fault (rb_tree_size(tree)==0) ***\n");
-        break; /* non necessario; per sopprimere il warning */
-
-    case 1:
-        /* l'albero era prima vuoto */
-        //nPeers = 0; /* elementi dellìalbero -1 */
-        *length = 0;
-        break;
-
-    case 2:
-        /* l'albero ha solo un altro elemento */
-        /* cerca il vicino */
-        /* cerca a sinistra */
-        if (rb_tree_prev(tree, key, &peerKey, (void**)&peerValue) == 0);
-        /* cerca a sinistra */
-        else if (rb_tree_next(tree, key, &peerKey, (void**)&peerValue) == 0);
-        /* non ha senso che si raggiunga */
-        else
-            errExit("*** peers_add_and_find_neighbours fault (size==2 no neighbour) ***\n");
-
-        /* aggiunge il peer */
-        neighbours[0] = &peerValue->toSend;
-        *length = 1; /* e segna il numero a 1 */
-        break;
-
-    default:
-        /* ci sono due vicini */
-        /* cerca quello a sinistra */
-        if (rb_tree_prev(tree, key, &peerKey, (void**)&peerValue) == 0);
-        /* altrimenti deve prendere il maggiore di tutti */
-        else if(rb_tree_max(tree, &peerKey, (void**)&peerValue) == 0);
-        /*  altrimenti disastro */
+        mid = lo + (hi - lo)/2;
+        if (sortedKeys[mid] <= key)
+            lo = mid;
         else
-            errExit("*** peers_add_and_find_neighbours fault (size>2 no left neighbour) ***\n");
-        /* assegna il primo peer */
-        neighbours[0] = &peerValue->toSend;
-
-        /* cerca quello a destra */
-        if (rb_tree_next(tree, key, &peerKey, (void**)&peerValue) == 0);
-        /* altrimenti deve prendere il minore di tutti */
-        else if(rb_tree_min(tree, &peerKey, (void**)&peerValue) == 0);
-        /*  altrimenti disastro */
-        else
-            errExit("*** peers_add_and_find_neighbours fault (size>2 no right neighbour) ***\n");
-        /* assegna il secondo peer */
-        neighbours[1] = &peerValue->toSend;
-
-        /* e segna che i peer sono 2 */
-        *length = 2;
-
-        break;
+            hi = mid;
     }
+    pos = lo;
+    if (sortedKeys[pos] != key)
+        errExit("*** peers_find_neighbours fault (peer not in sorted) ***\n");
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    neighbours_of(pos, neighbours, length);
+
+    if (guard_unlock() != 0)
         return -1;
 
     return 0;
@@ -195,19 +711,19 @@ peers_get_data_and_neighbours(
     const struct peer* P;
 
     /* SEZIONE CRITICA */
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(0) != 0)
         return -1;
 
     /* controllo - spero - superfluo */
     if (tree == NULL)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
     /* il nodo esiste */
     if (rb_tree_get(tree, key, (void**)&P) == -1)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
     *peer = &P->toSend;
@@ -215,11 +731,11 @@ peers_get_data_and_neighbours(
     /* cerca i vicini ora */
     if (peers_find_neighbours(key, neighbours, length) == -1)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    if (guard_unlock() != 0)
         return -1;
 
     return 0;
@@ -248,7 +764,7 @@ peers_add_and_find_neighbours(
 
     key = (long int)port;
 
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(1) != 0)
     {
         free(value);
         return -1;
@@ -259,34 +775,35 @@ peers_add_and_find_neighbours(
     {
         /* richiesta duplicata, mantiene il vecchio l'ID */
         *newID = value->id;
+        /* il peer è di sicuro attivo */
+        peers_confirm(key);
     }
     else
     {
         /* Questa richiesta non era ancora stata gestita */
-        value = (struct peer*)malloc(sizeof(struct peer));
+        /* salva l'ID della richiesta e assegna un nuovo ID */
+        value = peer_new(loginPid, counterID+1, port, ns_addr, ns_tcp);
         if (value == NULL)
         {
-            if (pthread_mutex_unlock(&guard) != 0)
+            if (guard_unlock() != 0)
                 errExit("*** peers_add_and_find_neighbours double fault[rb_tree_set:pthread_mutex_unlock] ***\n");
 
             return -1;
         }
-        /* salva l'ID della richiesta */
-        value->requestPid = loginPid;
-        value->ns_addr = *ns_addr;
-        value->ns_tcp = *ns_tcp;
-        /* nuovo ID */
         *newID = ++counterID;
-        value->id = counterID;
-        /* inizializza l'oggetto per i messaggi */
-        peer_data_init(&value->toSend, counterID, port, ns_tcp);
+        /* sostituisce un eventuale peer ricaricato sulla stessa porta */
+        peers_confirm(key);
+        /* i vicini di qualcuno sono cambiati */
+        topologyDirty = 1;
+        registry_append(REGISTRY_ADD, key, value);
     }
 
     /* inserisce un nuovo valore */
+    invalidate_sorted();
     if (rb_tree_set(tree, key, (void*)value) == -1)
     {
         free(value);
-        if (pthread_mutex_unlock(&guard) != 0)
+        if (guard_unlock() != 0)
             errExit("*** peers_add_and_find_neighbours double fault[rb_tree_set:pthread_mutex_unlock] ***\n");
 
         return -1;
@@ -297,12 +814,15 @@ peers_add_and_find_neighbours(
     if (peers_find_neighbours(key, neighbours, length) == -1)
     {
         free(value);
-        if (pthread_mutex_unlock(&guard) != 0)
+        if (guard_unlock() != 0)
             errExit("*** peers_add_and_find_neighbours double fault[rb_tree_set:pthread_mutex_unlock] ***\n");
         return -1;
     }
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    /* sono quelli comunicati con MESSAGES_BOOT_ACK */
+    remember_neighbours(value, neighbours, *length);
+
+    if (guard_unlock() != 0)
     {
         /* se fallisce anche questo addio */
         if (rb_tree_remove(tree, key, NULL) != 0)
@@ -329,24 +849,24 @@ static void print_elem(long int key, void* value)
 /* stampa tutti gli elementi dell'albero */
 int peers_showpeers(void)
 {
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(0) != 0)
         return -1;
 
     /* il sistema non è ancora stato inizializzato */
     if (tree == NULL)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
 
     printf("Totale peers: %ld\n", (long)rb_tree_size(tree));
     if (rb_tree_foreach(tree, &print_elem) == -1)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    if (guard_unlock() != 0)
         return -1;
 
     return 0;
@@ -355,49 +875,33 @@ int peers_showpeers(void)
 static void print_showneighbour(long int node, void* arg)
 {
     char currStr[32];
-    char prevStr[32];
-    char nextStr[32];
+    char neighStr[32];
     const struct peer_data* neighbours[MAX_NEIGHBOUR_NUMBER];
     struct peer* value;
-    uint16_t length;
+    uint16_t length, i;
 
     value = (struct peer*)arg;
     if (peers_find_neighbours(node, neighbours, &length) == -1)
-    {
         errExit("print_showneighbour fault [peers_find_neighbours]\n");
-    }
-    else
-    {
-        if (peers_find_neighbours(node, neighbours, &length) == -1)
-            errExit("print_showneighbour fault [peers_find_neighbours]\n");
-
-        if (ns_host_addr_as_string(currStr, sizeof(currStr), &value->ns_addr) == -1)
-            errExit("print_showneighbour fault [ns_host_addr_as_string]\n");
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
-        switch (length)
-        {
-        case 2:
-            if (ns_host_addr_as_string(nextStr, sizeof(nextStr), &neighbours[1]->ns_addr) == -1)
-                errExit("print_showneighbour fault [ns_host_addr_as_string]\n");
-
-        case 1:
-            if (ns_host_addr_as_string(prevStr, sizeof(prevStr), &neighbours[0]->ns_addr) == -1)
-                errExit("print_showneighbour fault [ns_host_addr_as_string]\n");
-        }
-#pragma GCC diagnostic pop
+    if (ns_host_addr_as_string(currStr, sizeof(currStr), &value->ns_addr) == -1)
+        errExit("print_showneighbour fault [ns_host_addr_as_string]\n");
 
-        printf("\t%ld - %s: {%s%s%s}\n", node, currStr, (length>0 ? prevStr : ""),
-                (length>1 ? ", " : ""), (length>1 ? nextStr : ""));
+    printf("\t%ld - %s: {", node, currStr);
+    for (i = 0; i != length; ++i)
+    {
+        if (ns_host_addr_as_string(neighStr, sizeof(neighStr), &neighbours[i]->ns_addr) == -1)
+            errExit("print_showneighbour fault [ns_host_addr_as_string]\n");
+        printf("%s%s", (i ? ", " : ""), neighStr);
     }
+    printf("}\n");
 }
 
 int peers_showneighbour(long int* peer)
 {
     struct peer* value;
 
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(0) != 0)
         return -1;
 
     if (peer == NULL)
@@ -406,7 +910,7 @@ int peers_showneighbour(long int* peer)
         printf("Totale peers: %ld\n", (long)rb_tree_size(tree));
         if (rb_tree_foreach(tree, &print_showneighbour) == -1)
         {
-            pthread_mutex_unlock(&guard);
+            guard_unlock();
             return -1;
         }
     }
@@ -415,7 +919,7 @@ int peers_showneighbour(long int* peer)
         if (rb_tree_get(tree, *peer, (void**)&value) == -1)
         {
             fprintf(stderr, "\tpeer (%ld) inesistente\n", *peer);
-            pthread_mutex_unlock(&guard);
+            guard_unlock();
             return -1;
         }
         else
@@ -424,52 +928,81 @@ int peers_showneighbour(long int* peer)
         }
     }
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    if (guard_unlock() != 0)
         return -1;
 
     return 0;
 }
 
-static void sendShutdown(long int peerPort, void* data, void* base)
+int peers_lock(int writer)
 {
-    char destAddr[32];
-    struct peer* p;
-    struct ns_host_addr* dest;
-    int sockfd;
+    return guard_lock(writer);
+}
 
-    (void)peerPort;
-    sockfd = *(int*)base;
-    p = (struct peer*)data;
-    dest = &p->ns_addr;
+int peers_unlock(void)
+{
+    return guard_unlock();
+}
 
-    if (ns_host_addr_as_string(destAddr, sizeof(destAddr), dest) == -1)
-        errExit("*** peers_send_shutdown:sendShutdown:ns_host_addr_as_string ***\n");
+/** Funzione ausiliaria di peers_get_targets:
+ * copia nell'array i dati necessari per
+ * raggiungere il peer.
+ */
+static void fill_target(long int peerPort, void* data, void* base)
+{
+    struct peer_target** next;
+    struct peer* p;
 
-    unified_io_push(UNIFIED_IO_NORMAL, "Sending to %s message MESSAGES_SHUTDOWN_REQ", destAddr);
+    next = (struct peer_target**)base;
+    p = (struct peer*)data;
 
-    if (messages_send_shutdown_req_ns(sockfd, dest, p->id) == -1)
-        errExit("*** peers_send_shutdown:sendShutdown:messages_send_shutdown_req_ns ***\n");
+    (*next)->port = peerPort;
+    (*next)->id = p->id;
+    (*next)->ns_addr = p->ns_addr;
+    ++*next;
 }
 
-int peers_send_shutdown(int sockfd)
+int peers_get_targets(struct peer_target** targets, size_t* length)
 {
-    if (pthread_mutex_lock(&guard) != 0)
+    ssize_t size;
+    struct peer_target* ans;
+    struct peer_target* next;
+
+    if (targets == NULL || length == NULL)
         return -1;
 
-    if (tree == NULL)
+    if (guard_lock(0) != 0)
+        return -1;
+
+    if (tree == NULL || (size = rb_tree_size(tree)) == -1)
+    {
+        guard_unlock();
+        return -1;
+    }
+
+    ans = malloc((size_t)(size ? size : 1)*sizeof(struct peer_target));
+    if (ans == NULL)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
 
-    if (rb_tree_accumulate(tree, &sendShutdown, &sockfd) == -1)
+    next = ans;
+    if (rb_tree_accumulate(tree, &fill_target, &next) == -1)
     {
-        pthread_mutex_unlock(&guard);
+        free(ans);
+        guard_unlock();
         return -1;
     }
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    if (guard_unlock() != 0)
+    {
+        free(ans);
         return -1;
+    }
+
+    *targets = ans;
+    *length = (size_t)(next - ans);
 
     return 0;
 }
@@ -478,18 +1011,18 @@ int peers_number(void)
 {
     int ans;
 
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(0) != 0)
         return -1;
 
     if (tree == NULL)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
 
     ans = (int)rb_tree_size(tree);
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    if (guard_unlock() != 0)
         return -1;
 
     return ans;
@@ -505,17 +1038,17 @@ int peers_get_id(long int key, uint32_t* ID)
     if (tree == NULL)
         return -1;
 
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(0) != 0)
         return -1;
 
     if (rb_tree_get(tree, key, (void**)&p) == -1 || p == NULL)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
     *ID = p->id;
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    if (guard_unlock() != 0)
         return -1;
 
     return 0;
@@ -526,17 +1059,278 @@ int peers_remove_peer(long int key)
     if (tree == NULL)
         return -1;
 
-    if (pthread_mutex_lock(&guard) != 0)
+    if (guard_lock(1) != 0)
         return -1;
 
+    /* un peer ricaricato che se ne va non va più confermato */
+    peers_confirm(key);
+    invalidate_sorted();
     if (rb_tree_remove(tree, key, NULL) == -1)
     {
-        pthread_mutex_unlock(&guard);
+        guard_unlock();
         return -1;
     }
+    topologyDirty = 1;
+    registry_append(REGISTRY_REMOVE, key, NULL);
 
-    if (pthread_mutex_unlock(&guard) != 0)
+    if (guard_unlock() != 0)
         return -1;
 
     return 0;
 }
+
+int peers_topology_updates(struct peer_update** updates, size_t* length)
+{
+    struct peer_update* ans;
+    const struct peer_data* neighbours[MAX_NEIGHBOUR_NUMBER];
+    uint16_t num, j;
+    size_t i, n;
+    struct peer* p;
+
+    if (updates == NULL || length == NULL)
+        return -1;
+
+    if (guard_lock(1) != 0)
+        return -1;
+
+    *updates = NULL;
+    *length = 0;
+    if (tree == NULL || !topologyDirty)
+        return guard_unlock();
+
+    if (refresh_sorted() != 0)
+    {
+        guard_unlock();
+        return -1;
+    }
+
+    ans = NULL;
+    n = 0;
+    for (i = 0; i != sortedLen; ++i)
+    {
+        p = sorted[i];
+        neighbours_of(i, neighbours, &num);
+
+        /* i vicini sono ancora quelli noti al peer? */
+        if (num == p->knownLen)
+        {
+            for (j = 0; j != num && neighbours[j]->ID == p->knownIDs[j]; ++j)
+                ;
+            if (j == num)
+                continue;
+        }
+
+        /* alla prima modifica alloca lo spazio per tutti */
+        if (ans == NULL)
+        {
+            ans = malloc(sortedLen*sizeof(struct peer_update));
+            if (ans == NULL)
+            {
+                guard_unlock();
+                return -1;
+            }
+        }
+
+        remember_neighbours(p, neighbours, num);
+        ans[n].ns_addr = p->ns_addr;
+        ans[n].id = p->id;
+        ans[n].seq = ++p->topologySeq;
+        ans[n].confirm = p->unverified;
+        ans[n].length = num;
+        for (j = 0; j != num; ++j)
+            ans[n].neighbours[j] = *neighbours[j];
+        ++n;
+    }
+    topologyDirty = 0;
+
+    *updates = ans;
+    *length = n;
+
+    return guard_unlock();
+}
+
+int peers_restore(int port)
+{
+    struct registry_header h;
+    FILE* fin;
+    size_t count, loaded;
+    uint32_t savedEpoch;
+    ssize_t size;
+
+    if (guard_lock(1) != 0)
+        return -1;
+
+    if (tree == NULL || REGISTRYjournal != NULL)
+    {
+        guard_unlock();
+        return -1;
+    }
+
+    sprintf(REGISTRYfile, REGISTRY_FILE_FORMAT, port);
+    sprintf(REGISTRYjournalFile, REGISTRY_JOURNAL_FORMAT, port);
+
+    /* prima l'istantanea */
+    savedEpoch = 0;
+    fin = fopen(REGISTRYfile, "r");
+    if (fin != NULL)
+    {
+        if (fread(&h, sizeof(h), 1, fin) == 1 && ntohl(h.magic) == REGISTRY_MAGIC)
+        {
+            counterID = ntohl(h.counterID);
+            savedEpoch = ntohl(h.epoch);
+            count = (size_t)ntohl(h.count);
+            loaded = registry_load_records(fin, count);
+            if (loaded != count)
+                unified_io_push(UNIFIED_IO_ERROR, "\"%s\" is truncated: %ld peers of %ld",
+                    REGISTRYfile, (long)loaded, (long)count);
+        }
+        fclose(fin);
+    }
+    /* poi le modifiche successive */
+    fin = fopen(REGISTRYjournalFile, "r");
+    if (fin != NULL)
+    {
+        loaded = registry_load_records(fin, (size_t)-1);
+        if (loaded)
+            unified_io_push(UNIFIED_IO_NORMAL, "Replayed %ld records from \"%s\"",
+                (long)loaded, REGISTRYjournalFile);
+        fclose(fin);
+    }
+
+    /* nuova epoch, sempre crescente */
+    REGISTRYepoch = (uint32_t)time(NULL);
+    if (REGISTRYepoch <= savedEpoch)
+        REGISTRYepoch = savedEpoch + 1;
+
+    /* i peer ricaricati vanno confermati */
+    unverifiedCount = 0;
+    if (rb_tree_foreach(tree, &registry_mark_unverified) == -1)
+    {
+        guard_unlock();
+        return -1;
+    }
+    if (unverifiedCount)
+        topologyDirty = 1;
+    invalidate_sorted();
+
+    size = rb_tree_size(tree);
+    if (size > 0)
+        unified_io_push(UNIFIED_IO_NORMAL, "Restored %ld peers from \"%s\"", (long)size, REGISTRYfile);
+
+    /* riparte da un'istantanea aggiornata */
+    registry_compact();
+
+    if (guard_unlock() != 0)
+        return -1;
+
+    return (int)size;
+}
+
+int peers_confirm(long int key)
+{
+    struct peer* p;
+
+    if (tree == NULL)
+        return -1;
+
+    if (guard_lock(1) != 0)
+        return -1;
+
+    if (rb_tree_get(tree, key, (void**)&p) == 0 && p->unverified)
+    {
+        p->unverified = 0;
+        --unverifiedCount;
+    }
+
+    return guard_unlock();
+}
+
+int peers_confirm_source(const struct ns_host_addr* source)
+{
+    struct peer* p;
+    uint16_t port;
+    int ans;
+
+    if (tree == NULL || source == NULL)
+        return -1;
+
+    if (ns_host_addr_get_port(source, &port) == -1)
+        return -1;
+
+    if (guard_lock(1) != 0)
+        return -1;
+
+    ans = 0;
+    if (rb_tree_get(tree, (long int)port, (void**)&p) == 0 && p->unverified
+        && ns_host_addr_equal(&p->ns_addr, source) == 1)
+    {
+        p->unverified = 0;
+        --unverifiedCount;
+        ans = 1;
+    }
+
+    if (guard_unlock() != 0)
+        return -1;
+
+    return ans;
+}
+
+int peers_unverified(void)
+{
+    return unverifiedCount;
+}
+
+uint32_t peers_epoch(void)
+{
+    return REGISTRYepoch;
+}
+
+int peers_revalidate(int drop)
+{
+    long int* keys;
+    size_t i, n;
+    int ans;
+
+    if (guard_lock(1) != 0)
+        return -1;
+
+    if (tree == NULL || refresh_sorted() != 0)
+    {
+        guard_unlock();
+        return -1;
+    }
+
+    keys = malloc((sortedLen ? sortedLen : 1)*sizeof(long int));
+    if (keys == NULL)
+    {
+        guard_unlock();
+        return -1;
+    }
+
+    n = 0;
+    for (i = 0; i != sortedLen; ++i)
+        if (sorted[i]->unverified)
+        {
+            keys[n++] = sortedKeys[i];
+            /* riceverà di nuovo i suoi vicini */
+            sorted[i]->knownLen = UNKNOWN_NEIGHBOURS;
+            topologyDirty = 1;
+        }
+
+    ans = 0;
+    if (drop)
+    {
+        /* chi non ha risposto non c'è più */
+        for (i = 0; i != n; ++i)
+            if (peers_remove_peer(keys[i]) != 0)
+                ans = -1;
+        if (n != 0)
+            unified_io_push(UNIFIED_IO_NORMAL, "Dropped %ld restored peers that did not answer", (long)n);
+    }
+    free(keys);
+
+    if (guard_unlock() != 0 || ans == -1)
+        return -1;
+
+    return unverifiedCount;
+}
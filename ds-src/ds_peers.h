@@ -10,6 +10,30 @@
 #include "../ns_host_addr.h"
 #include "../messages.h" /* per struct peer_data */
 
+/** Numero di vicini, da ciascun lato
+ * nell'ordine circolare delle porte, che
+ * il DS assegna di default a ogni peer.
+ */
+#ifndef DS_OVERLAY_NEAREST
+#define DS_OVERLAY_NEAREST 1
+#endif
+
+/** Se non nullo, di default il DS assegna
+ * a ogni peer anche i vicini che distano
+ * una potenza di due posizioni.
+ */
+#ifndef DS_OVERLAY_FINGERS
+#define DS_OVERLAY_FINGERS 1
+#endif
+
+/** Numero massimo di record nel journal del
+ * registro dei peer prima che questo venga
+ * compattato in una nuova istantanea.
+ */
+#ifndef DS_JOURNAL_MAX
+#define DS_JOURNAL_MAX 1024
+#endif
+
 /** Inizializza il sottosistema a gestione
  * dei peers.
  *
@@ -19,6 +43,68 @@
  */
 int peers_init(void);
 
+/** Ricarica il registro dei peer salvato
+ * dall'esecuzione precedente del DS sulla
+ * stessa porta e, da ora, salva su file ogni
+ * modifica. Va chiamato subito dopo peers_init.
+ *
+ * I peer ricaricati sono inseriti come non
+ * confermati: vanno contattati (con
+ * peers_topology_updates) e quelli che non
+ * rispondono rimossi con peers_revalidate.
+ *
+ * Restituisce il numero di peer ricaricati
+ * oppure -1 in caso di errore; file assenti o
+ * danneggiati non sono errori.
+ */
+int peers_restore(int port);
+
+/** Segna come attivo un peer ricaricato da
+ * file, che quindi non sarà rimosso da
+ * peers_revalidate. Se il peer non esiste o
+ * era già confermato non fa niente.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int peers_confirm(long int key);
+
+/** Come peers_confirm, ma il peer è quello
+ * associato alla porta dell'indirizzo dato
+ * ed è confermato solo se l'indirizzo da cui
+ * aveva fatto il login coincide con questo
+ * per intero: IP e porta.
+ *
+ * Restituisce 1 se il peer è stato confermato,
+ * 0 se non c'era niente da confermare e -1 in
+ * caso di errore.
+ */
+int peers_confirm_source(const struct ns_host_addr* source);
+
+/** Restituisce il numero di peer ricaricati
+ * non ancora confermati. Il valore, dopo
+ * peers_restore, può solo diminuire ed è
+ * letto senza lock: 0 è definitivo.
+ */
+int peers_unverified(void);
+
+/** Fa sì che i peer ricaricati non ancora
+ * confermati ricevano di nuovo i propri
+ * vicini dal prossimo peers_topology_updates,
+ * in un aggiornamento marcato da confermare,
+ * oppure, se drop non è nullo, li rimuove.
+ *
+ * Restituisce il numero di peer ancora da
+ * confermare oppure -1 in caso di errore.
+ */
+int peers_revalidate(int drop);
+
+/** Identificativo dell'esecuzione corrente
+ * del DS, diverso (maggiore) a ogni
+ * riavvio; 0 prima di peers_restore.
+ */
+uint32_t peers_epoch(void);
+
 /** Ripulisce tutte le risorse allocate
  * dal sottosistema a gestione dei peers.
  *
@@ -58,11 +144,31 @@ peers_add_and_find_neighbours(
  * numero di porta in questo sistema 
  * semplificato).
  *
+ * L'array fornito deve poter contenere
+ * MAX_NEIGHBOUR_NUMBER elementi; i primi
+ * due sono, se esistono, il predecessore e
+ * il successore del peer.
+ *
  * Restituisce 0 in caso di successo
  * e -1 in caso di errore.
  */
 int peers_find_neighbours(long int, const struct peer_data**, uint16_t*);
 
+/** Configura la forma dell'overlay: ogni peer
+ * avrà come vicini quelli che distano al più
+ * il primo argomento posizioni nell'ordine
+ * circolare delle porte e, se il secondo è
+ * non nullo, quelli che distano una potenza
+ * di due posizioni.
+ *
+ * Con (1, 0) si ottiene il semplice anello.
+ *
+ * Restituisce 0 in caso di successo e -1 in
+ * caso di errore (e.g. se l'overlay richiesto
+ * potesse superare MAX_NEIGHBOUR_NUMBER vicini).
+ */
+int peers_set_overlay(int, int);
+
 /** Ottiene i dati su un peer e i
  * suoi vicini.
  *
@@ -83,14 +189,83 @@ int peers_showpeers(void);
  */
 int peers_showneighbour(long int*);
 
-/** Invia a tutti i peer un messaggio
- * di shutdown utilizzando il socket
- * fornito come argomento.
+/** Acquisiscono e rilasciano il lock che
+ * protegge il registro dei peer, così che
+ * più operazioni siano svolte con una sola
+ * acquisizione. Con il primo argomento non
+ * nullo peers_lock lo acquisisce come
+ * scrittore, altrimenti come lettore e più
+ * thread possono possederlo insieme.
+ *
+ * Possedendolo si possono comunque invocare
+ * tutte le altre funzioni di questo modulo,
+ * ma un lettore non può invocare quelle che
+ * modificano il registro (aggiunta e
+ * rimozione di peer), che falliscono.
+ *
+ * Restituiscono 0 in caso di successo
+ * e -1 in caso di errore.
+ */
+int peers_lock(int);
+int peers_unlock(void);
+
+/** Dati necessari per contattare un peer
+ * senza dover accedere nuovamente al
+ * registro, ad esempio per comandarne lo
+ * spegnimento.
+ */
+struct peer_target
+{
+    long int port; /* chiave del peer */
+    uint32_t id;
+    struct ns_host_addr ns_addr;
+};
+
+/** Fornisce, in un array allocato
+ * dinamicamente che il chiamante dovrà
+ * liberare con free, i dati per
+ * raggiungere tutti i peer presenti,
+ * ordinati per porta.
+ *
+ * Restituisce 0 in caso di successo
+ * e -1 in caso di errore.
+ */
+int peers_get_targets(struct peer_target**, size_t*);
+
+/** Nuovi vicini da comunicare a un peer
+ * con un messaggio di tipo
+ * MESSAGES_TOPOLOGY_UPDATE.
+ */
+struct peer_update
+{
+    /* indirizzo UDP del peer */
+    struct ns_host_addr ns_addr;
+    uint32_t id;
+    /* numero di sequenza dell'aggiornamento */
+    uint32_t seq;
+    /* non nullo se il peer è ricaricato da
+     * file e non ancora confermato */
+    int confirm;
+    uint16_t length;
+    struct peer_data neighbours[MAX_NEIGHBOUR_NUMBER];
+};
+
+/** Individua tutti e soli i peer i cui vicini
+ * sono cambiati, a causa di aggiunte o
+ * rimozioni, rispetto a quelli che sono stati
+ * loro comunicati l'ultima volta e li
+ * considera da ora aggiornati.
+ *
+ * Fornisce un array allocato dinamicamente,
+ * che il chiamante dovrà liberare con free,
+ * oppure NULL se non c'è nessun peer da
+ * aggiornare. Va invocata da uno scrittore
+ * o senza possedere il lock.
  *
  * Restituisce 0 in caso di successo
  * e -1 in caso di errore.
  */
-int peers_send_shutdown(int);
+int peers_topology_updates(struct peer_update**, size_t*);
 
 /** Restituisce semplicemente
  * il numero di peer.
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 199506L /* per pthread_sigmask */
+#define _GNU_SOURCE /* per pthread_sigmask, recvmmsg e sendmmsg */
 
 #include "ds_udp.h"
 #include <pthread.h>
@@ -8,6 +8,7 @@
 #include "../commons.h"
 #include "../unified_io.h"
 #include "../messages.h"
+#include "../rb_tree.h"
 #include <signal.h>
 #include <sched.h>
 #include <setjmp.h> /* arte */
@@ -15,25 +16,44 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
 
 /* segnale utilizzato per terminare il
  * ciclo del server */
 #define INTERRUPT_SIGNAL SIGUSR1
 
-/** Id del thead che gestisce il socket
- * UDP
+/** Id dei thread che gestiscono i socket
+ * UDP: il primo crea il registro dei peer
+ * e allo spegnimento li termina tutti, gli
+ * altri condividono la porta con lui.
  */
-pthread_t UDP_tid;
+static pthread_t UDP_tids[DS_UDP_MAX_WORKERS];
+/* thread da avviare e thread avviati */
+static int UDPworkers = DS_UDP_WORKERS;
+static int UDPstarted;
+
+/** Argomenti di ciascun thread UDP.
+ */
+struct udp_worker_args
+{
+    /* porta richiesta, sostituita da quella usata */
+    int port;
+    /* non nullo per il primo thread */
+    int primary;
+};
 
 /** Fino a che questa variabile
  * non sarà azzerata il ciclo del
- * sottosistema UDP
+ * sottosistema UDP.
+ * Come sigSetJmp è propria di ogni
+ * thread, che viene fermato singolarmente.
  */
-volatile sig_atomic_t UDPloop = 1;
+static __thread volatile sig_atomic_t UDPloop = 1;
 
 /* serve a gestire la terminazione del
  * ciclo del thread UDP */
-sigjmp_buf sigSetJmp; /* bellissimo */
+static __thread sigjmp_buf sigSetJmp; /* bellissimo */
 static void sigHandler(int sigNum)
 {
     (void)sigNum;
@@ -41,11 +61,98 @@ static void sigHandler(int sigNum)
     siglongjmp(sigSetJmp, 1); /* magia */
 }
 
+/** Numero massimo di datagrammi letti con
+ * una sola recvmmsg e dimensione del buffer
+ * destinato a ciascuno.
+ * Ogni datagramma genera al più una risposta
+ * perciò anche queste sono inviate con una
+ * sola sendmmsg.
+ */
+#define UDP_BATCH 64
+#define UDP_BUFFER 1024
+
+/** Risposte generate durante la gestione di
+ * un blocco di datagrammi, che saranno inviate
+ * tutte insieme al termine.
+ */
+struct udp_replies
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    unsigned int n;
+};
+
+/** Accoda una risposta, allocata in memoria
+ * dinamica, di cui acquisisce la proprietà.
+ * L'indirizzo di destinazione deve restare
+ * valido fino all'invio.
+ */
+static void queueReply(struct udp_replies* replies,
+            void* msg, size_t msgLen,
+            struct sockaddr* dest, socklen_t destLen)
+{
+    unsigned int i;
+
+    if (replies->n == UDP_BATCH)
+        errExit("*** UDP:queueReply ***\n");
+
+    i = replies->n++;
+    replies->iov[i].iov_base = msg;
+    replies->iov[i].iov_len = msgLen;
+    memset(&replies->msgs[i], 0, sizeof(struct mmsghdr));
+    replies->msgs[i].msg_hdr.msg_name = (void*)dest;
+    replies->msgs[i].msg_hdr.msg_namelen = destLen;
+    replies->msgs[i].msg_hdr.msg_iov = &replies->iov[i];
+    replies->msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+/** Invia in blocco i messaggi preparati,
+ * ripetendo la sendmmsg fino a che non
+ * sono stati consegnati tutti al kernel.
+ * Un messaggio rifiutato è solo segnalato:
+ * come ogni datagramma può andare perso e
+ * il mittente lo ripeterà.
+ */
+static void sendBatch(int socketfd, struct mmsghdr* msgs, unsigned int n)
+{
+    unsigned int sent;
+    int ans;
+
+    for (sent = 0; sent < n; )
+    {
+        ans = sendmmsg(socketfd, msgs+sent, n-sent, 0);
+        if (ans == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            unified_io_push(UNIFIED_IO_ERROR, "\tsendmmsg failed");
+            ++sent;
+        }
+        else
+        {
+            sent += (unsigned int)ans;
+        }
+    }
+}
+
+/** Invia tutte le risposte accodate e ne
+ * libera la memoria.
+ */
+static void flushReplies(int socketfd, struct udp_replies* replies)
+{
+    unsigned int i;
+
+    sendBatch(socketfd, replies->msgs, replies->n);
+    for (i = 0; i != replies->n; ++i)
+        free(replies->iov[i].iov_base);
+    replies->n = 0;
+}
+
 /** Funzioni che gestiscono i vari casi.
  * Restituiscono 0 in caso di successo
  * e -1 in caso di errore.
  */
-static int handle_MESSAGES_BOOT_REQ(int socketfd, void* buffer, size_t msgLen, struct sockaddr* source, socklen_t sourceLen)
+static int handle_MESSAGES_BOOT_REQ(struct udp_replies* replies, void* buffer, size_t msgLen, struct sockaddr* source, socklen_t sourceLen)
 {
     struct boot_req* req;
     struct ns_host_addr ns_source; /* indirizzo "compresso" del mittente */
@@ -121,12 +228,11 @@ static int handle_MESSAGES_BOOT_REQ(int socketfd, void* buffer, size_t msgLen, s
 
         /* ora dovrebbe inviare un messaggio di risposta al peer MESSAGES_BOOT_ACK */
         /* genera il messaggio */
-        if (messages_make_boot_ack(&ack, &ackLen, req, newID, neighbours, (size_t)length) == -1)
+        if (messages_make_boot_ack(&ack, &ackLen, req, newID, peers_epoch(), neighbours, (size_t)length) == -1)
                 errExit("*** messages_make_boot_ack ***\n");
 
-        /* lo invia a destinazione */
-        if (sendto(socketfd, (void*)ack, ackLen, 0, source, sourceLen) != (ssize_t)ackLen)
-                errExit("*** messages_make_boot_ack ***\n");
+        /* sarà inviato insieme alle altre risposte */
+        queueReply(replies, (void*)ack, ackLen, source, sourceLen);
 
         /* infine libera la memoria */
         free((void*)ns_tcp);
@@ -143,12 +249,16 @@ static int handle_MESSAGES_BOOT_REQ(int socketfd, void* buffer, size_t msgLen, s
  * dei messaggi di tipo MESSAGES_CHECK_REQ.
  */
 static void
-handle_MESSAGES_CHECK_REQ(int socketfd,
+handle_MESSAGES_CHECK_REQ(struct udp_replies* replies,
             void* buffer, size_t msgLen,
             struct sockaddr* source, socklen_t sourceLen)
 {
-    /* Porta. */
+    /* Porta e identificativo della richiesta. */
     uint16_t port;
+    /* indirizzo e porta del mittente */
+    struct ns_host_addr ns_source;
+    uint16_t srcPort;
+    uint32_t reqID;
     /* puntatore tipizzato */
     struct check_req* req;
     /* dati del peer in questione */
@@ -159,6 +269,9 @@ handle_MESSAGES_CHECK_REQ(int socketfd,
     /* test */
     int err, i;
     char dataStr[64];
+    /* risposta */
+    struct check_ack* ack;
+    size_t ackLen;
 
     unified_io_push(UNIFIED_IO_NORMAL, "Received msg [MESSAGES_CHECK_REQ]");
     if (messages_check_check_req(buffer, msgLen) != 0)
@@ -168,10 +281,21 @@ handle_MESSAGES_CHECK_REQ(int socketfd,
     }
     req = (struct check_req*)buffer;
     /* estrae il contenuto del messaggio */
-    if (messages_get_check_req_body(req, &port) != 0)
+    if (messages_get_check_req_body(req, &port, &reqID) != 0)
         errExit("*** messages_get_check_req_body ***\n");
 
     unified_io_push(UNIFIED_IO_NORMAL, "\tRichieste informazioni per la porta (%d)", (int)port);
+    /* un peer ricaricato da file che chiede
+     * informazioni su di sé, dallo stesso
+     * indirizzo del login, è ancora attivo */
+    if (peers_unverified() > 0)
+    {
+        if (ns_host_addr_from_sockaddr(&ns_source, source) == -1
+            || ns_host_addr_get_port(&ns_source, &srcPort) == -1)
+            errExit("*** ns_host_addr_from_sockaddr ***\n");
+        if (srcPort == port && peers_confirm_source(&ns_source) == -1)
+            errExit("*** peers_confirm_source ***\n");
+    }
     /* cerca i dati */
     err = peers_get_data_and_neighbours(port, &peer, neighbours, &length);
     if (err)
@@ -189,138 +313,279 @@ handle_MESSAGES_CHECK_REQ(int socketfd,
         }
     }
 
-    if (messages_send_check_ack(socketfd, source, sourceLen, port, err != 0,
+    if (messages_make_check_ack(&ack, &ackLen, port, reqID, err != 0,
         peer, neighbours, (size_t)length) == -1)
-        errExit("*** messages_send_check_ack ***\n");
-    unified_io_push(UNIFIED_IO_NORMAL, "\tSent response [MESSAGES_CHECK_ACK]");
+        errExit("*** messages_make_check_ack ***\n");
+    queueReply(replies, (void*)ack, ackLen, source, sourceLen);
+    unified_io_push(UNIFIED_IO_NORMAL, "\tQueued response [MESSAGES_CHECK_ACK]");
 }
 
-/** Prova a spegnere tutti al più
- * 5 volte e si pone un tempo di
- * attesa di al più due secondi
- * tra un tentativo e l'altro
+/** Ogni peer riceve al più SHUTDOWN_ATTEMPT
+ * richieste di spegnimento, ciascuna con il
+ * proprio timer di ritrasmissione: il primo
+ * scade dopo SHUTDOWN_RTO millisecondi e ad
+ * ogni tentativo la durata raddoppia, fino a
+ * SHUTDOWN_RTO_MAX.
+ *
+ * Le richieste scadute nello stesso momento
+ * sono inviate con un'unica sendmmsg, a
+ * blocchi di al più SHUTDOWN_BATCH.
  */
-#define SHUTDOWN_TIMEOUT 2000 /* ms */
+#define SHUTDOWN_RTO 50 /* ms */
+#define SHUTDOWN_RTO_MAX 1000 /* ms */
 #define SHUTDOWN_ATTEMPT 5
+#define SHUTDOWN_BATCH 64
 
-/** Si occupa di inviare a tutti i peer
- * i messaggi che ne comandano lo
- * spegnimento, ovvero messaggi di tipo:
- * MESSAGES_SHUTDOWN_REQ
+/** Stato dello spegnimento di un singolo
+ * peer.
  */
-static void handlerPeersShutdown(int socketfd)
+struct shutdown_pending
+{
+    struct peer_target target;
+    /* messaggio da inviare, preparato una volta sola */
+    struct shutdown_req* req;
+    size_t reqLen;
+    struct sockaddr_storage ss;
+    socklen_t ssLen;
+    /* tentativi già compiuti */
+    int attempts;
+    /* istante (ms) in cui scade il timer
+     * e durata del prossimo */
+    long int deadline;
+    long int rto;
+    /* non nullo se ha risposto o ci si è arresi */
+    int done;
+};
+
+/** Istante corrente, in millisecondi,
+ * secondo un orologio monotono.
+ */
+static long int shutdownNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        errExit("*** shutdownNow:clock_gettime ***\n");
+
+    return (long int)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/** Legge tutti gli ack disponibili sul
+ * socket senza bloccarsi, togliendo da
+ * pending e dal registro i peer che hanno
+ * risposto.
+ */
+static void shutdownDrainAcks(int socketfd, struct rb_tree* pending)
 {
-    int i;
-    struct pollfd polled;
     char buffer[64];
     ssize_t dataLen;
     struct sockaddr_storage ss;
     socklen_t ssLen;
     char sender[32];
     struct shutdown_ack* ack;
-    uint32_t ID, ID2;
+    struct shutdown_pending* p;
+    void* found;
+    uint32_t ID;
     uint16_t port;
 
-    memset(&polled, 0, sizeof(struct pollfd));
-    polled.fd = socketfd;
-    polled.events = POLLIN;
+    errno = 0;
+    /* per la prima volta uso l'operatore "," */
+    while ((dataLen = recvfrom(socketfd, (void*)buffer, sizeof(buffer),
+        MSG_DONTWAIT, (struct sockaddr*)&ss, (ssLen = sizeof(ss), &ssLen))) != -1)
+    {
+        /* nel dubbio ripristina errno
+         * per il controllo dell'errore */
+        errno = 0;
 
-    unified_io_push(UNIFIED_IO_NORMAL, "Connected peers [%d]", (int)peers_number());
+        /* verifica che il messaggio ricevuto sia di tipo
+         * MESSAGES_SHUTDOWN_ACK */
+        if (recognise_messages_type((void*)buffer) != MESSAGES_SHUTDOWN_ACK)
+        {
+            unified_io_push(UNIFIED_IO_NORMAL, "\tInvalid message type!");
+            continue;
+        }
+        /* controlla l'integrità del messaggio */
+        if (messages_check_shutdown_ack((void*)buffer, (size_t)dataLen) == -1)
+        {
+            unified_io_push(UNIFIED_IO_NORMAL, "\tMalformed message!");
+            continue;
+        }
 
-    for (i = 0; peers_number()>0 && i < SHUTDOWN_ATTEMPT; i++)
-    {
-        /* log di quello che sta facendo */
-        unified_io_push(UNIFIED_IO_NORMAL, "Sending shutdown message, attempt [%d] of %d", i+1, SHUTDOWN_ATTEMPT);
+        ack = (struct shutdown_ack*)buffer;
 
-        /* invia a tutti il segnale di spegnimento */
-        if (peers_send_shutdown(socketfd) == -1)
-            errExit("*** handlerPeersShutdown:peers_send_shutdown ***\n");
+        if (sockaddr_as_string(sender, sizeof(sender),
+            (struct sockaddr*)&ss, ssLen) == -1)
+            errExit("*** handlerPeersShutdown:sockaddr_as_string ***\n");
 
-        /* si mette a gestire */
-        switch (poll(&polled, 1, SHUTDOWN_TIMEOUT))
+        /* estrae l'ID presente nel messaggio ricevuto */
+        if (messages_get_shutdown_ack_body(ack, &ID) == -1)
+            errExit("*** handlerPeersShutdown:messages_get_shutdown_ack_body ***\n");
+
+        /* estrae la porta di origine, utilizzata
+         * per identificare il mittente */
+        if (getSockAddrPort((struct sockaddr*)&ss, &port) == -1)
+            errExit("*** handlerPeersShutdown:getSockAddrPort ***\n");
+
+        /* un ack duplicato, o di un peer a cui
+         * si è già rinunciato, non trova nulla */
+        if (rb_tree_get(pending, (long)port, &found) == -1)
+            continue;
+        p = (struct shutdown_pending*)found;
+        if (p->target.id != ID)
         {
-        case -1:
-            /* DISASTRO */
-            errExit("*** handlerPeersShutdown:poll ***\n");
-            break;
+            unified_io_push(UNIFIED_IO_NORMAL, "\tNo peer with ID [%ld]", (long)ID);
+            continue;
+        }
 
-        case 0:
-            /* niente da fare */
-            unified_io_push(UNIFIED_IO_NORMAL, "No messages received");
-            break;
+        if (rb_tree_remove(pending, (long)port, NULL) == -1)
+            errExit("*** handlerPeersShutdown:rb_tree_remove ***\n");
+        p->done = 1;
 
-        default:
-            if (!(polled.revents & POLLIN))
-            {
-                errExit("*** poll: strange response ***\n");
-            }
+        if (peers_remove_peer((long)port) == -1)
+            errExit("*** handlerPeersShutdown:peers_remove_peer ***\n");
 
-            errno = 0;
-            /* per la prima volta uso l'operatore "," */
-            while ((dataLen = recvfrom(socketfd, (void*)buffer, sizeof(buffer),
-                MSG_DONTWAIT, (struct sockaddr*)&ss, (ssLen = sizeof(ss), &ssLen))) != -1)
-            {
-                unified_io_push(UNIFIED_IO_NORMAL, "\tReceived message");
-                /* nel dubbio ripristina errno
-                 * per il controllo dell'errore */
-                errno = 0;
-
-                /* verifica che il messaggio ricevuto sia di tipo
-                 * MESSAGES_SHUTDOWN_ACK */
-                if (recognise_messages_type((void*)buffer) != MESSAGES_SHUTDOWN_ACK)
-                {
-                    unified_io_push(UNIFIED_IO_NORMAL, "\tInvalid message type!");
-                    continue;
-                }
-                unified_io_push(UNIFIED_IO_NORMAL, "\tReceived message [MESSAGES_SHUTDOWN_ACK]");
-                /* controlla l'integrità del messaggio */
-                if (messages_check_shutdown_ack((void*)buffer, (size_t)dataLen) == -1)
-                {
-                    unified_io_push(UNIFIED_IO_NORMAL, "\tMalformed message!");
-                    continue;
-                }
+        unified_io_push(UNIFIED_IO_NORMAL, "\tReceived shutdown ack form %s, removed peer with ID [%ld]", sender, (long)ID);
+    }
+    if (errno != EWOULDBLOCK && errno != EAGAIN)
+        errExit("*** handlerPeersShutdown:recvfrom ***\n");
+}
+
+/** Si occupa di inviare a tutti i peer
+ * i messaggi che ne comandano lo
+ * spegnimento, ovvero messaggi di tipo:
+ * MESSAGES_SHUTDOWN_REQ
+ *
+ * Tutti i peer sono contattati insieme e
+ * ciascuno è ritrasmesso solo allo scadere
+ * del proprio timer, così che la procedura
+ * termini non appena arriva l'ultimo ack.
+ */
+static void handlerPeersShutdown(int socketfd)
+{
+    struct peer_target* targets;
+    size_t length, i;
+    struct shutdown_pending* all;
+    struct rb_tree* pending;
+    struct mmsghdr msgs[SHUTDOWN_BATCH];
+    struct iovec iov[SHUTDOWN_BATCH];
+    unsigned int batched;
+    struct pollfd polled;
+    long int now, next, start;
+
+    if (peers_get_targets(&targets, &length) == -1)
+        errExit("*** handlerPeersShutdown:peers_get_targets ***\n");
 
-                ack = (struct shutdown_ack*)buffer;
+    unified_io_push(UNIFIED_IO_NORMAL, "Connected peers [%d]", (int)length);
 
-                if (sockaddr_as_string(sender, sizeof(sender),
-                    (struct sockaddr*)&ss, ssLen) == -1)
-                    errExit("*** handlerPeersShutdown:sockaddr_as_string ***\n");
+    all = calloc(length ? length : 1, sizeof(struct shutdown_pending));
+    pending = rb_tree_init(NULL);
+    if (all == NULL || pending == NULL)
+        errExit("*** handlerPeersShutdown:calloc ***\n");
 
-                /* estrae l'ID presente nel messaggio ricevuto */
-                if (messages_get_shutdown_ack_body(ack, &ID) == -1)
-                    errExit("*** handlerPeersShutdown:messages_get_shutdown_ack_body ***\n");
+    start = shutdownNow();
+    /* prepara i messaggi e l'insieme dei peer da cui si attende un ack */
+    for (i = 0; i != length; ++i)
+    {
+        all[i].target = targets[i];
+        if (messages_make_shutdown_req(&all[i].req, &all[i].reqLen, targets[i].id) == -1)
+            errExit("*** handlerPeersShutdown:messages_make_shutdown_req ***\n");
+        all[i].ssLen = sizeof(all[i].ss);
+        if (sockaddr_from_ns_host_addr((struct sockaddr*)&all[i].ss, &all[i].ssLen, &targets[i].ns_addr) == -1)
+            errExit("*** handlerPeersShutdown:sockaddr_from_ns_host_addr ***\n");
+        all[i].deadline = start;
+        all[i].rto = SHUTDOWN_RTO;
+        if (rb_tree_set(pending, targets[i].port, (void*)&all[i]) == -1)
+            errExit("*** handlerPeersShutdown:rb_tree_set ***\n");
+    }
+    free(targets);
 
-                /* cosa ha ricevuto e da chi */
-                unified_io_push(UNIFIED_IO_NORMAL, "\tReceived shutdown ack form %s, ID [%ld]", sender, (long)ID);
+    memset(&polled, 0, sizeof(struct pollfd));
+    polled.fd = socketfd;
+    polled.events = POLLIN;
 
-                /* estrae la porta di origine, utilizzata
-                 * per identificare il mittente */
-                if (getSockAddrPort((struct sockaddr*)&ss, &port) == -1)
-                    errExit("*** handlerPeersShutdown:messages_get_shutdown_ack_body ***\n");
+    while (rb_tree_size(pending) > 0)
+    {
+        now = shutdownNow();
+        next = LONG_MAX;
+        batched = 0;
 
-                /* controlla se sia stato già rimosso
-                 * (pacchetto duplicato) e in caso
-                 * contrario rimuove il nuovo elemento */
-                /* cerca l'ID del peer a quella porta */
-                /* vede se coincide con quello atteso */
-                if (peers_get_id((long)port, &ID2) == -1 || ID != ID2)
-                {
-                    unified_io_push(UNIFIED_IO_NORMAL, "\tNo peer with ID [%ld]", (long)ID);
-                    continue;
-                }
-                /* lo elimina */
-                if (peers_remove_peer((long)port) == -1)
-                    errExit("*** handlerPeersShutdown:peers_remove_peer ***\n");
+        /* ritrasmette a chi ha il timer scaduto */
+        for (i = 0; i != length; ++i)
+        {
+            if (all[i].done)
+                continue;
 
-                unified_io_push(UNIFIED_IO_NORMAL, "\tRemoved peer with ID [%ld]", (long)ID);
+            if (all[i].deadline > now)
+            {
+                if (all[i].deadline < next)
+                    next = all[i].deadline;
+                continue;
             }
-            if (errno != EWOULDBLOCK && errno != EAGAIN)
-                errExit("*** handlerPeersShutdown:recvfrom ***\n");
 
-            /* ci sono dei messaggi da gestire */
+            if (all[i].attempts == SHUTDOWN_ATTEMPT)
+            {
+                /* ci si arrende */
+                all[i].done = 1;
+                if (rb_tree_remove(pending, all[i].target.port, NULL) == -1)
+                    errExit("*** handlerPeersShutdown:rb_tree_remove ***\n");
+                unified_io_push(UNIFIED_IO_NORMAL, "\tNo answer from peer with ID [%ld] after %d attempts",
+                    (long)all[i].target.id, SHUTDOWN_ATTEMPT);
+                continue;
+            }
+
+            iov[batched].iov_base = (void*)all[i].req;
+            iov[batched].iov_len = all[i].reqLen;
+            memset(&msgs[batched], 0, sizeof(struct mmsghdr));
+            msgs[batched].msg_hdr.msg_name = (void*)&all[i].ss;
+            msgs[batched].msg_hdr.msg_namelen = all[i].ssLen;
+            msgs[batched].msg_hdr.msg_iov = &iov[batched];
+            msgs[batched].msg_hdr.msg_iovlen = 1;
+
+            ++all[i].attempts;
+            all[i].deadline = now + all[i].rto;
+            if (all[i].deadline < next)
+                next = all[i].deadline;
+            all[i].rto *= 2;
+            if (all[i].rto > SHUTDOWN_RTO_MAX)
+                all[i].rto = SHUTDOWN_RTO_MAX;
+
+            if (++batched == SHUTDOWN_BATCH)
+            {
+                sendBatch(socketfd, msgs, batched);
+                batched = 0;
+            }
+        }
+        if (batched != 0)
+            sendBatch(socketfd, msgs, batched);
+
+        if (rb_tree_size(pending) == 0)
+            break;
+
+        /* attende gli ack fino alla prossima scadenza */
+        switch (poll(&polled, 1, next > now ? (int)(next - now) : 0))
+        {
+        case -1:
+            if (errno != EINTR)
+                errExit("*** handlerPeersShutdown:poll ***\n");
+            break;
+
+        case 0:
+            break;
+
+        default:
+            if (!(polled.revents & POLLIN))
+                errExit("*** poll: strange response ***\n");
+            shutdownDrainAcks(socketfd, pending);
             break;
         }
     }
+
+    unified_io_push(UNIFIED_IO_NORMAL, "Shutdown completed in %ld ms", shutdownNow() - start);
+
+    for (i = 0; i != length; ++i)
+        free(all[i].req);
+    free(all);
+    rb_tree_destroy(pending);
 }
 
 /** Funzione ausiliaria che si occupa di gestire
@@ -332,7 +597,7 @@ static void handlerPeersShutdown(int socketfd)
  */
 static void
 handle_peer_DETATCH(
-            int sockfd,
+            struct udp_replies* replies,
             const void* buffer,
             size_t bufferLen,
             struct sockaddr* sender,
@@ -341,9 +606,11 @@ handle_peer_DETATCH(
     uint16_t senderPort; /* porta che ha inviato il messaggio */
     uint32_t senderID; /* ID nel messaggio ricevuto */
     uint32_t foundID; /* ID associato a tale porta nel registro */
+    struct shutdown_ack* ack; /* risposta */
+    size_t ackLen;
 
     /* parametri validi */
-    if (sockfd < 0 || buffer == NULL || bufferLen == 0 || sender == NULL || senderLen == 0)
+    if (replies == NULL || buffer == NULL || bufferLen == 0 || sender == NULL || senderLen == 0)
         errExit("*** UDP:handle_peer_DETATCH ***\n");
 
     /* integrità dei messaggi */
@@ -362,8 +629,9 @@ handle_peer_DETATCH(
     unified_io_push(UNIFIED_IO_NORMAL, "\tPeer [ID:%ld] on port [%ld] requires disconnection", (long)senderID, (long)senderPort);
 
     /* vada come vada, risponde al messaggio */
-    if (messages_send_shutdown_response(sockfd, sender, senderLen, (struct shutdown_req*)buffer) == -1)
-        errExit("*** UDP:messages_send_shutdown_response ***\n");
+    if (messages_make_shutdown_ack(&ack, &ackLen, (struct shutdown_req*)buffer) == -1)
+        errExit("*** UDP:messages_make_shutdown_ack ***\n");
+    queueReply(replies, (void*)ack, ackLen, sender, senderLen);
 
     /* esiste tale peer? */
     if (peers_get_id((long)senderPort, &foundID) == 0)
@@ -390,27 +658,176 @@ handle_peer_DETATCH(
     }
 }
 
+/** Comunica con un messaggio di tipo
+ * MESSAGES_TOPOLOGY_UPDATE i nuovi vicini
+ * a tutti i peer i cui vicini sono cambiati
+ * dopo le ultime aggiunte o rimozioni, così
+ * che non debbano scoprirlo con CHECK_REQ.
+ * Gli aggiornamenti non sono ritrasmessi:
+ * un peer che ne perde uno se ne accorge dal
+ * numero di sequenza e ricade su CHECK_REQ.
+ *
+ * Va invocata senza possedere il lock del
+ * registro dei peer.
+ */
+static void pushTopologyUpdates(int socketfd)
+{
+    struct udp_replies pushes;
+    struct sockaddr_storage dests[UDP_BATCH];
+    struct peer_update* updates;
+    struct topology_update* msg;
+    size_t length, i, msgLen;
+    socklen_t destLen;
+
+    if (peers_topology_updates(&updates, &length) == -1)
+        errExit("*** UDP:peers_topology_updates ***\n");
+
+    pushes.n = 0;
+    for (i = 0; i != length; ++i)
+    {
+        if (messages_make_topology_update(&msg, &msgLen, updates[i].id, peers_epoch(), updates[i].seq,
+                updates[i].confirm, updates[i].neighbours, updates[i].length) == -1)
+            errExit("*** UDP:messages_make_topology_update ***\n");
+
+        destLen = sizeof(dests[pushes.n]);
+        if (sockaddr_from_ns_host_addr((struct sockaddr*)&dests[pushes.n], &destLen, &updates[i].ns_addr) == -1)
+            errExit("*** UDP:sockaddr_from_ns_host_addr ***\n");
+
+        queueReply(&pushes, (void*)msg, msgLen, (struct sockaddr*)&dests[pushes.n], destLen);
+        if (pushes.n == UDP_BATCH)
+            flushReplies(socketfd, &pushes);
+    }
+    flushReplies(socketfd, &pushes);
+    if (length != 0)
+        unified_io_push(UNIFIED_IO_NORMAL, "\tTopology update sent to %ld peers", (long)length);
+
+    free(updates);
+}
+
+/** Verifica se nel blocco di datagrammi ce
+ * n'è almeno uno che modifica il registro
+ * dei peer, caso in cui il blocco va
+ * gestito possedendone il lock come
+ * scrittore.
+ */
+static int batchWrites(char buffers[][UDP_BUFFER], int received)
+{
+    int j;
+
+    for (j = 0; j != received; ++j)
+        switch (recognise_messages_type((void*)buffers[j]))
+        {
+        case MESSAGES_BOOT_REQ:
+        case MESSAGES_SHUTDOWN_REQ:
+            return 1;
+
+        case MESSAGES_CHECK_REQ:
+            /* conferma i peer ricaricati da file */
+            if (peers_unverified() > 0)
+                return 1;
+            break;
+
+        default:
+            break;
+        }
+
+    return 0;
+}
+
+/** Gestisce un singolo datagramma ricevuto,
+ * accodando l'eventuale risposta.
+ *
+ * Va invocata possedendo il lock del
+ * registro dei peer (peers_lock), come
+ * scrittore se batchWrites lo richiede.
+ */
+static void handleDatagram(struct udp_replies* replies,
+            void* buffer, size_t msgLen,
+            struct sockaddr* sender, socklen_t senderLen)
+{
+    char srcStr[32]; /* per stampare l'indirizzo del mittente */
+    char timeStr[64]; /* per stampare ts ricezione messaggi */
+    time_t currTime;
+
+    /* orario e mittente del pacchetti */
+    if (sockaddr_as_string(srcStr, sizeof(srcStr), sender, senderLen) == -1)
+        errExit("*** UDP:sockaddr_as_string ***\n");
+    currTime = time(NULL);
+    if (ctime_r(&currTime, timeStr) == NULL)
+        errExit("*** UDP:ctime_r ***\n");
+    timeStr[strlen(timeStr)-1] = '\0';
+    unified_io_push(UNIFIED_IO_NORMAL, "[%s\b] packet from %s", timeStr, srcStr);
+
+    /* inizia il lavoro sul pacchetto */
+    /* controlla se è regolare */
+    switch (recognise_messages_type(buffer))
+    {
+    case -1:
+        /* errore - non dovrebbe mai accadere */
+        errExit("*** UDP:recognise_messages_type ***\n");
+        break;
+
+    case MESSAGES_MSG_UNKWN:
+        /* sentinella violata, quasi certamente
+         * è un messaggio di debugging */
+        unified_io_push(UNIFIED_IO_NORMAL, "Received msg [MESSAGES_MSG_UNKWN]");
+        break;
+
+    case MESSAGES_BOOT_REQ:
+        /* ricevuta richiesta di boot da gestire */
+        handle_MESSAGES_BOOT_REQ(replies, buffer, msgLen, sender, senderLen);
+        break;
+
+    case MESSAGES_SHUTDOWN_REQ:
+        unified_io_push(UNIFIED_IO_NORMAL, "Received msg [MESSAGES_SHUTDOWN_REQ]");
+        /* un peer si vuole staccare, gestisce il caso */
+        handle_peer_DETATCH(replies, buffer, msgLen, sender, senderLen);
+        break;
+
+    case MESSAGES_CHECK_REQ:
+        handle_MESSAGES_CHECK_REQ(replies, buffer, msgLen, sender, senderLen);
+        break;
+
+    default:
+        /* ricevuto un tipo di messaggio sconosciuto */
+        break;
+    }
+}
+
 /** Corpo del thread che gestisce il
  * socket UDP.
  */
 static void* UDP(void* args)
 {
     struct thread_semaphore* ts;
-    int* data;
+    struct udp_worker_args* data;
+    /* copia di data->primary, data non sarà
+     * più valido una volta avviato il thread */
+    int primary;
     /* porta decisa dal padre */
     int requestedPort;
     /* porta usata dal thread */
     int usedPort;
     /* fd del socket */
     int socket;
-    /* variabili per gestire i messaggi in arrivo */
-    ssize_t msgLen;
-    char buffer[1024];
-    struct sockaddr_storage sender;
-    socklen_t senderLen;
-    char srcStr[32]; /* per stampare l'indirizzo del mittente */
-    char timeStr[64]; /* per stampare ts ricezione messaggi */
-    time_t currTime;
+    /* variabili per gestire i messaggi in arrivo,
+     * letti a blocchi di al più UDP_BATCH */
+    struct mmsghdr in[UDP_BATCH];
+    struct iovec inIov[UDP_BATCH];
+    char buffers[UDP_BATCH][UDP_BUFFER];
+    struct sockaddr_storage senders[UDP_BATCH];
+    int received, j;
+    /* non nullo se il blocco modifica il registro */
+    int writes;
+    /* risposte da inviare al termine del blocco */
+    struct udp_replies replies;
+    /* peer ricaricati da file, istante (ms) del
+     * prossimo turno di verifica e turni svolti */
+    int restored;
+    long int revalidateAt;
+    int revalidateRound;
+    struct pollfd pfd;
+    long int timeout;
 
     /* per il segnale di terminazione */
     struct sigaction toStop;
@@ -420,12 +837,13 @@ static void* UDP(void* args)
     if (ts == NULL)
         errExit("*** UDP ***\n");
 
-    data = (int*)thread_semaphore_get_args(args);
+    data = (struct udp_worker_args*)thread_semaphore_get_args(args);
     if (data == NULL)
         errExit("*** UDP ***\n");
+    primary = data->primary;
 
     /* attiva il sottosistema per gestire i peer */
-    if (peers_init() == -1)
+    if (primary && peers_init() == -1)
     {
         if (thread_semaphore_signal(ts, -1, NULL) == -1)
             errExit("*** UDP:sigaction ***\n");
@@ -472,10 +890,11 @@ static void* UDP(void* args)
         pthread_exit(NULL);
     }
 
-    requestedPort = *data;
+    requestedPort = data->port;
 
-    /* crea il socket UDP */
-    socket = initUDPSocket(requestedPort);
+    /* crea il socket UDP, condividendo la porta
+     * se i thread sono più d'uno */
+    socket = UDPworkers > 1 ? initSharedUDPSocket(requestedPort) : initUDPSocket(requestedPort);
     if (socket == -1)
     {
         if (thread_semaphore_signal(ts, -1, NULL) == -1)
@@ -492,7 +911,16 @@ static void* UDP(void* args)
     }
     /* metodo per fornire al chiamante
      * la porta utilizzata */
-    *data = usedPort;
+    data->port = usedPort;
+
+    /* ricarica i peer dell'esecuzione precedente */
+    restored = 0;
+    if (primary && (restored = peers_restore(usedPort)) == -1)
+    {
+        if (thread_semaphore_signal(ts, -1, NULL) == -1)
+            errExit("*** UDP:peers_restore ***\n");
+        pthread_exit(NULL);
+    }
 
     /* socket creato, porta nota, si può iniziare */
     if (thread_semaphore_signal(ts, 0, NULL) == -1)
@@ -501,6 +929,32 @@ static void* UDP(void* args)
     /* a questo punto il padre può riprendere */
     unified_io_push(UNIFIED_IO_NORMAL, "UDP thread running");
 
+    /* prepara i descrittori dei datagrammi */
+    memset(in, 0, sizeof(in));
+    for (j = 0; j != UDP_BATCH; ++j)
+    {
+        inIov[j].iov_base = (void*)buffers[j];
+        inIov[j].iov_len = sizeof(buffers[j]);
+        in[j].msg_hdr.msg_name = (void*)&senders[j];
+        in[j].msg_hdr.msg_namelen = sizeof(senders[j]);
+        in[j].msg_hdr.msg_iov = &inIov[j];
+        in[j].msg_hdr.msg_iovlen = 1;
+    }
+    replies.n = 0;
+
+    /* i peer ricaricati sono contattati subito
+     * con la nuova epoch: chi è attivo risponde
+     * confermandosi, gli altri saranno rimossi */
+    revalidateAt = 0;
+    revalidateRound = 0;
+    if (restored > 0)
+    {
+        pushTopologyUpdates(socket);
+        revalidateAt = shutdownNow() + DS_REVALIDATE_PERIOD;
+    }
+    pfd.fd = socket;
+    pfd.events = POLLIN;
+
     /* qui va il loop di gestione delle richieste */
     UDPloop = 1;
 
@@ -513,64 +967,77 @@ static void* UDP(void* args)
 
         while (UDPloop)
         {
-            /* ascolta per una richiesta */
-            senderLen = sizeof(sender);
-            msgLen = recvfrom(socket, (void*)buffer, sizeof(buffer),
-                0, (struct sockaddr*)&sender, &senderLen);
+            /* durante la verifica dei peer ricaricati
+             * l'attesa è limitata dal prossimo turno */
+            if (revalidateAt != 0 && peers_unverified() == 0)
+            {
+                unified_io_push(UNIFIED_IO_NORMAL, "All restored peers confirmed");
+                revalidateAt = 0;
+            }
+            if (revalidateAt != 0)
+            {
+                timeout = revalidateAt - shutdownNow();
+                if (timeout < 0)
+                    timeout = 0;
+                if (poll(&pfd, 1, (int)timeout) == -1)
+                {
+                    if (errno != EINTR)
+                        errExit("*** UDP:poll ***\n");
+                    continue;
+                }
+                if ((pfd.revents & POLLIN) == 0)
+                {
+                    if (pthread_sigmask(SIG_BLOCK, &toBlock, NULL) != 0)
+                        errExit("*** UDP:pthread_sigmask ***\n");
+
+                    /* all'ultimo turno chi non ha risposto è rimosso */
+                    ++revalidateRound;
+                    if (peers_revalidate(revalidateRound >= DS_REVALIDATE_ATTEMPT) == -1)
+                        errExit("*** UDP:peers_revalidate ***\n");
+                    pushTopologyUpdates(socket);
+                    revalidateAt = revalidateRound < DS_REVALIDATE_ATTEMPT ?
+                        shutdownNow() + DS_REVALIDATE_PERIOD : 0;
+
+                    if (pthread_sigmask(SIG_UNBLOCK, &toBlock, NULL) != 0)
+                        errExit("*** UDP:pthread_sigmask ***\n");
+                    continue;
+                }
+            }
+
+            /* attende il primo datagramma e prende
+             * anche quelli già arrivati */
+            received = recvmmsg(socket, in, UDP_BATCH, MSG_WAITFORONE, NULL);
 
-            /* gestisce una richiesta alla volta */
+            /* gestisce un blocco alla volta */
             if (pthread_sigmask(SIG_BLOCK, &toBlock, NULL) != 0)
                 errExit("*** UDP:pthread_sigmask ***\n");
 
             /* ora quello che viene fatto qui è al sicuro
              * da interruzioni anomale */
             /* controlla che tutto sia andato bene */
-            if (msgLen == -1)
-                errExit("*** UDP:recvfrom ***\n");
-
-            /* orario e mittente del pacchetti */
-            if (sockaddr_as_string(srcStr, sizeof(srcStr), (struct sockaddr*)&sender, senderLen) == -1)
-                errExit("*** UDP:sockaddr_as_string ***\n");
-            currTime = time(NULL);
-            if (ctime_r(&currTime, timeStr) == NULL)
-                errExit("*** UDP:ctime_r ***\n");
-            timeStr[strlen(timeStr)-1] = '\0';
-            unified_io_push(UNIFIED_IO_NORMAL, "[%s\b] packet from %s", timeStr, srcStr);
-
-            /* inizia il lavoro sul pacchetto */
-            /* controlla se è regolare */
-            switch (recognise_messages_type((void*)buffer))
+            if (received == -1)
+                errExit("*** UDP:recvmmsg ***\n");
+
+            /* un'unica acquisizione del lock per tutto il blocco */
+            writes = batchWrites(buffers, received);
+            if (peers_lock(writes) == -1)
+                errExit("*** UDP:peers_lock ***\n");
+            for (j = 0; j != received; ++j)
             {
-            case -1:
-                /* errore - non dovrebbe mai accadere */
-                errExit("*** UDP:recognise_messages_type ***\n");
-                break;
-
-            case MESSAGES_MSG_UNKWN:
-                /* sentinella violata, quasi certamente
-                 * è un messaggio di debugging */
-                unified_io_push(UNIFIED_IO_NORMAL, "Received msg [MESSAGES_MSG_UNKWN]");
-                break;
-
-            case MESSAGES_BOOT_REQ:
-                /* ricevuta richiesta di boot da gestire */
-                handle_MESSAGES_BOOT_REQ(socket, buffer, msgLen, (struct sockaddr*)&sender, senderLen);
-                break;
-
-            case MESSAGES_SHUTDOWN_REQ:
-                unified_io_push(UNIFIED_IO_NORMAL, "Received msg [MESSAGES_SHUTDOWN_REQ]");
-                /* un peer si vuole staccare, gestisce il caso */
-                handle_peer_DETATCH(socket, (void*)buffer, msgLen, (struct sockaddr*)&sender, senderLen);
-                break;
-
-            case MESSAGES_CHECK_REQ:
-                handle_MESSAGES_CHECK_REQ(socket, (void*)buffer, msgLen, (struct sockaddr*)&sender, senderLen);
-                break;
-
-            default:
-                /* ricevuto un tipo di messaggio sconosciuto */
-                break;
+                handleDatagram(&replies, (void*)buffers[j], (size_t)in[j].msg_len,
+                    (struct sockaddr*)&senders[j], in[j].msg_hdr.msg_namelen);
+                /* ripristina il descrittore per la prossima recvmmsg */
+                in[j].msg_hdr.msg_namelen = sizeof(senders[j]);
             }
+            if (peers_unlock() == -1)
+                errExit("*** UDP:peers_unlock ***\n");
+
+            /* invia tutte le risposte insieme */
+            flushReplies(socket, &replies);
+
+            /* poi avvisa chi ha visto cambiare i propri vicini */
+            if (writes)
+                pushTopologyUpdates(socket);
 
             if (pthread_sigmask(SIG_UNBLOCK, &toBlock, NULL) != 0)
                 errExit("*** UDP:pthread_sigmask ***\n");
@@ -579,6 +1046,14 @@ static void* UDP(void* args)
     /* ora il segnale è di nuovo bloccato */
     /* mai raggiunto prima del termine */
 
+    /* gli altri thread si limitano a chiudere il socket */
+    if (!primary)
+    {
+        if (close(socket) != 0)
+            errExit("*** UDP:close ***\n");
+        return NULL;
+    }
+
     /** svolge tutte le operazioni
      * necessarie allo spegnimento
      * dei peer */
@@ -594,33 +1069,69 @@ static void* UDP(void* args)
     return NULL;
 }
 
+int UDPsetWorkers(int n)
+{
+    if (UDPstarted != 0 || n < 1 || n > DS_UDP_MAX_WORKERS)
+        return -1;
+
+    UDPworkers = n;
+    return 0;
+}
+
 int UDPstart(int port)
 {
-    int listeningOn;
+    struct udp_worker_args args;
 
-    listeningOn = port;
+    if (UDPstarted != 0)
+        return -1;
+
+    args.port = port;
+    args.primary = 1;
     /* si mette in attesa dell'avvio del thread UDP */
-    if (start_long_life_thread(&UDP_tid, &UDP, (void*)&listeningOn, NULL) == -1)
+    if (start_long_life_thread(&UDP_tids[0], &UDP, (void*)&args, NULL) == -1)
         return -1;
+    UDPstarted = 1;
+
+    /* gli altri si ancorano alla stessa porta */
+    args.primary = 0;
+    while (UDPstarted < UDPworkers)
+    {
+        if (start_long_life_thread(&UDP_tids[UDPstarted], &UDP, (void*)&args, NULL) == -1)
+        {
+            UDPstop();
+            return -1;
+        }
+        ++UDPstarted;
+    }
 
-    return listeningOn;
+    unified_io_push(UNIFIED_IO_NORMAL, "UDP threads running [%d] on port [%d]", UDPstarted, args.port);
+
+    return args.port;
 }
 
 int UDPstop(void)
 {
     /* controlla che fosse partito */
-    if (UDP_tid == 0)
-        return -1;
-
-    /* invia il segnale di terminazione */
-    /* assumo che il thread non termini mai
-     * prima del tempo */
-    if (pthread_kill(UDP_tid, INTERRUPT_SIGNAL) != 0)
+    if (UDPstarted == 0)
         return -1;
 
-    /* attende la terminazione del thread */
-    if (pthread_join(UDP_tid, NULL) != 0)
-        return -1;
+    /* ferma per ultimo il primo thread, così
+     * che durante lo spegnimento dei peer il
+     * suo sia l'unico socket sulla porta e
+     * riceva tutti gli ack */
+    while (UDPstarted > 0)
+    {
+        --UDPstarted;
+        /* invia il segnale di terminazione */
+        /* assumo che il thread non termini mai
+         * prima del tempo */
+        if (pthread_kill(UDP_tids[UDPstarted], INTERRUPT_SIGNAL) != 0)
+            return -1;
+
+        /* attende la terminazione del thread */
+        if (pthread_join(UDP_tids[UDPstarted], NULL) != 0)
+            return -1;
+    }
 
     return 0;
 }
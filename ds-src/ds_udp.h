@@ -10,9 +10,43 @@
 #ifndef DS_UDP
 #define DS_UDP
 
-/** Avvia il thread a gestione del socket
+/** Numero predefinito di thread che gestiscono
+ * le richieste UDP, ciascuno con il proprio
+ * socket ancorato alla stessa porta tramite
+ * SO_REUSEPORT. Modificabile prima dell'avvio
+ * con UDPsetWorkers.
+ */
+#ifndef DS_UDP_WORKERS
+#define DS_UDP_WORKERS 1
+#endif
+
+#define DS_UDP_MAX_WORKERS 64
+
+/** Dopo un riavvio i peer ricaricati da file
+ * sono contattati ogni DS_REVALIDATE_PERIOD
+ * millisecondi, per al più DS_REVALIDATE_ATTEMPT
+ * volte: chi in tutto questo tempo non si fa
+ * sentire è rimosso dal registro.
+ */
+#ifndef DS_REVALIDATE_PERIOD
+#define DS_REVALIDATE_PERIOD 1000
+#endif
+
+#ifndef DS_REVALIDATE_ATTEMPT
+#define DS_REVALIDATE_ATTEMPT 3
+#endif
+
+/** Imposta il numero di thread UDP, compreso
+ * tra 1 e DS_UDP_MAX_WORKERS. Va invocata
+ * prima di UDPstart.
+ *
+ * In caso di errore ritorna -1;
+ */
+int UDPsetWorkers(int);
+
+/** Avvia i thread a gestione dei socket
  * UDP e restituisce il numero di porta
- * su cui il thread ascolta.
+ * su cui i thread ascoltano.
  *
  * L'argomento è il numero di porta da
  * utilizzare oppure 0 se una qualsiasi
@@ -22,7 +56,7 @@
  */
 int UDPstart(int);
 
-/** Termina il thread che gestisce il
+/** Termina i thread che gestiscono i
  * socket UDP avviando tutta la fase
  * di terminazione dei peer.
  *
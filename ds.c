@@ -15,19 +15,51 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define ARGNAME "porta"
+#define ARGWORKERS "thread"
 
 void usageHelp(const char* p)
 {
-    printf("Usage:\n\t%s <" ARGNAME ">\n", p);
+    printf("Usage:\n\t%s <" ARGNAME "> [" ARGWORKERS "]\n", p);
 
     exit(EXIT_FAILURE);
 }
 
+/** Senza un terminale il server non ha una REPL:
+ * blocca SIGINT e SIGTERM, così che siano ereditati
+ * bloccati dai thread UDP, per poi attenderli con
+ * waitTermination. Permette di avviare il server da
+ * un altro programma, ad esempio bench.
+ */
+static void blockTermination(sigset_t* toWait)
+{
+    if (sigemptyset(toWait) != 0
+        || sigaddset(toWait, SIGINT) != 0
+        || sigaddset(toWait, SIGTERM) != 0
+        || pthread_sigmask(SIG_BLOCK, toWait, NULL) != 0)
+        errExit("*** Errore nel blocco dei segnali ***\n");
+}
+
+/* sostituisce main_loop finché non giunge un segnale */
+static void waitTermination(const sigset_t* toWait)
+{
+    int sig;
+
+    printf("Nessun terminale, si attende SIGINT o SIGTERM.\n");
+    fflush(stdout);
+    if (sigwait(toWait, &sig) != 0)
+        errExit("*** sigwait ***\n");
+}
+
 int main(int argc, char* argv[])
 {
     char serverID[10];
+    sigset_t toWait;
+    int headless;
 
     struct main_loop_command commands[] = {
         { "showneighbors", &showneighbours, "[peer] mostra i neighbor di un peer" },
@@ -40,15 +72,26 @@ int main(int argc, char* argv[])
     int commandNumber = sizeof(commands)/sizeof(struct main_loop_command );
     int port;
 
-    if (argc != 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+    if (argc < 2 || argc > 3 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
         usageHelp(argv[0]);
 
-    /* parsing dell'argomento */
+    /* parsing degli argomenti */
     port = argParseIntRange(argv[1], ARGNAME, 0, (1<<16)-1);
+    /* numero di thread UDP, opzionale */
+    if (argc == 3 && UDPsetWorkers(argParseIntRange(argv[2], ARGWORKERS, 1, DS_UDP_MAX_WORKERS)) == -1)
+        usageHelp(argv[0]);
+
+    headless = !isatty(STDIN_FILENO);
+    if (headless)
+        blockTermination(&toWait);
 
     if (unified_io_init() == -1)
         errExit("*** Errore attivazione sottosistema di I/O ***\n");
 
+    /* senza main_loop nessuno svuoterebbe la coda dei messaggi */
+    if (headless)
+        unified_io_set_mode(UNIFIED_IO_SYNC_MODE);
+
     printf("Attivato sottosistema di I/O.\n");
 
     port = UDPstart(port);
@@ -59,7 +102,10 @@ int main(int argc, char* argv[])
 
     sprintf(serverID, "[%d]", port);
 
-    main_loop(serverID, commands, commandNumber);
+    if (headless)
+        waitTermination(&toWait);
+    else
+        main_loop(serverID, commands, commandNumber);
 
     unified_io_set_mode(UNIFIED_IO_SYNC_MODE);
     if (UDPstop() == -1)
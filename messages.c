@@ -20,6 +20,50 @@
  * attraverso la rete.
  */
 
+/** Funzione con cui il thread corrente scrive
+ * sui socket TCP i messaggi scambiati trai
+ * peer, se NULL si usa direttamente writev.
+ */
+static __thread ssize_t (*STREAMwriter)(int, const struct iovec*, int);
+
+void messages_set_stream_writer(ssize_t (*writer)(int, const struct iovec*, int))
+{
+    STREAMwriter = writer;
+}
+
+/* Invia su un socket TCP il messaggio formato
+ * dai blocchi forniti, passando per il writer
+ * impostato dal thread, e restituisce 0 solo
+ * se è stato accettato per intero.
+ */
+static int messages_stream_writev(int sockFd, const struct iovec* iov, int iovcnt)
+{
+    ssize_t total, res;
+    int i;
+
+    total = 0;
+    for (i = 0; i != iovcnt; ++i)
+        total += (ssize_t)iov[i].iov_len;
+
+    if (STREAMwriter != NULL)
+        res = STREAMwriter(sockFd, iov, iovcnt);
+    else
+        res = writev(sockFd, iov, iovcnt);
+
+    return res == total ? 0 : -1;
+}
+
+/* Come messages_stream_writev ma per un unico blocco.
+ */
+static int messages_stream_send(int sockFd, const void* buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    return messages_stream_writev(sockFd, &iov, 1);
+}
+
 struct peer_data*
 peer_data_init(
             struct peer_data* ptr,
@@ -142,7 +186,9 @@ void* messages_clone(const void* msg)
         if (ans == NULL)
             return NULL;
 
-        *(struct boot_ack*)ans = *(struct boot_ack*)msg;
+        /* sono presenti solo i vicini effettivi */
+        memset(ans, 0, sizeof(struct boot_ack));
+        memcpy(ans, msg, BOOT_ACK_SIZE(((struct boot_ack*)msg)->body.length));
         break;
 
     case MESSAGES_SHUTDOWN_REQ:
@@ -306,6 +352,7 @@ messages_make_boot_ack(struct boot_ack** buffer,
             size_t* sz,
             const struct boot_req* req,
             uint32_t ID,
+            uint32_t epoch,
             const struct peer_data** peers,
             size_t nPeers)
 {
@@ -328,12 +375,13 @@ messages_make_boot_ack(struct boot_ack** buffer,
     ans->head.pid = req->head.pid;
     /* prepara il corpo */
     ans->body.ID = ID;
+    ans->body.epoch = htonl(epoch);
     ans->body.length = nPeers;
     for (i = 0; i < nPeers; ++i)
         ans->body.neighbours[i] = *peers[i];
 
     *buffer = ans;
-    *sz = sizeof(struct boot_ack);
+    *sz = BOOT_ACK_SIZE(nPeers);
     return 0;
 }
 
@@ -341,7 +389,7 @@ int messages_check_boot_ack(const void* buffer, size_t len)
 {
     struct boot_ack *ack;
 
-    if (buffer == NULL || len != sizeof(struct boot_ack))
+    if (buffer == NULL || len < BOOT_ACK_SIZE(0))
         return -1;
 
     ack = (struct boot_ack*)buffer;
@@ -351,7 +399,8 @@ int messages_check_boot_ack(const void* buffer, size_t len)
         return -1;
 
     /* controllo del corpo */
-    if (ack->body.length > MAX_NEIGHBOUR_NUMBER)
+    if (ack->body.length > MAX_NEIGHBOUR_NUMBER
+        || len != BOOT_ACK_SIZE(ack->body.length))
         return -1;
 
     return 0;
@@ -361,6 +410,7 @@ int
 messages_get_boot_ack_body(
             const struct boot_ack* ack,
             uint32_t* ID,
+            uint32_t* epoch,
             struct peer_data** neighbours,
             size_t* addrN)
 {
@@ -392,6 +442,8 @@ messages_get_boot_ack_body(
     }
     *addrN = (size_t)len;
     *ID = ack->body.ID;
+    if (epoch != NULL)
+        *epoch = ntohl(ack->body.epoch);
 
     return 0;
 }
@@ -400,13 +452,14 @@ int
 messages_get_boot_ack_body_cp(
             const struct boot_ack* ack,
             uint32_t* ID,
+            uint32_t* epoch,
             struct peer_data* neighboursArray,
             size_t* addrN)
 {
     struct peer_data* neighbours[MAX_NEIGHBOUR_NUMBER];
     int i, limit;
 
-    if (messages_get_boot_ack_body(ack, ID, neighbours, addrN) == -1)
+    if (messages_get_boot_ack_body(ack, ID, epoch, neighbours, addrN) == -1)
         return -1;
 
     limit = (int)*addrN;
@@ -610,7 +663,7 @@ int messages_check_check_req(const void* buffer, size_t bufLen)
     return 0;
 }
 
-int messages_make_check_req(struct check_req** buffer, size_t* sz, uint16_t port)
+int messages_make_check_req(struct check_req** buffer, size_t* sz, uint16_t port, uint32_t reqID)
 {
     struct check_req* ans;
 
@@ -624,6 +677,7 @@ int messages_make_check_req(struct check_req** buffer, size_t* sz, uint16_t port
     memset(ans, 0, sizeof(struct check_req));
     ans->head.type = htons(MESSAGES_CHECK_REQ);
     ans->body.port = htons(port);
+    ans->body.reqID = htonl(reqID);
 
     *buffer = ans;
     *sz = sizeof(struct check_req);
@@ -634,12 +688,14 @@ int messages_make_check_req(struct check_req** buffer, size_t* sz, uint16_t port
 int
 messages_get_check_req_body(
             const struct check_req* req,
-            uint16_t* port)
+            uint16_t* port,
+            uint32_t* reqID)
 {
-    if (req == NULL || port == NULL)
+    if (req == NULL || port == NULL || reqID == NULL)
         return -1;
 
     *port = ntohs(req->body.port);
+    *reqID = ntohl(req->body.reqID);
     return 0;
 }
 
@@ -648,12 +704,13 @@ messages_send_check_req(
             int sockfd,
             const struct sockaddr* dest,
             socklen_t destLen,
-            uint16_t port)
+            uint16_t port,
+            uint32_t reqID)
 {
     struct check_req* req;
     size_t len;
 
-    if (messages_make_check_req(&req, &len, port) == -1)
+    if (messages_make_check_req(&req, &len, port, reqID) == -1)
         return -1;
 
     if (sendto(sockfd, (void*)req, len, 0, dest, destLen) == -1)
@@ -670,6 +727,7 @@ int messages_make_check_ack(
             struct check_ack** buffer,
             size_t* bufLen,
             uint16_t port,
+            uint32_t reqID,
             uint8_t status,
             const struct peer_data* peer,
             const struct peer_data** neighbours,
@@ -697,6 +755,7 @@ int messages_make_check_ack(
     ans->head.type = htons(MESSAGES_CHECK_ACK);
     /* prepara il corpo */
     ans->body.port = htons(port);
+    ans->body.reqID = htonl(reqID);
     ans->body.status = status;
 
     /* solo in caso di stato nullo (tutto ok) */
@@ -717,7 +776,7 @@ int messages_make_check_ack(
         }
     }
 
-    *bufLen = sizeof(struct check_ack);
+    *bufLen = CHECK_ACK_SIZE(ans->body.length);
     *buffer = ans;
 
     return 0;
@@ -728,6 +787,7 @@ int messages_send_check_ack(
             const struct sockaddr* dest,
             socklen_t destLen,
             uint16_t port,
+            uint32_t reqID,
             uint8_t status,
             const struct peer_data* peer,
             const struct peer_data** neighbours,
@@ -737,7 +797,7 @@ int messages_send_check_ack(
     size_t bufLen;
 
     if (messages_make_check_ack(&buffer, &bufLen,
-        port, status, peer, neighbours, length) != 0)
+        port, reqID, status, peer, neighbours, length) != 0)
         return -1;
 
     if (sendto(sockfd, buffer, bufLen, 0, dest, destLen) != (ssize_t)bufLen)
@@ -755,7 +815,7 @@ int messages_check_check_ack(const void* buffer, size_t bufLen)
 {
     struct check_ack* check;
 
-    if (buffer == NULL || bufLen != sizeof(struct check_ack))
+    if (buffer == NULL || bufLen < CHECK_ACK_SIZE(0))
         return -1;
 
     check = (struct check_ack*)buffer;
@@ -763,7 +823,8 @@ int messages_check_check_ack(const void* buffer, size_t bufLen)
         return -1;
 
     /* controllo sul corpo del messaggio */
-    if (check->body.length > MAX_NEIGHBOUR_NUMBER)
+    if (check->body.length > MAX_NEIGHBOUR_NUMBER
+        || bufLen != CHECK_ACK_SIZE(check->body.length))
         return -1;
 
     return 0;
@@ -777,6 +838,7 @@ int messages_get_check_ack_status(const struct check_ack* ack)
 int messages_get_check_ack_body(
             const struct check_ack* ack,
             uint16_t* port,
+            uint32_t* reqID,
             uint8_t* status,
             struct peer_data* peer,
             struct peer_data* neighbours,
@@ -791,6 +853,9 @@ int messages_get_check_ack_body(
     if (port != NULL)
         *port = ntohs(ack->body.port);
 
+    if (reqID != NULL)
+        *reqID = ntohl(ack->body.reqID);
+
     if (status != NULL)
         *status = ack->body.status;
 
@@ -811,6 +876,90 @@ int messages_get_check_ack_body(
     return 0;
 }
 
+int messages_make_topology_update(
+            struct topology_update** buffer,
+            size_t* bufLen,
+            uint32_t ID,
+            uint32_t epoch,
+            uint32_t seq,
+            int confirm,
+            const struct peer_data* neighbours,
+            size_t length)
+{
+    struct topology_update* ans;
+    size_t i;
+
+    if (buffer == NULL || bufLen == NULL
+        || (neighbours == NULL && length != 0)
+        || length > MAX_NEIGHBOUR_NUMBER)
+        return -1;
+
+    ans = malloc(sizeof(struct topology_update));
+    if (ans == NULL)
+        return -1;
+
+    memset(ans, 0, sizeof(struct topology_update));
+    /* prepara l'header */
+    ans->head.type = htons(MESSAGES_TOPOLOGY_UPDATE);
+    /* prepara il corpo */
+    ans->body.ID = htonl(ID);
+    ans->body.epoch = htonl(epoch);
+    ans->body.seq = htonl(seq);
+    ans->body.confirm = (confirm != 0);
+    ans->body.length = (uint8_t)length;
+    for (i = 0; i != length; ++i)
+        ans->body.neighbours[i] = neighbours[i];
+
+    *bufLen = TOPOLOGY_UPDATE_SIZE(length);
+    *buffer = ans;
+
+    return 0;
+}
+
+int messages_check_topology_update(const void* buffer, size_t bufLen)
+{
+    const struct topology_update* update;
+
+    if (buffer == NULL || bufLen < TOPOLOGY_UPDATE_SIZE(0))
+        return -1;
+
+    update = (const struct topology_update*)buffer;
+    if (update->head.sentinel != 0 || ntohs(update->head.type) != MESSAGES_TOPOLOGY_UPDATE)
+        return -1;
+
+    if (update->body.length > MAX_NEIGHBOUR_NUMBER
+        || bufLen != TOPOLOGY_UPDATE_SIZE(update->body.length))
+        return -1;
+
+    return 0;
+}
+
+int messages_get_topology_update_body(
+            const struct topology_update* update,
+            uint32_t* ID,
+            uint32_t* epoch,
+            uint32_t* seq,
+            int* confirm,
+            struct peer_data* neighbours,
+            size_t* length)
+{
+    size_t i;
+
+    if (update == NULL || ID == NULL || epoch == NULL || seq == NULL
+        || confirm == NULL || neighbours == NULL || length == NULL)
+        return -1;
+
+    *ID = ntohl(update->body.ID);
+    *epoch = ntohl(update->body.epoch);
+    *seq = ntohl(update->body.seq);
+    *confirm = update->body.confirm != 0;
+    *length = (size_t)update->body.length;
+    for (i = 0; i != *length; ++i)
+        neighbours[i] = update->body.neighbours[i];
+
+    return 0;
+}
+
 int messages_make_flood_req(
             struct flood_req** req,
             size_t* reqLen,
@@ -877,7 +1026,37 @@ int messages_send_flood_req(
         authID, reqID, date, length, signatures) == -1)
         return -1;
 
-    if (send(sockFd, (void*)req, reqLen, 0) != (ssize_t)reqLen)
+    if (messages_stream_send(sockFd, (void*)req, reqLen) != 0)
+    {
+        free(req);
+        return -1;
+    }
+
+    free(req);
+    return 0;
+}
+
+int messages_send_flood_bloom(
+            int sockFd,
+            uint32_t authID,
+            uint32_t reqID,
+            const struct tm* date,
+            uint32_t nWords,
+            uint32_t* words)
+{
+    struct flood_req* req;
+    size_t reqLen;
+
+    if (sockFd < 0 || nWords == 0)
+        return -1;
+
+    /* stesso formato, cambia solo il tipo */
+    if (messages_make_flood_req(&req, &reqLen,
+        authID, reqID, date, nWords, words) == -1)
+        return -1;
+    req->head.type = htons(MESSAGES_FLOOD_BLOOM);
+
+    if (messages_stream_send(sockFd, (void*)req, reqLen) != 0)
     {
         free(req);
         return -1;
@@ -1063,7 +1242,7 @@ int messages_send_flood_ack(int sockFd,
     iov[1].iov_len = lenght * sizeof(struct ns_entry);
 
     /* puà inviare il messaggio */
-    if (writev(sockFd, iov, 2) != (ssize_t)(iov[0].iov_len+iov[1].iov_len))
+    if (messages_stream_writev(sockFd, iov, 2) != 0)
         return -1;
 
     return 0;
@@ -1098,7 +1277,7 @@ int messages_send_empty_flood_ack(
     /* lenght è già a 0 perciò non ci sono problemi */
 
     /* puà inviare il messaggio */
-    if (send(sockFd, (void*)&msg, msgLen, 0) != (ssize_t)msgLen)
+    if (messages_stream_send(sockFd, (void*)&msg, msgLen) != 0)
         return -1;
 
     return 0;
@@ -1164,23 +1343,116 @@ int messages_read_flood_ack_body(
     return 0;
 }
 
+ssize_t messages_send_sync_digest(
+            int sockFd,
+            const struct merkle_node* nodes,
+            size_t length)
+{
+    struct sync_digest* msg;
+    size_t msgLen, i;
+
+    /* l'array in coda ha dimensione 0? */
+    assert(sizeof(struct sync_digest) == offsetof(struct sync_digest, body.nodes));
+    if (sockFd < 0 || (length != 0 && nodes == NULL))
+        return -1;
+
+    msgLen = sizeof(struct sync_digest) + length*sizeof(struct merkle_node);
+    msg = malloc(msgLen);
+    if (msg == NULL)
+        return -1;
+    memset(msg, 0, msgLen);
+
+    /* testa */
+    msg->head.type = htons(MESSAGES_SYNC_DIGEST);
+    /* corpo */
+    msg->body.length = htonl(length);
+    for (i = 0; i != length; ++i)
+    {
+        msg->body.nodes[i].id = htonl(nodes[i].id);
+        msg->body.nodes[i].hash = htonl(nodes[i].hash);
+    }
+
+    if (messages_stream_send(sockFd, (void*)msg, msgLen) != 0)
+    {
+        free(msg);
+        return -1;
+    }
+
+    free(msg);
+    return (ssize_t)msgLen;
+}
+
+int messages_read_sync_digest_body(
+            int sockFd,
+            struct merkle_node** nodes,
+            size_t* length)
+{
+    struct sync_digest_body body;
+    const size_t bodyLen = sizeof(body);
+    struct merkle_node* ans = NULL;
+    uint32_t i, lenght;
+
+    if (nodes == NULL || length == NULL)
+        return -1;
+
+    if (recv(sockFd, (void*)&body, bodyLen, MSG_WAITALL) != (ssize_t)bodyLen)
+        return -1;
+
+    lenght = ntohl(body.length);
+    if (lenght > SYNC_DIGEST_MAX_NODES)
+        return -1;
+    if (lenght > 0)
+    {
+        ans = calloc(lenght, sizeof(struct merkle_node));
+        if (ans == NULL)
+            return -1;
+        if (recv(sockFd, (void*)ans, (size_t)lenght*sizeof(struct merkle_node), MSG_WAITALL)
+            != (ssize_t)(lenght*sizeof(struct merkle_node)))
+        {
+            free(ans);
+            return -1;
+        }
+        /* mette in host order */
+        for (i = 0; i != lenght; ++i)
+        {
+            ans[i].id = ntohl(ans[i].id);
+            ans[i].hash = ntohl(ans[i].hash);
+        }
+    }
+
+    *nodes = ans;
+    *length = (size_t)lenght;
+
+    return 0;
+}
+
 int messages_make_req_data(
             struct req_data** req,
             size_t* reqLen,
             uint32_t authID,
-            const struct query* query)
+            const struct query* query,
+            uint32_t ttl,
+            uint32_t length,
+            const uint32_t* visited)
 {
     struct req_data* ans;
     struct ns_query ns_query;
+    size_t ansLen;
+    uint32_t i;
 
-    if (req == NULL || reqLen == NULL || query == NULL)
+    if (req == NULL || reqLen == NULL || query == NULL
+        || (length != 0 && visited == NULL))
         return -1;
 
-    ans = malloc(sizeof(struct req_data));
+    /* controllo che l'array di dimensione 0
+     * abbia dimensione 0 */
+    assert(sizeof(struct req_data) == offsetof(struct req_data, body.visited));
+    ansLen = sizeof(struct req_data) + length*sizeof(uint32_t);
+    ans = malloc(ansLen);
     if (ans == NULL)
         return -1;
 
-    memset(ans, 0, sizeof(struct req_data));
+    memset(ans, 0, ansLen);
     ans->head.type = htons(MESSAGES_REQ_DATA);
 
     ans->body.autorID = htonl(authID);
@@ -1190,9 +1462,13 @@ int messages_make_req_data(
         return -1;
     }
     ans->body.query = ns_query; /* aggira il problema dell'allineamento dei puntatori */
+    ans->body.ttl = htonl(ttl);
+    ans->body.length = htonl(length);
+    for (i = 0; i != length; ++i)
+        ans->body.visited[i] = htonl(visited[i]);
 
     *req = ans;
-    *reqLen = sizeof(struct req_data);
+    *reqLen = ansLen;
 
     return 0;
 }
@@ -1200,15 +1476,19 @@ int messages_make_req_data(
 int messages_send_req_data(
             int sockfd,
             uint32_t authID,
-            const struct query* query)
+            const struct query* query,
+            uint32_t ttl,
+            uint32_t length,
+            const uint32_t* visited)
 {
     struct req_data* req;
     size_t reqLen;
 
-    if (messages_make_req_data(&req, &reqLen, authID, query) == -1)
+    if (messages_make_req_data(&req, &reqLen, authID, query,
+            ttl, length, visited) == -1)
         return -1;
 
-    if (send(sockfd, req, reqLen, 0) != (ssize_t)reqLen)
+    if (messages_stream_send(sockfd, req, reqLen) != 0)
     {
         free((void*)req);
         return -1;
@@ -1221,20 +1501,50 @@ int messages_send_req_data(
 int messages_read_req_data_body(
             int sockfd,
             uint32_t* authID,
-            struct query* query)
+            struct query* query,
+            uint32_t* ttl,
+            uint32_t* length,
+            uint32_t** visited)
 {
     struct req_data_body body;
+    uint32_t* array = NULL;
+    uint32_t i, lenght;
 
-    if (authID == NULL || query == NULL)
+    if (authID == NULL || query == NULL || ttl == NULL
+        || length == NULL || visited == NULL)
         return -1;
 
-    if (recv(sockfd, (void*)&body, sizeof(body), MSG_DONTWAIT) != (ssize_t)sizeof(body))
+    if (recv(sockfd, (void*)&body, sizeof(body), MSG_WAITALL) != (ssize_t)sizeof(body))
         return -1;
 
+    /* parte variabile */
+    lenght = ntohl(body.length);
+    if (lenght > REQ_DATA_MAX_VISITED)
+        return -1;
+    if (lenght > 0)
+    {
+        array = calloc(lenght, sizeof(uint32_t));
+        if (array == NULL)
+            return -1;
+        if (recv(sockfd, (void*)array, (size_t)lenght*sizeof(uint32_t), MSG_WAITALL) != (ssize_t)(lenght*sizeof(uint32_t)))
+        {
+            free(array);
+            return -1;
+        }
+        for (i = 0; i != lenght; ++i)
+            array[i] = ntohl(array[i]);
+    }
+
     /* dovrebbe essere tutto ok */
     if (readNsQuery(query, &body.query) != 0)
+    {
+        free(array);
         return -1;
+    }
     *authID = ntohl(body.autorID);
+    *ttl = ntohl(body.ttl);
+    *length = lenght;
+    *visited = array;
 
     return 0;
 }
@@ -1252,7 +1562,7 @@ int messages_send_hello_req(int sockfd, uint32_t senderID, uint32_t receiverID)
     msg.body.destID = htonl(receiverID);
 
     /* ora lo invia */
-    if (send(sockfd, (void*)&msg, sizeof(struct hello_req), 0) != (ssize_t)sizeof(struct hello_req))
+    if (messages_stream_send(sockfd, (void*)&msg, sizeof(struct hello_req)) != 0)
         return -1;
 
     return 0;
@@ -1291,7 +1601,7 @@ int messages_send_hello_ack(
     msg.body.status = htonl(status);
 
     /* ora lo invia */
-    if (send(sockfd, (void*)&msg, sizeof(struct hello_ack), 0) != (ssize_t)sizeof(struct hello_ack))
+    if (messages_stream_send(sockfd, (void*)&msg, sizeof(struct hello_ack)) != 0)
         return -1;
 
     return 0;
@@ -1328,7 +1638,7 @@ int messages_send_detatch_message(
     msg.body.status = htonl(status);
 
     /* invia il messaggio */
-    if (send(sockfd, (void*)&msg, sizeof(msg), 0) != (ssize_t)sizeof(msg))
+    if (messages_stream_send(sockfd, (void*)&msg, sizeof(msg)) != 0)
         return -1;
 
     return 0;
@@ -1364,7 +1674,7 @@ int messages_send_empty_reply_data(
     }
 
     /* invia solo la parte iniziale del messaggio */
-    if (send(sockfd, (void*)&msg, lenght, 0) != (ssize_t)lenght)
+    if (messages_stream_send(sockfd, (void*)&msg, lenght) != 0)
         return -1;
 
     return 0;
@@ -1377,7 +1687,6 @@ int messages_send_reply_data_answer(
 {
     struct reply_data msg;
     struct iovec iov[2];
-    ssize_t total;
 
     if (answer == NULL)
         return -1;
@@ -1394,8 +1703,7 @@ int messages_send_reply_data_answer(
         return -1;
 
     /* si prepara all'invio */
-    total = (ssize_t)iov[0].iov_len + (ssize_t)iov[1].iov_len;
-    if (writev(sockfd, iov, 2) != total)
+    if (messages_stream_writev(sockfd, iov, 2) != 0)
     {
         free(iov[1].iov_base); /* libera il corpo della query */
         return -1;
@@ -1497,3 +1805,195 @@ int messages_read_reply_data_body(
 
     return teStatus;
 }
+
+ssize_t messages_send_cache_digest(
+            int sockFd,
+            uint32_t levels,
+            uint32_t words,
+            const uint32_t* data)
+{
+    struct cache_digest* msg;
+    size_t msgLen, i, total = (size_t)levels*words;
+
+    /* l'array in coda ha dimensione 0? */
+    assert(sizeof(struct cache_digest) == offsetof(struct cache_digest, body.data));
+    if (sockFd < 0 || (total != 0 && data == NULL) || total > CACHE_DIGEST_MAX_WORDS)
+        return -1;
+
+    msgLen = sizeof(struct cache_digest) + total*sizeof(uint32_t);
+    msg = malloc(msgLen);
+    if (msg == NULL)
+        return -1;
+    memset(msg, 0, msgLen);
+
+    /* testa */
+    msg->head.type = htons(MESSAGES_CACHE_DIGEST);
+    /* corpo */
+    msg->body.levels = htonl(levels);
+    msg->body.words = htonl(words);
+    for (i = 0; i != total; ++i)
+        msg->body.data[i] = htonl(data[i]);
+
+    if (messages_stream_send(sockFd, (void*)msg, msgLen) != 0)
+    {
+        free(msg);
+        return -1;
+    }
+
+    free(msg);
+    return (ssize_t)msgLen;
+}
+
+int messages_read_cache_digest_body(
+            int sockFd,
+            uint32_t* levels,
+            uint32_t* words,
+            uint32_t** data)
+{
+    struct cache_digest_body body;
+    const size_t bodyLen = sizeof(body);
+    uint32_t* ans = NULL;
+    size_t i, total;
+
+    if (levels == NULL || words == NULL || data == NULL)
+        return -1;
+
+    if (recv(sockFd, (void*)&body, bodyLen, MSG_WAITALL) != (ssize_t)bodyLen)
+        return -1;
+
+    total = (size_t)ntohl(body.levels)*ntohl(body.words);
+    if (total > CACHE_DIGEST_MAX_WORDS)
+        return -1;
+    if (total > 0)
+    {
+        ans = calloc(total, sizeof(uint32_t));
+        if (ans == NULL)
+            return -1;
+        if (recv(sockFd, (void*)ans, total*sizeof(uint32_t), MSG_WAITALL)
+            != (ssize_t)(total*sizeof(uint32_t)))
+        {
+            free(ans);
+            return -1;
+        }
+        /* mette in host order */
+        for (i = 0; i != total; ++i)
+            ans[i] = ntohl(ans[i]);
+    }
+
+    *levels = ntohl(body.levels);
+    *words = ntohl(body.words);
+    *data = ans;
+
+    return 0;
+}
+
+int messages_send_bootstrap_req(int sockFd, const struct tm* newest)
+{
+    struct bootstrap_req msg;
+    /* problema dell'allineamento */
+    struct ns_tm ns_date;
+
+    if (sockFd < 0 || newest == NULL)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    /* testa */
+    msg.head.type = htons(MESSAGES_BOOTSTRAP_REQ);
+    /* corpo */
+    if (time_init_ns_tm(&ns_date, newest) != 0)
+        return -1;
+    msg.body.newest = ns_date;
+
+    if (messages_stream_send(sockFd, (void*)&msg, sizeof(msg)) != 0)
+        return -1;
+
+    return 0;
+}
+
+int messages_read_bootstrap_req_body(int sockFd, struct tm* newest)
+{
+    struct bootstrap_req_body body;
+    struct ns_tm ns_date;
+
+    if (newest == NULL)
+        return -1;
+
+    if (recv(sockFd, (void*)&body, sizeof(body), MSG_WAITALL) != (ssize_t)sizeof(body))
+        return -1;
+
+    ns_date = body.newest;
+    return time_read_ns_tm(newest, &ns_date);
+}
+
+ssize_t messages_send_bootstrap_chunk(
+            int sockFd,
+            uint32_t days,
+            const void* data,
+            size_t size,
+            int last)
+{
+    struct bootstrap_chunk msg;
+    struct iovec iov[2];
+
+    if (sockFd < 0 || (size != 0 && data == NULL) || size > BOOTSTRAP_MAX_CHUNK)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    /* testa */
+    msg.head.type = htons(MESSAGES_BOOTSTRAP_CHUNK);
+    /* corpo */
+    msg.body.days = htonl(days);
+    msg.body.size = htonl((uint32_t)size);
+    msg.body.last = htonl(last != 0);
+
+    /* i registri sono già in formato network safe */
+    iov[0].iov_base = (void*)&msg;
+    iov[0].iov_len = sizeof(msg);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = size;
+
+    if (messages_stream_writev(sockFd, iov, 2) != 0)
+        return -1;
+
+    return (ssize_t)(iov[0].iov_len+iov[1].iov_len);
+}
+
+int messages_read_bootstrap_chunk_body(
+            int sockFd,
+            uint32_t* days,
+            void** data,
+            size_t* size,
+            int* last)
+{
+    struct bootstrap_chunk_body body;
+    void* ans = NULL;
+    size_t len;
+
+    if (days == NULL || data == NULL || size == NULL || last == NULL)
+        return -1;
+
+    if (recv(sockFd, (void*)&body, sizeof(body), MSG_WAITALL) != (ssize_t)sizeof(body))
+        return -1;
+
+    len = (size_t)ntohl(body.size);
+    if (len > BOOTSTRAP_MAX_CHUNK)
+        return -1;
+    if (len > 0)
+    {
+        ans = malloc(len);
+        if (ans == NULL)
+            return -1;
+        if (recv(sockFd, ans, len, MSG_WAITALL) != (ssize_t)len)
+        {
+            free(ans);
+            return -1;
+        }
+    }
+
+    *days = ntohl(body.days);
+    *data = ans;
+    *size = len;
+    *last = ntohl(body.last) != 0;
+
+    return 0;
+}
@@ -9,12 +9,21 @@
 
 #include "ns_host_addr.h"
 #include <stdlib.h>
+#include <stddef.h>
+#include <sys/uio.h>
 #include "time_utils.h"
 #include "register.h"
 #include "peer-src/peer_query.h"
 
-/* in questo progetto minimale */
-#define MAX_NEIGHBOUR_NUMBER 2
+/** Numero massimo di vicini che il DS può
+ * assegnare a un peer: basta per l'anello con
+ * i finger alle potenze di due su 2^16 porte.
+ *
+ * Nei messaggi MESSAGES_BOOT_ACK e
+ * MESSAGES_CHECK_ACK sono trasmessi solo
+ * i vicini effettivamente presenti.
+ */
+#define MAX_NEIGHBOUR_NUMBER 32
 
 
 /** La struttura dei messaggi
@@ -92,7 +101,23 @@ enum messages_types
     MESSAGES_REPLY_DATA,
     /* per iniziare un rastrellamento di entry */
     MESSAGES_FLOOD_FOR_ENTRIES,
-    MESSAGES_REQ_ENTRIES
+    MESSAGES_REQ_ENTRIES,
+    /* per confrontare in background i registri
+     * posseduti con quelli di un vicino */
+    MESSAGES_SYNC_DIGEST,
+    /* come MESSAGES_FLOOD_FOR_ENTRIES ma le firme
+     * già note sono riassunte da un filtro di Bloom */
+    MESSAGES_FLOOD_BLOOM,
+    /* per comunicare ai vicini quali risposte si
+     * possono ottenere tramite il mittente */
+    MESSAGES_CACHE_DIGEST,
+    /* inviato dal server a un peer quando
+     * cambiano i suoi vicini */
+    MESSAGES_TOPOLOGY_UPDATE,
+    /* per ottenere da un vicino, in blocco,
+     * tutti i registri dei giorni conclusi */
+    MESSAGES_BOOTSTRAP_REQ,
+    MESSAGES_BOOTSTRAP_CHUNK
 };
 
 
@@ -196,8 +221,12 @@ struct boot_ack
          * in questo sistema semplificato sarà
          * dato dal numero di porta */
         uint32_t ID;
-        /* numero di vicini, deve valere length<MAX_NEIGHBOUR_NUMBER */
+        /* esecuzione del server, la stessa dei
+         * MESSAGES_TOPOLOGY_UPDATE successivi */
+        uint32_t epoch;
+        /* numero di vicini, deve valere length<=MAX_NEIGHBOUR_NUMBER */
         uint16_t length;
+        /* solo i primi length sono trasmessi */
         struct peer_data neighbours[MAX_NEIGHBOUR_NUMBER];
     } body __attribute__ ((packed));
 } __attribute__ ((packed));
@@ -258,6 +287,9 @@ struct check_req
     {
         /* query */
         uint16_t port;
+        /* identificativo della richiesta,
+         * ripetuto nella risposta */
+        uint32_t reqID;
     } body __attribute__ ((packed));
 } __attribute__ ((packed));
 
@@ -273,17 +305,60 @@ struct check_ack
     {
         /* query */
         uint16_t port;
+        /* identificativo della richiesta */
+        uint32_t reqID;
         /* errore se non 0 */
         uint8_t status;
         /* numero di vicini */
         uint8_t length;
         /* informazioni sul peer legato alla porta */
         struct peer_data peer;
-        /* informazioni sui suou vicini */
+        /* informazioni sui suoi vicini - solo
+         * i primi length sono trasmessi */
+        struct peer_data neighbours[MAX_NEIGHBOUR_NUMBER];
+    } body __attribute__ ((packed));
+} __attribute__ ((packed));
+
+/** Dimensione effettiva dei messaggi di tipo
+ * MESSAGES_BOOT_ACK e MESSAGES_CHECK_ACK che
+ * trasportano il numero di vicini indicato.
+ */
+#define BOOT_ACK_SIZE(n) (offsetof(struct boot_ack, body.neighbours) + (size_t)(n)*sizeof(struct peer_data))
+#define CHECK_ACK_SIZE(n) (offsetof(struct check_ack, body.neighbours) + (size_t)(n)*sizeof(struct peer_data))
+
+/** Formato dei messaggi di tipo
+ * MESSAGES_TOPOLOGY_UPDATE, con cui il
+ * server comunica a un peer i suoi nuovi
+ * vicini senza che li abbia richiesti.
+ */
+struct topology_update
+{
+    /* header */
+    struct messages_head head;
+    /* body */
+    struct topology_update_body
+    {
+        /* ID del peer destinatario */
+        uint32_t ID;
+        /* cambia a ogni riavvio del server */
+        uint32_t epoch;
+        /* cresce di uno a ogni aggiornamento
+         * inviato allo stesso peer, riparte
+         * da capo con una nuova epoch */
+        uint32_t seq;
+        /* non nullo se il peer, ricaricato dal
+         * server da file, deve confermare di
+         * essere attivo con un MESSAGES_CHECK_REQ */
+        uint8_t confirm;
+        /* numero di vicini */
+        uint8_t length;
+        /* solo i primi length sono trasmessi */
         struct peer_data neighbours[MAX_NEIGHBOUR_NUMBER];
     } body __attribute__ ((packed));
 } __attribute__ ((packed));
 
+#define TOPOLOGY_UPDATE_SIZE(n) (offsetof(struct topology_update, body.neighbours) + (size_t)(n)*sizeof(struct peer_data))
+
 /** Struttura che rappresenta il formato
  * di un messaggio di tipo
  * MESSAGES_FLOOD_FOR_ENTRIES
@@ -362,9 +437,25 @@ struct req_data
         /** Query effettiva
          */
         struct ns_query query;
+        /** Numero di salti che la richiesta
+         * può ancora compiere, 1 se il
+         * destinatario non deve inoltrarla
+         */
+        uint32_t ttl;
+        /* numero di elementi in coda */
+        uint32_t length;
+        /** ID dei peer già raggiunti dalla
+         * richiesta, da non contattare
+         */
+        uint32_t visited[0];
     } body __attribute__ ((packed));
 } __attribute__ ((packed));
 
+/** Massimo numero di ID accettato in coda
+ * a un messaggio di tipo MESSAGES_REQ_DATA.
+ */
+#define REQ_DATA_MAX_VISITED 1024
+
 /** Enumerazione per definire
  * delle costanti che indicano
  * lo stato di un messaggio
@@ -402,6 +493,124 @@ struct reply_data
     } body __attribute__ ((packed));
 } __attribute__ ((packed));
 
+/** Nodo del Merkle tree costruito sui registri
+ * di un peer: identificativo del nodo e hash
+ * del sottoalbero.
+ */
+struct merkle_node
+{
+    uint32_t id;
+    uint32_t hash;
+};
+
+/** Struttura che rappresenta il formato dei
+ * messaggi di tipo MESSAGES_SYNC_DIGEST.
+ *
+ * Elenca dei nodi del Merkle tree del mittente
+ * che il destinatario deve confrontare con i
+ * propri.
+ */
+struct sync_digest
+{
+    /* header */
+    struct messages_head head;
+    /* body */
+    struct sync_digest_body
+    {
+        /* numero di elementi in coda */
+        uint32_t length;
+        struct merkle_node nodes[0];
+    } body __attribute__ ((packed));
+} __attribute__ ((packed));
+
+/** Massimo numero di nodi accettato in coda
+ * a un messaggio di tipo MESSAGES_SYNC_DIGEST:
+ * tutti i nodi del Merkle tree (2*MERKLE_DAYS).
+ */
+#define SYNC_DIGEST_MAX_NODES (1<<14)
+
+/** Struttura che rappresenta il formato dei
+ * messaggi di tipo MESSAGES_CACHE_DIGEST.
+ *
+ * Contiene levels filtri di Bloom di words
+ * parole ciascuno: il livello i riassume le
+ * query le cui risposte sono nella cache dei
+ * peer a i salti dal mittente.
+ */
+struct cache_digest
+{
+    /* header */
+    struct messages_head head;
+    /* body */
+    struct cache_digest_body
+    {
+        uint32_t levels;
+        uint32_t words;
+        uint32_t data[0];
+    } body __attribute__ ((packed));
+} __attribute__ ((packed));
+
+/** Massimo numero di parole accettato in coda
+ * a un messaggio di tipo MESSAGES_CACHE_DIGEST.
+ */
+#define CACHE_DIGEST_MAX_WORDS (1<<16)
+
+/** Formato dei messaggi di tipo
+ * MESSAGES_BOOTSTRAP_REQ.
+ *
+ * Un peer appena entrato nel network lo invia
+ * a un vicino per ricevere i registri chiusi
+ * (completi) dei giorni fino a newest compreso.
+ */
+struct bootstrap_req
+{
+    /* header */
+    struct messages_head head;
+    /* body */
+    struct bootstrap_req_body
+    {
+        struct ns_tm newest;
+    } body __attribute__ ((packed));
+} __attribute__ ((packed));
+
+/** Registro di un giorno all'interno di un
+ * messaggio MESSAGES_BOOTSTRAP_CHUNK: data,
+ * numero di entry e entry stesse.
+ */
+struct bootstrap_day
+{
+    struct ns_tm date;
+    uint32_t length;
+    struct ns_entry entries[0];
+} __attribute__ ((packed));
+
+/** Formato dei messaggi di tipo
+ * MESSAGES_BOOTSTRAP_CHUNK, la risposta a
+ * MESSAGES_BOOTSTRAP_REQ divisa in blocchi.
+ *
+ * Il corpo è seguito da size byte contenenti
+ * days oggetti struct bootstrap_day uno dopo
+ * l'altro; last è non nullo nell'ultimo blocco.
+ */
+struct bootstrap_chunk
+{
+    /* header */
+    struct messages_head head;
+    /* body */
+    struct bootstrap_chunk_body
+    {
+        uint32_t days;
+        uint32_t size;
+        uint32_t last;
+    } body __attribute__ ((packed));
+} __attribute__ ((packed));
+
+/** Massima dimensione, in byte, accettata per
+ * la parte variabile di un messaggio di tipo
+ * MESSAGES_BOOTSTRAP_CHUNK.
+ */
+#define BOOTSTRAP_MAX_CHUNK (64*1024*1024)
+
 /** Formato dei messaggi di tipo
  * MESSAGES_PEER_HELLO_REQ.
  *
@@ -590,7 +799,8 @@ int messages_get_boot_req_body(struct ns_host_addr**, const struct boot_req*);
  * per inviarli attraverso un socket.
  *
  * Il terzo argomento è il messaggio a cui si
- * vuole rispondere.
+ * vuole rispondere, il quarto l'ID assegnato
+ * e il quinto l'epoch corrente del server.
  *
  * Gli ultimi due parametri permettono di
  * accedere all'elenco di neighbour da inviare
@@ -608,7 +818,7 @@ int messages_get_boot_req_body(struct ns_host_addr**, const struct boot_req*);
  *
  * È pensata per essere usata solo dal server.
  */
-int messages_make_boot_ack(struct boot_ack**, size_t*, const struct boot_req*, uint32_t, const struct peer_data**, size_t);
+int messages_make_boot_ack(struct boot_ack**, size_t*, const struct boot_req*, uint32_t, uint32_t, const struct peer_data**, size_t);
 
 /** Verifica che il messaggio di tipo
  * MESSAGES_BOOT_ACK, di cui vengono
@@ -628,16 +838,18 @@ int messages_check_boot_ack(const void*, size_t);
  * Il secondo è un puntatore alla variabile
  * dove viene immagazzinato l'ID fornito
  * dal server.
- * Il terzo argomento punta a un array, la
+ * Il terzo, se non NULL, riceve l'epoch
+ * del server.
+ * Il quarto argomento punta a un array, la
  * cui lunghezza è fornita tramite il
- * quarto argomento, di puntatori a oggetti
+ * quinto argomento, di puntatori a oggetti
  * struct ns_host_addr ricavati dal
  * messaggio.
  *
  * Restituisce 0 in caso di successo e -1
  * in caso di errore.
  */
-int messages_get_boot_ack_body(const struct boot_ack*, uint32_t*, struct peer_data**, size_t*);
+int messages_get_boot_ack_body(const struct boot_ack*, uint32_t*, uint32_t*, struct peer_data**, size_t*);
 
 /** Simile a messages_get_boot_ack_body ma
  * non alloca nulla in memoria dinamica ed
@@ -647,7 +859,7 @@ int messages_get_boot_ack_body(const struct boot_ack*, uint32_t*, struct peer_da
  * Restituisce 0 in caso di successo e -1
  * in caso di errore.
  */
-int messages_get_boot_ack_body_cp(const struct boot_ack*, uint32_t*, struct peer_data*, size_t*);
+int messages_get_boot_ack_body_cp(const struct boot_ack*, uint32_t*, uint32_t*, struct peer_data*, size_t*);
 
 /** Verifica che il pid del messaggio di
  * tipo MESSAGES_BOOT_ACK sia pare a
@@ -782,7 +994,7 @@ int messages_check_check_req(const void*, size_t);
 /** Costruisce un messaggio di tipo
  * MESSAGES_CHECK_REQ
  */
-int messages_make_check_req(struct check_req**, size_t*, uint16_t);
+int messages_make_check_req(struct check_req**, size_t*, uint16_t, uint32_t);
 
 /** Estrae il contenuto di un
  * messaggio di tipo
@@ -792,12 +1004,12 @@ int messages_make_check_req(struct check_req**, size_t*, uint16_t);
  * di integrità che deve essere
  * già stato svolto precedentemente.
  */
-int messages_get_check_req_body(const struct check_req*, uint16_t*);
+int messages_get_check_req_body(const struct check_req*, uint16_t*, uint32_t*);
 
 /** Crea e invia un messaggio di tipo
  * MESSAGES_CHECK_REQ
  */
-int messages_send_check_req(int, const struct sockaddr*, socklen_t, uint16_t);
+int messages_send_check_req(int, const struct sockaddr*, socklen_t, uint16_t, uint32_t);
 
 /** Genera un messaggio di tipo
  * MESSAGES_SHUTDOWN_ACK.
@@ -813,6 +1025,7 @@ int messages_make_check_ack(
             struct check_ack** buffer,
             size_t* bufLen,
             uint16_t port, /* porta su cui si cerca il peer */
+            uint32_t reqID, /* identificativo della richiesta */
             uint8_t status, /* 0 se tutto ok, 1 se non esiste il peer */
             const struct peer_data* peer, /* informazioni sul peer principale */
             const struct peer_data** neighbours, /* informazioni sui vicini */
@@ -829,6 +1042,7 @@ int messages_send_check_ack(
             const struct sockaddr* dest,
             socklen_t destLen,
             uint16_t port,
+            uint32_t reqID,
             uint8_t status,
             const struct peer_data* peer,
             const struct peer_data** neighbours,
@@ -872,11 +1086,57 @@ int messages_get_check_ack_status(const struct check_ack*);
 int messages_get_check_ack_body(
             const struct check_ack* ack,
             uint16_t* port,
+            uint32_t* reqID,
             uint8_t* status,
             struct peer_data* peer,
             struct peer_data* neighbours,
             size_t* length);
 
+/** Genera un messaggio di tipo
+ * MESSAGES_TOPOLOGY_UPDATE per il peer
+ * con l'ID dato contenente i primi length
+ * vicini forniti.
+ * epoch identifica l'esecuzione corrente
+ * del server; confirm non nullo chiede al
+ * peer di confermare di essere attivo.
+ *
+ * Restituisce 0 in caso di successo
+ * e -1 in caso di errore.
+ */
+int messages_make_topology_update(
+            struct topology_update** buffer,
+            size_t* bufLen,
+            uint32_t ID,
+            uint32_t epoch,
+            uint32_t seq,
+            int confirm,
+            const struct peer_data* neighbours,
+            size_t length);
+
+/** Verifica l'integrità di un
+ * messaggio del tipo
+ * MESSAGES_TOPOLOGY_UPDATE
+ */
+int messages_check_topology_update(const void*, size_t);
+
+/** Estrae il contenuto di un messaggio
+ * di tipo MESSAGES_TOPOLOGY_UPDATE già
+ * verificato: l'array dei vicini deve
+ * avere almeno MAX_NEIGHBOUR_NUMBER
+ * elementi.
+ *
+ * Restituisce 0 in caso di successo
+ * e -1 in caso di errore.
+ */
+int messages_get_topology_update_body(
+            const struct topology_update* update,
+            uint32_t* ID,
+            uint32_t* epoch,
+            uint32_t* seq,
+            int* confirm,
+            struct peer_data* neighbours,
+            size_t* length);
+
 /** Alloca e fornisce un oggetto di tipo
  * MESSAGES_FLOOD_FOR_ENTRIES
  * inizializzato con i dati forniti.
@@ -915,6 +1175,32 @@ int messages_send_flood_req(
             uint32_t length,
             uint32_t* signatures);
 
+/** Come messages_send_flood_req ma invia un
+ * messaggio di tipo MESSAGES_FLOOD_BLOOM: al
+ * posto delle firme ci sono le parole del
+ * filtro di Bloom (vedi bloom.h) costruito
+ * con seme FLOOD_BLOOM_SEED(authID, reqID).
+ * Il corpo si legge con
+ * messages_read_flood_req_body.
+ *
+ * Restituisce 0 in caso di successo
+ * e -1 in caso di errore.
+ */
+int messages_send_flood_bloom(
+            int sockFd,
+            uint32_t authID,
+            uint32_t reqID,
+            const struct tm* date,
+            uint32_t nWords,
+            uint32_t* words);
+
+/** Seme del filtro di Bloom di una richiesta:
+ * diverso per ogni richiesta così che un falso
+ * positivo non si ripeta sempre sulla stessa
+ * firma.
+ */
+#define FLOOD_BLOOM_SEED(authID, reqID) ((uint32_t)(authID)*0x9e3779b9u ^ (uint32_t)(reqID))
+
 /** Controlla l'integrità di un messaggio
  * di tipo MESSAGES_FLOOD_FOR_ENTRIES.
  *
@@ -1028,7 +1314,9 @@ int messages_read_flood_ack_body(
 
 /** Inizializza e fornisce un messaggio
  * di tipo MESSAGES_REQ_DATA con l'ID
- * dell'autore e la query indicata.
+ * dell'autore, la query indicata, il
+ * numero di salti consentiti e gli ID
+ * dei peer già raggiunti.
  *
  * Restituisce 0 in caso di successo
  * e -1 in caso di errore.
@@ -1037,7 +1325,10 @@ int messages_make_req_data(
             struct req_data** req,
             size_t* reqLen,
             uint32_t authID,
-            const struct query* query);
+            const struct query* query,
+            uint32_t ttl,
+            uint32_t length,
+            const uint32_t* visited);
 
 /** Invia un messaggio di tipo
  * MESSAGES_REQ_DATA tramite il
@@ -1049,19 +1340,29 @@ int messages_make_req_data(
 int messages_send_req_data(
             int sockfd,
             uint32_t authID,
-            const struct query* query);
+            const struct query* query,
+            uint32_t ttl,
+            uint32_t length,
+            const uint32_t* visited);
 
 /** Legge da un socket tcp il corpo di
  * un messaggio di tipo MESSAGES_REQ_DATA
  * e ne fornisce il contenuto.
  *
+ * L'array degli ID è allocato con calloc
+ * e va liberato dal chiamante; se la coda
+ * è vuota gli è associato NULL.
+ *
  * Restituisce 0 in caso di successo
  * e -1 in caso di errore.
  */
 int messages_read_req_data_body(
             int sockfd,
             uint32_t* authID,
-            struct query* query);
+            struct query* query,
+            uint32_t* ttl,
+            uint32_t* length,
+            uint32_t** visited);
 
 /** Invia un messaggio di tipo
  * MESSAGES_PEER_HELLO_REQ
@@ -1206,4 +1507,122 @@ int messages_read_reply_data_body(
             struct answer** answer
             );
 
+/** Invia un messaggio di tipo
+ * MESSAGES_SYNC_DIGEST contenente i nodi
+ * forniti.
+ *
+ * Restituisce il numero di byte inviati in
+ * caso di successo e -1 in caso di errore.
+ */
+ssize_t messages_send_sync_digest(
+            int sockFd,
+            const struct merkle_node* nodes,
+            size_t length);
+
+/** Legge da un socket il corpo di un messaggio
+ * di tipo MESSAGES_SYNC_DIGEST.
+ *
+ * L'array fornito è allocato dinamicamente e
+ * va liberato con free, vale NULL se il
+ * messaggio non contiene alcun nodo.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int messages_read_sync_digest_body(
+            int sockFd,
+            struct merkle_node** nodes,
+            size_t* length);
+
+/** Invia un messaggio di tipo
+ * MESSAGES_CACHE_DIGEST con i levels filtri,
+ * di words parole ciascuno, memorizzati uno
+ * dopo l'altro nell'array fornito.
+ *
+ * Restituisce il numero di byte inviati in
+ * caso di successo e -1 in caso di errore.
+ */
+ssize_t messages_send_cache_digest(
+            int sockFd,
+            uint32_t levels,
+            uint32_t words,
+            const uint32_t* data);
+
+/** Legge da un socket il corpo di un messaggio
+ * di tipo MESSAGES_CACHE_DIGEST.
+ *
+ * L'array fornito è allocato dinamicamente e
+ * va liberato con free, vale NULL se il
+ * messaggio è vuoto.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int messages_read_cache_digest_body(
+            int sockFd,
+            uint32_t* levels,
+            uint32_t* words,
+            uint32_t** data);
+
+/** Invia un messaggio di tipo
+ * MESSAGES_BOOTSTRAP_REQ per chiedere i registri
+ * chiusi dei giorni fino a newest compreso.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int messages_send_bootstrap_req(int sockFd, const struct tm* newest);
+
+/** Legge da un socket il corpo di un messaggio
+ * di tipo MESSAGES_BOOTSTRAP_REQ.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int messages_read_bootstrap_req_body(int sockFd, struct tm* newest);
+
+/** Invia un messaggio di tipo
+ * MESSAGES_BOOTSTRAP_CHUNK contenente i days
+ * registri serializzati nei size byte forniti
+ * (vedi struct bootstrap_day).
+ *
+ * Restituisce il numero di byte inviati in
+ * caso di successo e -1 in caso di errore.
+ */
+ssize_t messages_send_bootstrap_chunk(
+            int sockFd,
+            uint32_t days,
+            const void* data,
+            size_t size,
+            int last);
+
+/** Legge da un socket il corpo di un messaggio
+ * di tipo MESSAGES_BOOTSTRAP_CHUNK.
+ *
+ * Il buffer fornito è allocato dinamicamente e
+ * va liberato con free, vale NULL se il
+ * messaggio non contiene alcun registro.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int messages_read_bootstrap_chunk_body(
+            int sockFd,
+            uint32_t* days,
+            void** data,
+            size_t* size,
+            int* last);
+
+/** Imposta, per il solo thread chiamante, la
+ * funzione usata da tutte le messages_send_*
+ * che operano su socket TCP per scrivere i
+ * messaggi: riceve il socket e i blocchi che
+ * compongono un messaggio completo e deve
+ * restituirne la lunghezza totale se lo ha
+ * accettato (inviato o accodato) e -1 in caso
+ * di errore.
+ * Con NULL si torna a usare writev.
+ */
+void messages_set_stream_writer(ssize_t (*writer)(int, const struct iovec*, int));
+
 #endif
@@ -221,6 +221,26 @@ int ns_host_addr_any(const struct ns_host_addr* ns_addr)
     }
 }
 
+int ns_host_addr_equal(const struct ns_host_addr* a, const struct ns_host_addr* b)
+{
+    if (a == NULL || b == NULL)
+        return -1;
+
+    if (a->ip_version != b->ip_version || a->port != b->port)
+        return 0;
+
+    switch (a->ip_version)
+    {
+    case 4:
+        return memcmp(&a->ip.v4, &b->ip.v4, sizeof(a->ip.v4)) == 0;
+    case 6:
+        return memcmp(&a->ip.v6, &b->ip.v6, sizeof(a->ip.v6)) == 0;
+
+    default:
+        return -1;
+    }
+}
+
 int ns_host_addr_update_addr(struct ns_host_addr* ns_addr, const struct sockaddr* sk_addr)
 {
     struct ns_host_addr ans;
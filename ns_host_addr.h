@@ -143,6 +143,15 @@ sa_family_t ns_host_addr_get_ip_family(const struct ns_host_addr*);
  */
 int ns_host_addr_any(const struct ns_host_addr*);
 
+/** Verifica se i due indirizzi forniti
+ * coincidono per versione di IP,
+ * indirizzo e porta.
+ *
+ * Restituisce 1 se coincidono, 0 se
+ * sono diversi e -1 in caso di errore.
+ */
+int ns_host_addr_equal(const struct ns_host_addr*, const struct ns_host_addr*);
+
 /** Può essere necessario cambiare
  * l'indirizzo IP indicato in una
  * struct ns_host_addr. Questa funzione
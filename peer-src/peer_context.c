@@ -0,0 +1,111 @@
+#include "peer_context.h"
+#include "../thread_semaphore.h"
+#include "../commons.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** Contesto usato dai thread a cui non ne è
+ * stato associato uno, creato al primo uso.
+ */
+static struct peer_context* DEFAULTcontext;
+static pthread_once_t DEFAULTonce = PTHREAD_ONCE_INIT;
+
+/* contesto del thread corrente */
+static __thread struct peer_context* CURRENTcontext;
+
+static void DEFAULTcontext_init(void)
+{
+    DEFAULTcontext = peer_context_create();
+    if (DEFAULTcontext == NULL)
+        fatal("peer_context_create");
+}
+
+struct peer_context* peer_context_create(void)
+{
+    struct peer_context* ctx;
+
+    ctx = malloc(sizeof(struct peer_context));
+    if (ctx == NULL)
+        return NULL;
+    memset(ctx, 0, sizeof(struct peer_context));
+
+    ctx->udp = UDPstate_create();
+    ctx->tcp = TCPstate_create();
+    ctx->entries = ENTRIESstate_create();
+    if (ctx->udp == NULL || ctx->tcp == NULL || ctx->entries == NULL)
+    {
+        peer_context_destroy(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void peer_context_destroy(struct peer_context* ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    if (ctx->udp != NULL)
+        UDPstate_destroy(ctx->udp);
+    if (ctx->tcp != NULL)
+        TCPstate_destroy(ctx->tcp);
+    if (ctx->entries != NULL)
+        ENTRIESstate_destroy(ctx->entries);
+    free(ctx);
+}
+
+void peer_context_set(struct peer_context* ctx)
+{
+    CURRENTcontext = ctx;
+}
+
+struct peer_context* peer_context_get(void)
+{
+    if (CURRENTcontext == NULL)
+    {
+        if (pthread_once(&DEFAULTonce, &DEFAULTcontext_init) != 0)
+            fatal("pthread_once");
+        CURRENTcontext = DEFAULTcontext;
+    }
+
+    return CURRENTcontext;
+}
+
+/** Argomenti di CONTEXTthread: vivono sullo
+ * stack del padre, che resta bloccato finché
+ * il figlio non segnala il proprio avvio.
+ */
+struct context_thread_args
+{
+    struct peer_context* ctx;
+    void*(*t_fun)(void*);
+    void* args;
+};
+
+/* associa il contesto e passa a t_fun gli argomenti originali */
+static void* CONTEXTthread(void* args)
+{
+    struct context_thread_args* cta;
+
+    cta = (struct context_thread_args*)thread_semaphore_get_args(args);
+    if (cta == NULL)
+        fatal("thread_semaphore_get_args");
+
+    peer_context_set(cta->ctx);
+    if (thread_semaphore_set_args(args, cta->args) != 0)
+        fatal("thread_semaphore_set_args");
+
+    return cta->t_fun(args);
+}
+
+int peer_context_start_thread(pthread_t* thread, void*(*t_fun)(void*), void* args, void** data)
+{
+    struct context_thread_args cta;
+
+    cta.ctx = peer_context_get();
+    cta.t_fun = t_fun;
+    cta.args = args;
+
+    return start_long_life_thread(thread, &CONTEXTthread, (void*)&cta, data);
+}
@@ -0,0 +1,80 @@
+/** Contesto di un peer: raccoglie lo stato
+ * dei sottosistemi UDP, TCP ed ENTRIES così
+ * che più peer possano convivere nello
+ * stesso processo.
+ *
+ * Ogni thread lavora per il peer del contesto
+ * che gli è stato associato con
+ * peer_context_set; le funzioni dei
+ * sottosistemi agiscono sempre sul peer del
+ * thread chiamante.
+ * Un thread a cui non è stato associato
+ * alcun contesto usa quello predefinito, così
+ * che un processo con un solo peer non debba
+ * preoccuparsene.
+ */
+
+#ifndef PEER_CONTEXT
+#define PEER_CONTEXT
+
+#include <pthread.h>
+
+/** Stato dei singoli sottosistemi, definito
+ * nei rispettivi file sorgente.
+ */
+struct udp_state;
+struct tcp_state;
+struct entries_state;
+
+struct peer_context
+{
+    struct udp_state* udp;
+    struct tcp_state* tcp;
+    struct entries_state* entries;
+};
+
+/** Crea un nuovo contesto con tutti i
+ * sottosistemi inattivi.
+ *
+ * Restituisce NULL in caso di errore.
+ */
+struct peer_context* peer_context_create(void);
+
+/** Libera la memoria di un contesto.
+ * Tutti i sottosistemi del peer devono
+ * essere già stati chiusi.
+ */
+void peer_context_destroy(struct peer_context*);
+
+/** Associa il contesto al thread chiamante,
+ * NULL ripristina quello predefinito.
+ */
+void peer_context_set(struct peer_context*);
+
+/** Fornisce il contesto del thread chiamante.
+ *
+ * Non fallisce mai.
+ */
+struct peer_context* peer_context_get(void);
+
+/** Come start_long_life_thread ma il thread
+ * creato è associato al contesto del thread
+ * chiamante prima di eseguire t_fun.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int peer_context_start_thread(pthread_t*, void*(*t_fun)(void*), void*, void**);
+
+/** Creazione e distruzione dello stato dei
+ * sottosistemi, usate solo da peer_context_create
+ * e peer_context_destroy.
+ */
+struct udp_state* UDPstate_create(void);
+void UDPstate_destroy(struct udp_state*);
+struct tcp_state* TCPstate_create(void);
+void TCPstate_destroy(struct tcp_state*);
+struct entries_state* ENTRIESstate_create(void);
+void ENTRIESstate_destroy(struct entries_state*);
+
+#endif
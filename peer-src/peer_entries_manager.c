@@ -4,6 +4,8 @@
 
 #include "peer_entries_manager.h"
 #include "peer_tcp.h" /* per contattare i vicini */
+#include "peer_udp.h" /* per sapere se si è connessi */
+#include "peer_context.h"
 #include "../thread_semaphore.h"
 #include "../unified_io.h"
 #include "../register.h"
@@ -11,6 +13,8 @@
 #include "../commons.h"
 #include "../time_utils.h"
 #include "../rb_tree.h"
+#include "../set.h"
+#include "../bloom.h"
 #include <pthread.h>
 #include <time.h>
 #include <signal.h>
@@ -19,6 +23,9 @@
 #include <poll.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
 
 /* syscall specifica di linux, vediamo come va */
 #include <sys/timerfd.h>
@@ -29,70 +36,800 @@
  */
 #define TERM_SUBSYS_SIGNAL SIGQUIT
 
-/** Variabile di riferimento per definire
- * l'ultima data.
+/** Numero di categorie di entry,
+ * ovvero di valori di enum entry_type.
  */
-static struct tm lowerDate;
+#define ENTRY_CATEGORIES (NEW_CASE+1)
 
-/* flag che indica se il sottosistema è stato avviato */
-static sig_atomic_t started;
+/** Stato del sottosistema ENTRIES di un peer,
+ * raggiunto tramite il contesto del thread
+ * chiamante (vedere peer_context.h).
+ */
+struct entries_state
+{
+    /** Variabile di riferimento per definire
+     * l'ultima data.
+     */
+    struct tm lowerDate;
+
+    /* flag che indica se il sottosistema è stato avviato */
+    sig_atomic_t started;
+
+    /** MUTEX a guardia delle operazioni
+     * sui registri.
+     */
+    pthread_mutex_t REGISTERguard;
+    /** Lista dei registri a disposizione
+     * del peer corrente.
+     * In testa v'è quello corrispondente
+     * al giorno indicato dalla variabile
+     * da HEADdate
+     */
+    struct list* REGISTERlist;
+    /** data corrispondente all'oggetto
+     * in testa alla lista di registri
+     */
+    struct tm HEADdate;
+
+    /** Cache con le risposte alle query
+     * già calcolate.
+     * La memoria complessivamente occupata
+     * è limitata da ANSWERstats.budget: quando
+     * è superata vengono eliminate le risposte
+     * usate meno di recente (LRU) tra quelle
+     * che nessuno sta utilizzando.
+     *
+     * È una sorta di mappa del tipo
+     * map<hash(query), struct cached_answer>
+     * indicizzata da ANSWERtree_key: le risposte
+     * le cui chiavi vi collidono formano una
+     * catena a partire da quella nell'albero.
+     *
+     * Va acceduta solo possedendo REGISTERguard.
+     */
+    struct rb_tree* ANSWERcache;
+
+    /** Estremi della lista LRU: ANSWERlruHead
+     * è l'elemento usato più di recente e
+     * ANSWERlruTail quello usato meno di recente.
+     */
+    struct cached_answer* ANSWERlruHead;
+    struct cached_answer* ANSWERlruTail;
+
+    /** Contatori e limiti della cache delle
+     * risposte.
+     */
+    struct answer_cache_stats ANSWERstats;
+
+    /** File in cui sono salvate le risposte
+     * presenti nella cache, così che possano
+     * essere recuperate al riavvio del peer.
+     *
+     * Si trova accanto ai file dei registri
+     * e ha nome nella forma:
+     *  "peerID".answers
+     * Contiene una sequenza di record, ognuno
+     * formato dalla lunghezza (uint32_t in
+     * network order) di un oggetto struct
+     * ns_answer seguita dall'oggetto stesso.
+     * La chiave della cache è ricalcolata a
+     * partire dalla query al caricamento.
+     *
+     * Vi sono salvate solo le risposte che non
+     * coinvolgono il registro del giorno corrente,
+     * l'unico il cui contenuto può ancora cambiare.
+     *
+     * È NULL se la persistenza non è attiva.
+     *
+     * Le risposte eliminate dalla cache restano
+     * nel file, che è quindi riscritto quando
+     * ANSWERfileBytes (la sua dimensione) supera
+     * di ANSWER_FILE_GROWTH volte quella della
+     * cache.
+     */
+    FILE* ANSWERfile;
+    size_t ANSWERfileBytes;
+
+    /** Cache dei totali giornalieri.
+     *
+     * Per ogni categoria di entry memorizza il
+     * totale di ciascun giorno il cui registro
+     * è stato chiuso, indicizzato in base alla
+     * distanza in giorni da lowerDate.
+     * Un registro chiuso non cambia più, perciò
+     * questi valori restano validi fino alla
+     * chiusura del sottosistema e permettono di
+     * rispondere a una query calcolando solo i
+     * giorni non ancora noti.
+     *
+     * Per ogni categoria sono mantenute anche le
+     * somme prefisse dei giorni noti consecutivi
+     * a partire da lowerDate, così che il totale
+     * di un intervallo da esse coperto si ottenga
+     * in tempo costante.
+     *
+     * Va acceduta solo possedendo REGISTERguard.
+     */
+    struct
+    {
+        /* numero di giorni per cui c'è spazio */
+        size_t capacity;
+        int* totals[ENTRY_CATEGORIES];
+        /* flag: il totale del giorno è noto? */
+        unsigned char* known[ENTRY_CATEGORIES];
+        /* prefix[c][i] è la somma dei giorni [0,i) */
+        long* prefix[ENTRY_CATEGORIES];
+        /* giorni coperti dalle somme prefisse */
+        size_t prefixLen[ENTRY_CATEGORIES];
+    } DAYcache;
+
+    /** Identifica il peer quando si tratta
+     * di salvare il contenuto dei registri
+     * in dei file.
+     *
+     * È la porta su cui ascolta il peer.
+     */
+    int peerIDentifier;
+
+    /** Elenco delle viste materializzate da
+     * aggiornare a ogni cambio di registro.
+     *
+     * Va acceduto solo possedendo REGISTERguard.
+     */
+    const struct materialized_view* VIEWSlist;
+    size_t VIEWSnumber;
+
+    /** Stato della replica proattiva (push).
+     *
+     * PUSHcovered contiene gli indici (giorni
+     * trascorsi da lowerDate) dei giorni al cui
+     * cambio di registro il peer era connesso con
+     * il push attivo, e che ha quindi ricevuto
+     * dai vicini.
+     * Non basta però a dire che il registro sia
+     * completo (un push può andare perso o un
+     * peer non averlo inviato): PUSHconfirmed
+     * contiene quelli per cui un vicino ha poi
+     * mostrato, con la sincronizzazione del
+     * Merkle tree, di avere lo stesso registro.
+     * Per questi ultimi le query non avviano il
+     * FLOODING, ma i registri restano aperti:
+     * anche il vicino potrebbe non aver ricevuto
+     * tutti i push, e le entry che arrivano dopo
+     * invalidano le risposte che li comprendono.
+     * Per l'ultimo giorno la conferma vale solo
+     * dopo PUSH_SETTLE_TIME secondi da
+     * PUSHlastTime, per dare tempo ai push altrui
+     * di arrivare.
+     *
+     * Protetti da REGISTERguard.
+     */
+    int PUSHmode;
+    struct set* PUSHcovered;
+    struct set* PUSHconfirmed;
+    long PUSHlastDay;
+    time_t PUSHlastTime;
+
+    /** Merkle tree sui registri dei giorni conclusi.
+     *
+     * È memorizzato come un heap: la radice è il nodo 1,
+     * i figli del nodo n sono 2n e 2n+1 e la foglia
+     * MERKLE_DAYS+d contiene il digest (register_digest)
+     * del registro del giorno d, contato da lowerDate.
+     * Un sottoalbero senza entry vale 0.
+     *
+     * Protetto da REGISTERguard.
+     */
+    uint32_t MERKLEtree[2*MERKLE_DAYS];
+
+    /** Identificativo del thread che gestisce
+     * i registri
+     */
+    pthread_t REGISTER_tid;
+
+    /** Thread VIEWS, che ricalcola le viste
+     * materializzate al posto del thread ENTRIES
+     * così che questo non resti bloccato dalle
+     * query al network.
+     * VIEWSpending chiede un aggiornamento,
+     * VIEWSstop la terminazione: entrambi sono
+     * protetti da REGISTERguard e segnalati con
+     * VIEWScond.
+     */
+    pthread_t VIEWS_tid;
+    pthread_cond_t VIEWScond;
+    int VIEWSpending;
+    int VIEWSstop;
+
+    /** Avanzamento delle istanze del protocollo
+     * FLOODING avviate dall'ultima calcEntryQuery:
+     * floodingCompleted aggiorna i contatori e il
+     * totale parziale (somma dei totali dei giorni
+     * già completati) man mano che i giorni arrivano.
+     *
+     * Protetto da REGISTERguard.
+     */
+    struct flooding_progress FLOODprogress;
+    /* query a cui si riferisce FLOODprogress */
+    struct query FLOODquery;
+    /* segnalata, con REGISTERguard, a ogni giorno completato */
+    pthread_cond_t FLOODcond;
+
+    /** MUTEX che serializza le esecuzioni di
+     * calcEntryQuery, che possono avvenire sia
+     * dal thread principale sia, per le viste
+     * materializzate, dal thread VIEWS: i
+     * protocolli REQ_DATA e FLOODING prevedono
+     * una sola richiesta pendente alla volta.
+     *
+     * Va sempre preso prima di REGISTERguard.
+     */
+    pthread_mutex_t QUERYguard;
+};
+
+/* stato ENTRIES del peer del thread chiamante */
+#define CTX (peer_context_get()->entries)
+
+/** Elemento della cache delle risposte.
+ *
+ * Oltre alla risposta tiene traccia della
+ * memoria da essa occupata, del numero di
+ * utilizzatori che ne possiedono ancora il
+ * puntatore (e che ne impediscono quindi
+ * l'eliminazione) e della posizione nella
+ * lista LRU.
+ */
+struct cached_answer
+{
+    int64_t key;
+    struct answer* answer;
+    size_t size;
+    /* numero di riferimenti ancora in uso */
+    unsigned pins;
+    /* flag: la risposta non è più valida ma è in
+     * uso, va eliminata al rilascio */
+    int stale;
+    /* lista LRU - prev è l'elemento usato più di recente */
+    struct cached_answer* prev;
+    struct cached_answer* next;
+    /* risposta successiva con la stessa chiave nell'albero */
+    struct cached_answer* chain;
+};
+
+/** Chiave nell'albero della cache della
+ * risposta alla query con la chiave fornita.
+ *
+ * Dove long int ha 64 bit coincide con essa,
+ * altrimenti la si ripiega su 32 bit e le
+ * collisioni sono risolte dal campo chain.
+ */
+static long int ANSWERtree_key(int64_t key)
+{
+    if (sizeof(long int) >= sizeof(int64_t))
+        return (long int)key;
+
+    return (long int)(int32_t)ANSWER_DIGEST_KEY(key);
+}
+
+/** funzione di cleanup per l'albero: libera
+ * anche le risposte in catena */
+static void ANSWERcleanup(void* ptr)
+{
+    struct cached_answer* entry = (struct cached_answer*)ptr;
+    struct cached_answer* chain;
+
+    for (; entry != NULL; entry = chain)
+    {
+        chain = entry->chain;
+        freeAnswer(entry->answer);
+        free(entry);
+    }
+}
+
+/** Cerca nella cache la risposta alla query
+ * con la chiave fornita, confrontando la
+ * chiave completa.
+ *
+ * Restituisce NULL se non è presente.
+ */
+static struct cached_answer* ANSWERcache_find(int64_t key)
+{
+    struct cached_answer* entry;
+
+    if (rb_tree_get(CTX->ANSWERcache, ANSWERtree_key(key), (void**)&entry) == -1)
+        return NULL;
+    while (entry != NULL && entry->key != key)
+        entry = entry->chain;
+
+    return entry;
+}
+
+/** Toglie un elemento dalla lista LRU.
+ */
+static void ANSWERlru_unlink(struct cached_answer* entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        CTX->ANSWERlruHead = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        CTX->ANSWERlruTail = entry->prev;
+
+    entry->prev = entry->next = NULL;
+}
+
+/** Inserisce un elemento in testa alla lista
+ * LRU, ovvero lo segna come il più recente.
+ */
+static void ANSWERlru_push(struct cached_answer* entry)
+{
+    entry->prev = NULL;
+    entry->next = CTX->ANSWERlruHead;
+    if (CTX->ANSWERlruHead != NULL)
+        CTX->ANSWERlruHead->prev = entry;
+    else
+        CTX->ANSWERlruTail = entry;
+    CTX->ANSWERlruHead = entry;
+}
 
-/** MUTEX a guardia delle operazioni
- * sui registri.
+/** Rimuove dalla cache un elemento,
+ * liberandone la memoria.
  */
-static pthread_mutex_t REGISTERguard = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-/** Lista dei registri a disposizione
- * del peer corrente.
- * In testa v'è quello corrispondente
- * al giorno indicato dalla variabile
- * da HEADdate
+static void ANSWERcache_drop(struct cached_answer* entry)
+{
+    struct cached_answer* head, ** link;
+    long int treeKey;
+
+    ANSWERlru_unlink(entry);
+    CTX->ANSWERstats.bytes -= entry->size;
+    --CTX->ANSWERstats.entries;
+    ++CTX->ANSWERstats.changes;
+
+    treeKey = ANSWERtree_key(entry->key);
+    if (rb_tree_get(CTX->ANSWERcache, treeKey, (void**)&head) != 0)
+        fatal("rb_tree_get");
+    if (head == entry && entry->chain == NULL)
+    {
+        /* invoca anche ANSWERcleanup */
+        if (rb_tree_remove(CTX->ANSWERcache, treeKey, NULL) != 0)
+            fatal("rb_tree_remove");
+        return;
+    }
+    if (head == entry)
+    {
+        /* la successiva in catena prende il suo posto */
+        if (rb_tree_set(CTX->ANSWERcache, treeKey, (void*)entry->chain) != 0)
+            fatal("rb_tree_set");
+    }
+    else
+    {
+        for (link = &head->chain; *link != entry; link = &(*link)->chain)
+            if (*link == NULL)
+                fatal("Inconsistent state - ANSWERcache_drop");
+        *link = entry->chain;
+    }
+    entry->chain = NULL;
+    ANSWERcleanup(entry);
+}
+
+/** Elimina le risposte usate meno di recente
+ * finché la memoria occupata dalla cache non
+ * rientra nel limite. Le risposte ancora in
+ * uso vengono saltate.
  */
-static struct list* REGISTERlist;
-/** data corrispondente all'oggetto
- * in testa alla lista di registri
+static void ANSWERcache_evict(void)
+{
+    struct cached_answer* entry, * prev;
+
+    for (entry = CTX->ANSWERlruTail;
+        entry != NULL && CTX->ANSWERstats.bytes > CTX->ANSWERstats.budget;
+        entry = prev)
+    {
+        prev = entry->prev;
+        if (entry->pins != 0)
+            continue;
+        ANSWERcache_drop(entry);
+        ++CTX->ANSWERstats.evictions;
+    }
+}
+
+/** Svuota completamente la cache
+ * delle risposte.
+ */
+static void ANSWERcache_destroy(void)
+{
+    rb_tree_destroy(CTX->ANSWERcache);
+    CTX->ANSWERcache = NULL;
+    CTX->ANSWERlruHead = CTX->ANSWERlruTail = NULL;
+    CTX->ANSWERstats.bytes = 0;
+    CTX->ANSWERstats.entries = 0;
+}
+
+
+/** Formato del nome del file delle risposte.
  */
-static struct tm HEADdate;
+#define ANSWER_FILE_FORMAT "%d.answers"
 
-/** Cache con le risposte alle query
- * già calcolate.
- * I dati salvati vengono mantenuti
- * inalterati fino alla chiusura
- * del sottosistema e possono essere
- * letti contemporaneamente da più
- * thread senza problemi.
+/** Verifica se la risposta fornita possa
+ * essere salvata, ovvero se la query non
+ * riguarda il giorno corrente.
+ */
+static int ANSWERfile_persistable(const struct answer* A)
+{
+    return time_date_cmp(&answerQuery(A)->end, &CTX->HEADdate) < 0;
+}
+
+/** Scrive un record nel file fornito e ne
+ * somma la dimensione a *bytes.
  *
- * È una sorta di mappa del tipo
- * map<hash(query), answer>
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
  */
-static struct rb_tree* ANSWERcache;
+static int ANSWERfile_write(FILE* fout, const struct answer* A, size_t* bytes)
+{
+    struct ns_answer* nsA;
+    size_t nsLen;
+    uint32_t len;
+    int ans = 0;
 
-/** funzione di cleanup per l'albero */
-static void ANSWERcleanup(void* ptr)
+    if (initNsAnswer(&nsA, &nsLen, A) != 0)
+        return -1;
+
+    len = htonl((uint32_t)nsLen);
+    if (fwrite(&len, sizeof(len), 1, fout) != 1
+        || fwrite(nsA, nsLen, 1, fout) != 1)
+        ans = -1;
+    else
+        *bytes += sizeof(len) + nsLen;
+    free(nsA);
+
+    return ans;
+}
+
+/** Aggiunge una risposta al file delle
+ * risposte, se questo è aperto e se la
+ * risposta può essere salvata.
+ */
+static void ANSWERfile_append(const struct answer* A)
+{
+    if (CTX->ANSWERfile == NULL || !ANSWERfile_persistable(A))
+        return;
+
+    /* fflush perché sopravviva anche a una terminazione anomala */
+    if (ANSWERfile_write(CTX->ANSWERfile, A, &CTX->ANSWERfileBytes) != 0
+        || fflush(CTX->ANSWERfile) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Cannot write answer file, persistence disabled");
+        fclose(CTX->ANSWERfile);
+        CTX->ANSWERfile = NULL;
+    }
+}
+
+/** Riscrive il file delle risposte con le sole
+ * risposte della cache che possono essere salvate,
+ * dalla meno alla più recente, e lo riapre per
+ * aggiungervene di nuove.
+ * Il file è sostituito in modo atomico, perciò
+ * una terminazione anomala non lo danneggia.
+ *
+ * Se fallisce la persistenza resta disattivata.
+ *
+ * Va invocata solo possedendo REGISTERguard.
+ */
+static void ANSWERfile_compact(void)
+{
+    char filename[32], tmpname[40];
+    struct cached_answer* entry;
+    size_t bytes = 0;
+    FILE* fout;
+    int err = 0;
+
+    sprintf(filename, ANSWER_FILE_FORMAT, CTX->peerIDentifier);
+    sprintf(tmpname, "%s.tmp", filename);
+
+    if (CTX->ANSWERfile != NULL)
+        fclose(CTX->ANSWERfile);
+    CTX->ANSWERfile = NULL;
+
+    fout = fopen(tmpname, "w");
+    if (fout == NULL)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Cannot write \"%s\", answer persistence disabled", tmpname);
+        return;
+    }
+    for (entry = CTX->ANSWERlruTail; entry != NULL && !err; entry = entry->prev)
+        if (!entry->stale && ANSWERfile_persistable(entry->answer)
+            && ANSWERfile_write(fout, entry->answer, &bytes) != 0)
+            err = 1;
+    if (fclose(fout) != 0)
+        err = 1;
+    if (err || rename(tmpname, filename) != 0)
+    {
+        unlink(tmpname);
+        unified_io_push(UNIFIED_IO_ERROR, "Cannot write \"%s\", answer persistence disabled", filename);
+        return;
+    }
+
+    CTX->ANSWERfile = fopen(filename, "a");
+    if (CTX->ANSWERfile == NULL)
+        unified_io_push(UNIFIED_IO_ERROR, "Cannot open \"%s\", answer persistence disabled", filename);
+    CTX->ANSWERfileBytes = bytes;
+}
+
+/** Compatta il file delle risposte se è
+ * cresciuto oltre ANSWER_FILE_GROWTH volte
+ * la dimensione della cache (o del budget
+ * se la cache ne occupa meno di metà, così
+ * che una cache quasi vuota non provochi
+ * riscritture continue).
+ *
+ * Va invocata solo possedendo REGISTERguard.
+ */
+static void ANSWERfile_trim(void)
+{
+    size_t live;
+
+    if (CTX->ANSWERfile == NULL)
+        return;
+
+    live = CTX->ANSWERstats.bytes;
+    if (live < CTX->ANSWERstats.budget/2)
+        live = CTX->ANSWERstats.budget/2;
+    if (CTX->ANSWERfileBytes > ANSWER_FILE_GROWTH*live)
+        ANSWERfile_compact();
+}
+
+/** Chiude il file delle risposte.
+ */
+static void ANSWERfile_close(void)
+{
+    if (CTX->ANSWERfile != NULL)
+        fclose(CTX->ANSWERfile);
+    CTX->ANSWERfile = NULL;
+}
+
+/** Elimina dalla cache, e dal file delle
+ * risposte, tutte le risposte a query il
+ * cui intervallo comprende il giorno fornito.
+ * Quelle ancora in uso sono segnate come non
+ * più valide ed eliminate al rilascio.
+ *
+ * Va invocata solo possedendo REGISTERguard.
+ */
+static void ANSWERcache_dropCovering(const struct tm* date)
 {
-    freeAnswer((struct answer*)ptr);
+    struct cached_answer* entry, * next;
+    const struct query* Q;
+    int persisted = 0;
+
+    for (entry = CTX->ANSWERlruHead; entry != NULL; entry = next)
+    {
+        next = entry->next;
+        Q = answerQuery(entry->answer);
+        if (entry->stale || time_date_cmp(date, &Q->begin) < 0
+            || time_date_cmp(date, &Q->end) > 0)
+            continue;
+        if (ANSWERfile_persistable(entry->answer))
+            persisted = 1;
+        if (entry->pins != 0)
+            entry->stale = 1;
+        else
+            ANSWERcache_drop(entry);
+    }
+
+    /* il file contiene ancora le risposte eliminate */
+    if (persisted && CTX->ANSWERfile != NULL)
+        ANSWERfile_compact();
+}
+
+/** Funzione ausiliaria per l'implementazione di
+ * addAnswerToCache e calcEntryQuery.
+ *
+ * Inserisce la risposta nella cache, di cui
+ * diviene proprietà, ed eventualmente elimina
+ * le risposte usate meno di recente.
+ * Se pinned non è NULL la risposta presente
+ * in cache viene segnata come in uso, come
+ * farebbe findCachedAnswer, e vi è salvato
+ * il suo puntatore.
+ *
+ * Se la cache conteneva già una risposta in
+ * uso alla stessa query mantiene quella ed
+ * elimina la nuova.
+ *
+ * Va invocata solo possedendo REGISTERguard.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+static int ANSWERcache_insert(const struct query* Q, struct answer* A, struct answer** pinned)
+{
+    struct cached_answer* entry, * head;
+    int64_t hash;
+
+    hash = hashQuery(Q);
+    if (hash == 0 || !sameQuery(answerQuery(A), Q))
+        return -1;
+    entry = ANSWERcache_find(hash);
+    if (entry != NULL)
+    {
+        if (entry->answer != A)
+        {
+            if (entry->pins != 0)
+            {
+                /* qualcuno la sta usando - si tiene la vecchia,
+                 * anche se non più valida: sarà eliminata al
+                 * rilascio e la nuova ricalcolata */
+                freeAnswer(A);
+            }
+            else
+            {
+                CTX->ANSWERstats.bytes -= entry->size;
+                freeAnswer(entry->answer);
+                entry->answer = A;
+                entry->stale = 0;
+                entry->size = sizeof(struct cached_answer) + answerSize(A);
+                CTX->ANSWERstats.bytes += entry->size;
+            }
+        }
+        ANSWERlru_unlink(entry);
+    }
+    else
+    {
+        entry = calloc(1, sizeof(struct cached_answer));
+        if (entry == NULL)
+            return -1;
+        entry->key = hash;
+        entry->answer = A;
+        entry->size = sizeof(struct cached_answer) + answerSize(A);
+        if (rb_tree_get(CTX->ANSWERcache, ANSWERtree_key(hash), (void**)&head) == 0)
+        {
+            /* collisione sulla chiave dell'albero */
+            entry->chain = head->chain;
+            head->chain = entry;
+        }
+        else if (rb_tree_set(CTX->ANSWERcache, ANSWERtree_key(hash), (void*)entry) == -1)
+        {
+            free(entry);
+            return -1;
+        }
+        CTX->ANSWERstats.bytes += entry->size;
+        ++CTX->ANSWERstats.entries;
+        ++CTX->ANSWERstats.changes;
+        /* solo le nuove risposte vanno salvate */
+        ANSWERfile_append(A);
+    }
+    ANSWERlru_push(entry);
+
+    /* le risposte in uso non sono eliminabili */
+    if (pinned != NULL)
+    {
+        ++entry->pins;
+        *pinned = entry->answer;
+    }
+    ANSWERcache_evict();
+    ANSWERfile_trim();
+
+    return 0;
 }
 
-/** Identifica il peer quando si tratta
- * di salvare il contenuto dei registri
- * in dei file.
+/** Carica nella cache le risposte presenti nel
+ * file delle risposte del peer indicato, poi
+ * riscrive il file con le sole risposte rimaste
+ * nella cache e lo riapre per aggiungerne altre.
+ *
+ * Va invocata dopo init_REGISTERlist.
  *
- * È il numero fornito all'avvio del
- * processo da riga di comando.
+ * Un file assente, troncato o corrotto non
+ * costituisce un errore: le risposte non
+ * leggibili sono semplicemente scartate.
+ * Se il file non può essere riscritto la
+ * persistenza resta disattivata.
+ */
+static void ANSWERfile_load(int port)
+{
+    char filename[32];
+    struct ns_answer* nsA;
+    struct answer* A;
+    uint32_t len;
+    size_t nsLen;
+    FILE* fin;
+    int loaded = 0;
+
+    sprintf(filename, ANSWER_FILE_FORMAT, port);
+
+    fin = fopen(filename, "r");
+    if (fin != NULL)
+    {
+        while (fread(&len, sizeof(len), 1, fin) == 1)
+        {
+            nsLen = (size_t)ntohl(len);
+            if (nsLen < sizeof(struct ns_answer) || nsLen > CTX->ANSWERstats.budget)
+                break;
+            nsA = malloc(nsLen);
+            if (nsA == NULL)
+                break;
+            if (fread(nsA, nsLen, 1, fin) != 1
+                || readNsAnswer(&A, nsA, nsLen) != 0)
+            {
+                free(nsA);
+                break;
+            }
+            free(nsA);
+            /* scarta quelle non più valide */
+            if (checkQuery(answerQuery(A)) != 0 || !ANSWERfile_persistable(A)
+                || ANSWERcache_insert(answerQuery(A), A, NULL) != 0)
+            {
+                freeAnswer(A);
+                continue;
+            }
+            ++loaded;
+        }
+        fclose(fin);
+        if (loaded)
+            unified_io_push(UNIFIED_IO_NORMAL, "Loaded %d answers from \"%s\"", loaded, filename);
+    }
+
+    /* riscrive il file senza le risposte scartate */
+    ANSWERfile_compact();
+}
+
+
+
+/** Libera tutta la memoria usata da DAYcache.
  */
-static int peerIDentifier;
+static void DAYcache_destroy(void)
+{
+    int c;
+
+    for (c = 0; c != ENTRY_CATEGORIES; ++c)
+    {
+        free(CTX->DAYcache.totals[c]);
+        free(CTX->DAYcache.known[c]);
+        free(CTX->DAYcache.prefix[c]);
+    }
+    memset(&CTX->DAYcache, 0, sizeof(CTX->DAYcache));
+}
+
+
+/** Dimentica i totali del giorno fornito per
+ * tutte le categorie, accorciando le somme
+ * prefisse che lo comprendevano.
+ */
+static void DAYcache_forget(const struct tm* date)
+{
+    size_t i;
+    int c;
+
+    if (time_date_cmp(date, &CTX->lowerDate) < 0)
+        return;
+    i = (size_t)time_date_diff(date, &CTX->lowerDate);
+    if (i >= CTX->DAYcache.capacity)
+        return;
+
+    for (c = 0; c != ENTRY_CATEGORIES; ++c)
+    {
+        CTX->DAYcache.known[c][i] = 0;
+        if (CTX->DAYcache.prefixLen[c] > i)
+            CTX->DAYcache.prefixLen[c] = i;
+    }
+}
 
 struct tm firstRegisterClosed(void)
 {
     struct tm date;
 
-    if (!started)
+    if (!CTX->started)
         memset(&date, 0, sizeof(struct tm));
     else
     {
-        if (pthread_mutex_lock(&REGISTERguard) != 0)
+        if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
             abort();
-        date = lowerDate;
-        if (pthread_mutex_unlock(&REGISTERguard) != 0)
+        date = CTX->lowerDate;
+        if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
             abort();
     }
 
@@ -103,14 +840,14 @@ struct tm lastRegisterClosed(void)
 {
     struct tm date;
 
-    if (!started)
+    if (!CTX->started)
         memset(&date, 0, sizeof(struct tm));
     else
     {
-        if (pthread_mutex_lock(&REGISTERguard) != 0)
+        if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
             abort();
-        date = HEADdate;
-        if (pthread_mutex_unlock(&REGISTERguard) != 0)
+        date = CTX->HEADdate;
+        if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
             abort();
         time_date_dec(&date, 1);
     }
@@ -118,6 +855,393 @@ struct tm lastRegisterClosed(void)
     return date;
 }
 
+/** Viste materializzate di default.
+ */
+static const struct materialized_view VIEWSdefault[] = {
+    { AGGREGATION_SUM, SWAB, 7 },
+    { AGGREGATION_SUM, NEW_CASE, 7 },
+    { AGGREGATION_SUM, SWAB, 30 },
+    { AGGREGATION_SUM, NEW_CASE, 30 },
+    { AGGREGATION_DIFF, SWAB, 60 },
+    { AGGREGATION_DIFF, NEW_CASE, 60 }
+};
+
+struct entries_state* ENTRIESstate_create(void)
+{
+    struct entries_state* state;
+    pthread_mutexattr_t attr;
+
+    state = malloc(sizeof(struct entries_state));
+    if (state == NULL)
+        return NULL;
+    memset(state, 0, sizeof(struct entries_state));
+
+    /* REGISTERguard è ricorsivo */
+    if (pthread_mutexattr_init(&attr) != 0
+        || pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) != 0
+        || pthread_mutex_init(&state->REGISTERguard, &attr) != 0
+        || pthread_mutexattr_destroy(&attr) != 0
+        || pthread_cond_init(&state->FLOODcond, NULL) != 0
+        || pthread_cond_init(&state->VIEWScond, NULL) != 0
+        || pthread_mutex_init(&state->QUERYguard, NULL) != 0)
+        fatal("ENTRIESstate_create");
+
+    state->ANSWERstats.budget = ANSWER_CACHE_BUDGET;
+    state->VIEWSlist = VIEWSdefault;
+    state->VIEWSnumber = sizeof(VIEWSdefault)/sizeof(VIEWSdefault[0]);
+    state->PUSHmode = PUSH_REPLICATION;
+    state->PUSHlastDay = -1;
+
+    return state;
+}
+
+void ENTRIESstate_destroy(struct entries_state* state)
+{
+    if (state->VIEWSlist != VIEWSdefault)
+        free((void*)state->VIEWSlist);
+    pthread_mutex_destroy(&state->REGISTERguard);
+    pthread_cond_destroy(&state->FLOODcond);
+    pthread_cond_destroy(&state->VIEWScond);
+    pthread_mutex_destroy(&state->QUERYguard);
+    free(state);
+}
+
+
+int setMaterializedViews(const struct materialized_view* views, size_t n)
+{
+    struct materialized_view* tmp = NULL;
+    size_t i;
+
+    if (n != 0 && views == NULL)
+        return -1;
+    for (i = 0; i != n; ++i)
+        if (views[i].days < 1 || (views[i].aggregation != AGGREGATION_SUM
+            && views[i].aggregation != AGGREGATION_DIFF)
+            || (unsigned)views[i].category >= ENTRY_CATEGORIES)
+            return -1;
+
+    if (n != 0)
+    {
+        tmp = malloc(n*sizeof(struct materialized_view));
+        if (tmp == NULL)
+            return -1;
+        memcpy(tmp, views, n*sizeof(struct materialized_view));
+    }
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** setMaterializedViews:pthread_mutex_lock ***\n");
+
+    if (CTX->VIEWSlist != VIEWSdefault)
+        free((void*)CTX->VIEWSlist);
+    CTX->VIEWSlist = tmp;
+    CTX->VIEWSnumber = n;
+
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** setMaterializedViews:pthread_mutex_lock ***\n");
+
+    return 0;
+}
+
+
+void setPushReplication(int enable)
+{
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** setPushReplication:pthread_mutex_lock ***\n");
+    CTX->PUSHmode = (enable != 0);
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** setPushReplication:pthread_mutex_lock ***\n");
+}
+
+
+/* combina gli hash di due nodi fratelli */
+static uint32_t MERKLEcombine(uint32_t left, uint32_t right)
+{
+    uint32_t x;
+
+    if (left == 0 && right == 0)
+        return 0;
+
+    /* non commutativa: conta la posizione dei giorni */
+    x = left ^ (right * 0x9e3779b1u + 0x7f4a7c15u + (left << 6) + (left >> 2));
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x;
+}
+
+/** Aggiorna la foglia corrispondente al registro
+ * fornito e tutti i suoi antenati, se il registro
+ * appartiene a un giorno concluso.
+ *
+ * Va invocata tenendo REGISTERguard.
+ */
+static void MERKLEupdate(const struct e_register* R)
+{
+    const struct tm* date = register_date(R);
+    long day;
+    size_t i;
+
+    if (date == NULL || time_date_cmp(date, &CTX->lowerDate) < 0
+        || time_date_cmp(date, &CTX->HEADdate) >= 0)
+        return;
+    day = (long)time_date_diff(date, &CTX->lowerDate);
+    if (day >= MERKLE_DAYS)
+        return;
+
+    i = MERKLE_DAYS + (size_t)day;
+    if (CTX->MERKLEtree[i] == register_digest(R))
+        return;
+    CTX->MERKLEtree[i] = register_digest(R);
+    for (i /= 2; i != 0; i /= 2)
+        CTX->MERKLEtree[i] = MERKLEcombine(CTX->MERKLEtree[2*i], CTX->MERKLEtree[2*i+1]);
+}
+
+/* per list_foreach */
+static void MERKLEupdate_helper(void* el)
+{
+    MERKLEupdate((const struct e_register*)el);
+}
+
+int getMerkleNode(uint32_t node, uint32_t* hash)
+{
+    if (node == 0 || node >= 2*MERKLE_DAYS || hash == NULL)
+        return -1;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+    *hash = CTX->MERKLEtree[node];
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+
+    return 0;
+}
+
+/* struttura ausiliaria per confirmMerkleNode */
+struct pushConfirm
+{
+    /* foglie coperte dal nodo, come giorni da lowerDate */
+    long first, last;
+    time_t now;
+};
+
+static void confirmMerkleNode_helper(long int day, void* base)
+{
+    const struct pushConfirm* C = (const struct pushConfirm*)base;
+
+    if (day < C->first || day > C->last)
+        return;
+    /* i push altrui potrebbero essere ancora in viaggio */
+    if (day == CTX->PUSHlastDay && C->now < CTX->PUSHlastTime + PUSH_SETTLE_TIME)
+        return;
+    if (set_add(CTX->PUSHconfirmed, day) != 0)
+        fatal("set_add");
+}
+
+int confirmMerkleNode(uint32_t node)
+{
+    struct pushConfirm C;
+
+    if (node == 0 || node >= 2*MERKLE_DAYS)
+        return -1;
+
+    /* scende fino alle foglie estreme del sottoalbero */
+    C.first = C.last = (long)node;
+    while (C.first < MERKLE_DAYS)
+    {
+        C.first = 2*C.first;
+        C.last = 2*C.last+1;
+    }
+    C.first -= MERKLE_DAYS;
+    C.last -= MERKLE_DAYS;
+    C.now = time(NULL);
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+    if (CTX->PUSHcovered != NULL)
+    {
+        if (CTX->PUSHconfirmed == NULL && (CTX->PUSHconfirmed = set_init(NULL)) == NULL)
+            fatal("set_init");
+        if (set_accumulate(CTX->PUSHcovered, &confirmMerkleNode_helper, (void*)&C) != 0)
+            fatal("set_accumulate");
+    }
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+
+    return 0;
+}
+
+int getMerkleLeafDate(uint32_t node, struct tm* date)
+{
+    if (node < MERKLE_DAYS || node >= 2*MERKLE_DAYS || date == NULL)
+        return -1;
+
+    *date = time_date_add(&CTX->lowerDate, (int)(node - MERKLE_DAYS));
+    return 0;
+}
+
+int getMerkleLeaf(const struct tm* date, uint32_t* node)
+{
+    long day;
+
+    if (date == NULL || node == NULL || time_date_cmp(date, &CTX->lowerDate) < 0)
+        return -1;
+    day = (long)time_date_diff(date, &CTX->lowerDate);
+    if (day >= MERKLE_DAYS)
+        return -1;
+
+    *node = MERKLE_DAYS + (uint32_t)day;
+    return 0;
+}
+
+/* il sottosistema sta terminando? */
+static int VIEWSstopping(void)
+{
+    int stop;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** VIEWSstopping:pthread_mutex_lock ***\n");
+    stop = CTX->VIEWSstop;
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** VIEWSstopping:pthread_mutex_lock ***\n");
+
+    return stop;
+}
+
+/** Ricalcola tutte le viste materializzate
+ * sull'intervallo che termina con l'ultimo
+ * giorno concluso e le inserisce nella cache.
+ *
+ * Il calcolo è svolto da calcEntryQuery, che
+ * grazie a DAYcache ricava dai totali già
+ * noti tutti i giorni tranne quelli nuovi:
+ * a regime, a ogni cambio di registro viene
+ * contattato il network solo per l'ultimo
+ * giorno e le viste successive alla prima
+ * sono composte senza ulteriori scambi.
+ *
+ * Se il peer non è connesso al network non
+ * fa nulla.
+ */
+static void refreshMaterializedViews(void)
+{
+    struct materialized_view* views;
+    struct query query;
+    struct tm begin, end;
+    const struct answer* ans;
+    size_t i, n;
+    char queryStr[64];
+
+    /* copia l'elenco per non tenere il mutex durante i calcoli */
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** refreshMaterializedViews:pthread_mutex_lock ***\n");
+    n = CTX->VIEWSnumber;
+    views = (n != 0 ? malloc(n*sizeof(struct materialized_view)) : NULL);
+    if (views != NULL)
+        memcpy(views, CTX->VIEWSlist, n*sizeof(struct materialized_view));
+    end = CTX->HEADdate;
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** refreshMaterializedViews:pthread_mutex_lock ***\n");
+
+    if (views == NULL)
+        return;
+
+    /* l'ultimo giorno concluso */
+    time_date_dec(&end, 1);
+    for (i = 0; i != n; ++i)
+    {
+        /* il network potrebbe essere stato abbandonato */
+        if (!UDPisConnected() || VIEWSstopping())
+            break;
+
+        /* le variazioni richiedono un giorno in più */
+        begin = time_date_sub(&end, views[i].days
+            - (views[i].aggregation == AGGREGATION_SUM ? 1 : 0));
+        if (time_date_cmp(&begin, &CTX->lowerDate) < 0)
+            begin = CTX->lowerDate;
+        if (buildQuery(&query, views[i].aggregation, views[i].category, &begin, &end) != 0
+            || checkQuery(&query) != 0)
+            continue;
+
+        unified_io_push(UNIFIED_IO_NORMAL, "Refreshing materialized view: %s",
+            stringifyQuery(&query, queryStr, sizeof(queryStr)));
+        ans = calcEntryQuery(&query);
+        if (ans == NULL)
+            unified_io_push(UNIFIED_IO_ERROR, "Cannot refresh materialized view");
+        else
+            releaseCachedAnswer(ans);
+    }
+    free(views);
+}
+
+/** Funzione a gestione del thread VIEWS:
+ * attende le richieste del thread ENTRIES e
+ * a ognuna aggiorna le viste materializzate.
+ * Più richieste arrivate durante lo stesso
+ * aggiornamento ne provocano uno solo.
+ */
+static void* viewsSubsystem(void* args)
+{
+    struct thread_semaphore* ts;
+    sigset_t toBlock;
+
+    ts = thread_semaphore_form_args(args);
+    if (ts == NULL)
+        errExit("*** VIEWS ***\n");
+
+    if (unified_io_set_thread_name("VIEWS") != 0)
+        fatal("VIEWS:unified_io_set_thread_name");
+
+    /* i segnali sono gestiti dagli altri thread */
+    if (sigfillset(&toBlock) != 0
+        || pthread_sigmask(SIG_BLOCK, &toBlock, NULL) != 0)
+    {
+        if (thread_semaphore_signal(ts, -1, NULL) == -1)
+            errExit("*** VIEWS ***\n");
+        return NULL;
+    }
+
+    if (thread_semaphore_signal(ts, 0, NULL) == -1)
+        errExit("*** VIEWS ***\n");
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** VIEWS:pthread_mutex_lock ***\n");
+    while (1)
+    {
+        while (!CTX->VIEWSpending && !CTX->VIEWSstop)
+            if (pthread_cond_wait(&CTX->VIEWScond, &CTX->REGISTERguard) != 0)
+                errExit("*** VIEWS:pthread_cond_wait ***\n");
+        if (CTX->VIEWSstop)
+            break;
+        CTX->VIEWSpending = 0;
+        if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+            errExit("*** VIEWS:pthread_mutex_lock ***\n");
+
+        refreshMaterializedViews();
+
+        if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+            errExit("*** VIEWS:pthread_mutex_lock ***\n");
+    }
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** VIEWS:pthread_mutex_lock ***\n");
+
+    return NULL;
+}
+
+/* chiede al thread VIEWS di aggiornare (what = &VIEWSpending)
+ * le viste o di terminare (what = &VIEWSstop) */
+static void VIEWSnotify(int* what)
+{
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** VIEWSnotify:pthread_mutex_lock ***\n");
+    *what = 1;
+    if (pthread_cond_signal(&CTX->VIEWScond) != 0)
+        errExit("*** VIEWSnotify:pthread_cond_signal ***\n");
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** VIEWSnotify:pthread_mutex_lock ***\n");
+}
+
 /* handler farlocco */
 static void fakeHandler(int x) {(void)x;}
 
@@ -127,9 +1251,10 @@ static void newListHead(void)
     struct tm newDate;
     /* nuovo candidato testa */
     struct e_register* newHEAD;
+    struct e_register* oldHEAD;
 
     /* i registri sono identificati dall'ID del peer */
-    newHEAD = register_create(NULL, peerIDentifier);
+    newHEAD = register_create(NULL, CTX->peerIDentifier);
     if (newHEAD == NULL)
         errExit("*** ENTRIES:register_create ***\n");
 
@@ -137,25 +1262,79 @@ static void newListHead(void)
     newDate = *register_date(newHEAD);
 
     /* INIZIO SEZIONE CRITICA */
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
         errExit("*** ENTRIES:pthread_mutex_lock ***\n");
 
+    /* la vecchia testa diventa un giorno concluso */
+    if (list_first(CTX->REGISTERlist, (void**)&oldHEAD) != 0)
+        oldHEAD = NULL;
+
     unified_io_push(UNIFIED_IO_NORMAL,
         "Adding new register in date [%d-%d-%d]",
         newDate.tm_year+1900, newDate.tm_mon+1, newDate.tm_mday);
 
     /* prova a inserire il nuovo valore */
-    if (list_prepend(REGISTERlist, (void*)newHEAD) != 0)
+    if (list_prepend(CTX->REGISTERlist, (void*)newHEAD) != 0)
         errExit("*** ENTRIES:list_prepend ***\n");
 
     /* aggiorna la data di riferimeto */
-    HEADdate = newDate;
+    CTX->HEADdate = newDate;
+    if (oldHEAD != NULL)
+        MERKLEupdate(oldHEAD);
 
     /* TERMINE SEZIONE CRITICA */
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
         errExit("*** ENTRIES:pthread_mutex_lock ***\n");
 }
 
+/** Se il push è attivo invia ai vicini le entry
+ * del giorno appena concluso firmate dal peer
+ * corrente e segna il giorno come coperto.
+ *
+ * Se il peer non è connesso al network non
+ * fa nulla.
+ */
+static void pushClosedRegister(void)
+{
+    struct tm date;
+    long day;
+    int mode;
+    char dateStr[16];
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** pushClosedRegister:pthread_mutex_lock ***\n");
+    mode = CTX->PUSHmode;
+    date = CTX->HEADdate;
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** pushClosedRegister:pthread_mutex_lock ***\n");
+
+    if (!mode || !UDPisConnected())
+        return;
+
+    /* l'ultimo giorno concluso */
+    time_date_dec(&date, 1);
+    if (time_serialize_date(dateStr, &date) == NULL)
+        errExit("*** pushClosedRegister:time_serialize_date ***\n");
+    unified_io_push(UNIFIED_IO_NORMAL, "Pushing entries of %s", dateStr);
+    if (TCPpushEntries(&date) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Cannot push entries of %s", dateStr);
+        return;
+    }
+
+    day = (long)time_date_diff(&date, &CTX->lowerDate);
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** pushClosedRegister:pthread_mutex_lock ***\n");
+    if (CTX->PUSHcovered == NULL && (CTX->PUSHcovered = set_init(NULL)) == NULL)
+        errExit("*** pushClosedRegister:set_init ***\n");
+    if (set_add(CTX->PUSHcovered, day) != 0)
+        errExit("*** pushClosedRegister:set_add ***\n");
+    CTX->PUSHlastDay = day;
+    CTX->PUSHlastTime = time(NULL);
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** pushClosedRegister:pthread_mutex_lock ***\n");
+}
+
 /** Funzione a gestione del thread
  * che fa da guardia a register
  */
@@ -214,7 +1393,7 @@ static void* entriesSubsystem(void* args)
     memset(&start, 0, sizeof(start));
     /* primo avvio */
     /* si appoggia all'oggetto HEADdate per il primo avvio */
-    startTM = HEADdate; startTM.tm_hour = 18;
+    startTM = CTX->HEADdate; startTM.tm_hour = 18;
     start.it_value.tv_sec = mktime(&startTM); /* secondi da Epoch */
 
     /* ogni 24h - semplificazione che trascura il cambio di orario */
@@ -251,6 +1430,11 @@ static void* entriesSubsystem(void* args)
 
         /* nuova testa per l'elemento */
         newListHead(); /* se fallisce termina */
+        /* replica i dati del giorno concluso */
+        pushClosedRegister();
+        /* prepara le risposte che saranno richieste,
+         * senza bloccare questo thread */
+        VIEWSnotify(&CTX->VIEWSpending);
     }
 
     unified_io_push(UNIFIED_IO_NORMAL, "Terminating entries subsystem!");
@@ -346,7 +1530,7 @@ static int init_REGISTERlist(int defaultSignature)
 
     /* per tutti i giorni da ieri fino a alla data limite */
     for (tail_date = time_date_add(&test_date, -1);
-            time_date_cmp(&tail_date, &lowerDate) >= 0;
+            time_date_cmp(&tail_date, &CTX->lowerDate) >= 0;
             time_date_dec(&tail_date, 1))
     {
         /* prova a caricare il registro del vecchio giorno */
@@ -375,53 +1559,66 @@ static int init_REGISTERlist(int defaultSignature)
     printf("Created registers from [%s] to [%s]\n", dateStart, dateEnd);
 
     /* salva globalmente le informazioni */
-    HEADdate = test_date;
-    REGISTERlist = test_list;
+    CTX->HEADdate = test_date;
+    CTX->REGISTERlist = test_list;
 
     return 0;
 }
 
-/** Identificativo del thread che gestisce
- * i registri
- */
-static pthread_t REGISTER_tid;
 
 int startEntriesSubsystem(int port)
 {
     /* non si può avviare due volte */
-    if (started)
+    if (CTX->started)
         return -1;
 
     /* in modo che l'id del peer sia disponibile
      * ovunque nel file */
-    peerIDentifier = port;
+    CTX->peerIDentifier = port;
     /* inizializza la variabile globale limite inferiore */
-    lowerDate = time_date_init(INFERIOR_YEAR, 1, 1);
+    CTX->lowerDate = time_date_init(INFERIOR_YEAR, 1, 1);
 
-    ANSWERcache = rb_tree_init(NULL);
-    if (ANSWERcache == NULL)
+    CTX->ANSWERcache = rb_tree_init(NULL);
+    if (CTX->ANSWERcache == NULL)
         return -1;
     /* imposta la funzione di cleanup ler l'albero */
-    rb_tree_set_cleanup_f(ANSWERcache, &ANSWERcleanup);
+    rb_tree_set_cleanup_f(CTX->ANSWERcache, &ANSWERcleanup);
 
     /* crea i registri */
     if (init_REGISTERlist(port) != 0)
     {
-        rb_tree_destroy(ANSWERcache);
-        ANSWERcache = NULL;
+        ANSWERcache_destroy();
         return -1;
     }
 
+    /* costruisce il Merkle tree dei registri caricati */
+    memset(CTX->MERKLEtree, 0, sizeof(CTX->MERKLEtree));
+    list_foreach(CTX->REGISTERlist, &MERKLEupdate_helper);
+
+    /* recupera le risposte salvate */
+    ANSWERfile_load(port);
+
     /* avvia il subsystem */
-    if (start_long_life_thread(&REGISTER_tid, &entriesSubsystem, NULL, NULL) == -1)
+    CTX->VIEWSpending = 0;
+    CTX->VIEWSstop = 0;
+    if (peer_context_start_thread(&CTX->VIEWS_tid, &viewsSubsystem, NULL, NULL) == -1)
+    {
+        ANSWERfile_close();
+        ANSWERcache_destroy();
+        return -1;
+    }
+    if (peer_context_start_thread(&CTX->REGISTER_tid, &entriesSubsystem, NULL, NULL) == -1)
     {
-        rb_tree_destroy(ANSWERcache);
-        ANSWERcache = NULL;
+        VIEWSnotify(&CTX->VIEWSstop);
+        if (pthread_join(CTX->VIEWS_tid, NULL) != 0)
+            errExit("*** pthread_join ***\n");
+        ANSWERfile_close();
+        ANSWERcache_destroy();
         return -1;
     }
 
     /* accende il flag */
-    started = 1;
+    CTX->started = 1;
 
     return 0;
 }
@@ -429,25 +1626,55 @@ int startEntriesSubsystem(int port)
 int closeEntriesSubsystem(void)
 {
     /* controlla il flag */
-    if (!started)
+    if (!CTX->started)
         return -1;
 
-    if (pthread_kill(REGISTER_tid, TERM_SUBSYS_SIGNAL) != 0)
+    if (pthread_kill(CTX->REGISTER_tid, TERM_SUBSYS_SIGNAL) != 0)
         errExit("*** pthread_kill ***\n");
 
-    if (pthread_join(REGISTER_tid, NULL) != 0)
+    if (pthread_join(CTX->REGISTER_tid, NULL) != 0)
+        errExit("*** pthread_join ***\n");
+
+    /* un aggiornamento in corso si interrompe alla
+     * vista successiva */
+    VIEWSnotify(&CTX->VIEWSstop);
+    if (pthread_join(CTX->VIEWS_tid, NULL) != 0)
         errExit("*** pthread_join ***\n");
 
     /* flush di tutti i registri rimasti aperti */
-    list_destroy(REGISTERlist);
+    list_destroy(CTX->REGISTERlist);
     /* distrugge la cache delle risposte */
-    rb_tree_destroy(ANSWERcache);
-
-    started = 0;
+    unified_io_push(UNIFIED_IO_NORMAL,
+        "Answer cache: %lu hits, %lu misses, %lu evictions, %lu bytes in %lu answers",
+        CTX->ANSWERstats.hits, CTX->ANSWERstats.misses, CTX->ANSWERstats.evictions,
+        (unsigned long)CTX->ANSWERstats.bytes, (unsigned long)CTX->ANSWERstats.entries);
+    ANSWERfile_close();
+    ANSWERcache_destroy();
+    /* e quella dei totali giornalieri */
+    DAYcache_destroy();
+    set_destroy(CTX->PUSHcovered);
+    CTX->PUSHcovered = NULL;
+    set_destroy(CTX->PUSHconfirmed);
+    CTX->PUSHconfirmed = NULL;
+    CTX->PUSHlastDay = -1;
+
+    CTX->started = 0;
 
     return 0;
 }
 
+/* verifica se il registro del giorno fornito è
+ * stato ricevuto via push e confermato da un vicino
+ * (vedi PUSHconfirmed) - va invocata tenendo
+ * REGISTERguard */
+static int isPushConfirmed(const struct tm* date)
+{
+    if (CTX->PUSHconfirmed == NULL)
+        return 0;
+    return set_has(CTX->PUSHconfirmed,
+        (long)time_date_diff(date, &CTX->lowerDate)) == 1;
+}
+
 /** Funzione ausiliaria per l'implementazione di
  * findRegisterByDate che si occupa di verificare
  * se la data associata al registro primo argomento
@@ -470,7 +1697,7 @@ static struct e_register* findRegisterByDate(const struct tm* date)
 {
     struct e_register* R;
 
-    if (list_find(REGISTERlist, (void**)&R, &findRegisterByDate_helper, (void*)date) != 0)
+    if (list_find(CTX->REGISTERlist, (void**)&R, &findRegisterByDate_helper, (void*)date) != 0)
         return NULL;
 
     return R;
@@ -481,6 +1708,8 @@ int mergeRegisterContent(const struct e_register* R)
     /* registro posseduto dal peer */
     struct e_register* myReg;
     const struct tm* date;
+    char dateStr[16];
+    ssize_t before;
     int ans;
 
     if (R == NULL)
@@ -491,7 +1720,7 @@ int mergeRegisterContent(const struct e_register* R)
         return -1;
 
     /* sezione critica! */
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
         fatal("pthread_mutex_lock");
 
     myReg = findRegisterByDate(date);
@@ -500,12 +1729,30 @@ int mergeRegisterContent(const struct e_register* R)
     else
     {
         ans = 0;
+        before = register_size(myReg);
         /* fonde i registri */
         if (register_merge(myReg, R) == -1)
             fatal("register_merge"); /* se fallisce è un disastro! */
+        MERKLEupdate(myReg);
+        /* un registro chiuso è cambiato: i totali e
+         * le risposte che lo coinvolgono sono errati */
+        if (register_is_closed(myReg) != 0 && register_size(myReg) != before)
+        {
+            if (time_serialize_date(dateStr, date) == NULL)
+                fatal("time_serialize_date");
+            unified_io_push(UNIFIED_IO_NORMAL,
+                "Closed register %s updated: dropping its cached answers", dateStr);
+            DAYcache_forget(date);
+            ANSWERcache_dropCovering(date);
+            ans = 1;
+        }
+        /* le risposte possono comprendere anche i giorni
+         * confermati via push, che restano aperti */
+        else if (register_size(myReg) != before && isPushConfirmed(date))
+            ANSWERcache_dropCovering(date);
     }
 
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
         fatal("pthread_mutex_unlock");
 
     return ans;
@@ -516,27 +1763,27 @@ int addEntryToCurrent(const struct entry* E)
     struct e_register* currentRegister;
 
     /* controlla che il sottosistema sia stato avviato */
-    if (!started)
+    if (!CTX->started)
         return -1;
 
     if (E == NULL)
         return -1;
 
     /* INIZIO SEZIONE CRITICA */
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
         return -1;
 
     /* ottiene il riferimento al registro di oggi */
-    if (list_first(REGISTERlist, (void**)&currentRegister) != 0
+    if (list_first(CTX->REGISTERlist, (void**)&currentRegister) != 0
         /* ora inserisce la entry nel registro */
         || register_add_entry(currentRegister, E) != 0)
     {
-        pthread_mutex_unlock(&REGISTERguard);
+        pthread_mutex_unlock(&CTX->REGISTERguard);
         return -1;
     }
 
     /* FINE SEZIONE CRITICA */
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
         return -1;
 
     return 0;
@@ -544,51 +1791,365 @@ int addEntryToCurrent(const struct entry* E)
 
 const struct answer* findCachedAnswer(const struct query* Q)
 {
-    const struct answer* ans;
-    long int hash;
+    struct cached_answer* entry;
+    int64_t hash;
 
-    if (!started || checkQuery(Q) != 0)
+    if (!CTX->started || checkQuery(Q) != 0)
         return NULL;
 
     hash = hashQuery(Q);
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
         errExit("*** findCachedAnswer:pthread_mutex_lock ***\n");
 
-    if (rb_tree_get(ANSWERcache, hash, (void**)&ans) == -1)
+    /* la chiave è priva di collisioni ma si verifica comunque la query */
+    entry = ANSWERcache_find(hash);
+    if (entry == NULL || entry->stale || !sameQuery(answerQuery(entry->answer), Q))
     {
-        if (pthread_mutex_unlock(&REGISTERguard) != 0)
+        ++CTX->ANSWERstats.misses;
+        if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
             errExit("*** findCachedAnswer:pthread_mutex_lock ***\n");
         return NULL;
     }
+    ++CTX->ANSWERstats.hits;
+    /* diventa la più recente e non può essere eliminata */
+    ++entry->pins;
+    ANSWERlru_unlink(entry);
+    ANSWERlru_push(entry);
 
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
         errExit("*** findCachedAnswer:pthread_mutex_lock ***\n");
 
-    return ans;
+    return entry->answer;
+}
+
+void releaseCachedAnswer(const struct answer* A)
+{
+    struct cached_answer* entry;
+
+    if (!CTX->started || A == NULL)
+        return;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** releaseCachedAnswer:pthread_mutex_lock ***\n");
+
+    entry = ANSWERcache_find(hashQuery(answerQuery(A)));
+    if (entry == NULL || entry->answer != A || entry->pins == 0)
+        fatal("Inconsistent state - releaseCachedAnswer");
+    --entry->pins;
+    if (entry->stale && entry->pins == 0)
+        ANSWERcache_drop(entry);
+    /* potrebbe essere stata trattenuta oltre il limite */
+    ANSWERcache_evict();
+
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** releaseCachedAnswer:pthread_mutex_lock ***\n");
 }
 
 int addAnswerToCache(const struct query* Q, const struct answer* A)
 {
-    long int hash;
-
-    if (!started || checkQuery(Q) != 0 || A == NULL)
+    int ans;
+
+    if (!CTX->started || checkQuery(Q) != 0 || A == NULL)
+        return -1;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** addAnswerToCache:pthread_mutex_lock ***\n");
+
+    ans = ANSWERcache_insert(Q, (struct answer*)A, NULL);
+
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** addAnswerToCache:pthread_mutex_lock ***\n");
+
+    return ans;
+}
+
+void setAnswerCacheBudget(size_t budget)
+{
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** setAnswerCacheBudget:pthread_mutex_lock ***\n");
+
+    CTX->ANSWERstats.budget = budget;
+    if (CTX->ANSWERcache != NULL)
+        ANSWERcache_evict();
+
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** setAnswerCacheBudget:pthread_mutex_lock ***\n");
+}
+
+void getAnswerCacheStats(struct answer_cache_stats* stats)
+{
+    if (stats == NULL)
+        return;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** getAnswerCacheStats:pthread_mutex_lock ***\n");
+
+    *stats = CTX->ANSWERstats;
+
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** getAnswerCacheStats:pthread_mutex_lock ***\n");
+}
+
+int getAnswerCacheDigest(uint32_t* words, size_t nWords, uint32_t seed)
+{
+    const struct cached_answer* entry;
+
+    if (words == NULL || nWords == 0)
+        return -1;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        errExit("*** getAnswerCacheDigest:pthread_mutex_lock ***\n");
+
+    for (entry = CTX->ANSWERlruHead; entry != NULL; entry = entry->next)
+        if (!entry->stale)
+            bloom_add(words, nWords, seed, ANSWER_DIGEST_KEY(entry->key));
+
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        errExit("*** getAnswerCacheDigest:pthread_mutex_lock ***\n");
+
+    return 0;
+}
+
+/** Fornisce la posizione in DAYcache del
+ * giorno indicato oppure -1 se la data
+ * precede lowerDate.
+ */
+static long DAYcache_index(const struct tm* date)
+{
+    if (time_date_cmp(date, &CTX->lowerDate) < 0)
+        return -1;
+
+    return (long)time_date_diff(date, &CTX->lowerDate);
+}
+
+/** Si assicura che DAYcache possa contenere
+ * almeno il numero di giorni indicato.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+static int DAYcache_reserve(size_t len)
+{
+    size_t newCap, oldCap = CTX->DAYcache.capacity;
+    int c;
+    int* totals;
+    unsigned char* known;
+    long* prefix;
+
+    if (len <= oldCap)
+        return 0;
+
+    /* cresce almeno del doppio per non riallocare ogni giorno */
+    newCap = (2*oldCap > len ? 2*oldCap : len);
+    for (c = 0; c != ENTRY_CATEGORIES; ++c)
+    {
+        totals = realloc(CTX->DAYcache.totals[c], newCap*sizeof(int));
+        if (totals == NULL)
+            return -1;
+        CTX->DAYcache.totals[c] = totals;
+
+        known = realloc(CTX->DAYcache.known[c], newCap*sizeof(unsigned char));
+        if (known == NULL)
+            return -1;
+        memset(known+oldCap, 0, (newCap-oldCap)*sizeof(unsigned char));
+        CTX->DAYcache.known[c] = known;
+
+        prefix = realloc(CTX->DAYcache.prefix[c], (newCap+1)*sizeof(long));
+        if (prefix == NULL)
+            return -1;
+        if (oldCap == 0)
+            prefix[0] = 0;
+        CTX->DAYcache.prefix[c] = prefix;
+    }
+    CTX->DAYcache.capacity = newCap;
+
+    return 0;
+}
+
+/** Salva in DAYcache il totale, per la
+ * categoria indicata, del giorno fornito,
+ * aggiornando le somme prefisse.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+static int DAYcache_set(enum entry_type type, const struct tm* date, int total)
+{
+    long i;
+    size_t j;
+
+    i = DAYcache_index(date);
+    if (i == -1 || DAYcache_reserve((size_t)i+1) != 0)
+        return -1;
+
+    CTX->DAYcache.totals[type][i] = total;
+    CTX->DAYcache.known[type][i] = 1;
+
+    /* estende le somme prefisse finché i giorni noti sono consecutivi */
+    for (j = CTX->DAYcache.prefixLen[type]; j < CTX->DAYcache.capacity && CTX->DAYcache.known[type][j]; ++j)
+        CTX->DAYcache.prefix[type][j+1] = CTX->DAYcache.prefix[type][j] + CTX->DAYcache.totals[type][j];
+    CTX->DAYcache.prefixLen[type] = j;
+
+    return 0;
+}
+
+/** Verifica se DAYcache conosca il totale del
+ * giorno fornito per la categoria data.
+ */
+static int DAYcache_has(enum entry_type type, const struct tm* date)
+{
+    long i = DAYcache_index(date);
+
+    return i != -1 && (size_t)i < CTX->DAYcache.capacity && CTX->DAYcache.known[type][i];
+}
+
+/** Prova a rispondere alla query usando solamente
+ * i totali giornalieri presenti in DAYcache.
+ *
+ * Restituisce la risposta in caso di successo e
+ * NULL se anche un solo giorno dell'intervallo
+ * non è noto (o in caso di errore).
+ */
+static struct answer* DAYcache_compose(const struct query* Q)
+{
+    struct answer* ans = NULL;
+    enum entry_type type = Q->category;
+    long a, b;
+    size_t i, n;
+    int* totals;
+
+    a = DAYcache_index(&Q->begin);
+    b = DAYcache_index(&Q->end);
+    if (a == -1 || b < a || (size_t)b >= CTX->DAYcache.capacity)
+        return NULL;
+
+    /* totale di un intervallo coperto dalle somme prefisse */
+    if (Q->aggregation == AGGREGATION_SUM && (size_t)b < CTX->DAYcache.prefixLen[type])
+    {
+        if (makeSumAnswer(&ans, Q, (int)(CTX->DAYcache.prefix[type][b+1] - CTX->DAYcache.prefix[type][a])) != 0)
+            return NULL;
+        return ans;
+    }
+
+    n = (size_t)(b-a+1);
+    totals = calloc(n, sizeof(int));
+    if (totals == NULL)
+        return NULL;
+    /* la posizione 0 corrisponde alla data più recente */
+    for (i = 0; i != n; ++i)
+    {
+        if (!CTX->DAYcache.known[type][b-i])
+            break;
+        totals[i] = CTX->DAYcache.totals[type][b-i];
+    }
+    if (i == n && calcAnswerFromTotals(&ans, Q, totals, n) != 0)
+        ans = NULL;
+    free(totals);
+
+    return ans;
+}
+
+/** Struttura ausiliaria per raccogliere i
+ * totali giornalieri dei registri su cui
+ * è stata calcolata una query.
+ */
+struct dailyTotals
+{
+    const struct query* query;
+    /* posizione i -> giorno (fine - i) */
+    int* totals;
+    unsigned char* done;
+    int error; /* flag, se non 0 è un disastro */
+};
+
+static void dailyTotals_helper(void* reg, void* base)
+{
+    const struct e_register* R;
+    struct dailyTotals* ref;
+    const struct tm* date;
+    enum entry_type type;
+    int total;
+    size_t i;
+
+    R = (const struct e_register*)reg;
+    ref = (struct dailyTotals*)base;
+
+    date = register_date(R);
+    /* giorno già aggregato da floodingCompleted: lo
+     * fornirà DAYcache */
+    if (date != NULL && register_is_closed(R) == 1
+        && DAYcache_has(ref->query->category, date))
+        return;
+    total = register_calc_type(R, ref->query->category);
+    if (date == NULL || total == -1)
+    {
+        ref->error = 1;
+        return;
+    }
+    i = (size_t)time_date_diff(&ref->query->end, date);
+    ref->totals[i] = total;
+    ref->done[i] = 1;
+
+    /* un registro chiuso non cambierà più: i suoi totali vanno in cache */
+    if (register_is_closed(R) == 1)
+        for (type = 0; type != ENTRY_CATEGORIES; ++type)
+            if ((total = register_calc_type(R, type)) == -1
+                || DAYcache_set(type, date, total) != 0)
+                ref->error = 1;
+}
+
+/** Calcola la risposta alla query usando i
+ * registri della lista fornita per i giorni
+ * in essa presenti e DAYcache per tutti gli
+ * altri.
+ *
+ * Restituisce 0 in caso di successo e -1 in
+ * caso di errore.
+ */
+static int calcAnswerWithDAYcache(struct answer** A,
+            const struct query* Q,
+            struct list* l)
+{
+    struct dailyTotals data;
+    size_t i, n;
+    long b;
+    int ans = 0;
+
+    n = (size_t)time_date_diff(&Q->end, &Q->begin)+1;
+    b = DAYcache_index(&Q->end);
+
+    data.query = Q;
+    data.error = 0;
+    data.totals = calloc(n, sizeof(int));
+    data.done = calloc(n, sizeof(unsigned char));
+    if (data.totals == NULL || data.done == NULL)
+    {
+        free(data.totals);
+        free(data.done);
         return -1;
+    }
 
-    hash = hashQuery(Q);
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
-        errExit("*** addAnswerToCache:pthread_mutex_lock ***\n");
-
-    if (rb_tree_set(ANSWERcache, hash, (void*)A) == -1)
+    /* giorni appena calcolati */
+    list_accumulate(l, &dailyTotals_helper, (void*)&data);
+    /* giorni già noti */
+    for (i = 0; i != n && !data.error; ++i)
     {
-        if (pthread_mutex_unlock(&REGISTERguard) != 0)
-            errExit("*** addAnswerToCache:pthread_mutex_lock ***\n");
-        return -1;
+        if (data.done[i])
+            continue;
+        if (b-(long)i < 0 || (size_t)(b-(long)i) >= CTX->DAYcache.capacity
+            || !CTX->DAYcache.known[Q->category][b-i])
+            data.error = 1;
+        else
+            data.totals[i] = CTX->DAYcache.totals[Q->category][b-i];
     }
 
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
-        errExit("*** addAnswerToCache:pthread_mutex_lock ***\n");
+    if (data.error || calcAnswerFromTotals(A, Q, data.totals, n) != 0)
+        ans = -1;
 
-    return 0;
+    free(data.totals);
+    free(data.done);
+
+    return ans;
 }
 
 static int calcEntryQuery_helper(void* reg, void* que)
@@ -608,7 +2169,9 @@ static int calcEntryQuery_helper(void* reg, void* que)
     if (readQuery(Q, NULL, NULL, &begin, &end) == -1)
         errExit("*** DISASTRO:calcEntryQuery_helper ***\n");
 
-    return !(time_date_cmp(date, &begin) < 0 || time_date_cmp(date, &end) > 0);
+    /* i giorni di cui si conosce già il totale non vanno ricalcolati */
+    return !(time_date_cmp(date, &begin) < 0 || time_date_cmp(date, &end) > 0)
+        && !DAYcache_has(Q->category, date);
 }
 
 #ifndef NDEBUG
@@ -646,60 +2209,279 @@ static void startFlooding(void* el)
     }
 }
 
-struct answer* calcEntryQuery(const struct query* query)
+/** Funzione ausiliaria che seleziona i registri
+ * per cui startFlooding avvierà il protocollo:
+ * quelli aperti, esclusi i giorni ricevuti via
+ * push e confermati da un vicino. Questi ultimi
+ * non sono chiusi, così le entry che arrivano
+ * dopo invalidano le risposte che li comprendono
+ * (vedi mergeRegisterContent).
+ *
+ * Va invocata tenendo REGISTERguard.
+ */
+static int needsFlooding(void* el, void* base)
+{
+    const struct e_register* R = (const struct e_register*)el;
+
+    (void)base;
+    return register_is_closed(R) == 0 && !isPushConfirmed(register_date(R));
+}
+
+/** Struttura ausiliaria per calcolare una
+ * risposta provvisoria con i registri posseduti.
+ */
+struct partialTotals
+{
+    const struct query* query;
+    /* posizione i -> giorno (fine - i) */
+    int* totals;
+    struct query_coverage* coverage;
+    int error; /* flag, se non 0 è un disastro */
+};
+
+static void partialTotals_helper(void* reg, void* base)
+{
+    const struct e_register* R;
+    struct partialTotals* ref;
+    const struct tm* date;
+    long i;
+    int total;
+
+    R = (const struct e_register*)reg;
+    ref = (struct partialTotals*)base;
+
+    date = register_date(R);
+    if (date == NULL)
+    {
+        ref->error = 1;
+        return;
+    }
+    i = (long)time_date_diff(&ref->query->end, date);
+    if (i < 0 || (size_t)i >= ref->coverage->days)
+        return; /* fuori dall'intervallo */
+
+    /* i giorni chiusi e aggregati sono già in DAYcache */
+    if (register_is_closed(R) == 1 && DAYcache_has(ref->query->category, date))
+        total = CTX->DAYcache.totals[ref->query->category][DAYcache_index(date)];
+    else if ((total = register_calc_type(R, ref->query->category)) == -1)
+    {
+        ref->error = 1;
+        return;
+    }
+    ref->totals[i] = total;
+    ref->coverage->dayClosed[i] = (register_is_closed(R) == 1);
+    ref->coverage->signatures[i] = (size_t)max(0, (int)register_size(R));
+    if (ref->coverage->dayClosed[i])
+        ++ref->coverage->closed;
+}
+
+/** Come calcPartialAnswer ma va invocata
+ * tenendo REGISTERguard.
+ */
+static int calcPartialAnswer_locked(struct answer** A,
+            struct query_coverage* C,
+            const struct query* Q)
+{
+    struct partialTotals data;
+
+    memset(C, 0, sizeof(*C));
+    C->days = (size_t)time_date_diff(&Q->end, &Q->begin)+1;
+    C->dayClosed = calloc(C->days, sizeof(unsigned char));
+    C->signatures = calloc(C->days, sizeof(size_t));
+    data.query = Q;
+    data.coverage = C;
+    data.error = 0;
+    data.totals = calloc(C->days, sizeof(int));
+    if (C->dayClosed == NULL || C->signatures == NULL || data.totals == NULL)
+        data.error = 1;
+    else
+        list_accumulate(CTX->REGISTERlist, &partialTotals_helper, (void*)&data);
+
+    if (data.error || calcAnswerFromTotals(A, Q, data.totals, C->days) != 0)
+    {
+        free(data.totals);
+        freeQueryCoverage(C);
+        return -1;
+    }
+    free(data.totals);
+    return 0;
+}
+
+int calcPartialAnswer(struct answer** A,
+            struct query_coverage* C,
+            const struct query* Q)
+{
+    int ans;
+
+    if (A == NULL || C == NULL || !CTX->started || checkQuery(Q) != 0)
+        return -1;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+    ans = calcPartialAnswer_locked(A, C, Q);
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+
+    return ans;
+}
+
+void freeQueryCoverage(struct query_coverage* C)
+{
+    if (C == NULL)
+        return;
+    free(C->dayClosed);
+    free(C->signatures);
+    memset(C, 0, sizeof(*C));
+}
+
+/** Calcola una risposta provvisoria alla query e
+ * la fornisce, con la sua copertura, alla funzione
+ * update; va invocata tenendo REGISTERguard, che è
+ * rilasciato durante la chiamata a update.
+ */
+static void progressiveUpdate(const struct query* Q,
+            void (*update)(const struct answer*, const struct query_coverage*))
+{
+    struct answer* A;
+    struct query_coverage C;
+
+    if (calcPartialAnswer_locked(&A, &C, Q) != 0)
+        return;
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+    update(A, &C);
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+    freeAnswer(A);
+    freeQueryCoverage(&C);
+}
+
+/** Attende, tenendo REGISTERguard, che terminino
+ * le istanze del protocollo FLOODING avviate per
+ * la query, aggiornando la risposta provvisoria
+ * ogni volta che un giorno si completa.
+ *
+ * Restituisce 0 se sono terminate tutte e -1 in
+ * caso di timeout.
+ */
+static int waitFloodingProgress(const struct query* Q,
+            void (*update)(const struct answer*, const struct query_coverage*))
+{
+    struct timespec deadline;
+    size_t seen = 0;
+    int rc;
+
+    if (clock_gettime(CLOCK_REALTIME, &deadline) != 0)
+        fatal("clock_gettime");
+    deadline.tv_sec += FLOODING_TIMEOUT;
+
+    while (1)
+    {
+        if (CTX->FLOODprogress.completed != seen)
+        {
+            seen = CTX->FLOODprogress.completed;
+            progressiveUpdate(Q, update);
+            continue;
+        }
+        if (CTX->FLOODprogress.completed >= CTX->FLOODprogress.days)
+            break;
+        rc = pthread_cond_timedwait(&CTX->FLOODcond, &CTX->REGISTERguard, &deadline);
+        if (rc == ETIMEDOUT)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "FLOODING: timeout!");
+            return -1;
+        }
+        if (rc != 0)
+            fatal("pthread_cond_timedwait");
+    }
+
+    /* attende che il thread TCP rilasci le istanze */
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+    rc = TCPendFlooding();
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+
+    return rc;
+}
+
+
+/** Implementazione di calcEntryQuery e di
+ * calcEntryQueryProgressive: se update non è NULL
+ * gli fornisce le risposte provvisorie.
+ */
+static struct answer* calcEntryQuery_impl(const struct query* query,
+            void (*update)(const struct answer*, const struct query_coverage*))
 {
     struct list* l = NULL;
+    struct list* toFlood;
     struct answer* ans;
     int reqResult; /* come è andata la richiesta hai vicini? */
 
     /* sistema avviato? */
-    if (!started)
+    if (!CTX->started)
         return NULL;
 
     if (checkQuery(query) != 0)
         return NULL;
 
+    /* una query alla volta */
+    if (pthread_mutex_lock(&CTX->QUERYguard) != 0)
+        errExit("*** calcEntryQuery:pthread_mutex_lock ***\n");
+
     /* INIZIO SEZIONE CRITICA */
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
         errExit("*** calcEntryQuery:pthread_mutex_lock ***\n");
 
     ans = (struct answer*)findCachedAnswer(query); /* cerca la soluzione nella cache */
     if (ans != NULL) /* trovata! */
     {
         unified_io_push(UNIFIED_IO_NORMAL, "CACHE HIT!");
+        ++CTX->ANSWERstats.cached;
+    }
+    else if ((ans = DAYcache_compose(query)) != NULL) /* ricavabile dai totali giornalieri */
+    {
+        unified_io_push(UNIFIED_IO_NORMAL, "CACHE HIT! (composed from daily totals)");
+        ++CTX->ANSWERstats.composed;
+        if (ANSWERcache_insert(query, ans, &ans) == -1)
+            errExit("*** calcEntryQuery:ANSWERcache_insert ***\n");
     }
     else /* il risultato va calcolato */
     {
         unified_io_push(UNIFIED_IO_NORMAL, "CACHE MISS!");
 
+        /* intanto fornisce quanto già si sa */
+        if (update != NULL)
+            progressiveUpdate(query, update);
+
         /* contatta i vicini per vedere se hanno già il risultato */
         unified_io_push(UNIFIED_IO_NORMAL, "Sending query to neighbours...");
 
         /* per evitare deadlock */
-        if (pthread_mutex_unlock(&REGISTERguard) != 0)
+        if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
             fatal("pthread_mutex_unlock");
         /* se non si rilasciasse il mutex finirebbe per bloccarsi con l'altro thread */
         reqResult = TCPreqData(query);
-        if (pthread_mutex_lock(&REGISTERguard) != 0)
+        if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
             fatal("pthread_mutex_lock");
 
-        if (reqResult == 0)
+        /* la risposta ricevuta potrebbe essere già stata eliminata dalla cache */
+        if (reqResult == 0 && (ans = (struct answer*)findCachedAnswer(query)) != NULL)
         {
             /* i vicini hanno risposto */
             unified_io_push(UNIFIED_IO_NORMAL, "Answer received from neighbours!");
-            ans = (struct answer*)findCachedAnswer(query);
-            if (ans == NULL)
-                fatal("Inconsistent state - findCachedAnswer");
+            ++CTX->ANSWERstats.fromNeighbours;
             /* a questo punto ha preso la risposta da un vicino */
         }
         else
         {
             unified_io_push(UNIFIED_IO_NORMAL, "CALCULATING QUERY!");
 
-            l = list_select(REGISTERlist, &calcEntryQuery_helper, (void*)query);
+            l = list_select(CTX->REGISTERlist, &calcEntryQuery_helper, (void*)query);
             if (l == NULL)
             {
-                if (pthread_mutex_unlock(&REGISTERguard) != 0)
+                if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0
+                    || pthread_mutex_unlock(&CTX->QUERYguard) != 0)
                     errExit("*** calcEntryQuery:pthread_mutex_lock ***\n");
                 return NULL;
             }
@@ -709,28 +2491,49 @@ struct answer* calcEntryQuery(const struct query* query)
             printf("Stampa dei registri scelti:\n");
             list_foreach(l, &register_print_helper);
             #endif
-            if (pthread_mutex_unlock(&REGISTERguard) != 0)
+            /* i giorni ricevuti via push e confermati
+             * non richiedono il FLOODING */
+            toFlood = list_select(l, &needsFlooding, NULL);
+            if (toFlood == NULL)
+                fatal("list_select");
+            /* azzera l'avanzamento prima che i giorni
+             * inizino a completarsi */
+            memset(&CTX->FLOODprogress, 0, sizeof(CTX->FLOODprogress));
+            CTX->FLOODprogress.days = (size_t)list_size(toFlood);
+            CTX->FLOODprogress.active = 1;
+            CTX->FLOODquery = *query;
+            if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
                 fatal("pthread_mutex_unlock");
             unified_io_push(UNIFIED_IO_NORMAL, "Starting FLOODING protocol...");
             /* serve sbloccare il mutex */
-            list_foreach(l, &startFlooding);
+            list_foreach(toFlood, &startFlooding);
+            list_destroy(toFlood);
             unified_io_push(UNIFIED_IO_NORMAL, "Wait for FLOODING termination...");
-            (void)TCPendFlooding();
-            if (pthread_mutex_lock(&REGISTERguard) != 0)
+            if (update == NULL)
+                (void)TCPendFlooding();
+            if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
                 fatal("pthread_mutex_lock");
+            if (update != NULL)
+                (void)waitFloodingProgress(query, update);
+            CTX->FLOODprogress.active = 0;
+            unified_io_push(UNIFIED_IO_NORMAL, "FLOODING: [%ld/%ld] days completed",
+                (long)CTX->FLOODprogress.completed, (long)CTX->FLOODprogress.days);
 
-            if (calcAnswer(&ans, query, l) != 0)
-                errExit("*** calcEntryQuery:calcAnswer ***\n");
+            /* i giorni non ricalcolati sono presi da DAYcache */
+            if (calcAnswerWithDAYcache(&ans, query, l) != 0)
+                errExit("*** calcEntryQuery:calcAnswerWithDAYcache ***\n");
 
             /** Salva il dato nella cache.
              */
-            if (addAnswerToCache(query, ans) == -1)
-                errExit("*** calcEntryQuery:addAnswerToCache ***\n");
+            if (ANSWERcache_insert(query, ans, &ans) == -1)
+                errExit("*** calcEntryQuery:ANSWERcache_insert ***\n");
+            ++CTX->ANSWERstats.flooded;
         }
     }
 
     /* FINE SEZIONE CRITICA */
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0
+        || pthread_mutex_unlock(&CTX->QUERYguard) != 0)
         errExit("*** calcEntryQuery:pthread_mutex_lock ***\n");
 
     /* libera la memoria richiesta - non ha effetti collaterali
@@ -742,6 +2545,17 @@ struct answer* calcEntryQuery(const struct query* query)
     return ans;
 }
 
+struct answer* calcEntryQuery(const struct query* query)
+{
+    return calcEntryQuery_impl(query, NULL);
+}
+
+struct answer* calcEntryQueryProgressive(const struct query* query,
+            void (*update)(const struct answer*, const struct query_coverage*))
+{
+    return calcEntryQuery_impl(query, update);
+}
+
 int closeRegister(const struct tm* date)
 {
     struct e_register* R;
@@ -751,7 +2565,7 @@ int closeRegister(const struct tm* date)
         return -1;
 
     /* sezione critica! */
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
         fatal("pthread_mutex_lock");
 
     ans = 0;
@@ -763,12 +2577,76 @@ int closeRegister(const struct tm* date)
     else if (register_close(R) != 0)
             fatal("register_close");
 
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+
+    return ans;
+}
+
+int floodingCompleted(const struct tm* date)
+{
+    struct e_register* R;
+    enum entry_type type;
+    char dateStr[16];
+    int total, ans;
+
+    if (date == NULL)
+        return -1;
+
+    /* sezione critica! */
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+
+    ans = 0;
+    R = findRegisterByDate(date);
+    if (R == NULL)
+    {
+        ans = -1;
+    }
+    else
+    {
+        if (register_is_closed(R) == 0 && register_close(R) != 0)
+            fatal("register_close");
+        /* il registro non cambierà più: lo aggrega subito
+         * così calcEntryQuery non dovrà farlo alla fine */
+        for (type = 0; type != ENTRY_CATEGORIES; ++type)
+            if ((total = register_calc_type(R, type)) == -1
+                || DAYcache_set(type, date, total) != 0)
+                ans = -1;
+        if (ans == 0 && CTX->FLOODprogress.active
+            && time_date_cmp(date, &CTX->FLOODquery.begin) >= 0
+            && time_date_cmp(date, &CTX->FLOODquery.end) <= 0)
+        {
+            ++CTX->FLOODprogress.completed;
+            CTX->FLOODprogress.partial += register_calc_type(R, CTX->FLOODquery.category);
+            if (time_serialize_date(dateStr, date) == NULL)
+                fatal("time_serialize_date");
+            unified_io_push(UNIFIED_IO_NORMAL, "FLOODING: %s completed [%ld/%ld], partial total [%ld]",
+                dateStr, (long)CTX->FLOODprogress.completed, (long)CTX->FLOODprogress.days,
+                CTX->FLOODprogress.partial);
+            if (pthread_cond_broadcast(&CTX->FLOODcond) != 0)
+                fatal("pthread_cond_broadcast");
+        }
+    }
+
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
         fatal("pthread_mutex_unlock");
 
     return ans;
 }
 
+void getFloodingProgress(struct flooding_progress* progress)
+{
+    if (progress == NULL)
+        return;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+    *progress = CTX->FLOODprogress;
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+}
+
 int getNsRegisterData(const struct tm* date,
             struct ns_entry** buffer, size_t* bufLen,
             const struct set* skip)
@@ -780,7 +2658,7 @@ int getNsRegisterData(const struct tm* date,
         return -1;
 
     /* sezione critica! */
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
         fatal("pthread_mutex_lock");
 
     ans = 0;
@@ -792,7 +2670,7 @@ int getNsRegisterData(const struct tm* date,
     else if (register_as_ns_array(R, buffer, bufLen, skip, NULL) == -1)
             fatal("register_as_ns_array");
 
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
         fatal("pthread_mutex_unlock");
 
     return ans;
@@ -811,7 +2689,7 @@ int getRegisterSignatures(const struct tm* date,
         return -1;
 
     /* sezione critica! */
-    if (pthread_mutex_lock(&REGISTERguard) != 0)
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
         fatal("pthread_mutex_lock");
 
     ans = 0;
@@ -821,7 +2699,7 @@ int getRegisterSignatures(const struct tm* date,
         ans = -1;
     }
 
-    if (pthread_mutex_unlock(&REGISTERguard) != 0)
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
         fatal("pthread_mutex_unlock");
 
     /* passaggio dei dati se tutto è andato bene */
@@ -845,3 +2723,281 @@ int getRegisterSignatures(const struct tm* date,
 
     return ans;
 }
+
+int getOwnNsRegisterData(const struct tm* date,
+            struct ns_entry** buffer, size_t* bufLen)
+{
+    const struct e_register* R;
+    struct set* skip;
+    int* array;
+    size_t i, len;
+    int ans;
+
+    if (date == NULL || buffer == NULL || bufLen == NULL)
+        return -1;
+
+    skip = set_init(NULL);
+    if (skip == NULL)
+        return -1;
+
+    /* sezione critica! */
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+
+    ans = 0;
+    R = findRegisterByDate(date);
+    if (R == NULL || register_owned_signatures(R, &array, &len) == -1)
+    {
+        ans = -1;
+    }
+    else
+    {
+        /* si escludono tutte le firme altrui */
+        for (i = 0; i != len; ++i)
+            if (array[i] != CTX->peerIDentifier && set_add(skip, array[i]) != 0)
+                fatal("set_add");
+        free(array);
+        if (register_as_ns_array(R, buffer, bufLen, skip, NULL) == -1)
+            fatal("register_as_ns_array");
+    }
+
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+
+    set_destroy(skip);
+
+    return ans;
+}
+
+/** Dati per la preparazione di un blocco del
+ * bootstrap con list_accumulate: i registri
+ * chiusi con data non successiva a cursor
+ * sono serializzati in data finché questo
+ * non supera maxBytes; il primo escluso va
+ * in next.
+ */
+struct bootstrapChunk
+{
+    const struct tm* cursor;
+    size_t maxBytes;
+    char* data;
+    size_t size, capacity;
+    uint32_t days;
+    int full;
+    int error;
+    struct tm next;
+};
+
+static void bootstrapChunk_helper(void* el, void* base)
+{
+    const struct e_register* R = (const struct e_register*)el;
+    struct bootstrapChunk* b = (struct bootstrapChunk*)base;
+    struct bootstrap_day day;
+    /* problema dell'allineamento */
+    struct ns_tm ns_date;
+    struct ns_entry* entries;
+    size_t len, need;
+    char* tmp;
+
+    if (b->full || b->error || register_is_closed(R) != 1
+        || time_date_cmp(register_date(R), b->cursor) > 0)
+        return;
+
+    /* il blocco è pieno: si riparte da qui */
+    if (b->days != 0 && b->size >= b->maxBytes)
+    {
+        b->full = 1;
+        b->next = *register_date(R);
+        return;
+    }
+
+    if (register_as_ns_array(R, &entries, &len, NULL, NULL) != 0
+        || time_init_ns_tm(&ns_date, register_date(R)) != 0)
+    {
+        b->error = 1;
+        return;
+    }
+    day.date = ns_date;
+    day.length = htonl((uint32_t)len);
+
+    need = b->size + sizeof(day) + len*sizeof(struct ns_entry);
+    if (need > b->capacity)
+    {
+        tmp = realloc(b->data, 2*need);
+        if (tmp == NULL)
+        {
+            free(entries);
+            b->error = 1;
+            return;
+        }
+        b->data = tmp;
+        b->capacity = 2*need;
+    }
+    memcpy(b->data+b->size, &day, sizeof(day));
+    if (len != 0)
+        memcpy(b->data+b->size+sizeof(day), entries, len*sizeof(struct ns_entry));
+    b->size = need;
+    ++b->days;
+    free(entries);
+}
+
+static int register_is_closed_helper(void* el, void* base)
+{
+    (void)base;
+    return register_is_closed((const struct e_register*)el) == 1;
+}
+
+int needsBootstrap(void)
+{
+    int ans;
+
+    if (!CTX->started)
+        return 0;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+    /* nessun giorno chiuso: ogni query richiederebbe il FLOODING */
+    ans = list_find(CTX->REGISTERlist, NULL, &register_is_closed_helper, NULL) != 0;
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+
+    return ans;
+}
+
+int getBootstrapChunk(struct tm* cursor, size_t maxBytes,
+            void** data, size_t* size, uint32_t* days)
+{
+    struct bootstrapChunk b;
+
+    if (!CTX->started || cursor == NULL || data == NULL || size == NULL || days == NULL)
+        return -1;
+
+    memset(&b, 0, sizeof(b));
+    b.cursor = cursor;
+    b.maxBytes = maxBytes;
+
+    if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_lock");
+    /* la lista va dal giorno più recente al più vecchio */
+    list_accumulate(CTX->REGISTERlist, &bootstrapChunk_helper, (void*)&b);
+    if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+        fatal("pthread_mutex_unlock");
+
+    if (b.error)
+    {
+        free(b.data);
+        return -1;
+    }
+
+    *data = (void*)b.data;
+    *size = b.size;
+    *days = b.days;
+    if (!b.full)
+        return 0;
+
+    *cursor = b.next;
+    return 1;
+}
+
+/** Dati per il caricamento di un blocco del
+ * bootstrap con list_accumulate: i registri
+ * ricevuti sono ordinati come REGISTERlist,
+ * dal più recente, perciò basta scorrerle
+ * insieme una volta sola.
+ */
+struct bootstrapLoad
+{
+    struct e_register** regs;
+    uint32_t days, next;
+    size_t loaded;
+};
+
+static void bootstrapLoad_helper(void* el, void* base)
+{
+    struct e_register* myReg = (struct e_register*)el;
+    struct bootstrapLoad* b = (struct bootstrapLoad*)base;
+    int cmp = 1;
+
+    /* salta i giorni che il peer non gestisce */
+    while (b->next != b->days
+        && (cmp = time_date_cmp(register_date(b->regs[b->next]), register_date(myReg))) > 0)
+        ++b->next;
+    if (b->next == b->days || cmp != 0)
+        return;
+
+    /* il registro di oggi resta aperto */
+    if (time_date_cmp(register_date(myReg), &CTX->HEADdate) < 0)
+    {
+        if (register_merge(myReg, b->regs[b->next]) == -1)
+            fatal("register_merge");
+        MERKLEupdate(myReg);
+        /* il vicino lo aveva completo: niente FLOODING */
+        if (register_close(myReg) != 0)
+            fatal("register_close");
+        b->loaded += (size_t)register_size(b->regs[b->next]);
+    }
+    ++b->next;
+}
+
+int loadBootstrapChunk(const void* data, size_t size, uint32_t days, size_t* entries)
+{
+    const char* p = (const char*)data;
+    struct bootstrap_day day;
+    struct ns_tm ns_date;
+    struct bootstrapLoad b;
+    struct tm date;
+    size_t len;
+    uint32_t i;
+    int ans;
+
+    if ((size != 0 && data == NULL) || entries == NULL)
+        return -1;
+
+    memset(&b, 0, sizeof(b));
+    b.regs = calloc(days ? days : 1, sizeof(struct e_register*));
+    if (b.regs == NULL)
+        return -1;
+
+    /* prima ricostruisce tutti i registri del blocco */
+    ans = 0;
+    for (i = 0; i != days && ans == 0; ++i)
+    {
+        /* controlla che il giorno stia nel blocco */
+        if (size < sizeof(day))
+        {
+            ans = -1;
+            break;
+        }
+        memcpy(&day, p, sizeof(day));
+        len = (size_t)ntohl(day.length);
+        ns_date = day.date;
+        if (len > (size-sizeof(day))/sizeof(struct ns_entry)
+            || time_read_ns_tm(&date, &ns_date) != 0
+            || (b.regs[i] = register_from_ns_array(&date,
+                (const struct ns_entry*)(p+sizeof(day)), len)) == NULL)
+        {
+            ans = -1;
+            break;
+        }
+        b.days = i+1;
+
+        p += sizeof(day) + len*sizeof(struct ns_entry);
+        size -= sizeof(day) + len*sizeof(struct ns_entry);
+    }
+
+    if (ans == 0)
+    {
+        if (pthread_mutex_lock(&CTX->REGISTERguard) != 0)
+            fatal("pthread_mutex_lock");
+        list_accumulate(CTX->REGISTERlist, &bootstrapLoad_helper, (void*)&b);
+        if (pthread_mutex_unlock(&CTX->REGISTERguard) != 0)
+            fatal("pthread_mutex_unlock");
+        *entries = b.loaded;
+    }
+
+    for (i = 0; i != b.days; ++i)
+        register_destroy(b.regs[i]);
+    free(b.regs);
+
+    return ans;
+}
@@ -20,6 +20,120 @@
  */
 #define INFERIOR_YEAR 2020
 
+/** Limite predefinito, in byte, alla memoria
+ * occupata dalla cache delle risposte alle
+ * query. Può essere ridefinito al momento
+ * della compilazione oppure modificato a
+ * runtime mediante setAnswerCacheBudget.
+ */
+#ifndef ANSWER_CACHE_BUDGET
+#define ANSWER_CACHE_BUDGET (1<<20)
+#endif
+
+/** Il file delle risposte salvate è riscritto,
+ * eliminando quelle non più in cache, quando
+ * supera di questo fattore la dimensione della
+ * cache (almeno metà del budget).
+ */
+#ifndef ANSWER_FILE_GROWTH
+#define ANSWER_FILE_GROWTH 4
+#endif
+
+/** Se non nullo attiva di default la replica
+ * proattiva (push) dei registri: alle 18:00 il
+ * peer invia ai vicini le entry da lui firmate
+ * nel giorno appena concluso. Può essere
+ * modificato a runtime con setPushReplication.
+ */
+#ifndef PUSH_REPLICATION
+#define PUSH_REPLICATION 0
+#endif
+
+/** Secondi che devono trascorrere dal cambio
+ * di registro prima che la conferma di un vicino
+ * permetta di usare, senza ricorrere al FLOODING,
+ * il registro del giorno appena concluso
+ * ricevuto via push.
+ */
+#ifndef PUSH_SETTLE_TIME
+#define PUSH_SETTLE_TIME 60
+#endif
+
+/** Numero di giorni, a partire dal primo gennaio
+ * di INFERIOR_YEAR, coperti dal Merkle tree sui
+ * registri. Deve essere una potenza di 2.
+ *
+ * I nodi sono numerati come in un heap: la radice
+ * è il nodo 1, i figli del nodo n sono 2n e 2n+1 e
+ * i nodi da MERKLE_DAYS a 2*MERKLE_DAYS-1 sono le
+ * foglie, una per giorno.
+ */
+#define MERKLE_DAYS (1<<13)
+
+/** Descrive una vista materializzata: una query
+ * sugli ultimi giorni conclusi che viene
+ * ricalcolata a ogni cambio di registro
+ * (alle 18:00) e inserita nella cache delle
+ * risposte prima che qualcuno la richieda.
+ *
+ * Per AGGREGATION_SUM days indica il numero
+ * di giorni sommati, per AGGREGATION_DIFF
+ * il numero di variazioni giornaliere.
+ */
+struct materialized_view
+{
+    enum aggregation_type aggregation;
+    enum entry_type category;
+    int days;
+};
+
+/** Contatori e stato della cache delle
+ * risposte alle query.
+ */
+struct answer_cache_stats
+{
+    unsigned long hits, misses, evictions;
+    /* come il peer ha risposto alle proprie query:
+     * dalla cache, componendo i totali giornalieri,
+     * con la risposta di un vicino o calcolandola
+     * dopo il protocollo FLOODING */
+    unsigned long cached, composed, fromNeighbours, flooded;
+    /* memoria occupata e suo limite (byte) */
+    size_t bytes, budget;
+    /* numero di risposte salvate */
+    size_t entries;
+    /* risposte inserite o rimosse dall'avvio */
+    unsigned long changes;
+};
+
+/** Avanzamento delle istanze del protocollo
+ * FLOODING avviate dall'ultima query calcolata.
+ */
+struct flooding_progress
+{
+    /* non nullo finché la query le attende */
+    int active;
+    /* giorni richiesti e già completati */
+    size_t days, completed;
+    /* somma dei totali, per la categoria della
+     * query, dei giorni già completati */
+    long partial;
+};
+
+/** Copertura di una risposta provvisoria (vedi
+ * calcPartialAnswer): per ogni giorno della query,
+ * con la posizione 0 corrispondente alla data più
+ * recente come in struct answer, indica se il
+ * registro è chiuso e quante entry sono note.
+ */
+struct query_coverage
+{
+    size_t days;    /* giorni dell'intervallo */
+    size_t closed;  /* quanti sono chiusi */
+    unsigned char* dayClosed;
+    size_t* signatures;
+};
+
 /** Fornisce la data del più vecchio
  * registro posseduto dal peer corrente.
  *
@@ -64,6 +178,19 @@ int closeEntriesSubsystem(void);
  * dal sottosistema quello corrispondente al
  * registro fornito e vi carica le entry presenti
  * nell'argomento.
+ *
+ * Se il registro era già chiuso e la fusione
+ * vi ha aggiunto delle entry, i totali di quel
+ * giorno e le risposte in cache (e salvate su
+ * file) che lo comprendono sono eliminati.
+ * Lo stesso vale per le sole risposte se il
+ * registro, ricevuto via push e confermato da
+ * un vicino, è stato usato dalle query senza
+ * avviare il FLOODING.
+ *
+ * Restituisce 0 in caso di successo, 1 se ha
+ * modificato un registro chiuso e -1 in caso
+ * di errore.
  */
 int mergeRegisterContent(const struct e_register*);
 
@@ -82,6 +209,10 @@ int addEntryToCurrent(const struct entry*);
  * ATTENZIONE: non bisogna mai invocare free
  * o qualsiasi altra funzione con side effect
  * sul puntatore eventualmente restituito.
+ * La risposta restituita resta in uso, e non
+ * può quindi essere eliminata dalla cache,
+ * finché non viene invocata su di essa
+ * releaseCachedAnswer.
  *
  * Restituisce il puntatore all'oggetto
  * struct answer in caso di successo e
@@ -89,6 +220,16 @@ int addEntryToCurrent(const struct entry*);
  */
 const struct answer* findCachedAnswer(const struct query*);
 
+/** Segnala che la risposta ottenuta mediante
+ * findCachedAnswer o calcEntryQuery non è più
+ * in uso e può quindi essere eliminata dalla
+ * cache quando questa supera il suo limite.
+ *
+ * Dopo l'invocazione il puntatore non va più
+ * utilizzato.
+ */
+void releaseCachedAnswer(const struct answer*);
+
 /** Aggiunge il risultato di una query alla
  * cache per poterlo recuperare più avanti
  * mediante findCachedAnswer.
@@ -103,15 +244,112 @@ const struct answer* findCachedAnswer(const struct query*);
  */
 int addAnswerToCache(const struct query*, const struct answer*);
 
+/** Imposta il limite, in byte, alla memoria
+ * occupata dalla cache delle risposte ed
+ * elimina quelle in eccesso.
+ */
+void setAnswerCacheBudget(size_t);
+
+/** Fornisce una copia dei contatori della
+ * cache delle risposte.
+ */
+void getAnswerCacheStats(struct answer_cache_stats*);
+
+/** Chiave a 32 bit con cui le risposte della
+ * cache sono inserite nel filtro di Bloom
+ * prodotto da getAnswerCacheDigest; hash è il
+ * valore di hashQuery della query.
+ */
+#define ANSWER_DIGEST_KEY(hash) ((uint32_t)((uint64_t)(hash) ^ ((uint64_t)(hash) >> 32)))
+
+/** Aggiunge al filtro di Bloom fornito (vedi
+ * bloom.h) le chiavi ANSWER_DIGEST_KEY di tutte
+ * le risposte presenti nella cache.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int getAnswerCacheDigest(uint32_t* words, size_t nWords, uint32_t seed);
+
+/** Sostituisce l'elenco delle viste materializzate
+ * con quello fornito, che viene copiato.
+ * Con 0 viste la funzionalità è disattivata.
+ *
+ * Di default sono mantenuti i totali degli
+ * ultimi 7 e 30 giorni e le variazioni degli
+ * ultimi 60 giorni per entrambe le categorie.
+ * Le viste sono aggiornate da un thread
+ * dedicato, così che le query al network non
+ * ritardino la gestione dei registri.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore, anche se una vista ha
+ * aggregazione, categoria o giorni non validi.
+ */
+int setMaterializedViews(const struct materialized_view*, size_t);
+
+/** Attiva (valore non nullo) o disattiva la
+ * replica proattiva dei registri.
+ *
+ * Se al cambio di registro il push è attivo e
+ * il peer è connesso al network le query che
+ * coinvolgono il giorno concluso non avviano il
+ * FLOODING non appena la sincronizzazione con
+ * un vicino (vedi confirmMerkleNode) mostra che
+ * questo ha un registro uguale, almeno
+ * PUSH_SETTLE_TIME secondi dopo il push.
+ * Finché ciò non accade, o se la sincronizzazione
+ * è disattivata, resta il FLOODING.
+ * Il registro non è però chiuso, perché anche il
+ * vicino potrebbe non aver ricevuto tutti i push:
+ * le entry che arrivano dopo invalidano le
+ * risposte che lo comprendono.
+ * Va attivato su tutti i peer del network.
+ */
+void setPushReplication(int);
+
 /** Provvede a eseguire il calcolo di una
  * query su un dato intervallo.
  *
  * Restituisce un puntatore a un oggetto
  * rappresentante il risultato della query
  * oppure NULL in caso di errore.
+ * Come per findCachedAnswer, la risposta
+ * appartiene alla cache e va rilasciata con
+ * releaseCachedAnswer quando non serve più.
  */
 struct answer* calcEntryQuery(const struct query*);
 
+/** Come calcEntryQuery ma, se il risultato va
+ * calcolato, invoca subito update con la risposta
+ * provvisoria ottenuta dai soli registri posseduti
+ * e la sua copertura, e poi di nuovo ogni volta che
+ * un giorno viene completato dal protocollo FLOODING.
+ * Risposta e copertura valgono solo per la durata
+ * della chiamata a update.
+ *
+ * La risposta finale è quella di calcEntryQuery.
+ */
+struct answer* calcEntryQueryProgressive(const struct query*,
+            void (*update)(const struct answer*, const struct query_coverage*));
+
+/** Calcola subito, senza contattare i vicini, la
+ * migliore risposta possibile alla query con i
+ * registri posseduti, chiusi o meno, e ne descrive
+ * la copertura.
+ * La risposta non è salvata in cache e va liberata
+ * con freeAnswer, la copertura con freeQueryCoverage.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int calcPartialAnswer(struct answer**, struct query_coverage*, const struct query*);
+
+/** Libera la memoria usata da un oggetto di
+ * tipo struct query_coverage.
+ */
+void freeQueryCoverage(struct query_coverage*);
+
 /** Cerca tra i registri posseduti dal peer
  * quello con la data fornita e ne fornisce
  * una rappresentazione in formato network
@@ -131,6 +369,15 @@ int getNsRegisterData(const struct tm* date,
             struct ns_entry** buffer, size_t* bufLen,
             const struct set* skip);
 
+/** Come getNsRegisterData ma fornisce solo le
+ * entry firmate dal peer corrente.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int getOwnNsRegisterData(const struct tm* date,
+            struct ns_entry** buffer, size_t* bufLen);
+
 /** Chiude il registro associato alla data
  * fornita, se qualcosa di irreparabile
  * avviene abortisce.
@@ -140,6 +387,25 @@ int getNsRegisterData(const struct tm* date,
  */
 int closeRegister(const struct tm* date);
 
+/** Da invocare quando termina un'istanza del
+ * protocollo FLOODING avviata dal peer corrente:
+ * chiude il registro della data fornita e ne
+ * aggrega subito i totali giornalieri, senza
+ * attendere gli altri giorni della query, e
+ * aggiorna l'avanzamento (vedi
+ * getFloodingProgress).
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int floodingCompleted(const struct tm* date);
+
+/** Fornisce una copia dell'avanzamento delle
+ * istanze del protocollo FLOODING avviate
+ * dall'ultima query calcolata.
+ */
+void getFloodingProgress(struct flooding_progress*);
+
 /** Cerca il registro corrispondente alla data
  * fornita e restituisce un array di uint32_t
  * contenente tutte le firme possedute dal
@@ -155,4 +421,84 @@ int closeRegister(const struct tm* date);
 int getRegisterSignatures(const struct tm* date,
             uint32_t** buffer, size_t* bufLen);
 
+/** Fornisce l'hash del nodo indicato del Merkle
+ * tree costruito sui registri dei giorni conclusi
+ * (vedi MERKLE_DAYS): due peer con gli stessi
+ * registri hanno nodi uguali e i sottoalberi dei
+ * nodi diversi contengono i giorni che
+ * differiscono.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int getMerkleNode(uint32_t node, uint32_t* hash);
+
+/** Segnala che un vicino possiede un nodo del
+ * Merkle tree uguale a quello indicato: i giorni
+ * ricevuti via push coperti dal nodo sono quindi
+ * confermati e le query che li coinvolgono non
+ * avvieranno il FLOODING (vedi setPushReplication).
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int confirmMerkleNode(uint32_t node);
+
+/** Fornisce la data del giorno corrispondente
+ * alla foglia indicata del Merkle tree.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore (il nodo non è una foglia).
+ */
+int getMerkleLeafDate(uint32_t node, struct tm* date);
+
+/** Fornisce la foglia del Merkle tree che
+ * corrisponde al giorno indicato; è l'inversa
+ * di getMerkleLeafDate.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore (giorno non coperto).
+ */
+int getMerkleLeaf(const struct tm* date, uint32_t* node);
+
+/** Verifica se il peer non possiede alcun
+ * registro chiuso, caso in cui conviene
+ * ottenerli in blocco da un vicino con
+ * getBootstrapChunk/loadBootstrapChunk.
+ *
+ * Restituisce un valore non nullo in caso
+ * affermativo e 0 altrimenti.
+ */
+int needsBootstrap(void);
+
+/** Serializza in un buffer allocato
+ * dinamicamente, come una sequenza di oggetti
+ * struct bootstrap_day, i registri chiusi con
+ * data non successiva a *cursor, dal più
+ * recente, fermandosi appena il buffer supera
+ * maxBytes.
+ *
+ * Se restano altri registri aggiorna *cursor
+ * perché la chiamata successiva prosegua da
+ * dove si è fermata.
+ *
+ * Restituisce 1 se restano altri registri da
+ * inviare, 0 se il blocco è l'ultimo e -1 in
+ * caso di errore.
+ */
+int getBootstrapChunk(struct tm* cursor, size_t maxBytes,
+            void** data, size_t* size, uint32_t* days);
+
+/** Aggiunge ai registri del peer il contenuto
+ * di un blocco prodotto da getBootstrapChunk
+ * e li chiude, così che le query che li
+ * coinvolgono non avviino il FLOODING.
+ * Fornisce in entries il numero di entry
+ * caricate.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * se il blocco è malformato.
+ */
+int loadBootstrapChunk(const void* data, size_t size, uint32_t days, size_t* entries);
+
 #endif
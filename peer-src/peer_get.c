@@ -54,12 +54,45 @@ parsePeriod(const char* args,
     return 0;
 }
 
+/** Parola chiave che, in fondo al comando get,
+ * richiede le risposte provvisorie.
+ */
+#define GET_PROGRESSIVE "progressivo"
+
+/** Stampa una risposta provvisoria e la sua
+ * copertura, elencando i giorni non ancora
+ * chiusi con il numero di entry note.
+ */
+static void printProvisional(const struct answer* A, const struct query_coverage* C)
+{
+    const struct query* Q;
+    struct tm date;
+    char dateStr[16];
+    size_t i;
+
+    Q = answerQuery(A);
+    printf("Provisional result: [%ld/%ld] days closed\n",
+        (long)C->closed, (long)C->days);
+    if (printAnswer(A) != 0)
+        errExit("*** FAIL:printAnswer ***\n");
+    for (i = 0; i != C->days; ++i)
+    {
+        if (C->dayClosed[i])
+            continue;
+        date = time_date_sub(&Q->end, (int)i);
+        printf("\t%s: open, %ld entries known\n",
+            time_serialize_date(dateStr, &date), (long)C->signatures[i]);
+    }
+    fflush(stdout);
+}
+
 int get(const char* args)
 {
     char aggr[16] = "";
     char type[16] = "";
     char period[32] = "";
-    int ret;
+    char mode[16] = "";
+    int ret, progressive;
     enum aggregation_type aggregation;
     enum entry_type query_type;
     struct tm date_min, date_max;
@@ -76,12 +109,28 @@ int get(const char* args)
         return WRN_CONTINUE;
     }
 
-    ret = sscanf(args, "%15s %15s %31s", aggr, type, period);
+    ret = sscanf(args, "%15s %15s %31s %15s", aggr, type, period, mode);
     if (ret < 2)
     {
         printError("Parametri invalidi!\n");
         return ERR_PARAMS;
     }
+    /* la modalità progressiva può seguire il periodo o sostituirlo */
+    progressive = 0;
+    if (ret == 3 && strcasecmp(period, GET_PROGRESSIVE) == 0)
+    {
+        progressive = 1;
+        ret = 2;
+    }
+    else if (ret == 4)
+    {
+        if (strcasecmp(mode, GET_PROGRESSIVE) != 0)
+        {
+            printError("Parametri invalidi!\n");
+            return ERR_PARAMS;
+        }
+        progressive = 1;
+    }
     /* controllo sul parametro aggregazione */
     if (strcasecmp(aggr, "totale") == 0)
         aggregation = AGGREGATION_SUM;
@@ -138,7 +187,10 @@ int get(const char* args)
     printf("Calculating: %s\n", stringifyQuery(&query, strQuery, sizeof(strQuery)));
     /* cambia la modalità di funzionamento del sottosistema di IO */
     saved_mode = unified_io_set_mode(UNIFIED_IO_SYNC_MODE);
-    ans = calcEntryQuery(&query);
+    if (progressive)
+        ans = calcEntryQueryProgressive(&query, &printProvisional);
+    else
+        ans = calcEntryQuery(&query);
     /* la ripristina */
     unified_io_set_mode(saved_mode);
     if (ans == NULL)
@@ -149,6 +201,8 @@ int get(const char* args)
     printf("Result:\n");
     if (printAnswer(ans) != 0)
         errExit("*** FAIL:printAnswer ***\n");
+    /* la risposta può ora essere eliminata dalla cache */
+    releaseCachedAnswer(ans);
 
     return OK_CONTINUE;
 }
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE /* per pthread_setattr_default_np */
+#include "peer_instance.h"
+#include "peer_udp.h"
+#include "peer_tcp.h"
+#include "peer_entries_manager.h"
+#include "../main_loop.h"
+#include "../thread_semaphore.h"
+#include "../unified_io.h"
+#include "../commons.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+struct peer_instance
+{
+    /* stato del peer */
+    struct peer_context* ctx;
+    /* thread che fa le veci del thread
+     * principale del peer */
+    pthread_t host;
+    /* porta richiesta e poi effettivamente usata */
+    int port;
+    /* indirizzo del server */
+    const char* hostname;
+    const char* portname;
+    /* spento a 0 quando il peer termina */
+    volatile sig_atomic_t running;
+};
+
+/* alza il limite ai descrittori di file aperti */
+static void raiseFileLimit(int peers)
+{
+    struct rlimit rl;
+    rlim_t needed;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        errExit("*** getrlimit ***\n");
+
+    needed = (rlim_t)peers*INSTANCE_FILES_PER_PEER + 64;
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < needed)
+    {
+        rl.rlim_cur = rl.rlim_max = needed;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == 0)
+            return;
+        if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+            errExit("*** getrlimit ***\n");
+        printf("ATTENZIONE: al massimo %lu descrittori di file, potrebbero non bastare.\n",
+            (unsigned long)rl.rlim_max);
+    }
+
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+        errExit("*** setrlimit ***\n");
+}
+
+/* riduce lo stack predefinito dei nuovi thread */
+static void shrinkThreadStack(void)
+{
+    pthread_attr_t attr;
+
+    if (pthread_attr_init(&attr) != 0
+        || pthread_attr_setstacksize(&attr, INSTANCE_STACK_SIZE) != 0
+        || pthread_setattr_default_np(&attr) != 0)
+        errExit("*** pthread_setattr_default_np ***\n");
+
+    pthread_attr_destroy(&attr);
+}
+
+void peer_instance_reserve(int peers)
+{
+    raiseFileLimit(peers);
+    shrinkThreadStack();
+}
+
+/** Chiude tutti i sottosistemi avviati, nello
+ * stesso ordine usato dal peer.
+ */
+static void INSTANCEclose(void)
+{
+    if (UDPstop() == -1)
+        errExit("*** INSTANCE:UDPstop ***\n");
+    if (TCPclose() == -1)
+        errExit("*** INSTANCE:TCPclose ***\n");
+    if (closeEntriesSubsystem() == -1)
+        errExit("*** INSTANCE:closeEntriesSubsystem ***\n");
+}
+
+/** Funzione del thread che gestisce un'istanza:
+ * avvia i sottosistemi come farebbe il main del
+ * peer e poi attende il segnale di terminazione,
+ * inviato da peer_instance_stop o dal thread UDP
+ * quando il server si spegne.
+ */
+static void* INSTANCEhost(void* args)
+{
+    struct thread_semaphore* ts;
+    struct peer_instance* inst;
+    sigset_t toWait;
+    int sig;
+
+    ts = thread_semaphore_form_args(args);
+    if (ts == NULL)
+        errExit("*** INSTANCE ***\n");
+
+    inst = (struct peer_instance*)thread_semaphore_get_args(args);
+    if (inst == NULL)
+        errExit("*** INSTANCE ***\n");
+
+    /* firma da assegnare a tutti i messaggi del thread */
+    if (unified_io_set_thread_name("INSTANCE") != 0)
+        fatal("INSTANCE:unified_io_set_thread_name");
+
+    peer_context_set(inst->ctx);
+
+    /* il segnale sarà atteso con sigwait, la maschera
+     * è ereditata dai thread dei sottosistemi */
+    if (sigemptyset(&toWait) != 0
+        || sigaddset(&toWait, MAIN_LOOP_TERMINATION_SIGNAL) != 0
+        || pthread_sigmask(SIG_BLOCK, &toWait, NULL) != 0)
+    {
+        if (thread_semaphore_signal(ts, -1, NULL) == -1)
+            errExit("*** INSTANCE ***\n");
+        pthread_exit(NULL);
+    }
+
+    inst->port = UDPstart(inst->port);
+    if (inst->port == -1)
+    {
+        if (thread_semaphore_signal(ts, -1, NULL) == -1)
+            errExit("*** INSTANCE ***\n");
+        pthread_exit(NULL);
+    }
+
+    if (TCPinit(inst->port) != 0)
+    {
+        UDPstop();
+        if (thread_semaphore_signal(ts, -1, NULL) == -1)
+            errExit("*** INSTANCE ***\n");
+        pthread_exit(NULL);
+    }
+
+    if (startEntriesSubsystem(inst->port) != 0)
+    {
+        UDPstop();
+        TCPclose();
+        if (thread_semaphore_signal(ts, -1, NULL) == -1)
+            errExit("*** INSTANCE ***\n");
+        pthread_exit(NULL);
+    }
+
+    if (UDPconnect(inst->hostname, inst->portname) == -1)
+    {
+        INSTANCEclose();
+        if (thread_semaphore_signal(ts, -1, NULL) == -1)
+            errExit("*** INSTANCE ***\n");
+        pthread_exit(NULL);
+    }
+
+    inst->running = 1;
+    /* il peer è nel network, il padre può riprendere */
+    if (thread_semaphore_signal(ts, 0, NULL) == -1)
+        errExit("*** INSTANCE ***\n");
+
+    do {
+        if (sigwait(&toWait, &sig) != 0)
+            errExit("*** INSTANCE:sigwait ***\n");
+    } while (sig != MAIN_LOOP_TERMINATION_SIGNAL);
+
+    inst->running = 0;
+    INSTANCEclose();
+
+    return NULL;
+}
+
+struct peer_instance* peer_instance_start(int port, const char* hostname, const char* portname)
+{
+    struct peer_instance* inst;
+    struct thread_semaphore* ts;
+    struct thread_semaphore_args argv;
+    int status;
+
+    if (port < 0 || hostname == NULL || portname == NULL)
+        return NULL;
+
+    inst = malloc(sizeof(struct peer_instance));
+    if (inst == NULL)
+        return NULL;
+    memset(inst, 0, sizeof(struct peer_instance));
+
+    inst->ctx = peer_context_create();
+    if (inst->ctx == NULL)
+    {
+        free(inst);
+        return NULL;
+    }
+    inst->port = port;
+    inst->hostname = hostname;
+    inst->portname = portname;
+
+    /* come start_long_life_thread, ma il thread
+     * resta joinable anche se l'avvio fallisce */
+    ts = thread_semaphore_init();
+    if (ts == NULL)
+    {
+        peer_context_destroy(inst->ctx);
+        free(inst);
+        return NULL;
+    }
+    argv.ts = ts;
+    argv.args = inst;
+    if (pthread_create(&inst->host, NULL, &INSTANCEhost, (void*)&argv) != 0)
+    {
+        thread_semaphore_destroy(ts);
+        peer_context_destroy(inst->ctx);
+        free(inst);
+        return NULL;
+    }
+
+    /* ritorna solo a peer avviato o fallito */
+    if (thread_semaphore_wait(ts) != 0
+        || thread_semaphore_get_status(ts, &status, NULL) != 0)
+        errExit("*** INSTANCE:thread_semaphore_wait ***\n");
+
+    if (status != 0)
+    {
+        /* il thread termina subito dopo la segnalazione:
+         * lo si attende prima di eliminarne il contesto */
+        if (pthread_join(inst->host, NULL) != 0)
+            errExit("*** INSTANCE:pthread_join ***\n");
+        thread_semaphore_destroy(ts);
+        peer_context_destroy(inst->ctx);
+        free(inst);
+        return NULL;
+    }
+
+    if (thread_semaphore_destroy(ts) != 0)
+        errExit("*** INSTANCE:thread_semaphore_destroy ***\n");
+
+    /* il thread ospite ha finito di usarli */
+    inst->hostname = NULL;
+    inst->portname = NULL;
+
+    return inst;
+}
+
+int peer_instance_port(const struct peer_instance* inst)
+{
+    if (inst == NULL)
+        return -1;
+
+    return inst->port;
+}
+
+struct peer_context* peer_instance_context(const struct peer_instance* inst)
+{
+    if (inst == NULL)
+        return NULL;
+
+    return inst->ctx;
+}
+
+int peer_instance_running(const struct peer_instance* inst)
+{
+    if (inst == NULL)
+        return 0;
+
+    return inst->running;
+}
+
+int peer_instance_stop(struct peer_instance* inst)
+{
+    int err;
+
+    if (inst == NULL)
+        return -1;
+
+    /* il thread potrebbe aver già ricevuto il
+     * segnale dal thread UDP */
+    err = pthread_kill(inst->host, MAIN_LOOP_TERMINATION_SIGNAL);
+    if (err != 0 && err != ESRCH)
+        return -1;
+
+    if (pthread_join(inst->host, NULL) != 0)
+        return -1;
+
+    peer_context_destroy(inst->ctx);
+    free(inst);
+
+    return 0;
+}
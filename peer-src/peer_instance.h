@@ -0,0 +1,99 @@
+/** Funzioni per avviare e terminare più peer
+ * all'interno dello stesso processo.
+ *
+ * Ogni istanza ha il proprio contesto (vedi
+ * peer_context.h) e un thread che ne fa le
+ * veci del thread principale: avvia i
+ * sottosistemi, connette il peer al network
+ * e li chiude quando l'istanza viene fermata
+ * oppure il server ne richiede lo spegnimento.
+ */
+
+#ifndef PEER_INSTANCE
+#define PEER_INSTANCE
+
+#include "peer_context.h"
+
+/** Dimensione dello stack dei thread creati dopo
+ * peer_instance_reserve: quella predefinita (di
+ * solito 8MiB) renderebbe inutilmente pesanti
+ * migliaia di thread.
+ */
+#ifndef INSTANCE_STACK_SIZE
+#define INSTANCE_STACK_SIZE (512*1024)
+#endif
+
+/** Descrittori di file da riservare a ogni peer:
+ * socket UDP e TCP, pipe, timer, file delle
+ * risposte e due per ogni vicino, poiché
+ * entrambi gli estremi delle connessioni tra
+ * peer dello stesso processo sono aperti qui.
+ */
+#ifndef INSTANCE_FILES_PER_PEER
+#define INSTANCE_FILES_PER_PEER 32
+#endif
+
+/** Oggetto che rappresenta un peer
+ * avviato con peer_instance_start.
+ */
+struct peer_instance;
+
+/** Prepara il processo a ospitare il numero di
+ * peer indicato: alza il limite ai descrittori
+ * di file aperti, accontentandosi del massimo
+ * consentito se non si hanno i privilegi per
+ * superarlo, e riduce lo stack predefinito dei
+ * nuovi thread a INSTANCE_STACK_SIZE.
+ *
+ * Va invocata prima di avviare qualsiasi thread.
+ */
+void peer_instance_reserve(int);
+
+/** Avvia un nuovo peer sulla porta indicata
+ * (0 per lasciarla scegliere al sistema) e
+ * lo connette al server all'indirizzo e alla
+ * porta specificati.
+ * Ritorna solo quando il peer è entrato nel
+ * network oppure l'avvio è fallito.
+ *
+ * Il thread chiamante non deve avere bloccato
+ * MAIN_LOOP_TERMINATION_SIGNAL.
+ *
+ * Restituisce NULL in caso di errore.
+ */
+struct peer_instance* peer_instance_start(int port, const char* hostname, const char* portname);
+
+/** Fornisce la porta su cui ascolta il peer.
+ *
+ * Restituisce -1 in caso di errore.
+ */
+int peer_instance_port(const struct peer_instance*);
+
+/** Fornisce il contesto del peer, da
+ * associare con peer_context_set al thread
+ * che voglia eseguire operazioni per suo
+ * conto (ad esempio i comandi add e get).
+ *
+ * Restituisce NULL in caso di errore.
+ */
+struct peer_context* peer_instance_context(const struct peer_instance*);
+
+/** Verifica se il peer è ancora attivo, ovvero
+ * se il server non ne ha già richiesto lo
+ * spegnimento.
+ *
+ * Restituisce un valore non nullo in caso
+ * affermativo e 0 altrimenti.
+ */
+int peer_instance_running(const struct peer_instance*);
+
+/** Disconnette il peer dal network, ne chiude
+ * tutti i sottosistemi e libera le risorse
+ * dell'istanza.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int peer_instance_stop(struct peer_instance*);
+
+#endif
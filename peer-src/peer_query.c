@@ -232,6 +232,90 @@ int calcAnswer(
     return 0;
 }
 
+int calcAnswerFromTotals(
+            struct answer** A,
+            const struct query* Q,
+            const int* totals,
+            size_t n)
+{
+    struct answer* ans;
+    int* data;
+    size_t i;
+
+    if (A == NULL || Q == NULL || totals == NULL || checkQuery(Q) != 0)
+        return -1;
+
+    /* un totale per ogni giorno dell'intervallo */
+    if (n != (size_t)time_date_diff(&Q->end, &Q->begin)+1)
+        return -1;
+
+    ans = malloc(sizeof(struct answer));
+    if (ans == NULL)
+        return -1;
+
+    switch (Q->aggregation)
+    {
+    case AGGREGATION_SUM:
+        data = calloc(1, sizeof(int));
+        if (data == NULL)
+        {
+            free(ans);
+            return -1;
+        }
+        for (i = 0; i != n; ++i)
+            data[0] += totals[i];
+        ans->length = 1;
+        break;
+
+    case AGGREGATION_DIFF:
+        /* checkQuery garantisce n >= 2 */
+        data = calloc(n-1, sizeof(int));
+        if (data == NULL)
+        {
+            free(ans);
+            return -1;
+        }
+        for (i = 1; i != n; ++i)
+            data[i-1] = totals[i-1] - totals[i];
+        ans->length = n-1;
+        break;
+
+    default:
+        free(ans);
+        return -1;
+    }
+    ans->data = data;
+    ans->query = *Q;
+    *A = ans;
+
+    return 0;
+}
+
+int makeSumAnswer(struct answer** A, const struct query* Q, int total)
+{
+    struct answer* ans;
+
+    if (A == NULL || checkQuery(Q) != 0 || Q->aggregation != AGGREGATION_SUM)
+        return -1;
+
+    ans = malloc(sizeof(struct answer));
+    if (ans == NULL)
+        return -1;
+
+    ans->data = malloc(sizeof(int));
+    if (ans->data == NULL)
+    {
+        free(ans);
+        return -1;
+    }
+    ans->data[0] = total;
+    ans->length = 1;
+    ans->query = *Q;
+    *A = ans;
+
+    return 0;
+}
+
 void freeAnswer(struct answer* A)
 {
     if (A->length != 0)
@@ -239,6 +323,22 @@ void freeAnswer(struct answer* A)
     free(A);
 }
 
+const struct query* answerQuery(const struct answer* A)
+{
+    if (A == NULL)
+        return NULL;
+
+    return &A->query;
+}
+
+size_t answerSize(const struct answer* A)
+{
+    if (A == NULL)
+        return 0;
+
+    return sizeof(struct answer) + A->length*sizeof(int);
+}
+
 int initNsQuery(struct ns_query* nsQuery, const struct query* Q)
 {
     if (nsQuery == NULL || Q == NULL)
@@ -386,56 +486,73 @@ int readQuery(const struct query* query,
     return 0;
 }
 
-/** Per poter stare in un long anche
- * su macchine a 32 bit deve stare entro
- * 4 byte.
+/** Struttura della chiave fornita da hashQuery,
+ * dal bit meno significativo:
+ *  +4 bit: tipo dell'aggregazione
+ *  +4 bit: categoria delle entry
+ *  +27 bit: numero del giorno d'inizio
+ *  +27 bit: numero del giorno di fine
+ * I giorni sono contati a partire da
+ * QUERY_KEY_EPOCH_YEAR, così che la codifica
+ * sia iniettiva per ogni query valida e il
+ * risultato resti sempre positivo.
+ */
+#define QUERY_KEY_EPOCH_YEAR 1970
+#define QUERY_KEY_FIELD_BITS 4
+#define QUERY_KEY_DAY_BITS 27
+
+/** Fornisce il numero del giorno fornito
+ * a partire da QUERY_KEY_EPOCH_YEAR oppure
+ * -1 se non è rappresentabile nella chiave.
  */
-struct query_hash
+static int64_t queryKeyDay(const struct tm* date)
 {
-    int aggr_type : 1; /* totale o differenza? */
-    int aggr_categ : 1; /* tamponi o positivi */
-    /* 15 bit per data - anno 0 == 2000 */
-    /* inizio */
-    int start_day : 5; /* 1-31 giorno */
-    int start_mon : 4; /* 1-12 mese */
-    int start_year : 6; /* 0-63 anno */
-    /* fine */
-    int end_day : 5; /* 1-31 giorno */
-    int end_mon : 4; /* 1-12 mese */
-    int end_year : 6; /* 0-63 anno */
-};
+    struct tm epoch = time_date_init(QUERY_KEY_EPOCH_YEAR, 1, 1);
+    int64_t day;
+
+    if (time_date_cmp(date, &epoch) < 0)
+        return -1;
+
+    day = (int64_t)time_date_diff(date, &epoch);
+    if (day >= ((int64_t)1 << QUERY_KEY_DAY_BITS))
+        return -1;
+
+    return day;
+}
+
+/* la chiave occupa 62 bit */
+_Static_assert(2*QUERY_KEY_FIELD_BITS + 2*QUERY_KEY_DAY_BITS < 8*sizeof(int64_t),
+        "query key does not fit in int64_t");
 
-long int hashQuery(const struct query* query)
+int64_t hashQuery(const struct query* query)
 {
-    long int ans;
-    struct query_hash hash;
-    int year, month, day;
+    int64_t begin, end;
 
-    assert(sizeof(struct query_hash) == 4);
-    if (query == NULL)
+    if (query == NULL
+        || (unsigned)query->aggregation >= (1U << QUERY_KEY_FIELD_BITS)
+        || (unsigned)query->category >= (1U << QUERY_KEY_FIELD_BITS))
         return 0;
 
-    /* azzera tutto */
-    memset(&hash, 0, sizeof(struct query_hash));
-    /* campi a singolo bit */
-    hash.aggr_type = query->aggregation;
-    hash.aggr_categ = query->category;
-    /* data di inizio */
-    if (time_date_read(&query->begin, &year, &month, &day) == -1)
+    begin = queryKeyDay(&query->begin);
+    end = queryKeyDay(&query->end);
+    if (begin == -1 || end == -1)
         return 0;
-    hash.start_day = year - 2000;
-    hash.start_mon = month;
-    hash.start_day = day;
-    /* data di fine */
-    if (time_date_read(&query->end, &year, &month, &day) == -1)
+
+    return (int64_t)query->aggregation
+        | (int64_t)query->category << QUERY_KEY_FIELD_BITS
+        | begin << (2*QUERY_KEY_FIELD_BITS)
+        | end << (2*QUERY_KEY_FIELD_BITS + QUERY_KEY_DAY_BITS);
+}
+
+int sameQuery(const struct query* Q1, const struct query* Q2)
+{
+    if (Q1 == NULL || Q2 == NULL)
         return 0;
-    hash.end_day = year - 2000;
-    hash.end_mon = month;
-    hash.end_day = day;
 
-    ans = 0;
-    *(struct query_hash*)&ans = hash;
-    return ans;
+    return Q1->aggregation == Q2->aggregation
+        && Q1->category == Q2->category
+        && time_date_cmp(&Q1->begin, &Q2->begin) == 0
+        && time_date_cmp(&Q1->end, &Q2->end) == 0;
 }
 
 int printAnswer(const struct answer* A)
@@ -8,6 +8,7 @@
 #include "../register.h"
 #include "../list.h"
 #include "../time_utils.h"
+#include <stdint.h>
 
 /** Enumerazione che elenca tutti i tipi delle
  * aggregazioni il cui calcolo può essere
@@ -93,11 +94,50 @@ char* stringifyQuery(const struct query*, char*, size_t);
  */
 int calcAnswer(struct answer**, const struct query*, const struct list*);
 
+/** Come calcAnswer ma, invece di una lista di
+ * registri, utilizza direttamente l'array dei
+ * totali giornalieri della categoria richiesta
+ * dalla query.
+ *
+ * L'array deve avere tanti elementi quanti
+ * sono i giorni dell'intervallo della query
+ * e, coerentemente con struct answer, la
+ * posizione 0 corrisponde alla data più
+ * recente (la fine dell'intervallo).
+ *
+ * Restituisce 0 in caso di successo e -1 in
+ * caso di errore.
+ */
+int calcAnswerFromTotals(struct answer**, const struct query*, const int*, size_t);
+
+/** Genera la risposta a una query di tipo
+ * AGGREGATION_SUM il cui totale è già noto.
+ *
+ * Restituisce 0 in caso di successo e -1 in
+ * caso di errore.
+ */
+int makeSumAnswer(struct answer**, const struct query*, int);
+
 /** Libera correttamente lo spazio allocato da
  * un oggetto di tipo struct answer.
  */
 void freeAnswer(struct answer*);
 
+/** Fornisce la query a cui l'oggetto
+ * struct answer risponde.
+ *
+ * Restituisce NULL in caso di errore.
+ */
+const struct query* answerQuery(const struct answer*);
+
+/** Fornisce il numero di byte di memoria
+ * dinamica occupati da un oggetto di tipo
+ * struct answer, compresi i dati.
+ *
+ * Restituisce 0 in caso di errore.
+ */
+size_t answerSize(const struct answer*);
+
 /** Inizializza un oggetto di tipo struct ns_query
  * con il contenuto di un oggetto struct query.
  *
@@ -161,13 +201,23 @@ int readQuery(const struct query* query,
             struct tm* begin,
             struct tm* end);
 
-/** Calcola un hash di una query e lo restituisce.
- * Permette di identificare in maniera univoca
- * tutte le query le cui date
+/** Calcola la chiave a 64 bit di una query e
+ * la restituisce.
+ * La codifica (numeri dei giorni di inizio e
+ * fine più tipo e categoria) è priva di
+ * collisioni: query diverse hanno sempre
+ * chiavi diverse.
  *
  * Restituisce 0 in caso di errore.
  */
-long int hashQuery(const struct query* query);
+int64_t hashQuery(const struct query* query);
+
+/** Verifica se due query sono identiche.
+ *
+ * Restituisce un valore non nullo in caso
+ * affermativo e 0 altrimenti.
+ */
+int sameQuery(const struct query*, const struct query*);
 
 /** Stampa su stdout il contenuto di una
  * risposta a una query, ovvero il contenuto
@@ -1,7 +1,8 @@
-#define _POSIX_C_SOURCE 200112L /* per pselect */
+#define _POSIX_C_SOURCE 200112L
 #define _GNU_SOURCE
 
 #include "peer_tcp.h"
+#include "peer_context.h"
 #include "peer_entries_manager.h"
 #include "../socket_utils.h"
 #include "../thread_semaphore.h"
@@ -14,9 +15,12 @@
 #include "../commons.h"
 #include "../rb_tree.h"
 #include "../set.h"
+#include "../list.h"
+#include "../queue.h"
+#include "../bloom.h"
 #include <signal.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <unistd.h>
 #include <assert.h>
 #include <sys/uio.h>
@@ -36,9 +40,13 @@
 #define TERM_SUBSYS_SIGNAL SIGQUIT
 
 /** Parametro da usare per la listen
- * sul socket TCP
+ * sul socket TCP e numero massimo di
+ * connessioni contemporanee: tutti i
+ * vicini che il DS può assegnare più
+ * qualche slot per le connessioni in
+ * fase di apertura.
  */
-#define MAX_TCP_CONNECTION 20
+#define MAX_TCP_CONNECTION (MAX_NEIGHBOUR_NUMBER+8)
 
 /** Numero di secondi dopo i quali un socket con il
  * quale è stato iniziato il processo di apertura
@@ -49,43 +57,305 @@
 
 /** Numero di byte che vengono
  * scritti in nella pipe per
- * trasferire un comando
+ * svegliare il thread TCP
  */
 #define CMD_SIZE sizeof(uint8_t)
 
-/** Tempo massimo che si aspetta
- * prima di considerare fallita
- * una richiesta di tipo REQ_DATA
- * inviata ai propri vicini.
+/** Tempo concesso a ogni salto di una
+ * richiesta di tipo REQ_DATA: chi la
+ * inoltra con ttl salti residui aspetta
+ * ttl*QUERY_TIMEOUT secondi, chi la origina
+ * REQ_DATA_TTL*QUERY_TIMEOUT, così ognuno
+ * riceve le risposte negative di chi sta
+ * più a valle prima di arrendersi.
  */
 #define QUERY_TIMEOUT 5
 
-/** Massima attesa per aspettare che tutte le istanze
- * del protocollo FLOODING terminino.
- * È grande poiché il protocollo è particolarmente
- * complesso e potrebbe richiedere molto tempo per
- * venire completato. In un contesto reale potrebbe
- * non essere sufficiente nemmeno questo limite.
+/** Stato del sottosistema TCP di un peer,
+ * raggiunto tramite il contesto del thread
+ * chiamante (vedere peer_context.h).
  */
-#define FLOODING_TIMEOUT 60
+struct tcp_state
+{
+    /** Flag che permette di riconoscere se
+     * il thread TCP è già stato avviato.
+     */
+    int activated;
 
-/** Flag che permette di riconoscere se
- * il thread TCP è già stato avviato.
- */
-static int activated;
+    /** Thread id del thread TCP
+     */
+    pthread_t TCP_tid;
 
-/** Thread id del thread TCP
- */
-static pthread_t TCP_tid;
+    /** Descrittore di file
+     * del socket tcp
+     */
+    int tcpFd;
 
-/** Descrittore di file
- * del socket tcp
- */
-static int tcpFd;
+    /** ID del peer corrente nel network
+     */
+    uint32_t peerID;
 
-/** ID del peer corrente nel network
- */
-static uint32_t peerID;
+    /** Connessioni gestite dal thread TCP, servono
+     * a OUTwriter per risalire dal socket alla sua
+     * coda di uscita.
+     */
+    struct peer_tcp* OUTpeers;
+    size_t* OUTpeersNumber;
+
+    /** Coda dei comandi per il thread TCP (oggetti
+     * struct TCPcommand) e pipe, non bloccante in
+     * entrambi i versi, il cui solo scopo è
+     * svegliarlo: chi accoda un comando vi scrive
+     * un byte, e se la pipe è piena il thread ha
+     * già dei risvegli in sospeso. Così né i
+     * worker né il thread TCP stesso, che accoda
+     * comandi per sé, si bloccano o falliscono
+     * quando il thread TCP non svuota la pipe.
+     */
+    struct queue* CMDqueue;
+    int tcPipe[2];
+    /* alias di comodo per evitare di fare confusione */
+    int tcPipe_readEnd;
+    int tcPipe_writeEnd;
+
+    /** Flag che indica se il thread tcp
+     * era stato avviato con successo.
+     */
+    volatile int running;
+
+    /** Mutex e variabile di condizione da utilizzare per le operazioni
+     * di sincronizzazione tra thread nell'esecuzione del protocollo
+     * FLOODING */
+    pthread_mutex_t FLOODINGmutex;
+    pthread_cond_t FLOODINGcond;
+
+    /** Map<hash<struct FLOODINGdescriptor>, struct FLOODINGdescriptor>
+     * mappa che contiene tutte le istanze del protocollo richieste
+     * FLOODING al momento gestite dal peer corrente. */
+    struct rb_tree* FLOODINGinstances;
+    /** Contatore degli elementi dentro la mappa FLOODINGinstances
+     * che si riferiscono a richieste iniziate dal peer corrente */
+    size_t FLOODINGmyInstances; /* zero di default */
+    /** Contatore per assegnare un ID univoco a tutte le richieste
+     * generate dal peer corrente. - lo modfica solo il thread principale */
+    uint32_t FLOODINGcounter;
+    /** Se non nullo le nuove istanze iniziate dal peer
+     * riassumono le firme note con un filtro di Bloom.
+     */
+    volatile int FLOODbloom;
+
+    /** Sincronizzazione in background, vedere
+     * syncRound: banda per turno, byte già
+     * inviati nel turno corrente e istante
+     * del prossimo turno.
+     */
+    volatile size_t SYNCbandwidth;
+    size_t SYNCspent;
+    time_t SYNCnext;
+
+    /* valore di answer_cache_stats.changes
+     * all'ultimo invio di MESSAGES_CACHE_DIGEST */
+    unsigned long DIGESTchanges;
+
+    /* stato del bootstrap, vedere needsBootstrap */
+    int BOOTSTRAPneeded;
+    int BOOTSTRAPfd;
+    struct timeval BOOTSTRAPstart;
+    size_t BOOTSTRAPdays, BOOTSTRAPentries;
+
+    /** Raccolta di strutture dati per gestire
+     * l'esecuzione del protocollo REQ_DATA.
+     *
+     *Descrizione del protocollo:
+     * Thread coinvolti:
+     *  +thread principale  - master
+     *  +thread tcp         - slave
+     * Precondizioni (all'inizio e dopo ogni esecuzione):
+     *  +REQ_DATAsocket:    vuoto
+     *  +REQ_DATAflag:      0
+     *  +REQ_DATAquery:     Inaffidabile
+     *  +REQ_DATAfound:     Inaffidabile
+     * Terminologia:
+     *  +mutex      ->  REQ_DATAmutex
+     *  +cond       ->  REQ_DATAcond
+     * Funzionamento:
+     *  INIZIAZIONE:    (thread principale)
+     *      1) il thread principale esegue tutti i controlli del caso
+     *          ed abortisce il tutto in caso di errore
+     *      2) acquisisce il mutex
+     *      3) inizalizza così le strtutture globali:
+     *          +REQ_DATAflag:      1
+     *          +REQ_DATAquery:     query fornita
+     *          +REQ_DATAno_peer:   0
+     *      4) invia al thread tcp il comando con la query da gestire
+     *      5) si mette in attesa sulla variabile di condizione
+     *          con timeout REQ_DATA_TTL*QUERY_TIMEOUT
+     *
+     *  SVOLGIMENTO:    (thread tcp)
+     *      1) riceve il comando di esecuzione del protocollo
+     *      2) acquisisce il mutex
+     *      3) verifica le condizioni - altrimenti rilascia il mutex
+     *          e smette di eseguire il protocollo:
+     *          +REQ_DATAflag:      1
+     *          +REQ_DATAquery:     query ricevuta insieme al comando
+     *      4) per ogni socket di connessione tcp nello stato
+     *          PCS_READY:
+     *          +invia tramite esso un messaggio di tipo
+     *              MESSAGES_REQ_DATA
+     *          +verifica che l'invio sia andato a buon fine:
+     *              a) successo:
+     *                  +aggiunge il descrittore di file all'insieme
+     *                      REQ_DATAsocket
+     *              b) fallimento:
+     *                  +va alla prossima iterazione
+     *          -se non trova nessun socket:
+     *              a) segnala la variabile di condizione
+     *              b) imposta REQ_DATAno_peer a 1
+     *      5) rilascia il mutex e termina questa fase del protocollo
+     *
+     *  RICEZIONE: (MESSAGES_REQ_DATA)      (thread tcp | altro processo)
+     *      1) Riconosce il mesaggio
+     *      2) Cerca una risposta nella cache
+     *          a)trovata:      la restituisce la risposta
+     *          b)non trovata:  se il TTL lo consente inoltra la
+     *                          richiesta ai vicini non ancora
+     *                          raggiunti (vedi struct REQ_DATArelay),
+     *                          altrimenti fornisce una risposta vuota
+     *
+     *  RICEZIONE: (MESSAGES_REPLY_DATA)    (thread tcp)
+     *      1) verifica l'integrità del messaggio, altrimenti
+     *          abbandona questa fase del protocollo
+     *      2) aquisisce il mutex
+     *      3) verifica - altrimenti rilascia il mutex e termina
+     *          questa fase del protocollo - le seguenti condizioni:
+     *          +REQ_DATAflag:      1
+     *          +REQ_DATAsocket:    contiene il descrittore sorgente
+     *          +REQ_DATAquery:     coincida con quella trovata nel
+     *                                  messaggio.
+     *      4) Controlla che la risposta abbia un corpo:
+     *          a)sì:
+     *              +carica la risposta ottenuta nella cache
+     *              +imposta:
+     *                  -REQ_DATAflag:      0
+     *              +segnala la variabile di condizione
+     *          b)no:
+     *              +rimuove il descrittore del socket dall'insieme
+     *                  REQ_DATAsocket
+     *              +controlla che REQ_DATAsocket sia non vuoto
+     *                  -se vuoto: segnala la variabile di condizione
+     *                          e imposta REQ_DATAno_peer a 1
+     *      5) rilascia il mutex e termina questa fase del protocollo
+     *
+     *  CHIUSURA SOCKET:    (thread tcp)
+     *      1) controlla che lo stato del socket sia PCS_READY,
+     *          altrimenti termina
+     *      2) aquisisce il mutex
+     *      3) rimuove, se vi si trova, il descrittore di file
+     *          dall'insieme REQ_DATAsocket
+     *          -a questo punto se l'insieme REQ_DATAsocket risulta voto:
+     *              +segnala la variabile di condizione
+     *              +imposta REQ_DATAno_peer a 1
+     *      4) rilascia il mutex e termina questa fase del protocollo
+     *
+     *  CONCLUSIONE:    (thread principale)
+     *      1) acquisisce il mutex - era bloccato sulla variabile di
+     *          condizione
+     *      2) verifica i valori di REQ_DATAflag e REQ_DATAno_peer:
+     *          +1,0:
+     *              timeout: nessuna risposta è giunta dai vicini.
+     *          +1,1:
+     *              fallimento: nessun peer a cui chiedere la risposta
+     *          +0,?:
+     *              successo: un vicino ci ha fornito la risposta!
+     *      3) rilascia il mutex e termina il protocollo
+     */
+    pthread_mutex_t REQ_DATAmutex;
+    pthread_cond_t REQ_DATAcond;
+    /* insieme dei socket socket coinvolti:
+     *  quando si avvia il protocollo si contattano tutti
+     *  i vicini (se non ce ne sono termina subito) e si
+     *  invia loro */
+    struct set* REQ_DATAsocket;
+    /* se a 1 si sta aspettando */
+    volatile sig_atomic_t REQ_DATAflag;
+    /* se a 1 significa che  */
+    volatile sig_atomic_t REQ_DATAno_peer;
+    /* query richiesta */
+    struct query REQ_DATAquery;
+
+    /* richieste REQ_DATA inoltrate per conto dei vicini,
+     * list<struct REQ_DATArelay> */
+    struct list* REQ_DATArelays;
+
+    /** Variabili che permetto al thread di
+     * ottenere le informazioni sui suoi
+     * vicini */
+    struct peer_data neighbours[MAX_NEIGHBOUR_NUMBER]; /* dati sui vicini */
+    size_t neighboursNumber; /* numero di vicini. */
+
+    /** Istante entro cui, se non giunge prima un
+     * aggiornamento della topologia, il thread TCP
+     * interroga il server sui vicini; 0 se non c'è
+     * nessuna verifica in sospeso.
+     */
+    time_t CHECKdeadline;
+    /** Istante in cui è stato applicato l'ultimo
+     * aggiornamento della topologia annunciato
+     * dal server; 0 se non ne è giunto nessuno.
+     */
+    time_t TOPOLOGYlast;
+
+    /** Lavori affidati ai worker e non ancora
+     * conclusi e flag che, se non nullo, fa
+     * scartare i lavori conclusi.
+     *
+     * Protetti da WORKguard.
+     */
+    size_t WORKpending;
+    int WORKstopping;
+
+    /** Contatori del traffico inviato ai vicini,
+     * vedere TCPgetTrafficStats.
+     */
+    pthread_mutex_t TRAFFICguard;
+    struct tcp_traffic_stats TRAFFICstats;
+};
+
+/* stato TCP del peer del thread chiamante */
+#define CTX (peer_context_get()->tcp)
+
+struct tcp_state* TCPstate_create(void)
+{
+    struct tcp_state* state;
+
+    state = malloc(sizeof(struct tcp_state));
+    if (state == NULL)
+        return NULL;
+    memset(state, 0, sizeof(struct tcp_state));
+
+    if (pthread_mutex_init(&state->FLOODINGmutex, NULL) != 0
+        || pthread_cond_init(&state->FLOODINGcond, NULL) != 0
+        || pthread_mutex_init(&state->REQ_DATAmutex, NULL) != 0
+        || pthread_cond_init(&state->REQ_DATAcond, NULL) != 0
+        || pthread_mutex_init(&state->TRAFFICguard, NULL) != 0)
+        fatal("TCPstate_create");
+
+    state->FLOODbloom = FLOOD_BLOOM;
+    state->SYNCbandwidth = SYNC_BANDWIDTH;
+    state->BOOTSTRAPfd = -1;
+
+    return state;
+}
+
+void TCPstate_destroy(struct tcp_state* state)
+{
+    pthread_mutex_destroy(&state->FLOODINGmutex);
+    pthread_cond_destroy(&state->FLOODINGcond);
+    pthread_mutex_destroy(&state->REQ_DATAmutex);
+    pthread_cond_destroy(&state->REQ_DATAcond);
+    pthread_mutex_destroy(&state->TRAFFICguard);
+    free(state);
+}
 
 /** Enumerazione che elenca tutti i
  * possibili comandi riconosciuti dal
@@ -109,7 +379,7 @@ enum tcp_commands
      * e mettersi in attesa di una risposta.
      * Un messaggio di questo tipo è sempre
      * seguito a un oggetto di tipo query
-     * nella pipe che il thread dovrà
+     * nel comando, che il thread dovrà
      * prelevare e gestire.
      */
     TCP_COMMAND_QUERY,
@@ -153,6 +423,35 @@ enum tcp_commands
      * del protocollo fallita.
      */
     TCP_COMMAND_CLOSE_FLOODING,
+    /** Comanda al thread TCP di inviare ai vicini
+     * delle entry in modalità push (vedi
+     * TCPpushEntries). È seguito dal puntatore
+     * a un oggetto struct PUSHdata, allocato
+     * dinamicamente, che il thread TCP
+     * provvederà a liberare.
+     */
+    TCP_COMMAND_PUSH,
+    /** Comanda al thread TCP di inoltrare ai vicini
+     * una richiesta MESSAGES_REQ_DATA giunta da un
+     * altro peer o, se è già stata inoltrata, di
+     * rispondere che nessuno ha la risposta.
+     * È seguito dal puntatore al corrispondente
+     * oggetto struct REQ_DATArelay.
+     */
+    TCP_COMMAND_RELAY_QUERY,
+    /** Il server ha comunicato spontaneamente
+     * nuovi vicini (UDPneighbours), il thread
+     * deve adeguare le connessioni senza
+     * doverlo interrogare.
+     */
+    TCP_COMMAND_TOPOLOGY,
+    /** Un worker ha terminato un lavoro che gli
+     * era stato affidato dal thread TCP, il quale
+     * deve completarne gli effetti sulla rete.
+     * È seguito dal puntatore al corrispondente
+     * oggetto struct WORKtask.
+     */
+    TCP_COMMAND_WORK_DONE,
     /** Comanda al thread TCP di avviare
      * la procedura di terminazione
      */
@@ -199,6 +498,27 @@ const char* statusAsString(enum peer_conn_status status)
     }
 }
 
+/** Classi di priorità della coda di uscita di
+ * ciascuna connessione: i messaggi di controllo
+ * passano davanti ai trasferimenti di massa.
+ */
+enum out_priority
+{
+    OUT_CONTROL,    /* richieste, risposte brevi, HELLO... */
+    OUT_BULK,       /* MESSAGES_REQ_ENTRIES, MESSAGES_BOOTSTRAP_CHUNK */
+    OUT_PRIORITIES  /* numero di classi */
+};
+
+/** Messaggio completo in attesa di essere
+ * scritto sul socket di un vicino.
+ */
+struct out_msg
+{
+    struct out_msg* next;
+    size_t len;
+    char data[0];
+};
+
 /** Struttura dati atta a contenere
  * le informazioni e il socket
  * per raggiungere un peer
@@ -222,6 +542,25 @@ struct peer_tcp
          * MESSAGES_FLOOD_FOR_ENTRIES e si aspetta una
          * risposta MESSAGES_REQ_ENTRIES */
     struct set* FLOODINGsend;
+    /* ultimo MESSAGES_CACHE_DIGEST ricevuto dal vicino:
+     * cacheDigestLevels filtri di cacheDigestWords parole,
+     * NULL se non se ne è ancora ricevuto alcuno */
+    uint32_t* cacheDigest;
+    uint32_t cacheDigestLevels, cacheDigestWords;
+    /* coda di uscita, una lista FIFO per priorità:
+     * outCurrent è il messaggio di cui sono già stati
+     * scritti outSent byte e va completato per primo */
+    struct out_msg* outHead[OUT_PRIORITIES];
+    struct out_msg* outTail[OUT_PRIORITIES];
+    size_t outBytes[OUT_PRIORITIES];
+    struct out_msg* outCurrent;
+    size_t outSent;
+    /* invio a passo dei registri chiusi in risposta
+     * a un MESSAGES_BOOTSTRAP_REQ: giorno da cui
+     * riprendere e byte già inviati */
+    int bootstrapSending;
+    struct tm bootstrapCursor;
+    size_t bootstrapSent;
 };
 
 /* Funzione ausiliaria per ottenere un set a partire da un
@@ -245,18 +584,126 @@ struct set* make_set_from_uint32_t(uint32_t* array, size_t arrLen)
     return ans;
 }
 
-/** Pipe per passare in modo semplice dei
- * comandi al thread TCP
+/** Seme dei filtri di Bloom dei messaggi
+ * MESSAGES_CACHE_DIGEST.
+ */
+#define CACHE_DIGEST_SEED ((uint32_t)0x5bd1e995)
+
+/** Verifica, in base all'ultimo MESSAGES_CACHE_DIGEST
+ * ricevuto dal vicino, se la risposta alla query con
+ * la chiave (hashQuery) fornita possa essere nella
+ * cache di un peer entro ttl-1 salti dal vicino, il
+ * vicino stesso compreso.
+ *
+ * Restituisce 0 solo se è certo che non ci sia.
+ */
+static int mayHoldAnswer(const struct peer_tcp* peer, int64_t key, uint32_t ttl)
+{
+    uint32_t i;
+
+    /* senza informazioni non si può escludere nulla */
+    if (peer->cacheDigest == NULL || peer->cacheDigestLevels < ttl)
+        return 1;
+    for (i = 0; i != ttl; ++i)
+        if (bloom_has(peer->cacheDigest + (size_t)i*peer->cacheDigestWords,
+                peer->cacheDigestWords, CACHE_DIGEST_SEED, ANSWER_DIGEST_KEY(key)) != 0)
+            return 1;
+    return 0;
+}
+
+
+/** Byte in attesa nella coda di uscita di
+ * una connessione.
+ */
+static size_t OUTpending(const struct peer_tcp* conn)
+{
+    size_t ans;
+    int p;
+
+    ans = conn->outCurrent != NULL ? conn->outCurrent->len - conn->outSent : 0;
+    for (p = 0; p != OUT_PRIORITIES; ++p)
+        ans += conn->outBytes[p];
+    return ans;
+}
+
+/** Scrive sul socket quanto possibile della coda
+ * di uscita senza mai bloccarsi: prima termina il
+ * messaggio in corso, poi passa ai successivi
+ * scegliendo sempre la classe più prioritaria.
+ *
+ * Restituisce 0 se non ci sono stati problemi
+ * (anche se restano dati da inviare) e -1 in caso
+ * di errore sul socket; non chiude la connessione.
  */
-static int tcPipe[2];
-/* alias di comodo per evitare di fare confusione */
-static int tcPipe_readEnd;
-static int tcPipe_writeEnd;
+static int OUTflush(struct peer_tcp* conn)
+{
+    struct out_msg* msg;
+    ssize_t sent;
+    int p;
+
+    while (1)
+    {
+        if (conn->outCurrent == NULL)
+        {
+            for (p = 0; p != OUT_PRIORITIES && conn->outHead[p] == NULL; ++p)
+                ;
+            if (p == OUT_PRIORITIES)
+                return 0; /* coda vuota */
+            msg = conn->outHead[p];
+            conn->outHead[p] = msg->next;
+            if (conn->outHead[p] == NULL)
+                conn->outTail[p] = NULL;
+            conn->outBytes[p] -= msg->len;
+            conn->outCurrent = msg;
+            conn->outSent = 0;
+        }
+        msg = conn->outCurrent;
+        sent = send(conn->sockfd, msg->data + conn->outSent,
+            msg->len - conn->outSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0; /* si riprenderà quando sarà scrivibile */
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        conn->outSent += (size_t)sent;
+        if (conn->outSent == msg->len)
+        {
+            conn->outCurrent = NULL;
+            free(msg);
+        }
+    }
+}
 
-/** Flag che indica se il thread tcp
- * era stato avviato con successo.
+/** Svuota la coda di uscita di una connessione
+ * che sta per essere chiusa, tentando un'ultima
+ * scrittura non bloccante di quanto in attesa.
  */
-static volatile int running;
+static void OUTclear(struct peer_tcp* conn)
+{
+    struct out_msg* msg;
+    int p;
+
+    if (OUTpending(conn) != 0 && OUTflush(conn) == 0 && OUTpending(conn) != 0)
+        unified_io_push(UNIFIED_IO_ERROR, "Dropping [%ld] queued bytes for socket (%d)",
+            (long)OUTpending(conn), conn->sockfd);
+    free(conn->outCurrent);
+    conn->outCurrent = NULL;
+    for (p = 0; p != OUT_PRIORITIES; ++p)
+    {
+        while ((msg = conn->outHead[p]) != NULL)
+        {
+            conn->outHead[p] = msg->next;
+            free(msg);
+        }
+        conn->outTail[p] = NULL;
+        conn->outBytes[p] = 0;
+    }
+    conn->bootstrapSending = 0;
+}
+
 
 /** Raccolta di strutture dati e funzioni utilizzate
  * durante l'esecuzione del protocollo detto FLOODING.
@@ -326,6 +773,18 @@ struct FLOODINGdescriptor
     /* array di firme da ignorare */
     size_t numSignatures;
     uint32_t* signatures;
+    /* flag che indica che signatures contiene le parole
+     * di un filtro di Bloom (MESSAGES_FLOOD_BLOOM) */
+    int bloom;
+    /* istanze del peer con filtro: probabilità stimata
+     * di falso positivo del filtro inviato ed entry
+     * ricevute, per decidere se serve bloomFollowUp */
+    double bloomFP;
+    size_t received;
+    /* risposte ricevute la cui fusione con i registri è
+     * stata affidata ai worker e non è ancora conclusa:
+     * finché non è nullo l'istanza non può terminare */
+    size_t pendingWork;
 };
 /* "costruttore" di un oggetto di tipo struct FLOODINGdescriptor */
 static struct FLOODINGdescriptor*
@@ -443,22 +902,11 @@ static long int FLOODINGdescriptorHash(const struct FLOODINGdescriptor* fd)
 {
     return FLOODINGHash(fd->authorID, fd->reqID);
 }
-/** Mutex e variabile di condizione da utilizzare per le operazioni
- * di sincronizzazione tra thread nell'esecuzione del protocollo
- * FLOODING */
-static pthread_mutex_t FLOODINGmutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t FLOODINGcond = PTHREAD_COND_INITIALIZER;
-
-/** Map<hash<struct FLOODINGdescriptor>, struct FLOODINGdescriptor>
- * mappa che contiene tutte le istanze del protocollo richieste
- * FLOODING al momento gestite dal peer corrente. */
-static struct rb_tree* FLOODINGinstances;
-/** Contatore degli elementi dentro la mappa FLOODINGinstances
- * che si riferiscono a richieste iniziate dal peer corrente */
-static size_t FLOODINGmyInstances; /* zero di default */
-/** Contatore per assegnare un ID univoco a tutte le richieste
- * generate dal peer corrente. - lo modfica solo il thread principale */
-static uint32_t FLOODINGcounter;
+
+void TCPsetFloodBloom(int enable)
+{
+    CTX->FLOODbloom = (enable != 0);
+}
 
 /** Trova un descrittore nella mappa FLOODINGinstances
  * dato il suo hash */
@@ -468,13 +916,13 @@ FLOODINGdescriptor_findByHash(long int hash)
     struct FLOODINGdescriptor* ans;
 
     /* SEZIONE CRITICA */
-    if (pthread_mutex_lock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_lock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_lock");
     /* aggiunge il nuovo descrittore all'insieme */
-    if (rb_tree_get(FLOODINGinstances, hash, (void**)&ans) == -1)
+    if (rb_tree_get(CTX->FLOODINGinstances, hash, (void**)&ans) == -1)
         ans = NULL;
     /* termine sezione critica */
-    if (pthread_mutex_unlock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_unlock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_unlock");
 
     return ans;
@@ -501,23 +949,24 @@ FLOODINGdescriptor_newMine(const struct tm* date)
         fatal("FLOODINGdescriptor_create");
 
     newDes->mine = 1;                  /* io sono l'autore */
-    newDes->authorID = peerID;         /* usa il mio ID */
-    newDes->reqID = ++FLOODINGcounter; /* ID progressivo della richiesta */
+    newDes->authorID = CTX->peerID;         /* usa il mio ID */
+    newDes->reqID = ++CTX->FLOODINGcounter; /* ID progressivo della richiesta */
     newDes->date = *date;              /* assegna la data da gestore */
     newDes->mainSockFd = -1;           /* per evitare spiacevoli incidenti */
+    newDes->bloom = CTX->FLOODbloom;        /* modalità scelta all'avvio */
 
     hash = FLOODINGdescriptorHash(newDes); /* hash della richiesta */
 
     /* SEZIONE CRITICA */
-    if (pthread_mutex_lock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_lock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_lock");
     /* aggiunge il nuovo descrittore all'insieme */
-    if (rb_tree_set(FLOODINGinstances, hash, newDes) == -1)
+    if (rb_tree_set(CTX->FLOODINGinstances, hash, newDes) == -1)
         fatal("rb_tree_set");
     /* il chiamante ha iniziato una nuova esecuzione */
-    ++FLOODINGmyInstances;
+    ++CTX->FLOODINGmyInstances;
     /* termine sezione critica */
-    if (pthread_mutex_unlock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_unlock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_unlock");
 
     return hash;
@@ -536,7 +985,8 @@ FLOODINGdescriptor_newOther(
             const struct tm* date,
             /* fime già note - SHALLOW COPY */
             size_t numSignatures,
-            uint32_t* signatures
+            uint32_t* signatures,
+            int bloom /* signatures è un filtro di Bloom */
             )
 {
     struct FLOODINGdescriptor* newDes;
@@ -554,17 +1004,18 @@ FLOODINGdescriptor_newOther(
     newDes->mainSockFd = originalFd;
     newDes->numSignatures = numSignatures;
     newDes->signatures = signatures;
+    newDes->bloom = bloom;
 
     hash = FLOODINGdescriptorHash(newDes); /* hash della richiesta */
 
     /* SEZIONE CRITICA */
-    if (pthread_mutex_lock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_lock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_lock");
     /* aggiunge il nuovo descrittore all'insieme */
-    if (rb_tree_set(FLOODINGinstances, hash, newDes) == -1)
+    if (rb_tree_set(CTX->FLOODINGinstances, hash, newDes) == -1)
         fatal("rb_tree_set");
     /* termine sezione critica */
-    if (pthread_mutex_unlock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_unlock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_unlock");
 
     return newDes;
@@ -583,34 +1034,120 @@ static void FLOODINGdescriptor_remove(struct FLOODINGdescriptor* des)
     if (des == NULL)
         fatal("FLOODINGdescriptor_remove");
 
+    /* il giorno è completo: il sottosistema ENTRIES
+     * chiude il registro e lo aggrega subito, senza
+     * aspettare le altre istanze ancora in corso */
+    if (des->mine && floodingCompleted(&des->date) != 0)
+        fatal("floodingCompleted");
+
     hash = FLOODINGdescriptorHash(des);
     /* SEZIONE CRITICA */
-    if (pthread_mutex_lock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_lock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_lock");
     if (des->mine) /* era stata iniziata dal peer corrente */
     {
-        /* si può considerare chiuso il registro associato */
-        if (closeRegister(&des->date) != 0)
-            fatal("closeRegister");
-        --FLOODINGmyInstances;
-        if (FLOODINGmyInstances == 0)
+        --CTX->FLOODINGmyInstances;
+        if (CTX->FLOODINGmyInstances == 0)
         {   /* FINITO! Tutte le richieste del peer sono soddisfatte */
-            if (pthread_cond_broadcast(&FLOODINGcond) != 0)
+            if (pthread_cond_broadcast(&CTX->FLOODINGcond) != 0)
                 fatal("pthread_cond_broadcast");
         }
     }
     /* rimuove il descrittore */
-    if (rb_tree_remove(FLOODINGinstances, hash, NULL) == -1)
+    if (rb_tree_remove(CTX->FLOODINGinstances, hash, NULL) == -1)
         fatal("rb_tree_remove");
-    if (pthread_mutex_unlock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_unlock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_unlock");
 }
 
+/** Fornisce l'insieme delle firme da non inviare in
+ * risposta alla richiesta descritta: quelle elencate
+ * dal richiedente oppure, se la richiesta contiene un
+ * filtro di Bloom, quelle possedute dal peer corrente
+ * che il filtro dichiara note (falsi positivi compresi).
+ */
+static struct set* FLOODINGdescriptor_skipSet(const struct FLOODINGdescriptor* des)
+{
+    struct set* ans;
+    uint32_t* own;
+    size_t i, ownLen;
+
+    if (!des->bloom)
+    {
+        ans = make_set_from_uint32_t(des->signatures, des->numSignatures);
+        if (ans == NULL)
+            fatal("make_set_from_uint32_t");
+        return ans;
+    }
+
+    ans = set_init(NULL);
+    if (ans == NULL)
+        fatal("set_init");
+    if (getRegisterSignatures(&des->date, &own, &ownLen) != 0)
+        return ans;
+    for (i = 0; i != ownLen; ++i)
+        if (bloom_has(des->signatures, des->numSignatures,
+                FLOOD_BLOOM_SEED(des->authorID, des->reqID), own[i]) == 1
+            && set_add(ans, (long)own[i]) != 0)
+            fatal("set_add");
+    free(own);
+
+    return ans;
+}
+
+/** Comando accodato per il thread TCP, seguito
+ * dal corpo previsto dal tipo di comando.
+ */
+struct TCPcommand
+{
+    uint8_t cmd;
+    size_t len;
+    char body[0];
+};
+
+/** Accoda un comando per il thread TCP e lo sveglia.
+ * Non si blocca mai: può essere usata da qualsiasi
+ * thread, compreso quello TCP. Abortisce in caso di
+ * errore.
+ */
+static void TCPcommand_send(uint8_t cmd, const void* body, size_t len)
+{
+    struct TCPcommand* command;
+    uint8_t wakeUp = 0;
+
+    command = malloc(sizeof(struct TCPcommand) + len);
+    if (command == NULL)
+        fatal("malloc");
+    command->cmd = cmd;
+    command->len = len;
+    if (len != 0)
+        memcpy(command->body, body, len);
+
+    if (queue_push(CTX->CMDqueue, (void*)command) < 0)
+        fatal("queue_push");
+    /* pipe piena: il thread TCP ha già dei risvegli da leggere */
+    if (write(CTX->tcPipe_writeEnd, &wakeUp, CMD_SIZE) != CMD_SIZE && errno != EAGAIN)
+        fatal("writing to command pipe");
+}
+
+/** Copia in body il corpo del comando, che deve
+ * essere lungo len byte.
+ *
+ * Restituisce 0 in caso di successo e -1 in caso
+ * di errore.
+ */
+static int TCPcommand_body(const struct TCPcommand* command, void* body, size_t len)
+{
+    if (command->len != len)
+        return -1;
+    memcpy(body, command->body, len);
+    return 0;
+}
+
 /* comanda al thread tcp di avviare l'esecuzione del protocollo
  * di flooding con un comando di tipo TCP_COMMAND_FLOODING */
 int TCPstartFlooding(const struct tm* date)
 {
-    struct iovec iov[2];
     uint8_t tmpCmd = TCP_COMMAND_FLOODING;
     long hash;
 
@@ -621,16 +1158,7 @@ int TCPstartFlooding(const struct tm* date)
     /* costruisce l'oggetto rappresentante la query */
     hash = FLOODINGdescriptor_newMine(date);
 
-    /* comando */
-    iov[0].iov_base = (void*)&tmpCmd;
-    iov[0].iov_len = CMD_SIZE;
-    /* oggetto rappresentate la data */
-    iov[1].iov_base = (void*)&hash;
-    iov[1].iov_len = sizeof(hash);
-
-    /* write nella pipe */
-    if (writev(tcPipe_writeEnd, iov, 2) != (ssize_t)(iov[0].iov_len+iov[1].iov_len))
-        fatal("writev");
+    TCPcommand_send(tmpCmd, &hash, sizeof(hash));
 
     return 0;
 }
@@ -638,40 +1166,245 @@ int TCPstartFlooding(const struct tm* date)
  * del protocollo di flooding TCP_COMMAND_PROPAGATE */
 static void cmdPropagateFLOODING(long int hash)
 {
-    struct iovec iov[2];
     uint8_t tmpCmd = TCP_COMMAND_PROPAGATE;
 
     unified_io_push(UNIFIED_IO_NORMAL, "PROPAGATION: [hash:%ld]", hash);
 
-    /* comando */
-    iov[0].iov_base = (void*)&tmpCmd;
-    iov[0].iov_len = CMD_SIZE;
-    /* oggetto rappresentate l'hash */
-    iov[1].iov_base = (void*)&hash;
-    iov[1].iov_len = sizeof(hash);
-
-    /* write nella pipe */
-    if (writev(tcPipe_writeEnd, iov, 2) != (ssize_t)(iov[0].iov_len+iov[1].iov_len))
-        fatal("writev");
+    TCPcommand_send(tmpCmd, &hash, sizeof(hash));
 }
 /* invia a se stesso TCP_COMMAND_SEND_FLOOD_RESPONSE - hash query da gestire */
 static void cmdResponseFLOODING(long int hash)
 {
-    struct iovec iov[2];
     uint8_t tmpCmd = TCP_COMMAND_SEND_FLOOD_RESPONSE;
 
     unified_io_push(UNIFIED_IO_NORMAL, "RESPONSE: [hash:%ld]", hash);
 
-    /* comando */
-    iov[0].iov_base = (void*)&tmpCmd;
-    iov[0].iov_len = CMD_SIZE;
-    /* oggetto rappresentate l'hash */
-    iov[1].iov_base = (void*)&hash;
-    iov[1].iov_len = sizeof(hash);
+    TCPcommand_send(tmpCmd, &hash, sizeof(hash));
+}
+
+/** Tipi dei lavori che il thread TCP affida ai worker.
+ */
+enum WORKtype
+{
+    /* fonde R con i registri posseduti */
+    WORK_MERGE,
+    /* prepara le entry della risposta all'istanza
+     * del protocollo FLOODING des */
+    WORK_FLOOD_RESPONSE
+};
+
+/** Lavoro affidato a un worker: il thread TCP lo
+ * crea, un worker lo svolge e lo restituisce con
+ * TCP_COMMAND_WORK_DONE perché il thread TCP ne
+ * completi gli effetti sulla rete.
+ */
+struct WORKtask
+{
+    enum WORKtype type;
+    /* peer che ha affidato il lavoro */
+    struct peer_context* ctx;
+    /* connessione a cui si riferisce, la coppia
+     * identifica lo slot anche se il socket viene
+     * chiuso e il suo numero riutilizzato */
+    int sockfd;
+    time_t creation_time;
+    /* WORK_MERGE */
+    struct e_register* R;
+    int sync;       /* risposta della sincronizzazione in background */
+    int counted;    /* conteggiata in pendingWork dell'istanza hash */
+    /* WORK_FLOOD_RESPONSE */
+    struct FLOODINGdescriptor* des;
+    struct ns_entry* entries;
+    size_t entryNum;
+    /* comuni */
+    long int hash;
+    int result;
+};
+
+/** Coda dei lavori in attesa di un worker, un
+ * elemento NULL chiede al worker di terminare.
+ *
+ * I worker sono condivisi da tutti i peer del
+ * processo: li avvia il primo thread TCP che
+ * parte e li ferma l'ultimo che termina
+ * (WORKusers conta i thread TCP attivi).
+ * WORKcond è segnalata ogni volta che un peer
+ * resta senza lavori in corso.
+ */
+static pthread_mutex_t WORKguard = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WORKcond = PTHREAD_COND_INITIALIZER;
+static struct queue* WORKqueue;
+static pthread_t WORKtid[TCP_WORKERS];
+static size_t WORKusers;
+
+/* crea un nuovo lavoro riferito alla connessione fornita */
+static struct WORKtask* WORKtask_create(enum WORKtype type, const struct peer_tcp* conn)
+{
+    struct WORKtask* task;
+
+    task = malloc(sizeof(struct WORKtask));
+    if (task == NULL)
+        fatal("malloc");
+    memset(task, 0, sizeof(struct WORKtask));
+    task->type = type;
+    task->ctx = peer_context_get();
+    task->sockfd = conn->sockfd;
+    task->creation_time = conn->creation_time;
+
+    return task;
+}
+
+static void WORKtask_destroy(struct WORKtask* task)
+{
+    if (task->R != NULL)
+        register_destroy(task->R);
+    free(task->entries);
+    free(task);
+}
+
+/* restituisce al thread TCP un lavoro concluso */
+static void cmdWorkDone(struct WORKtask* task)
+{
+    uint8_t tmpCmd = TCP_COMMAND_WORK_DONE;
+
+    TCPcommand_send(tmpCmd, &task, sizeof(task));
+}
+
+/** Codice dei worker: svolgono, nell'ordine di
+ * arrivo, i lavori pesanti per la CPU che il
+ * thread TCP non deve eseguire per non ritardare
+ * la gestione dei socket.
+ */
+static void* WORKER(void* args)
+{
+    struct thread_semaphore* ts;
+    struct WORKtask* task;
+    struct set* toSkip;
+    sigset_t toBlock;
+    int stopping;
+
+    ts = thread_semaphore_form_args(args);
+    if (ts == NULL)
+        errExit("*** WORKER ***\n");
+
+    if (unified_io_set_thread_name("WORKER") != 0)
+        fatal("WORKER:unified_io_set_thread_name");
+
+    /* i segnali sono gestiti dagli altri thread */
+    if (sigfillset(&toBlock) != 0
+        || pthread_sigmask(SIG_BLOCK, &toBlock, NULL) != 0)
+    {
+        if (thread_semaphore_signal(ts, -1, NULL) == -1)
+            errExit("*** WORKER ***\n");
+        return NULL;
+    }
+
+    if (thread_semaphore_signal(ts, 0, NULL) == -1)
+        errExit("*** WORKER ***\n");
+
+    while (queue_pop(WORKqueue, (void**)&task, 0) >= 0 && task != NULL)
+    {
+        /* il lavoro si svolge per conto del suo peer */
+        peer_context_set(task->ctx);
+        switch (task->type)
+        {
+        case WORK_MERGE:
+            task->result = mergeRegisterContent(task->R);
+            register_destroy(task->R);
+            task->R = NULL;
+            break;
+        case WORK_FLOOD_RESPONSE:
+            /* insieme delle firme da evitare */
+            toSkip = FLOODINGdescriptor_skipSet(task->des);
+            task->result = getNsRegisterData(&task->des->date,
+                &task->entries, &task->entryNum, toSkip);
+            set_destroy(toSkip);
+            break;
+        }
+        if (pthread_mutex_lock(&WORKguard) != 0)
+            fatal("pthread_mutex_lock");
+        stopping = CTX->WORKstopping;
+        if (pthread_mutex_unlock(&WORKguard) != 0)
+            fatal("pthread_mutex_unlock");
+        if (stopping)
+            WORKtask_destroy(task);
+        else
+            cmdWorkDone(task);
+
+        if (pthread_mutex_lock(&WORKguard) != 0)
+            fatal("pthread_mutex_lock");
+        if (--CTX->WORKpending == 0 && pthread_cond_broadcast(&WORKcond) != 0)
+            fatal("pthread_cond_broadcast");
+        if (pthread_mutex_unlock(&WORKguard) != 0)
+            fatal("pthread_mutex_unlock");
+    }
+    peer_context_set(NULL);
+
+    return NULL;
+}
+
+/* affida un lavoro ai worker */
+static void WORKsubmit(struct WORKtask* task)
+{
+    if (pthread_mutex_lock(&WORKguard) != 0)
+        fatal("pthread_mutex_lock");
+    ++CTX->WORKpending;
+    if (pthread_mutex_unlock(&WORKguard) != 0)
+        fatal("pthread_mutex_unlock");
+
+    if (queue_push(WORKqueue, (void*)task) < 0)
+        fatal("queue_push");
+}
+
+/* avvia i worker se non lo sono già - invocata dal thread TCP */
+static void WORKstart(void)
+{
+    size_t i;
+
+    if (pthread_mutex_lock(&WORKguard) != 0)
+        fatal("pthread_mutex_lock");
+    CTX->WORKstopping = 0;
+    if (WORKusers++ == 0)
+    {
+        WORKqueue = queue_init(NULL, Q_CONCURRENT);
+        if (WORKqueue == NULL)
+            fatal("queue_init");
+        for (i = 0; i != TCP_WORKERS; ++i)
+            if (start_long_life_thread(&WORKtid[i], &WORKER, NULL, NULL) == -1)
+                fatal("start_long_life_thread");
+    }
+    if (pthread_mutex_unlock(&WORKguard) != 0)
+        fatal("pthread_mutex_unlock");
+}
+
+/** Attende che i worker abbiano svolto i lavori in
+ * coda del peer corrente, scartandone i risultati,
+ * e li termina se nessun altro peer li usa.
+ */
+static void WORKstop(void)
+{
+    size_t i;
 
-    /* write nella pipe */
-    if (writev(tcPipe_writeEnd, iov, 2) != (ssize_t)(iov[0].iov_len+iov[1].iov_len))
-        fatal("writev");
+    if (pthread_mutex_lock(&WORKguard) != 0)
+        fatal("pthread_mutex_lock");
+    CTX->WORKstopping = 1;
+    while (CTX->WORKpending != 0)
+        if (pthread_cond_wait(&WORKcond, &WORKguard) != 0)
+            fatal("pthread_cond_wait");
+    if (--WORKusers == 0)
+    {
+        /* nessun lavoro in coda: i worker trovano subito NULL */
+        for (i = 0; i != TCP_WORKERS; ++i)
+            if (queue_push(WORKqueue, NULL) < 0)
+                fatal("queue_push");
+        for (i = 0; i != TCP_WORKERS; ++i)
+            if (pthread_join(WORKtid[i], NULL) != 0)
+                fatal("pthread_join");
+        queue_destroy(WORKqueue);
+        WORKqueue = NULL;
+    }
+    if (pthread_mutex_unlock(&WORKguard) != 0)
+        fatal("pthread_mutex_unlock");
 }
 
 /* sfrutta FLOODINGmyInstances */
@@ -686,7 +1419,7 @@ int TCPendFlooding(void)
     unified_io_push(UNIFIED_IO_NORMAL, "Wait until all my FLOODING instances are terminated");
 
     /* SEZIONE CRITICA */
-    if (pthread_mutex_lock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_lock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_lock");
 
     /* controlla che siano finite le esecuzioni */
@@ -694,8 +1427,8 @@ int TCPendFlooding(void)
     timeout.tv_sec = now.tv_sec + FLOODING_TIMEOUT;
     timeout.tv_nsec = now.tv_usec * 1000;
     retcode = 0;
-    while (FLOODINGmyInstances > 0 && retcode != ETIMEDOUT) {
-        retcode = pthread_cond_timedwait(&FLOODINGcond, &FLOODINGmutex, &timeout);
+    while (CTX->FLOODINGmyInstances > 0 && retcode != ETIMEDOUT) {
+        retcode = pthread_cond_timedwait(&CTX->FLOODINGcond, &CTX->FLOODINGmutex, &timeout);
     }
     if (retcode == ETIMEDOUT)
         ans = -1;
@@ -703,7 +1436,7 @@ int TCPendFlooding(void)
         fatal("pthread_cond_timedwait");
 
     /* termine sezione critica */
-    if (pthread_mutex_unlock(&FLOODINGmutex) != 0)
+    if (pthread_mutex_unlock(&CTX->FLOODINGmutex) != 0)
         fatal("pthread_mutex_unlock");
 
     if (ans == 0)
@@ -714,196 +1447,413 @@ int TCPendFlooding(void)
     return ans;
 }
 
-/** Raccolta di strutture dati per gestire
- * l'esecuzione del protocollo REQ_DATA.
- *
- *Descrizione del protocollo:
- * Thread coinvolti:
- *  +thread principale  - master
- *  +thread tcp         - slave
- * Precondizioni (all'inizio e dopo ogni esecuzione):
- *  +REQ_DATAsocket:    vuoto
- *  +REQ_DATAflag:      0
- *  +REQ_DATAquery:     Inaffidabile
- *  +REQ_DATAfound:     Inaffidabile
- * Terminologia:
- *  +mutex      ->  REQ_DATAmutex
- *  +cond       ->  REQ_DATAcond
- * Funzionamento:
- *  INIZIAZIONE:    (thread principale)
- *      1) il thread principale esegue tutti i controlli del caso
- *          ed abortisce il tutto in caso di errore
- *      2) acquisisce il mutex
- *      3) inizalizza così le strtutture globali:
- *          +REQ_DATAflag:      1
- *          +REQ_DATAquery:     query fornita
- *          +REQ_DATAno_peer:   0
- *      4) invia al thread tcp il comando con la query da gestire
- *      5) si mette in attesa sulla variabile di condizione
- *          con timeout QUERY_TIMEOUT
- *
- *  SVOLGIMENTO:    (thread tcp)
- *      1) riceve il comando di esecuzione del protocollo
- *      2) acquisisce il mutex
- *      3) verifica le condizioni - altrimenti rilascia il mutex
- *          e smette di eseguire il protocollo:
- *          +REQ_DATAflag:      1
- *          +REQ_DATAquery:     query ricevuta insieme al comando
- *      4) per ogni socket di connessione tcp nello stato
- *          PCS_READY:
- *          +invia tramite esso un messaggio di tipo
- *              MESSAGES_REQ_DATA
- *          +verifica che l'invio sia andato a buon fine:
- *              a) successo:
- *                  +aggiunge il descrittore di file all'insieme
- *                      REQ_DATAsocket
- *              b) fallimento:
- *                  +va alla prossima iterazione
- *          -se non trova nessun socket:
- *              a) segnala la variabile di condizione
- *              b) imposta REQ_DATAno_peer a 1
- *      5) rilascia il mutex e termina questa fase del protocollo
- *
- *  RICEZIONE: (MESSAGES_REQ_DATA)      (thread tcp | altro processo)
- *      1) Riconosce il mesaggio
- *      2) Cerca una risposta nella cache
- *          a)trovata:      la restituisce la risposta
- *          b)non trovata:  fornisce una risposta vuota
+/** Replica proattiva (push) delle entry.
  *
- *  RICEZIONE: (MESSAGES_REPLY_DATA)    (thread tcp)
- *      1) verifica l'integrità del messaggio, altrimenti
- *          abbandona questa fase del protocollo
- *      2) aquisisce il mutex
- *      3) verifica - altrimenti rilascia il mutex e termina
- *          questa fase del protocollo - le seguenti condizioni:
- *          +REQ_DATAflag:      1
- *          +REQ_DATAsocket:    contiene il descrittore sorgente
- *          +REQ_DATAquery:     coincida con quella trovata nel
- *                                  messaggio.
- *      4) Controlla che la risposta abbia un corpo:
- *          a)sì:
- *              +carica la risposta ottenuta nella cache
- *              +imposta:
- *                  -REQ_DATAflag:      0
- *              +segnala la variabile di condizione
- *          b)no:
- *              +rimuove il descrittore del socket dall'insieme
- *                  REQ_DATAsocket
- *              +controlla che REQ_DATAsocket sia non vuoto
- *                  -se vuoto: segnala la variabile di condizione
- *                          e imposta REQ_DATAno_peer a 1
- *      5) rilascia il mutex e termina questa fase del protocollo
+ * Un push viaggia in un messaggio di tipo
+ * MESSAGES_REQ_ENTRIES non richiesto, il cui
+ * authorID è quello del peer che lo ha
+ * originato e il cui reqID vale PUSH_REQ_ID,
+ * valore mai assegnato alle istanze del
+ * protocollo FLOODING.
  *
- *  CHIUSURA SOCKET:    (thread tcp)
- *      1) controlla che lo stato del socket sia PCS_READY,
- *          altrimenti termina
- *      2) aquisisce il mutex
- *      3) rimuove, se vi si trova, il descrittore di file
- *          dall'insieme REQ_DATAsocket
- *          -a questo punto se l'insieme REQ_DATAsocket risulta voto:
- *              +segnala la variabile di condizione
- *              +imposta REQ_DATAno_peer a 1
- *      4) rilascia il mutex e termina questa fase del protocollo
- *
- *  CONCLUSIONE:    (thread principale)
- *      1) acquisisce il mutex - era bloccato sulla variabile di
- *          condizione
- *      2) verifica i valori di REQ_DATAflag e REQ_DATAno_peer:
- *          +1,0:
- *              timeout: nessuna risposta è giunta dai vicini.
- *          +1,1:
- *              fallimento: nessun peer a cui chiedere la risposta
- *          +0,?:
- *              successo: un vicino ci ha fornito la risposta!
- *      3) rilascia il mutex e termina il protocollo
- */
-static pthread_mutex_t REQ_DATAmutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t REQ_DATAcond = PTHREAD_COND_INITIALIZER;
-/* insieme dei socket socket coinvolti:
- *  quando si avvia il protocollo si contattano tutti
- *  i vicini (se non ce ne sono termina subito) e si
- *  invia loro */
-static struct set* REQ_DATAsocket;
-/* se a 1 si sta aspettando */
-static volatile sig_atomic_t REQ_DATAflag;
-/* se a 1 significa che  */
-static volatile sig_atomic_t REQ_DATAno_peer;
-/* query richiesta */
-struct query REQ_DATAquery;
+ * Chi lo riceve inoltra agli altri vicini solo
+ * le entry le cui firme non conosceva: ogni
+ * firma attraversa così ciascun peer una sola
+ * volta e la propagazione termina da sé.
+ */
+#define PUSH_REQ_ID 0
 
-/** Funzione ausiliaria che controlla che la
- * query fornita sia al stessa che il thread
- * principale ha inviato.
- * Restituisce 0 in caso contrario, altrimenti
- * un valore non nullo in caso di corrispondenza.
+/** Dati di un push da inviare ai vicini,
+ * passati al thread TCP insieme al comando
+ * TCP_COMMAND_PUSH.
  */
-static int REQ_DATAisThisQuery(const struct query* query)
+struct PUSHdata
+{
+    uint32_t authorID;
+    struct tm date;
+    /* socket da cui è giunto il push, da
+     * saltare nell'inoltro - -1 se è stato
+     * originato dal peer corrente */
+    int sourceFd;
+    struct ns_entry* entries;
+    size_t length;
+};
+
+/* invia al thread TCP il comando TCP_COMMAND_PUSH - la
+ * memoria dell'oggetto passa al thread TCP */
+static void cmdPUSH(struct PUSHdata* push)
 {
-    return hashQuery(&REQ_DATAquery) == hashQuery(query);
+    uint8_t tmpCmd = TCP_COMMAND_PUSH;
+
+    TCPcommand_send(tmpCmd, &push, sizeof(push));
 }
 
-/** Versione sperimentale della
- * funzione, fallisce sempre.
- * Serve a verificare che i vicini
- * ricevano effettivamente il
- * messaggio con la query.
- */
-int TCPreqData(const struct query* query)
+int TCPpushEntries(const struct tm* date)
 {
-    struct iovec iov[2];
-    uint8_t tmpCmd = TCP_COMMAND_QUERY;
-    /* man pthread_cond_timedwait per capirne l'utilizzo */
-    struct timeval now;
-    struct timespec timeout;
-    int retcode;
-    /* per restituire il valore della funzione */
-    int ans = -1; /* di default si aspetta di fallire */
+    struct PUSHdata* push;
 
-    /* se non è attivo ha senso che si blocchi */
-    if (!running)
-        fatal("TCPreqData while TCP thread is not running!");
+    if (!CTX->running || date == NULL)
+        return -1;
 
-    if (query == NULL)
+    push = calloc(1, sizeof(struct PUSHdata));
+    if (push == NULL)
         return -1;
 
-    /* "header" del comando */
-    iov[0].iov_base = (void*)&tmpCmd;
-    iov[0].iov_len = CMD_SIZE;
-    /* "corpo" del comando */
-    iov[1].iov_base = (void*)query;
-    iov[1].iov_len = sizeof(*query);
+    /* solo le entry firmate dal peer corrente */
+    if (getOwnNsRegisterData(date, &push->entries, &push->length) != 0)
+    {
+        free(push);
+        return -1;
+    }
+    /* niente da inviare */
+    if (push->length == 0)
+    {
+        free(push->entries);
+        free(push);
+        return 0;
+    }
 
-    /* INIZIAZIONE protocollo REQ_DATA */
-    if (pthread_mutex_lock(&REQ_DATAmutex) != 0)
-        fatal("pthread_mutex_lock");
-    /* 3) variabili globali */
-    REQ_DATAflag = 1;
-    REQ_DATAquery = *query;
-    REQ_DATAno_peer = 0;
+    push->authorID = CTX->peerID;
+    push->date = *date;
+    push->sourceFd = -1;
+    cmdPUSH(push);
 
-    /* 4) scrive tutto nella pipe apposita */
-    if (writev(tcPipe_writeEnd, iov, 2) != (ssize_t)iov[0].iov_len + (ssize_t)iov[1].iov_len)
-        fatal("writing to command pipe");
+    return 0;
+}
+
+/** Sincronizzazione in background (anti-entropy).
+ *
+ * Ogni SYNC_PERIOD secondi il thread TCP invia ai
+ * vicini la radice del proprio Merkle tree (vedi
+ * getMerkleNode) in un messaggio MESSAGES_SYNC_DIGEST.
+ * Chi riceve dei nodi li confronta con i propri e, per
+ * ogni nodo interno che differisce, risponde con gli
+ * hash dei suoi due figli: i due peer scendono così
+ * insieme lungo i soli rami diversi e in un numero
+ * logaritmico di messaggi arrivano alle foglie, ovvero
+ * ai giorni che differiscono.
+ *
+ * Per ciascuno di essi si invia al vicino un messaggio
+ * MESSAGES_FLOOD_FOR_ENTRIES con reqID SYNC_REQ_ID,
+ * che il vicino non propaga ma a cui risponde
+ * direttamente con le entry mancanti. La foglia è
+ * anche rimandata al vicino marcata con SYNC_ECHO,
+ * perché recuperi a sua volta le entry che gli
+ * mancano senza rispondere di nuovo.
+ *
+ * I byte inviati per la sincronizzazione sono contati
+ * in SYNCspent: superato SYNCbandwidth non si invia
+ * altro fino al turno successivo.
+ *
+ * Fa eccezione il controllo esatto che segue un
+ * FLOODING con filtro di Bloom (vedi bloomFollowUp):
+ * le sue foglie sono marcate con SYNC_CHECK e le
+ * richieste di entry che ne derivano usano il reqID
+ * SYNC_CHECK_REQ_ID, così entrambi i peer le servono
+ * anche a banda esaurita o a sincronizzazione
+ * disattivata.
+ *
+ * Tutto è gestito dal solo thread TCP.
+ */
+#define SYNC_REQ_ID ((uint32_t)0xFFFFFFFF)
+#define SYNC_CHECK_REQ_ID ((uint32_t)0xFFFFFFFE)
+#define SYNC_ECHO ((uint32_t)0x80000000)
+#define SYNC_CHECK ((uint32_t)0x40000000)
+
+/* reqID dei messaggi della sincronizzazione */
+#define IS_SYNC_REQ_ID(reqID) ((reqID) == SYNC_REQ_ID || (reqID) == SYNC_CHECK_REQ_ID)
+
+/* un vicino deve poter inviare tutto il Merkle tree */
+#if 2*MERKLE_DAYS > SYNC_DIGEST_MAX_NODES
+#error "SYNC_DIGEST_MAX_NODES is too small!"
+#endif
+
+
+void TCPsetSyncBandwidth(size_t bytes)
+{
+    CTX->SYNCbandwidth = bytes;
+}
+
+/* verifica che nel turno corrente ci sia ancora banda */
+static int SYNCallowed(void)
+{
+    return CTX->SYNCspent < CTX->SYNCbandwidth;
+}
+
+/** Byte iniziali di un messaggio che servono a
+ * TRAFFICcount: l'intestazione e, per i messaggi
+ * del FLOODING, authorID e reqID.
+ */
+#define TRAFFIC_PREFIX (sizeof(struct messages_head) + 2*sizeof(uint32_t))
+
+/** Aggiorna i contatori del traffico con un
+ * messaggio di len byte, i cui primi avail byte
+ * (almeno l'intestazione) sono in data.
+ *
+ * I messaggi del FLOODING con reqID PUSH_REQ_ID,
+ * SYNC_REQ_ID o SYNC_CHECK_REQ_ID appartengono al push e alla
+ * sincronizzazione e sono contati a parte.
+ */
+static void TRAFFICcount(const uint8_t* data, size_t avail, size_t len)
+{
+    struct tcp_traffic_stats* stats;
+    struct messages_head head;
+    uint32_t reqID = 0;
+    uint16_t type;
+
+    memcpy(&head, data, sizeof(head));
+    type = ntohs(head.type);
+    if (avail >= TRAFFIC_PREFIX)
+    {
+        memcpy(&reqID, data + sizeof(head) + sizeof(uint32_t), sizeof(reqID));
+        reqID = ntohl(reqID);
+    }
+
+    if (pthread_mutex_lock(&CTX->TRAFFICguard) != 0)
+        fatal("pthread_mutex_lock");
+
+    stats = &CTX->TRAFFICstats;
+    ++stats->messages;
+    stats->bytes += len;
+    switch (type)
+    {
+    case MESSAGES_FLOOD_FOR_ENTRIES:
+    case MESSAGES_FLOOD_BLOOM:
+    case MESSAGES_REQ_ENTRIES:
+        if (avail < TRAFFIC_PREFIX)
+            break;
+        if (type == MESSAGES_REQ_ENTRIES && reqID == PUSH_REQ_ID)
+        {
+            ++stats->pushMessages;
+            stats->pushBytes += len;
+        }
+        else if (IS_SYNC_REQ_ID(reqID))
+        {
+            ++stats->syncMessages;
+            stats->syncBytes += len;
+        }
+        else
+        {
+            ++stats->floodMessages;
+            stats->floodBytes += len;
+        }
+        break;
+    case MESSAGES_SYNC_DIGEST:
+        ++stats->syncMessages;
+        stats->syncBytes += len;
+        break;
+    case MESSAGES_REQ_DATA:
+    case MESSAGES_REPLY_DATA:
+        ++stats->reqDataMessages;
+        stats->reqDataBytes += len;
+        break;
+    default:
+        break;
+    }
+
+    if (pthread_mutex_unlock(&CTX->TRAFFICguard) != 0)
+        fatal("pthread_mutex_unlock");
+}
+
+void TCPgetTrafficStats(struct tcp_traffic_stats* stats)
+{
+    if (stats == NULL)
+        return;
+
+    if (pthread_mutex_lock(&CTX->TRAFFICguard) != 0)
+        fatal("pthread_mutex_lock");
+
+    *stats = CTX->TRAFFICstats;
+
+    if (pthread_mutex_unlock(&CTX->TRAFFICguard) != 0)
+        fatal("pthread_mutex_unlock");
+}
+
+/** Writer installato con messages_set_stream_writer
+ * dal thread TCP: invece di scrivere direttamente
+ * sul socket di un vicino accoda il messaggio nella
+ * sua coda di uscita e ne tenta subito l'invio, così
+ * un vicino lento non blocca il thread.
+ * I socket che non corrispondono a una connessione
+ * nota sono scritti direttamente.
+ *
+ * Un messaggio che porterebbe la coda oltre
+ * OUTQUEUE_LIMIT byte è rifiutato come un errore di
+ * invio, a meno che la coda non sia vuota.
+ */
+static ssize_t OUTwriter(int sockfd, const struct iovec* iov, int iovcnt)
+{
+    struct peer_tcp* conn;
+    struct out_msg* msg;
+    struct messages_head head;
+    uint8_t prefix[TRAFFIC_PREFIX];
+    enum out_priority p;
+    size_t i, len, pending, avail;
+    ssize_t sent;
+    int j;
+
+    conn = NULL;
+    for (i = 0; CTX->OUTpeers != NULL && i != *CTX->OUTpeersNumber; ++i)
+        if (CTX->OUTpeers[i].sockfd == sockfd
+            && CTX->OUTpeers[i].status != PCS_EMPTY && CTX->OUTpeers[i].status != PCS_CLOSED)
+        {
+            conn = &CTX->OUTpeers[i];
+            break;
+        }
+    if (conn == NULL)
+    {
+        sent = writev(sockfd, iov, iovcnt);
+        /* l'intestazione è sempre nel primo blocco,
+         * il resto del prefisso può seguire */
+        if (sent > 0 && iovcnt > 0 && iov[0].iov_len >= sizeof(head))
+        {
+            for (j = 0, avail = 0; j != iovcnt && avail < sizeof(prefix); ++j)
+            {
+                len = min((int)(sizeof(prefix) - avail), (int)iov[j].iov_len);
+                memcpy(prefix + avail, iov[j].iov_base, len);
+                avail += len;
+            }
+            TRAFFICcount(prefix, avail, (size_t)sent);
+        }
+        return sent;
+    }
+
+    len = 0;
+    for (j = 0; j != iovcnt; ++j)
+        len += iov[j].iov_len;
+    if (len < sizeof(head))
+        return -1;
+    pending = OUTpending(conn);
+    if (pending != 0 && pending + len > OUTQUEUE_LIMIT)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Output queue of socket (%d) is full: [%ld] bytes pending",
+            sockfd, (long)pending);
+        return -1;
+    }
+
+    msg = malloc(sizeof(struct out_msg) + len);
+    if (msg == NULL)
+        fatal("malloc");
+    msg->next = NULL;
+    msg->len = 0;
+    for (j = 0; j != iovcnt; ++j)
+    {
+        memcpy(msg->data + msg->len, iov[j].iov_base, iov[j].iov_len);
+        msg->len += iov[j].iov_len;
+    }
+
+    /* la classe dipende dal tipo del messaggio, anche
+     * MESSAGES_DETATCH è accodato dietro ai dati di
+     * massa perché l'altro chiude appena lo riceve */
+    memcpy(&head, msg->data, sizeof(head));
+    switch (ntohs(head.type))
+    {
+    case MESSAGES_REQ_ENTRIES:
+    case MESSAGES_BOOTSTRAP_CHUNK:
+    case MESSAGES_DETATCH:
+        p = OUT_BULK;
+        break;
+    default:
+        p = OUT_CONTROL;
+        break;
+    }
+    if (conn->outTail[p] == NULL)
+        conn->outHead[p] = msg;
+    else
+        conn->outTail[p]->next = msg;
+    conn->outTail[p] = msg;
+    conn->outBytes[p] += len;
+    TRAFFICcount((const uint8_t*)msg->data, len, len);
+
+    /* tentativo immediato, il resto quando il
+     * socket tornerà scrivibile */
+    if (OUTflush(conn) == -1)
+        return -1;
+    return (ssize_t)len;
+}
+
+/** Stato del bootstrap: un peer senza registri
+ * chiusi (vedi needsBootstrap) chiede al primo
+ * vicino con cui stabilisce una connessione
+ * tutti i registri dei giorni conclusi, con un
+ * messaggio MESSAGES_BOOTSTRAP_REQ, e li riceve
+ * in blocchi MESSAGES_BOOTSTRAP_CHUNK di circa
+ * BOOTSTRAP_CHUNK byte.
+ *
+ * BOOTSTRAPfd è il socket da cui arrivano i
+ * blocchi, -1 se non c'è un trasferimento in
+ * corso: se la connessione cade si riprova con
+ * un altro vicino al turno di sincronizzazione
+ * successivo.
+ *
+ * Tutto è gestito dal solo thread TCP.
+ */
+
+
+/** Funzione ausiliaria che controlla che la
+ * query fornita sia al stessa che il thread
+ * principale ha inviato.
+ * Restituisce 0 in caso contrario, altrimenti
+ * un valore non nullo in caso di corrispondenza.
+ */
+static int REQ_DATAisThisQuery(const struct query* query)
+{
+    return sameQuery(&CTX->REQ_DATAquery, query);
+}
+
+/** Versione sperimentale della
+ * funzione, fallisce sempre.
+ * Serve a verificare che i vicini
+ * ricevano effettivamente il
+ * messaggio con la query.
+ */
+int TCPreqData(const struct query* query)
+{
+    uint8_t tmpCmd = TCP_COMMAND_QUERY;
+    /* man pthread_cond_timedwait per capirne l'utilizzo */
+    struct timeval now;
+    struct timespec timeout;
+    int retcode;
+    /* per restituire il valore della funzione */
+    int ans = -1; /* di default si aspetta di fallire */
+
+    /* se non è attivo ha senso che si blocchi */
+    if (!CTX->running)
+        fatal("TCPreqData while TCP thread is not running!");
+
+    if (query == NULL)
+        return -1;
+
+    /* INIZIAZIONE protocollo REQ_DATA */
+    if (pthread_mutex_lock(&CTX->REQ_DATAmutex) != 0)
+        fatal("pthread_mutex_lock");
+    /* 3) variabili globali */
+    CTX->REQ_DATAflag = 1;
+    CTX->REQ_DATAquery = *query;
+    CTX->REQ_DATAno_peer = 0;
+
+    /* 4) accoda il comando con la query */
+    TCPcommand_send(tmpCmd, query, sizeof(*query));
 
     /* 5) attesa */
     if (gettimeofday(&now, NULL) != 0)
         fatal("gettimeofday");
-    timeout.tv_sec = now.tv_sec + QUERY_TIMEOUT;
+    timeout.tv_sec = now.tv_sec + REQ_DATA_TTL*QUERY_TIMEOUT;
     timeout.tv_nsec = now.tv_usec * 1000;
     retcode = 0;
-    while (REQ_DATAflag && retcode != ETIMEDOUT && !REQ_DATAno_peer)
+    while (CTX->REQ_DATAflag && retcode != ETIMEDOUT && !CTX->REQ_DATAno_peer)
     {
-         retcode = pthread_cond_timedwait(&REQ_DATAcond,
-                                    &REQ_DATAmutex, &timeout);
+         retcode = pthread_cond_timedwait(&CTX->REQ_DATAcond,
+                                    &CTX->REQ_DATAmutex, &timeout);
     }
     /* CONCLUSIONE protocollo REQ_DATA */
     /* 2) controllo dell'esito */
-    set_clear(REQ_DATAsocket); /* svuota il set */
-    if (REQ_DATAflag || REQ_DATAno_peer)
+    set_clear(CTX->REQ_DATAsocket); /* svuota il set */
+    if (CTX->REQ_DATAflag || CTX->REQ_DATAno_peer)
     {
         unified_io_push(UNIFIED_IO_ERROR, "No neighbour sent answer!");
         /* nessuna risposta - timeout */
-        if (retcode != ETIMEDOUT && !REQ_DATAno_peer) /* controlla anomalie */
+        if (retcode != ETIMEDOUT && !CTX->REQ_DATAno_peer) /* controlla anomalie */
             fatal("pthread_cond_timedwait");
         ans = -1; /* non necassario ma lasciato per leggibilità */
     }
@@ -913,12 +1863,107 @@ int TCPreqData(const struct query* query)
         ans = 0;
     }
     /* 3) rilascio e terminazione */
-    if (pthread_mutex_unlock(&REQ_DATAmutex) != 0)
+    if (pthread_mutex_unlock(&CTX->REQ_DATAmutex) != 0)
         fatal("pthread_mutex_unlock");
 
     return ans;
 }
 
+/** Richiesta MESSAGES_REQ_DATA giunta da un vicino e
+ * inoltrata dal peer corrente perché la risposta non
+ * era nella sua cache. Una risposta trovata ripercorre
+ * all'indietro il cammino della richiesta e ogni peer
+ * attraversato la salva nella propria cache, così le
+ * query più richieste si diffondono nella rete.
+ *
+ * Gli oggetti sono usati dal solo thread TCP e sono
+ * eliminati dalla lista REQ_DATArelays quando done
+ * diventa non nullo e nessun comando
+ * TCP_COMMAND_RELAY_QUERY che li riguarda è ancora
+ * in attesa nella coda dei comandi.
+ *
+ * Se le risposte dei vicini non arrivano entro
+ * expiry (ttl*QUERY_TIMEOUT secondi dalla
+ * ricezione, così che scada prima chi sta più
+ * a valle) si risponde comunque negativamente.
+ */
+struct REQ_DATArelay
+{
+    struct query query;
+    uint32_t authorID;
+    /* salti consentiti a chi riceve la richiesta inoltrata */
+    uint32_t ttl;
+    /* ID dei peer già raggiunti dalla richiesta */
+    uint32_t length;
+    uint32_t* visited;
+    /* vicino da cui è giunta la richiesta - NULL se la
+     * connessione è stata chiusa */
+    struct peer_tcp* source;
+    int sourceFd;
+    /* socket da cui si aspetta ancora una risposta */
+    struct set* pending;
+    /* la richiesta è stata inoltrata */
+    int forwarded;
+    /* si è risposto al vicino, va eliminata */
+    int done;
+    /* comandi TCP_COMMAND_RELAY_QUERY nella coda dei comandi */
+    unsigned queued;
+    /* istante oltre il quale non si attendono più risposte */
+    time_t expiry;
+};
+
+/* "distruttore" degli oggetti di tipo struct REQ_DATArelay */
+static void REQ_DATArelay_destroy(void* el)
+{
+    struct REQ_DATArelay* relay = (struct REQ_DATArelay*)el;
+
+    free(relay->visited);
+    set_destroy(relay->pending);
+    free(relay);
+}
+
+/* per list_eliminate */
+static int REQ_DATArelay_isDone(void* el)
+{
+    const struct REQ_DATArelay* relay = (const struct REQ_DATArelay*)el;
+
+    if (!relay->done || relay->queued != 0)
+        return 0;
+    REQ_DATArelay_destroy(el);
+    return 1;
+}
+
+/* invia al thread TCP il comando TCP_COMMAND_RELAY_QUERY */
+static void cmdRelayQuery(struct REQ_DATArelay* relay)
+{
+    uint8_t tmpCmd = TCP_COMMAND_RELAY_QUERY;
+
+    ++relay->queued;
+    TCPcommand_send(tmpCmd, &relay, sizeof(relay));
+}
+
+/* per list_accumulate: aggiorna le richieste inoltrate
+ * in seguito alla chiusura del socket fornito */
+static void REQ_DATArelay_closeSocket(void* el, void* fd)
+{
+    struct REQ_DATArelay* relay = (struct REQ_DATArelay*)el;
+    int sockfd = *(int*)fd;
+
+    if (relay->done)
+        return;
+    if (relay->sourceFd == sockfd)
+        relay->source = NULL;
+    if (set_has(relay->pending, sockfd) == 1)
+    {
+        if (set_remove(relay->pending, sockfd) != 0)
+            fatal("set_remove");
+        /* nessuno può più rispondere: la risposta negativa
+         * sarà inviata dal thread TCP */
+        if (set_size(relay->pending) == 0 && relay->forwarded)
+            cmdRelayQuery(relay);
+    }
+}
+
 /** Svolge le operazioni necessarie al protocollo
  * REQ_DATA nel caso si debba chiudere il socket
  * dato.
@@ -931,29 +1976,32 @@ static void closeConnection_REQ_DATA(int sockfd)
 {
     /* fase CHIUSURA SOCKET del protocollo REQ_DATA */
     /* 2) cattura il mutex */
-    if (pthread_mutex_lock(&REQ_DATAmutex) != 0)
+    if (pthread_mutex_lock(&CTX->REQ_DATAmutex) != 0)
         fatal("pthread_mutex_lock");
 
     /* 3) il socket era tra quelli utilizzati? */
-    if (set_has(REQ_DATAsocket, sockfd))
+    if (set_has(CTX->REQ_DATAsocket, sockfd))
     {
         /* lo rimuove dall'insieme */
-        if (set_remove(REQ_DATAsocket, sockfd) == -1)
+        if (set_remove(CTX->REQ_DATAsocket, sockfd) == -1)
             fatal("REQ_DATA: set_remove");
         /* l'insieme è ora vuoto? */
-        if (set_size(REQ_DATAsocket) == 0)
+        if (set_size(CTX->REQ_DATAsocket) == 0)
         {
             unified_io_push(UNIFIED_IO_ERROR, "Closing last socket (%d) for REQ_DATA protocol", sockfd);
-            if (pthread_cond_signal(&REQ_DATAcond) != 0)
+            if (pthread_cond_signal(&CTX->REQ_DATAcond) != 0)
                 fatal("pthread_cond_signal");
             /* andata male */
-            REQ_DATAno_peer = 1;
+            CTX->REQ_DATAno_peer = 1;
         }
     }
 
     /* 4) rilascia il mutex */
-    if (pthread_mutex_unlock(&REQ_DATAmutex) != 0)
+    if (pthread_mutex_unlock(&CTX->REQ_DATAmutex) != 0)
         fatal("pthread_mutex_unlock");
+
+    /* anche le richieste inoltrate possono essere coinvolte */
+    list_accumulate(CTX->REQ_DATArelays, &REQ_DATArelay_closeSocket, (void*)&sockfd);
 }
 
 /* L'istanza del protocollo FLOODING identificata dall'hash fornito
@@ -961,18 +2009,9 @@ static void closeConnection_REQ_DATA(int sockfd)
  * strutture dati coinvolte */
 static void send_TCP_COMMAND_CLOSE_FLOODING(long int hash)
 {
-    struct iovec iov[2];
     uint8_t tmpCmd = TCP_COMMAND_CLOSE_FLOODING;
 
-    /* "header" del comando */
-    iov[0].iov_base = (void*)&tmpCmd;
-    iov[0].iov_len = CMD_SIZE;
-    /* argomento del comando */
-    iov[1].iov_base = (void*)&hash;
-    iov[1].iov_len = sizeof(hash);
-    /* invio del comando */
-    if (writev(tcPipe_writeEnd, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len))
-        fatal("writing to command pipe");
+    TCPcommand_send(tmpCmd, &hash, sizeof(hash));
 }
 
 /** Tutti i dati necessari a rispondere alla query ricevuta
@@ -980,18 +2019,9 @@ static void send_TCP_COMMAND_CLOSE_FLOODING(long int hash)
  */
 static void send_TCP_COMMAND_SEND_FLOOD_RESPONSE(long int hash)
 {
-    struct iovec iov[2];
     uint8_t tmpCmd = TCP_COMMAND_SEND_FLOOD_RESPONSE;
 
-    /* "header" del comando */
-    iov[0].iov_base = (void*)&tmpCmd;
-    iov[0].iov_len = CMD_SIZE;
-    /* argomento del comando */
-    iov[1].iov_base = (void*)&hash;
-    iov[1].iov_len = sizeof(hash);
-    /* invio del comando */
-    if (writev(tcPipe_writeEnd, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len))
-        fatal("writing to command pipe");
+    TCPcommand_send(tmpCmd, &hash, sizeof(hash));
 }
 
 /** Funzione ausiliaria da invocare nel
@@ -1066,6 +2096,12 @@ static void closeConnection(struct peer_tcp* conn)
         closeConnection_FLOODING(conn);
         /* il socket era usato per una esecuzione del protocollo REQ_DATA? */
         closeConnection_REQ_DATA(conn->sockfd);
+        /* il bootstrap andrà ripetuto con un altro vicino */
+        if (conn->sockfd == CTX->BOOTSTRAPfd)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "BOOTSTRAP: connection lost after [%ld] days", (long)CTX->BOOTSTRAPdays);
+            CTX->BOOTSTRAPfd = -1;
+        }
         break;
 
     default:
@@ -1073,6 +2109,10 @@ static void closeConnection(struct peer_tcp* conn)
         break;
     }
 
+    free(conn->cacheDigest);
+    conn->cacheDigest = NULL;
+    /* quanto resta in coda è perso */
+    OUTclear(conn);
     /* lo stato ora è chiuso */
     conn->status = PCS_CLOSED;
     /* chiusura del socket */
@@ -1085,7 +2125,7 @@ static void closeConnection(struct peer_tcp* conn)
 
 /** Funzione ausiliaria che invia al
  * thread TCP il comando di spegnimento
- * usando la pipe a disposizione.
+ * usando la coda dei comandi.
  */
 static void sendShutdownRequest(void)
 {
@@ -1094,8 +2134,7 @@ static void sendShutdownRequest(void)
     /* controlla che non abbia fatto disastri */
     assert(sizeof(tmpCmd) == CMD_SIZE);
 
-    if (write(tcPipe_writeEnd, &tmpCmd, CMD_SIZE) != CMD_SIZE)
-        fatal("writing to command pipe");
+    TCPcommand_send(tmpCmd, NULL, 0);
 }
 
 /** Funzione ausiliaria che invia al
@@ -1111,8 +2150,19 @@ static void sendCheckRequest(void)
     /* controlla che non abbia fatto disastri */
     assert(sizeof(tmpCmd) == CMD_SIZE);
 
-    if (write(tcPipe_writeEnd, &tmpCmd, CMD_SIZE) != CMD_SIZE)
-        fatal("writing to command pipe");
+    TCPcommand_send(tmpCmd, NULL, 0);
+}
+
+void TCPtopologyChanged(void)
+{
+    uint8_t tmpCmd = TCP_COMMAND_TOPOLOGY;
+
+    assert(sizeof(tmpCmd) == CMD_SIZE);
+
+    if (!CTX->running)
+        return;
+
+    TCPcommand_send(tmpCmd, NULL, 0);
 }
 
 int TCPinit(int port)
@@ -1121,27 +2171,35 @@ int TCPinit(int port)
     int flag;
 
     /* controlla che il sistema non sia già stato avviato */
-    if (activated)
+    if (CTX->activated)
         return -1;
 
     /* prepara la struttura per gestire il protocollo
      * FLOODING */
-    FLOODINGinstances = rb_tree_init(NULL);
-    if (FLOODINGinstances == NULL)
+    CTX->FLOODINGinstances = rb_tree_init(NULL);
+    if (CTX->FLOODINGinstances == NULL)
         fatal("rb_tree_init");
-    rb_tree_set_cleanup_f(FLOODINGinstances, &FLOODINGdescriptor_destroy_wrapper);
+    rb_tree_set_cleanup_f(CTX->FLOODINGinstances, &FLOODINGdescriptor_destroy_wrapper);
 
     /* prepara la struttura per gestire il protocollo
      * REQ_DATA */
-    REQ_DATAsocket = set_init(NULL);
-    if (REQ_DATAsocket == NULL)
+    CTX->REQ_DATAsocket = set_init(NULL);
+    if (CTX->REQ_DATAsocket == NULL)
         fatal("REQ_DATAsocket = set_init(NULL)");
+    CTX->REQ_DATArelays = list_init(NULL);
+    if (CTX->REQ_DATArelays == NULL)
+        fatal("list_init");
+    list_set_cleanup(CTX->REQ_DATArelays, &REQ_DATArelay_destroy);
 
-    if (pipe2(tcPipe, O_NONBLOCK) != 0)
+    if (pipe2(CTX->tcPipe, O_NONBLOCK) != 0)
         errExit("*** pipe! ***\n");
+    CTX->CMDqueue = queue_init(NULL, Q_CONCURRENT);
+    if (CTX->CMDqueue == NULL)
+        fatal("queue_init");
+    queue_set_cleanup_f(CTX->CMDqueue, &free);
 
-    tcPipe_readEnd = tcPipe[0];
-    tcPipe_writeEnd = tcPipe[1];
+    CTX->tcPipe_readEnd = CTX->tcPipe[0];
+    CTX->tcPipe_writeEnd = CTX->tcPipe[1];
 
     sk = initTCPSocket(port, MAX_TCP_CONNECTION);
     if (sk == -1)
@@ -1156,8 +2214,8 @@ int TCPinit(int port)
         return -1;
     }
 
-    tcpFd = sk;
-    activated = 1;
+    CTX->tcpFd = sk;
+    CTX->activated = 1;
 
     return 0;
 }
@@ -1233,11 +2291,6 @@ static int readMessageHeader(int sockFd, void* buffer)
     return recognise_messages_type(buffer);
 }
 
-/** Variabili che permetto al thread di
- * ottenere le informazioni sui suoi
- * vicini */
-static struct peer_data neighbours[MAX_NEIGHBOUR_NUMBER]; /* dati sui vicini */
-static size_t neighboursNumber; /* numero di vicini. */
 
 /** Funzione ausiliaria e per il testing che stampa
  * le informazioni su un elenco di peer.
@@ -1350,6 +2403,7 @@ endFor:
         fatal("findPeerSlot: ans == NULL");
 
     /* azzera lo slot */
+    OUTclear(ans);
     memset(ans, 0, sizeof(*ans));
     return ans;
 }
@@ -1408,6 +2462,33 @@ static void acceptPeer(int listenFd,
     }
 }
 
+/** Chiede al vicino, se serve e non lo si sta
+ * già facendo, i registri di tutti i giorni
+ * conclusi.
+ */
+static void bootstrapRequest(struct peer_tcp* neighbour)
+{
+    struct tm newest;
+
+    if (!CTX->BOOTSTRAPneeded || CTX->BOOTSTRAPfd != -1 || neighbour->status != PCS_READY)
+        return;
+
+    newest = lastRegisterClosed();
+    if (messages_send_bootstrap_req(neighbour->sockfd, &newest) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Error while sending request via (%d)", neighbour->sockfd);
+        closeConnection(neighbour);
+        sendCheckRequest();
+        return;
+    }
+
+    unified_io_push(UNIFIED_IO_NORMAL, "BOOTSTRAP: registers requested via (%d)", neighbour->sockfd);
+    CTX->BOOTSTRAPfd = neighbour->sockfd;
+    CTX->BOOTSTRAPdays = CTX->BOOTSTRAPentries = 0;
+    if (gettimeofday(&CTX->BOOTSTRAPstart, NULL) != 0)
+        fatal("gettimeofday");
+}
+
 /** Funzione ausiliaria per gestire i messaggi
  * di tipo
  * MESSAGES_PEER_HELLO_REQ.
@@ -1438,21 +2519,35 @@ static void handle_MESSAGES_PEER_HELLO_REQ(struct peer_tcp* neighbour)
     }
     unified_io_push(UNIFIED_IO_NORMAL, "In HELLO REQ: [senderID:%lu] [maybeME:%lu]", (unsigned long)senderID, (unsigned long)maybeME);
     /* controlla che il suo ID sia corretto */
-    if (peerID != maybeME)
+    if (CTX->peerID != maybeME)
     {
-        unified_io_push(UNIFIED_IO_ERROR, "I am NOT [maybeME:%lu], I am [PeerID:%ul]", (unsigned long)maybeME, (unsigned long)peerID);
+        unified_io_push(UNIFIED_IO_ERROR, "I am NOT [maybeME:%lu], I am [PeerID:%ul]", (unsigned long)maybeME, (unsigned long)CTX->peerID);
         if (messages_send_hello_ack(sockfd, MESSAGES_HELLO_NOT_ME) != 0)
             unified_io_push(UNIFIED_IO_ERROR, "Error sending [MESSAGES_PEER_HELLO_ACK] via socket (%d)", sockfd);
         goto onError;
     }
     /* siamo stati contattati da un più "giovane"? */
-    if (peerID > senderID)
+    if (CTX->peerID > senderID)
     {
-        unified_io_push(UNIFIED_IO_ERROR, "Protocolo error: [senderID:%lu] < [PeerID:%lu]", (unsigned long)senderID, (unsigned long)peerID);
+        unified_io_push(UNIFIED_IO_ERROR, "Protocolo error: [senderID:%lu] < [PeerID:%lu]", (unsigned long)senderID, (unsigned long)CTX->peerID);
         if (messages_send_hello_ack(sockfd, MESSAGES_HELLO_PROTOCOL_ERROR) != 0)
             unified_io_push(UNIFIED_IO_ERROR, "Error sending [MESSAGES_PEER_HELLO_ACK] via socket (%d)", sockfd);
         goto onError;
     }
+    /* prima i vicini già noti, il mittente potrebbe
+     * essere tra loro */
+    if (UDPneighbours(currentNeighbours, &numCurrentNeighbours) == 0)
+        for (i = 0; i != numCurrentNeighbours; ++i)
+            if (senderID == peer_data_extract_ID(&currentNeighbours[i]))
+            {
+                neighbour->data = currentNeighbours[i];
+                neighbour->status = PCS_READY;
+                neighbour->FLOODINGreceived = set_init(NULL);
+                neighbour->FLOODINGsend = set_init(NULL);
+                if (neighbour->FLOODINGreceived == NULL || neighbour->FLOODINGsend == NULL)
+                    fatal("set_init");
+                goto onSuccess;
+            }
     /* checking current peers */
     unified_io_push(UNIFIED_IO_NORMAL, "Contacting server for check...");
     if (UDPcheck(currentNeighbours, &numCurrentNeighbours) == -1)
@@ -1495,6 +2590,8 @@ onSuccess:
         goto onError;
     }
     unified_io_push(UNIFIED_IO_NORMAL, "Ack sent!");
+    /* un peer appena arrivato recupera i giorni passati */
+    bootstrapRequest(neighbour);
     /* se arriva qui è andato tutto bene */
     return;
 onError:
@@ -1527,9 +2624,14 @@ static void handle_MESSAGES_REQ_DATA(struct peer_tcp* neighbour)
     int sockfd = neighbour->sockfd;
     char queryStr[48] = "";
     const struct answer* answer;
+    int sendResult;
+    /* per l'inoltro della richiesta */
+    uint32_t ttl, length;
+    uint32_t* visited = NULL;
+    struct REQ_DATArelay* relay;
 
     /* parsing del corpo della richiesta */
-    if (messages_read_req_data_body(sockfd, &authID, &query) != 0)
+    if (messages_read_req_data_body(sockfd, &authID, &query, &ttl, &length, &visited) != 0)
     {
         unified_io_push(UNIFIED_IO_ERROR, "Error occurred reading body of [MESSAGES_REQ_DATA] via socket (%d)", sockfd);
         goto onError;
@@ -1539,6 +2641,7 @@ static void handle_MESSAGES_REQ_DATA(struct peer_tcp* neighbour)
     if (checkQuery(&query) != 0)
     {
         unified_io_push(UNIFIED_IO_ERROR, "Malformed query received!");
+        free(visited);
         /* invia una risposta con l'errore - il peer corrente non può rispondere */
         if (messages_send_empty_reply_data(sockfd, MESSAGES_REPLY_DATA_ERROR, NULL) != 0)
             goto onSend;
@@ -1550,6 +2653,30 @@ static void handle_MESSAGES_REQ_DATA(struct peer_tcp* neighbour)
     /* ricerca */
     answer = findCachedAnswer(&query);
     /* risultato */
+    if (answer == NULL && ttl > 1)
+    {
+        /* la chiede a sua volta ai propri vicini */
+        unified_io_push(UNIFIED_IO_NORMAL, "Answer NOT found! Forwarding query [TTL:%u]", (unsigned)ttl-1);
+        relay = calloc(1, sizeof(struct REQ_DATArelay));
+        if (relay == NULL)
+            fatal("calloc");
+        relay->query = query;
+        relay->authorID = authID;
+        relay->ttl = ttl-1;
+        relay->length = length;
+        relay->visited = visited;
+        relay->source = neighbour;
+        relay->sourceFd = sockfd;
+        relay->expiry = time(NULL) + (time_t)relay->ttl*QUERY_TIMEOUT;
+        relay->pending = set_init(NULL);
+        if (relay->pending == NULL)
+            fatal("set_init");
+        if (list_append(CTX->REQ_DATArelays, relay) != 0)
+            fatal("list_append");
+        cmdRelayQuery(relay);
+        return;
+    }
+    free(visited);
     if (answer == NULL)
     {
         unified_io_push(UNIFIED_IO_NORMAL, "Answer NOT found!");
@@ -1559,7 +2686,10 @@ static void handle_MESSAGES_REQ_DATA(struct peer_tcp* neighbour)
     else
     {
         unified_io_push(UNIFIED_IO_NORMAL, "Answer found!");
-        if (messages_send_reply_data_answer(sockfd, answer) == -1)
+        sendResult = messages_send_reply_data_answer(sockfd, answer);
+        /* la risposta può ora essere eliminata dalla cache */
+        releaseCachedAnswer(answer);
+        if (sendResult == -1)
             goto onSend;
     }
 
@@ -1575,6 +2705,127 @@ onError:
     sendCheckRequest();
 }
 
+/** Conclude una richiesta inoltrata rispondendo al
+ * vicino da cui era giunta con la risposta fornita
+ * oppure, se è NULL, con MESSAGES_REPLY_DATA_NOT_FOUND,
+ * senza eliminarla dalla lista REQ_DATArelays.
+ */
+static void REQ_DATArelay_sendBack(struct REQ_DATArelay* relay, const struct answer* answer)
+{
+    struct peer_tcp* source = relay->source;
+    int res;
+
+    relay->done = 1;
+    if (source != NULL && source->status == PCS_READY && source->sockfd == relay->sourceFd)
+    {
+        if (answer != NULL)
+            res = messages_send_reply_data_answer(source->sockfd, answer);
+        else
+            res = messages_send_empty_reply_data(source->sockfd,
+                    MESSAGES_REPLY_DATA_NOT_FOUND, &relay->query);
+        if (res != 0)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "Error occurred while sending [MESSAGES_REPLY_DATA] via socket (%d)", source->sockfd);
+            closeConnection(source);
+            sendCheckRequest();
+        }
+    }
+}
+
+/* come REQ_DATArelay_sendBack ma elimina le richieste concluse */
+static void REQ_DATArelay_answer(struct REQ_DATArelay* relay, const struct answer* answer)
+{
+    REQ_DATArelay_sendBack(relay, answer);
+    list_eliminate(CTX->REQ_DATArelays, &REQ_DATArelay_isDone);
+}
+
+/* per list_accumulate: conclude le richieste scadute
+ * e calcola in *base la scadenza più vicina */
+static void REQ_DATArelay_expire_helper(void* el, void* base)
+{
+    struct REQ_DATArelay* relay = (struct REQ_DATArelay*)el;
+    time_t* next = (time_t*)base;
+
+    if (relay->done)
+        return;
+    if (time(NULL) >= relay->expiry)
+    {
+        unified_io_push(UNIFIED_IO_NORMAL, "REQ_DATA: relayed query expired");
+        REQ_DATArelay_sendBack(relay, NULL);
+    }
+    else if (*next == 0 || relay->expiry < *next)
+        *next = relay->expiry;
+}
+
+/** Risponde negativamente alle richieste inoltrate
+ * le cui risposte non sono giunte entro la scadenza
+ * e le elimina.
+ *
+ * Restituisce l'istante della prossima scadenza
+ * oppure 0 se non ci sono richieste in attesa.
+ */
+static time_t REQ_DATArelay_expire(void)
+{
+    time_t next = 0;
+
+    list_accumulate(CTX->REQ_DATArelays, &REQ_DATArelay_expire_helper, (void*)&next);
+    list_eliminate(CTX->REQ_DATArelays, &REQ_DATArelay_isDone);
+
+    return next;
+}
+
+/* chiave per la ricerca in REQ_DATArelays */
+struct REQ_DATAreply
+{
+    const struct query* query;
+    int sockfd;
+};
+
+/* per list_find */
+static int REQ_DATArelay_waits(void* el, void* base)
+{
+    const struct REQ_DATArelay* relay = (const struct REQ_DATArelay*)el;
+    const struct REQ_DATAreply* key = (const struct REQ_DATAreply*)base;
+
+    return !relay->done && set_has(relay->pending, key->sockfd) == 1
+        && sameQuery(&relay->query, key->query);
+}
+
+/** Gestisce una risposta giunta per una richiesta
+ * inoltrata dal peer corrente: la rimanda indietro
+ * e la salva nella cache.
+ *
+ * Restituisce 1 se la risposta è stata trattenuta
+ * (appartiene ora alla cache) e 0 altrimenti.
+ */
+static int REQ_DATArelay_reply(struct peer_tcp* neighbour,
+            const struct query* query, struct answer* answer)
+{
+    struct REQ_DATArelay* relay;
+    struct REQ_DATAreply key;
+
+    key.query = query;
+    key.sockfd = neighbour->sockfd;
+    if (list_find(CTX->REQ_DATArelays, (void**)&relay, &REQ_DATArelay_waits, (void*)&key) != 0)
+        return 0;
+
+    if (answer != NULL)
+    {
+        unified_io_push(UNIFIED_IO_NORMAL, "Relaying answer back to socket (%d)", relay->sourceFd);
+        REQ_DATArelay_answer(relay, answer);
+        /* anche chi inoltra conserva la risposta */
+        if (addAnswerToCache(query, answer) != 0)
+            freeAnswer(answer);
+        return 1;
+    }
+
+    if (set_remove(relay->pending, neighbour->sockfd) != 0)
+        fatal("set_remove");
+    if (set_size(relay->pending) == 0)
+        REQ_DATArelay_answer(relay, NULL);
+    return 0;
+}
+
 /** Gestisce la parte del protocollo REQ_DATA
  * che riguarda handle_MESSAGES_REPLY_DATA
  */
@@ -1584,47 +2835,53 @@ handle_MESSAGES_REPLY_DATA_protocol(
             struct query* query,
             struct answer* answer)
 {
+    /* la risposta era per il peer corrente */
+    int mine = 0;
+
     /* 2) prende il mutex */
-    if (pthread_mutex_lock(&REQ_DATAmutex) != 0)
+    if (pthread_mutex_lock(&CTX->REQ_DATAmutex) != 0)
         fatal("pthread_mutex_lock");
 
     /* 3) controllo delle condizioni */
-    if (REQ_DATAflag && set_has(REQ_DATAsocket, neighbour->sockfd) && REQ_DATAisThisQuery(query))
+    if (CTX->REQ_DATAflag && set_has(CTX->REQ_DATAsocket, neighbour->sockfd) && REQ_DATAisThisQuery(query))
     {
+        mine = 1;
         /* questa risposta era attesa */
         /* rimuove il descrittore dall'insieme */
-        set_remove(REQ_DATAsocket, neighbour->sockfd);
+        set_remove(CTX->REQ_DATAsocket, neighbour->sockfd);
         if (answer != NULL)
         {
             /* abbiamo una risposta */
-            REQ_DATAflag = 0;
+            CTX->REQ_DATAflag = 0;
             /* aggiunge la risposta alla cache */
             addAnswerToCache(query, answer);
             /* segnala la variabile di condizione */
-            pthread_cond_signal(&REQ_DATAcond);
+            pthread_cond_signal(&CTX->REQ_DATAcond);
         }
         else
         {
-            if (set_size(REQ_DATAsocket) == 0)
+            if (set_size(CTX->REQ_DATAsocket) == 0)
             {
                 unified_io_push(UNIFIED_IO_NORMAL, "No neighbour sent valid response");
                 /* non ci sono altri vicini che potrebbero rispondere */
-                pthread_cond_signal(&REQ_DATAcond);
-                REQ_DATAno_peer = 1;
+                pthread_cond_signal(&CTX->REQ_DATAcond);
+                CTX->REQ_DATAno_peer = 1;
             }
         }
     }
-    else
+
+    /* 5) rilascia il mutex */
+    if (pthread_mutex_unlock(&CTX->REQ_DATAmutex) != 0)
+        fatal("pthread_mutex_unlock");
+
+    /* potrebbe essere per una richiesta inoltrata */
+    if (!mine && !REQ_DATArelay_reply(neighbour, query, answer))
     {
         /* rilascia le risorse */
         free(query);
         /* non serve controllare anche answer dato
          * che se non è NULL è uguale ad answer */
     }
-
-    /* 5) rilascia il mutex */
-    if (pthread_mutex_unlock(&REQ_DATAmutex) != 0)
-        fatal("pthread_mutex_unlock");
 }
 
 /** Funzione ausiliaria per gestire la
@@ -1694,10 +2951,53 @@ static void handle_MESSAGES_REPLY_DATA(struct peer_tcp* neighbour)
 
 }
 
+/** Risponde a un messaggio MESSAGES_FLOOD_FOR_ENTRIES
+ * della sincronizzazione in background inviando
+ * direttamente al vicino le entry le cui firme non
+ * sono tra quelle fornite, che vengono liberate.
+ *
+ * Se la banda del turno è esaurita non risponde,
+ * a meno che la richiesta non sia parte di un
+ * controllo esatto (reqID SYNC_CHECK_REQ_ID): il
+ * vicino riproverà al turno successivo.
+ */
+static void handleSyncRequest(struct peer_tcp* neighbour,
+            uint32_t authorID, uint32_t reqID, const struct tm* date,
+            uint32_t lenght, uint32_t* signatures)
+{
+    struct set* skip;
+    struct ns_entry* entries = NULL;
+    size_t len = 0;
+
+    skip = make_set_from_uint32_t(signatures, (size_t)lenght);
+    free(signatures);
+    if ((reqID == SYNC_CHECK_REQ_ID || SYNCallowed())
+        && getNsRegisterData(date, &entries, &len, skip) != 0)
+        len = 0;
+    set_destroy(skip);
+
+    if (len != 0)
+    {
+        unified_io_push(UNIFIED_IO_NORMAL, "SYNC: sending [%ld] entries via socket (%d)",
+            (long)len, neighbour->sockfd);
+        if (messages_send_flood_ack(neighbour->sockfd, authorID, reqID,
+                date, entries, len) == -1)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "Error while sending response via (%d)", neighbour->sockfd);
+            closeConnection(neighbour);
+            sendCheckRequest();
+        }
+        else
+            CTX->SYNCspent += sizeof(struct flood_ack) + len*sizeof(struct ns_entry);
+    }
+    free(entries);
+}
+
 /** Fa tutto quello che serve per gestire la ricezione
- * di un messaggio di tipo MESSAGES_FLOOD_FOR_ENTRIES.
+ * di un messaggio di tipo MESSAGES_FLOOD_FOR_ENTRIES
+ * o, se bloom non è nullo, MESSAGES_FLOOD_BLOOM.
  */
-static void handle_MESSAGES_FLOOD_FOR_ENTRIES(struct peer_tcp* neighbour)
+static void handle_MESSAGES_FLOOD_FOR_ENTRIES(struct peer_tcp* neighbour, int bloom)
 {
     uint32_t authorID, reqID;
     struct tm date;
@@ -1728,9 +3028,21 @@ static void handle_MESSAGES_FLOOD_FOR_ENTRIES(struct peer_tcp* neighbour)
     unified_io_push(UNIFIED_IO_NORMAL, "[MESSAGES_FLOOD_FOR_ENTRIES]: "
         "[Auth:%lu][Req:%lu] %s", (unsigned long)authorID, (unsigned long)reqID, dateStr);
     /* elenco firme già note */
-    unified_io_push(UNIFIED_IO_NORMAL, "\tSender own (%lu) signatures:", (unsigned long)lenght);
-    for (i = 0; i != lenght; ++i)
-        unified_io_push(UNIFIED_IO_NORMAL, "\t\t%ld) signature: [%ld]", (long)i, (long)signatures[i]);
+    if (bloom)
+        unified_io_push(UNIFIED_IO_NORMAL, "\tSender signatures in a Bloom filter of (%lu) words", (unsigned long)lenght);
+    else
+    {
+        unified_io_push(UNIFIED_IO_NORMAL, "\tSender own (%lu) signatures:", (unsigned long)lenght);
+        for (i = 0; i != lenght; ++i)
+            unified_io_push(UNIFIED_IO_NORMAL, "\t\t%ld) signature: [%ld]", (long)i, (long)signatures[i]);
+    }
+
+    /* la sincronizzazione in background non va propagata */
+    if (IS_SYNC_REQ_ID(reqID) && !bloom)
+    {
+        handleSyncRequest(neighbour, authorID, reqID, &date, lenght, signatures);
+        return;
+    }
 
     /* dovrebbe verificare se il messaggio è stato già ricevuto */
     des = FLOODINGdescriptor_findByIDs(authorID, reqID);
@@ -1741,7 +3053,7 @@ static void handle_MESSAGES_FLOOD_FOR_ENTRIES(struct peer_tcp* neighbour)
         /* crea una nuova istanza del protocollo */
         des = FLOODINGdescriptor_newOther(authorID, reqID,
                         neighbour->sockfd, &date,
-                        (size_t)lenght, signatures);
+                        (size_t)lenght, signatures, bloom);
         /* ATTENZIONE: SHALLOW COPY->signatures */
         if (des == NULL)
             fatal("FLOODINGdescriptor_newOther");
@@ -1778,6 +3090,412 @@ static void handle_MESSAGES_FLOOD_FOR_ENTRIES(struct peer_tcp* neighbour)
     }
 }
 
+/** Gestisce la ricezione di un push: aggiunge ai
+ * registri del peer le entry ricevute e inoltra
+ * agli altri vicini solo quelle le cui firme non
+ * erano già note.
+ *
+ * Libera il registro fornito.
+ */
+static void handlePush(int sourceFd, uint32_t authID,
+            const struct tm* date, struct e_register* R)
+{
+    uint32_t* signatures;
+    size_t len;
+    struct set* known;
+    struct PUSHdata* push;
+
+    if (R == NULL)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Empty push received!");
+        return;
+    }
+
+    /* le entry con firme già note sono duplicati */
+    if (getRegisterSignatures(date, &signatures, &len) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "No register for pushed date: push ignored!");
+        register_destroy(R);
+        return;
+    }
+    known = make_set_from_uint32_t(signatures, len);
+    free(signatures);
+
+    push = calloc(1, sizeof(struct PUSHdata));
+    if (push == NULL)
+        fatal("calloc");
+    if (register_as_ns_array(R, &push->entries, &push->length, known, NULL) != 0)
+        fatal("register_as_ns_array");
+    set_destroy(known);
+
+    unified_io_push(UNIFIED_IO_NORMAL, "Push: [%ld] entries received, [%ld] new",
+        (long)register_size(R), (long)push->length);
+    if (mergeRegisterContent(R) == -1)
+        fatal("mergeRegisterContent");
+    register_destroy(R);
+
+    if (push->length == 0)
+    {
+        /* già visto: la propagazione si ferma qui */
+        free(push->entries);
+        free(push);
+        return;
+    }
+
+    push->authorID = authID;
+    push->date = *date;
+    push->sourceFd = sourceFd;
+    cmdPUSH(push);
+}
+
+/** Chiede al vicino le entry del giorno indicato
+ * le cui firme non sono note al peer corrente;
+ * se check non è nullo la richiesta fa parte di
+ * un controllo esatto.
+ *
+ * Restituisce 0 in caso di successo e -1 se la
+ * connessione è stata chiusa.
+ */
+static int syncPullDay(struct peer_tcp* neighbour, const struct tm* date, int check)
+{
+    uint32_t* signatures;
+    size_t sigLen;
+
+    if (getRegisterSignatures(date, &signatures, &sigLen) != 0)
+        return 0;
+    if (messages_send_flood_req(neighbour->sockfd, CTX->peerID,
+            check ? SYNC_CHECK_REQ_ID : SYNC_REQ_ID,
+            date, (uint32_t)sigLen, signatures) == -1)
+    {
+        free(signatures);
+        unified_io_push(UNIFIED_IO_ERROR, "Error while sending request via (%d)", neighbour->sockfd);
+        closeConnection(neighbour);
+        sendCheckRequest();
+        return -1;
+    }
+    CTX->SYNCspent += sizeof(struct flood_req) + sigLen*sizeof(uint32_t);
+    free(signatures);
+
+    return 0;
+}
+
+/** Gestisce la ricezione di un messaggio di tipo
+ * MESSAGES_SYNC_DIGEST confrontando i nodi ricevuti
+ * con quelli del proprio Merkle tree.
+ */
+static void handle_MESSAGES_SYNC_DIGEST(struct peer_tcp* neighbour)
+{
+    struct merkle_node* nodes;
+    struct merkle_node* out;
+    size_t i, n, outLen;
+    uint32_t id, mine;
+    int echo, check, mustSend;
+    struct tm date;
+    ssize_t sent;
+
+    if (messages_read_sync_digest_body(neighbour->sockfd, &nodes, &n) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Error occurred while reading [MESSAGES_SYNC_DIGEST] body from socket (%d)...", neighbour->sockfd);
+        closeConnection(neighbour);
+        sendCheckRequest();
+        return;
+    }
+    unified_io_push(UNIFIED_IO_NORMAL, "[MESSAGES_SYNC_DIGEST]: [%ld] nodes", (long)n);
+
+    /* al più due figli per nodo ricevuto */
+    out = (n != 0 ? calloc(2*n, sizeof(struct merkle_node)) : NULL);
+    if (n != 0 && out == NULL)
+        fatal("calloc");
+
+    mustSend = 0;
+    for (i = outLen = 0; i != n; ++i)
+    {
+        echo = (nodes[i].id & SYNC_ECHO) != 0;
+        check = (nodes[i].id & SYNC_CHECK) != 0;
+        id = nodes[i].id & ~(SYNC_ECHO | SYNC_CHECK);
+        if (getMerkleNode(id, &mine) != 0)
+            continue;
+        if (mine == nodes[i].hash)
+        {
+            /* il vicino ha gli stessi registri per questi giorni */
+            (void)confirmMerkleNode(id);
+            continue;
+        }
+
+        if (getMerkleLeafDate(id, &date) == 0)
+        {
+            /* giorno diverso: recupera le entry mancanti */
+            if (!check && !SYNCallowed())
+                continue;
+            if (syncPullDay(neighbour, &date, check) != 0)
+            {
+                free(out);
+                free(nodes);
+                return;
+            }
+            if (!echo)
+            {
+                out[outLen].id = id | SYNC_ECHO | (check ? SYNC_CHECK : 0);
+                out[outLen++].hash = mine;
+                mustSend |= check;
+            }
+        }
+        else
+        {
+            /* si scende nei due sottoalberi */
+            out[outLen].id = 2*id;
+            (void)getMerkleNode(2*id, &out[outLen++].hash);
+            out[outLen].id = 2*id+1;
+            (void)getMerkleNode(2*id+1, &out[outLen++].hash);
+        }
+    }
+
+    if (outLen != 0 && (mustSend || SYNCallowed()))
+    {
+        sent = messages_send_sync_digest(neighbour->sockfd, out, outLen);
+        if (sent == -1)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "Error while sending response via (%d)", neighbour->sockfd);
+            closeConnection(neighbour);
+            sendCheckRequest();
+        }
+        else
+            CTX->SYNCspent += (size_t)sent;
+    }
+    free(out);
+    free(nodes);
+}
+
+/** Controllo esatto che segue il termine di un'istanza
+ * del FLOODING avviata dal peer corrente con un filtro
+ * di Bloom: invia a ogni vicino la foglia del Merkle
+ * tree del giorno cosicché, se il filtro ha fatto
+ * scartare delle firme in realtà sconosciute (falsi
+ * positivi), i due registri risultino diversi e le
+ * entry mancanti siano richieste con l'elenco esatto
+ * delle firme (vedi handle_MESSAGES_SYNC_DIGEST).
+ *
+ * Il giorno è chiuso al termine del FLOODING, prima
+ * che il controllo si concluda: le entry recuperate
+ * dopo aggiornano il registro chiuso e invalidano
+ * le risposte che lo coinvolgono (vedi
+ * mergeRegisterContent). Perciò la foglia è inviata
+ * sempre, marcata con SYNC_CHECK perché anche il
+ * vicino la serva a sincronizzazione esaurita o
+ * disattivata, ed è solo conteggiata in SYNCspent; la
+ * stima delle firme perse, ricavata dalle entry
+ * ricevute e dalla probabilità di falso positivo
+ * del filtro, è solo riportata. Un filtro vuoto
+ * non ha falsi positivi e non richiede controlli.
+ */
+static void bloomFollowUp(const struct FLOODINGdescriptor* des)
+{
+    struct merkle_node leaf;
+    double missed;
+    ssize_t sent;
+    size_t i;
+
+    if (des->bloomFP <= 0)
+        return;
+    if (getMerkleLeaf(&des->date, &leaf.id) != 0 || getMerkleNode(leaf.id, &leaf.hash) != 0)
+        return;
+    leaf.id |= SYNC_CHECK;
+
+    /* ogni firma sconosciuta è scartata con probabilità bloomFP */
+    missed = (des->bloomFP < 1 ? (double)des->received*des->bloomFP/(1 - des->bloomFP) : -1);
+    unified_io_push(UNIFIED_IO_NORMAL, "Bloom filter follow-up: %.2f signatures possibly missed", missed);
+    for (i = 0; i != *CTX->OUTpeersNumber; ++i)
+    {
+        if (CTX->OUTpeers[i].status != PCS_READY)
+            continue;
+        sent = messages_send_sync_digest(CTX->OUTpeers[i].sockfd, &leaf, 1);
+        if (sent == -1)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "Error while sending digest via (%d)", CTX->OUTpeers[i].sockfd);
+            closeConnection(&CTX->OUTpeers[i]);
+            sendCheckRequest();
+        }
+        else
+            CTX->SYNCspent += (size_t)sent;
+    }
+}
+
+/** Memorizza il contenuto di un messaggio di tipo
+ * MESSAGES_CACHE_DIGEST per decidere a quali vicini
+ * inviare le successive richieste REQ_DATA.
+ */
+static void handle_MESSAGES_CACHE_DIGEST(struct peer_tcp* neighbour)
+{
+    uint32_t levels, words;
+    uint32_t* data;
+
+    if (messages_read_cache_digest_body(neighbour->sockfd, &levels, &words, &data) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Error occurred while reading [MESSAGES_CACHE_DIGEST] body from socket (%d)...", neighbour->sockfd);
+        closeConnection(neighbour);
+        sendCheckRequest();
+        return;
+    }
+    unified_io_push(UNIFIED_IO_NORMAL, "[MESSAGES_CACHE_DIGEST]: [%u] levels of [%u] words",
+        (unsigned)levels, (unsigned)words);
+
+    free(neighbour->cacheDigest);
+    neighbour->cacheDigest = data;
+    neighbour->cacheDigestLevels = levels;
+    neighbour->cacheDigestWords = words;
+}
+
+/** Prosegue l'invio dei registri chiusi richiesti
+ * da un vicino con MESSAGES_BOOTSTRAP_REQ: genera
+ * nuovi blocchi solo finché nella sua coda di
+ * uscita ci sono meno di BOOTSTRAP_CHUNK byte di
+ * dati di massa, così da non accumulare in memoria
+ * l'intero archivio se il vicino è lento.
+ *
+ * Restituisce 0 in caso di successo e -1 se la
+ * connessione è stata chiusa per un errore.
+ */
+static int bootstrapContinue(struct peer_tcp* neighbour)
+{
+    void* data;
+    size_t size;
+    uint32_t days;
+    int more;
+
+    while (neighbour->bootstrapSending && neighbour->outBytes[OUT_BULK] < BOOTSTRAP_CHUNK)
+    {
+        more = getBootstrapChunk(&neighbour->bootstrapCursor, BOOTSTRAP_CHUNK, &data, &size, &days);
+        if (more == -1)
+            fatal("getBootstrapChunk");
+        if (messages_send_bootstrap_chunk(neighbour->sockfd, days, data, size, !more) == -1)
+        {
+            free(data);
+            unified_io_push(UNIFIED_IO_ERROR, "Error while sending response via (%d)", neighbour->sockfd);
+            closeConnection(neighbour);
+            sendCheckRequest();
+            return -1;
+        }
+        free(data);
+        neighbour->bootstrapSent += size;
+        if (!more)
+        {
+            neighbour->bootstrapSending = 0;
+            unified_io_push(UNIFIED_IO_NORMAL, "BOOTSTRAP: [%ld] bytes sent via (%d)",
+                (long)neighbour->bootstrapSent, neighbour->sockfd);
+        }
+    }
+    return 0;
+}
+
+/** Risponde a un messaggio MESSAGES_BOOTSTRAP_REQ
+ * inviando tutti i registri chiusi richiesti,
+ * in blocchi di circa BOOTSTRAP_CHUNK byte, man
+ * mano che la coda di uscita del vicino si svuota.
+ */
+static void handle_MESSAGES_BOOTSTRAP_REQ(struct peer_tcp* neighbour)
+{
+    struct tm cursor, last;
+
+    if (messages_read_bootstrap_req_body(neighbour->sockfd, &cursor) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Error occurred while reading [MESSAGES_BOOTSTRAP_REQ] body from socket (%d)...", neighbour->sockfd);
+        closeConnection(neighbour);
+        sendCheckRequest();
+        return;
+    }
+
+    /* i registri più recenti non sono ancora chiusi */
+    last = lastRegisterClosed();
+    if (time_date_cmp(&cursor, &last) > 0)
+        cursor = last;
+
+    /* una nuova richiesta sostituisce la precedente */
+    neighbour->bootstrapCursor = cursor;
+    neighbour->bootstrapSent = 0;
+    neighbour->bootstrapSending = 1;
+    (void)bootstrapContinue(neighbour);
+}
+
+/** Gestisce la ricezione di un blocco della
+ * risposta a MESSAGES_BOOTSTRAP_REQ caricandone
+ * il contenuto nei registri.
+ */
+static void handle_MESSAGES_BOOTSTRAP_CHUNK(struct peer_tcp* neighbour)
+{
+    void* data;
+    size_t size, entries;
+    uint32_t days;
+    int last;
+    struct timeval now;
+
+    if (messages_read_bootstrap_chunk_body(neighbour->sockfd, &days, &data, &size, &last) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Error occurred while reading [MESSAGES_BOOTSTRAP_CHUNK] body from socket (%d)...", neighbour->sockfd);
+        closeConnection(neighbour);
+        sendCheckRequest();
+        return;
+    }
+
+    if (neighbour->sockfd != CTX->BOOTSTRAPfd)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "UNREQUESTED BOOTSTRAP CHUNK RECEIVED!");
+        free(data);
+        return;
+    }
+
+    if (loadBootstrapChunk(data, size, days, &entries) != 0)
+    {
+        free(data);
+        unified_io_push(UNIFIED_IO_ERROR, "Malformed [MESSAGES_BOOTSTRAP_CHUNK] from socket (%d)", neighbour->sockfd);
+        closeConnection(neighbour);
+        sendCheckRequest();
+        return;
+    }
+    free(data);
+    CTX->BOOTSTRAPdays += days;
+    CTX->BOOTSTRAPentries += entries;
+
+    if (last)
+    {
+        if (gettimeofday(&now, NULL) != 0)
+            fatal("gettimeofday");
+        unified_io_push(UNIFIED_IO_NORMAL, "BOOTSTRAP: [%ld] days and [%ld] entries received in %ld ms",
+            (long)CTX->BOOTSTRAPdays, (long)CTX->BOOTSTRAPentries,
+            (long)((now.tv_sec-CTX->BOOTSTRAPstart.tv_sec)*1000 + (now.tv_usec-CTX->BOOTSTRAPstart.tv_usec)/1000));
+        CTX->BOOTSTRAPneeded = 0;
+        CTX->BOOTSTRAPfd = -1;
+    }
+}
+
+/** Termina l'istanza del protocollo FLOODING se non
+ * si attendono più risposte dai vicini e i worker hanno
+ * fuso con i registri tutte quelle ricevute: se era del
+ * peer corrente la rimuove, altrimenti risponde a chi
+ * l'aveva inoltrata.
+ */
+static void FLOODINGdescriptor_settle(struct FLOODINGdescriptor* des)
+{
+    if (set_size(des->socketSet) != 0 || des->pendingWork != 0)
+        return;
+
+    unified_io_push(UNIFIED_IO_NORMAL, "All responses for original request received!");
+    /* verifica se la query era stata generata dal peer corrente */
+    if (des->mine)
+    {
+        /* Sì: è andato tutto bene - possiamo considerare il protocollo terminato */
+        unified_io_push(UNIFIED_IO_NORMAL, "FLOODING protocol instance successfully terminated!");
+        if (des->bloom)
+            bloomFollowUp(des);
+        FLOODINGdescriptor_remove(des);
+    }
+    else
+    {
+        /* NO: se non se ne aspettano si può rispondere a chi l'ha inviata */
+        unified_io_push(UNIFIED_IO_NORMAL, "FLOODING RESPONSE will be sent to requester!");
+        cmdResponseFLOODING(FLOODINGdescriptorHash(des));
+    }
+}
+
 /** Funzione ausiliaria per gestire la ricezione
  * di messaggi di tipo MESSAGES_REQ_ENTRIES.
  * Questi messaggi contengono delle entry che il peer
@@ -1794,6 +3512,10 @@ static void handle_MESSAGES_REQ_ENTRIES(struct peer_tcp* neighbour)
     long int hash;
     /* per l'output */
     char dateStr[16];
+    /* la risposta era attesa dall'istanza */
+    int expected;
+    /* per affidare la fusione a un worker */
+    struct WORKtask* task;
 
     unified_io_push(UNIFIED_IO_NORMAL, "Reading body of [MESSAGES_REQ_ENTRIES] from socket (%d)...", neighbour->sockfd);
     /* legger il corpo di un messaggio */
@@ -1816,16 +3538,47 @@ static void handle_MESSAGES_REQ_ENTRIES(struct peer_tcp* neighbour)
     unified_io_push(UNIFIED_IO_NORMAL, "[MESSAGES_REQ_ENTRIES]: "
         "[Auth:%lu][Req:%lu] %s", (unsigned long)authID, (unsigned long)reqID, dateStr);
 
+    /* non è la risposta a una richiesta ma un push */
+    if (reqID == PUSH_REQ_ID)
+    {
+        handlePush(neighbour->sockfd, authID, &date, R);
+        return;
+    }
+    /* risposta della sincronizzazione in background */
+    if (IS_SYNC_REQ_ID(reqID))
+    {
+        if (R != NULL)
+        {
+            unified_io_push(UNIFIED_IO_NORMAL, "SYNC: [%ld] entries received", (long)register_size(R));
+            task = WORKtask_create(WORK_MERGE, neighbour);
+            task->R = R;
+            task->sync = 1;
+            WORKsubmit(task);
+        }
+        return;
+    }
+
+    unified_io_push(UNIFIED_IO_NORMAL, "Searching request descriptor...");
+    /* pesca il descrittore della query per vedere se abbia senso la ricezione */
+    des = FLOODINGdescriptor_findByIDs(authID, reqID);
+    expected = des != NULL && set_has(des->socketSet, neighbour->sockfd) == 1;
+
     /* carica i dati se ci sono */
     if (R != NULL)
     {
         unified_io_push(UNIFIED_IO_NORMAL, "Adding new data to peer registers! [%ld] new entries!", (long)register_size(R));
-        /* se non è vuoto aggiunge il contenuto ai dati posseduti dal peer */
-        /* fonde questo registro con quelli già posseduti */
-        if (mergeRegisterContent(R) != 0)
-            fatal("mergeRegisterContent");
-        /* ora libera la memoria */
-        register_destroy(R);
+        /* la fusione con i registri posseduti è svolta da un
+         * worker, l'istanza non termina prima che sia conclusa */
+        task = WORKtask_create(WORK_MERGE, neighbour);
+        task->R = R;
+        if (expected)
+        {
+            task->counted = 1;
+            task->hash = FLOODINGdescriptorHash(des);
+            des->received += (size_t)register_size(R);
+            ++des->pendingWork;
+        }
+        WORKsubmit(task);
         R = NULL;
     }
     else
@@ -1833,15 +3586,12 @@ static void handle_MESSAGES_REQ_ENTRIES(struct peer_tcp* neighbour)
         unified_io_push(UNIFIED_IO_ERROR, "Message [MESSAGES_REQ_ENTRIES] was empty!");
     }
 
-    unified_io_push(UNIFIED_IO_NORMAL, "Searching request descriptor...");
-    /* pesca il descrittore della query per vedere se abbia senso la ricezione */
-    des = FLOODINGdescriptor_findByIDs(authID, reqID);
     /* valuta se è vuoto */
     if (des != NULL)
     {
         /* calcola l'hash */
         hash = FLOODINGdescriptorHash(des);
-        if (set_has(des->socketSet, neighbour->sockfd) == 1)
+        if (expected)
         {
             /* rimuove anche dal descrittore del vicino */
             if (set_remove(neighbour->FLOODINGsend, hash) != 0)
@@ -1849,33 +3599,17 @@ static void handle_MESSAGES_REQ_ENTRIES(struct peer_tcp* neighbour)
             /* rimuove il socket da quelli associati alla query */
             if (set_remove(des->socketSet, neighbour->sockfd) != 0)
                 fatal("set_remove");
-            /* controlla se si aspettano altri messaggi per soddisfare la query */
-            if (set_size(des->socketSet) == 0)
-            {
-                unified_io_push(UNIFIED_IO_NORMAL, "All responses for original request received!");
-                /* verifica se la query era stata generata dal peer corrente */
-                if (des->mine)
-                {
-                    /* Sì: è andato tutto bene - possiamo considerare il protocollo terminato */
-                    unified_io_push(UNIFIED_IO_NORMAL, "FLOODING protocol instance successfully terminated!");
-                    FLOODINGdescriptor_remove(des);
-                }
-                else
-                {
-                    /* NO: se non se ne aspettano si può rispondere a chi l'ha inviata */
-                    unified_io_push(UNIFIED_IO_NORMAL, "FLOODING RESPONSE will be sent to requester!");
-                    cmdResponseFLOODING(hash);
-                }
-            }
+            /* controlla se si aspettano altri messaggi per soddisfare la query */
+            FLOODINGdescriptor_settle(des);
         } /* situazione molto strana - non ha senso, abortire? */
         else
         {
             unified_io_push(UNIFIED_IO_ERROR, "UNREQUESTED RESPONSE RECEIVED!!!");
         }
-    } /* altrimenti non ha senso - si potrebbe sfruttare per il push dei dati */
+    } /* altrimenti non ha senso - risposta giunta dopo la chiusura dell'istanza */
     else
     {
-        unified_io_push(UNIFIED_IO_ERROR, "No request descriptor found! Maybe is it a push?");
+        unified_io_push(UNIFIED_IO_ERROR, "No request descriptor found! Late response?");
     }
 }
 
@@ -1931,6 +3665,8 @@ static void handleNeighbour(struct peer_tcp* neighbour)
             if (neighbour->FLOODINGreceived == NULL || neighbour->FLOODINGsend == NULL)
                 fatal("set_init");
             unified_io_push(UNIFIED_IO_NORMAL, "Successfully connected to socket (%d)", sockfd);
+            /* un peer appena arrivato recupera i giorni passati */
+            bootstrapRequest(neighbour);
         }
         break;
     case MESSAGES_DETATCH:
@@ -1948,12 +3684,32 @@ static void handleNeighbour(struct peer_tcp* neighbour)
     /* FLOODING protocol */
     case MESSAGES_FLOOD_FOR_ENTRIES:
         unified_io_push(UNIFIED_IO_NORMAL, "Received [MESSAGES_FLOOD_FOR_ENTRIES] from (%d)", sockfd);
-        handle_MESSAGES_FLOOD_FOR_ENTRIES(neighbour);
+        handle_MESSAGES_FLOOD_FOR_ENTRIES(neighbour, 0);
+        break;
+    case MESSAGES_FLOOD_BLOOM:
+        unified_io_push(UNIFIED_IO_NORMAL, "Received [MESSAGES_FLOOD_BLOOM] from (%d)", sockfd);
+        handle_MESSAGES_FLOOD_FOR_ENTRIES(neighbour, 1);
         break;
     case MESSAGES_REQ_ENTRIES:
         unified_io_push(UNIFIED_IO_NORMAL, "Received [MESSAGES_REQ_ENTRIES] from (%d)", sockfd);
         handle_MESSAGES_REQ_ENTRIES(neighbour);
         break;
+    case MESSAGES_SYNC_DIGEST:
+        unified_io_push(UNIFIED_IO_NORMAL, "Received [MESSAGES_SYNC_DIGEST] from (%d)", sockfd);
+        handle_MESSAGES_SYNC_DIGEST(neighbour);
+        break;
+    case MESSAGES_CACHE_DIGEST:
+        unified_io_push(UNIFIED_IO_NORMAL, "Received [MESSAGES_CACHE_DIGEST] from (%d)", sockfd);
+        handle_MESSAGES_CACHE_DIGEST(neighbour);
+        break;
+    case MESSAGES_BOOTSTRAP_REQ:
+        unified_io_push(UNIFIED_IO_NORMAL, "Received [MESSAGES_BOOTSTRAP_REQ] from (%d)", sockfd);
+        handle_MESSAGES_BOOTSTRAP_REQ(neighbour);
+        break;
+    case MESSAGES_BOOTSTRAP_CHUNK:
+        unified_io_push(UNIFIED_IO_NORMAL, "Received [MESSAGES_BOOTSTRAP_CHUNK] from (%d)", sockfd);
+        handle_MESSAGES_BOOTSTRAP_CHUNK(neighbour);
+        break;
     default:
         /* nel caso si ricevano messaggi di tipo sconosciuto: */
         /* chiude la connessione */
@@ -1964,19 +3720,21 @@ static void handleNeighbour(struct peer_tcp* neighbour)
     }
 }
 
-/** Funzione ausiliaria che interroga il server
- * per individuare la presenza di eventuali nuovi
- * vicini ed eventualmente avviare la procedura
- * di connessione nei loro confronti.
+
+/** Funzione ausiliaria che adegua le connessioni
+ * ai vicini forniti: avvia la procedura di
+ * connessione verso quelli nuovi e si stacca
+ * da chi non è più tra loro.
  */
-static void tryToReachNeighbours(
+static void reconcileNeighbours(
             struct peer_tcp reachedPeers[],
-            size_t* reachedNumber
+            size_t* reachedNumber,
+            const struct peer_data currentNeighbours[],
+            size_t numCurrentNeighbours
             )
 {
     char buffer[32];
-    struct peer_data currentNeighbours[MAX_NEIGHBOUR_NUMBER];
-    size_t i, j, numCurrentNeighbours, connNumber;
+    size_t i, j, connNumber;
     u_int32_t otherID;
     struct peer_tcp* newSlot;
     int newSock; /* socket per provare a connettersi */
@@ -1985,15 +3743,7 @@ static void tryToReachNeighbours(
     /* numero delle connessioni già presenti */
     connNumber = *reachedNumber;
 
-    unified_io_push(UNIFIED_IO_NORMAL, "Requesting discovery server about neighbours...");
-    if (UDPcheck(currentNeighbours, &numCurrentNeighbours) == -1)
-    {
-        unified_io_push(UNIFIED_IO_ERROR, "Cannot reach discovery server!");
-        sendCheckRequest(); /* bisognerebbe mettere un limite ai fallimenti */
-        return;
-    }
-    unified_io_push(UNIFIED_IO_NORMAL, "Discovery server has answered!");
-    /* stampa il risultato */
+    /* stampa i vicini */
     print_neighbours(currentNeighbours, numCurrentNeighbours);
 
     /* sono stati ottenuti dei risultati */
@@ -2003,7 +3753,7 @@ static void tryToReachNeighbours(
         unified_io_push(UNIFIED_IO_NORMAL, "%d)handling-> %s", i, buffer);
         otherID = peer_data_extract_ID(&currentNeighbours[i]);
         /* ha ID più alto: sarà l'altro a dover iniziare la connessione */
-        if (otherID > peerID)
+        if (otherID > CTX->peerID)
         {
             unified_io_push(UNIFIED_IO_NORMAL, "Skipped because of ID order");
             continue;
@@ -2062,16 +3812,44 @@ static void tryToReachNeighbours(
         otherID = peer_data_extract_ID(&reachedPeers[i].data);
         /* lo cerca tra i vicini */
         for (j = 0; j != numCurrentNeighbours; ++j)
-        {
             if (otherID == peer_data_extract_ID(&currentNeighbours[j]))
-                continue; /* trovato - può ignorare */
-        }
+                break;
+        if (j != numCurrentNeighbours)
+            continue; /* trovato - può ignorare */
         /* la connessione va chiusa - gestisce la terminazione */
         /* invia il messaggio di terminazione */
         handlePeerDetach(&reachedPeers[i]);
     }
 }
 
+/** Funzione ausiliaria che interroga il server
+ * per individuare la presenza di eventuali nuovi
+ * vicini ed eventualmente avviare la procedura
+ * di connessione nei loro confronti.
+ */
+static void tryToReachNeighbours(
+            struct peer_tcp reachedPeers[],
+            size_t* reachedNumber
+            )
+{
+    struct peer_data currentNeighbours[MAX_NEIGHBOUR_NUMBER];
+    size_t numCurrentNeighbours;
+
+    unified_io_push(UNIFIED_IO_NORMAL, "Requesting discovery server about neighbours...");
+    if (UDPcheck(currentNeighbours, &numCurrentNeighbours) == -1)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "Cannot reach discovery server!");
+        /* ritenta più tardi, non appena fallisce
+         * (es. in chiusura) si girerebbe a vuoto */
+        CTX->CHECKdeadline = time(NULL) + CHECK_RETRY;
+        return;
+    }
+    unified_io_push(UNIFIED_IO_NORMAL, "Discovery server has answered!");
+
+    reconcileNeighbours(reachedPeers, reachedNumber,
+            currentNeighbours, numCurrentNeighbours);
+}
+
 /** Funzione ausiliaria che si occupa di gestire
  * eventuali condizioni eccezionali coinvolgenti
  * i socket tcp che dovrebbe connettere ai vicini
@@ -2091,7 +3869,7 @@ static void handleNeighbourSocketException(struct peer_tcp* neighbour)
  * TCP_COMMAND_QUERY
  */
 static void handle_TCP_COMMAND_QUERY(
-            int cmdPipe,
+            const struct TCPcommand* command,
             struct peer_tcp reachedPeers[],
             size_t* reachedNumber
             )
@@ -2103,12 +3881,15 @@ static void handle_TCP_COMMAND_QUERY(
     char buffer[64] = "";
     int i, limit;
     int found;
+    /* ID del peer corrente e di tutti i vicini contattati */
+    uint32_t visited[MAX_TCP_CONNECTION+1];
+    uint32_t length = 0;
 
     /* SVOLGIMENTO protocollo REQ_DATA */
 
-    /* legge la query dalla pipe */
-    if (read(cmdPipe, (void*)&query, qLen) != (ssize_t)qLen)
-        fatal("Error reading query from pipe");
+    /* legge la query dal comando */
+    if (TCPcommand_body(command, (void*)&query, qLen) != 0)
+        fatal("Error reading query from command");
     /* controllo di integrità */
     if(checkQuery(&query) != 0)
         fatal("Malformed query received by TCP thread");
@@ -2117,23 +3898,36 @@ static void handle_TCP_COMMAND_QUERY(
         stringifyQuery(&query, buffer, sizeof(buffer)));
 
     /* 2) acquisizione del mutex */
-    if (pthread_mutex_lock(&REQ_DATAmutex) != 0)
+    if (pthread_mutex_lock(&CTX->REQ_DATAmutex) != 0)
         fatal("pthread_mutex_lock");
 
     /* 3) controlla variabili */
-    if (REQ_DATAflag && REQ_DATAisThisQuery(&query))
+    if (CTX->REQ_DATAflag && REQ_DATAisThisQuery(&query))
     {
         /* 4) controlla tutti i socket posseduti */
         unified_io_push(UNIFIED_IO_NORMAL, "REQ_DATA query matched!");
         limit = (int)*reachedNumber;
         found = 0; /* per verificare di avere almeno un invio */
+        /* i vicini non devono inoltrarsi la richiesta a vicenda */
+        visited[length++] = CTX->peerID;
+        for (i = 0; i < limit; ++i)
+            if (reachedPeers[i].status == PCS_READY)
+                visited[length++] = peer_data_extract_ID(&reachedPeers[i].data);
         for (i = 0; i < limit; ++i)
         {
             if (reachedPeers[i].status == PCS_READY)
             {
+                /* il vicino ha annunciato di non poter rispondere */
+                if (!mayHoldAnswer(&reachedPeers[i], hashQuery(&query), REQ_DATA_TTL))
+                {
+                    unified_io_push(UNIFIED_IO_NORMAL, "Peer [%u] cannot have the answer: skipped",
+                        peer_data_extract_ID(&reachedPeers[i].data));
+                    continue;
+                }
                 unified_io_push(UNIFIED_IO_NORMAL, "Sending query to peer [%u] via socket (%d)",
                     peer_data_extract_ID(&reachedPeers[i].data), reachedPeers[i].sockfd);
-                if (messages_send_req_data(reachedPeers[i].sockfd, peerID, &query) == -1)
+                if (messages_send_req_data(reachedPeers[i].sockfd, CTX->peerID, &query,
+                        REQ_DATA_TTL, length, visited) == -1)
                 {
                     unified_io_push(UNIFIED_IO_ERROR, "No neighbours to ask quesy result!");
                     /* chiude la connessione */
@@ -2143,7 +3937,7 @@ static void handle_TCP_COMMAND_QUERY(
                     continue; /* al prossimo socket! */
                 }
                 /* aggiunge il descrittore a quelli controllati */
-                if (set_add(REQ_DATAsocket, reachedPeers[i].sockfd) != 0)
+                if (set_add(CTX->REQ_DATAsocket, reachedPeers[i].sockfd) != 0)
                     fatal("set_add");
                 found = 1; /* Ha trovato un vicino! */
             }
@@ -2151,8 +3945,8 @@ static void handle_TCP_COMMAND_QUERY(
         if (!found)
         {
             unified_io_push(UNIFIED_IO_ERROR, "No neighbours to ask query result!");
-            pthread_cond_signal(&REQ_DATAcond);
-            REQ_DATAno_peer = 1;
+            pthread_cond_signal(&CTX->REQ_DATAcond);
+            CTX->REQ_DATAno_peer = 1;
         }
     }
     else
@@ -2160,7 +3954,7 @@ static void handle_TCP_COMMAND_QUERY(
         unified_io_push(UNIFIED_IO_ERROR, "REQ_DATA query mismatch!");
     }
     /* 5) termina fase SVOLGIMENTO */
-    if (pthread_mutex_unlock(&REQ_DATAmutex) != 0)
+    if (pthread_mutex_unlock(&CTX->REQ_DATAmutex) != 0)
         fatal("pthread_mutex_unlock");
 }
 
@@ -2169,7 +3963,7 @@ static void handle_TCP_COMMAND_QUERY(
  * protocollo FLOODING
  */
 static void handle_TCP_COMMAND_FLOODING(
-            int cmdPipe,
+            const struct TCPcommand* command,
             struct peer_tcp reachedPeers[],
             size_t* reachedNumber
             )
@@ -2186,10 +3980,13 @@ static void handle_TCP_COMMAND_FLOODING(
     /* dati da usare nei messaggi MESSAGES_FLOOD_FOR_ENTRIES */
     uint32_t* signatures;
     size_t sigNumber, j;
+    /* eventuale filtro di Bloom da inviare al loro posto */
+    uint32_t* words = NULL;
+    size_t nWords = 0;
 
     /* legge l'ID del descrittore da recuperare */
-    if (read(cmdPipe, (void*)&floodingCmdHash, sizeof(long)) != (ssize_t)sizeof(long))
-        fatal("Error reading descriptor hash from pipe");
+    if (TCPcommand_body(command, (void*)&floodingCmdHash, sizeof(long)) != 0)
+        fatal("Error reading descriptor hash from command");
 
     des = FLOODINGdescriptor_findByHash(floodingCmdHash);
     if (des == NULL)
@@ -2209,6 +4006,21 @@ static void handle_TCP_COMMAND_FLOODING(
     for(j = 0; j != sigNumber; ++j)
         unified_io_push(UNIFIED_IO_NORMAL, "\t%u) [%u]", j, signatures[j]);
 
+    /* il filtro conviene solo se più corto dell'elenco */
+    if (des->bloom && bloom_words(sigNumber) < sigNumber)
+    {
+        nWords = bloom_words(sigNumber);
+        words = calloc(nWords, sizeof(uint32_t));
+        if (words == NULL)
+            fatal("calloc");
+        for (j = 0; j != sigNumber; ++j)
+            bloom_add(words, nWords, FLOOD_BLOOM_SEED(des->authorID, des->reqID), signatures[j]);
+        des->bloomFP = bloom_fp_rate(words, nWords);
+        unified_io_push(UNIFIED_IO_NORMAL, "Using a Bloom filter of %u words", (unsigned int)nWords);
+    }
+    else
+        des->bloom = 0;
+
     /* cerca tutti i vicini */
     for (i = 0; i != limit; ++i)
     {
@@ -2218,9 +4030,11 @@ static void handle_TCP_COMMAND_FLOODING(
             unified_io_push(UNIFIED_IO_NORMAL, "Sending [MESSAGES_FLOOD_FOR_ENTRIES]"
                 " via socket (%d)", reachedPeers[i].sockfd);
             /* invia il messaggio */
-            if (messages_send_flood_req(reachedPeers[i].sockfd,
-                    des->authorID, des->reqID,
-                    &des->date, sigNumber, signatures
+            if ((words != NULL
+                    ? messages_send_flood_bloom(reachedPeers[i].sockfd,
+                        des->authorID, des->reqID, &des->date, nWords, words)
+                    : messages_send_flood_req(reachedPeers[i].sockfd,
+                        des->authorID, des->reqID, &des->date, sigNumber, signatures)
                 ) == -1)
             {
                 /* gestisce l'eventuale fallimento */
@@ -2242,6 +4056,8 @@ static void handle_TCP_COMMAND_FLOODING(
             }
         }
     }
+    free(words);
+    free(signatures);
     /* se non si è riuscito a inviare niente a nessuno */
     if (!any)
     {
@@ -2258,7 +4074,7 @@ static void handle_TCP_COMMAND_FLOODING(
  * la "query FLOODING" ricevuta.
  */
 static void handle_TCP_COMMAND_PROPAGATE(
-            int cmdPipe,
+            const struct TCPcommand* command,
             struct peer_tcp reachedPeers[],
             size_t* reachedNumber
             )
@@ -2271,8 +4087,8 @@ static void handle_TCP_COMMAND_PROPAGATE(
     int any = 0;
 
     /* legge l'hash della richiesta */
-    if (read(cmdPipe, (void*)&hash, sizeof(long)) != (ssize_t)sizeof(long))
-        fatal("Error reading descriptor hash from pipe");
+    if (TCPcommand_body(command, (void*)&hash, sizeof(long)) != 0)
+        fatal("Error reading descriptor hash from command");
 
     unified_io_push(UNIFIED_IO_NORMAL, "Handling: [hash:%ld]", hash);
     unified_io_push(UNIFIED_IO_NORMAL, "Searching descriptor...");
@@ -2300,8 +4116,10 @@ static void handle_TCP_COMMAND_PROPAGATE(
 
             unified_io_push(UNIFIED_IO_NORMAL, "Sending [MESSAGES_FLOOD_FOR_ENTRIES]"
                 " via socket (%d)", reachedPeers[i].sockfd);
-            /* prova a inviare il messaggio */
-            if (messages_send_flood_req(reachedPeers[i].sockfd,
+            /* prova a inviare il messaggio, il filtro
+             * di Bloom viaggia così come è stato ricevuto */
+            if ((des->bloom ? messages_send_flood_bloom : messages_send_flood_req)(
+                    reachedPeers[i].sockfd,
                     des->authorID, des->reqID, &des->date,
                     des->numSignatures, des->signatures
                 ) == -1)
@@ -2338,7 +4156,7 @@ static void handle_TCP_COMMAND_PROPAGATE(
  * invia al socket mittente una risposta per il protocollo FLOODING.
  */
 static void handle_TCP_COMMAND_SEND_FLOOD_RESPONSE(
-            int cmdPipe,
+            const struct TCPcommand* command,
             struct peer_tcp reachedPeers[],
             size_t* reachedNumber
             )
@@ -2347,14 +4165,12 @@ static void handle_TCP_COMMAND_SEND_FLOOD_RESPONSE(
     struct FLOODINGdescriptor* des;
     size_t i, limit = *reachedNumber;
     int sender; /* fd del socket da usare */
-    /* per inviare il messaggio */
-    struct ns_entry* entries;
-    size_t entryNum;
-    struct set* toSkip;
+    /* per preparare il messaggio */
+    struct WORKtask* task;
 
     /* legge l'hash del messaggio da gesture */
-    if (read(cmdPipe, (void*)&hash, sizeof(long)) != (ssize_t)sizeof(long))
-        fatal("Error reading descriptor hash from pipe");
+    if (TCPcommand_body(command, (void*)&hash, sizeof(long)) != 0)
+        fatal("Error reading descriptor hash from command");
 
     unified_io_push(UNIFIED_IO_NORMAL, "Handling request: [HASH:%ld]", hash);
 
@@ -2366,6 +4182,13 @@ static void handle_TCP_COMMAND_SEND_FLOOD_RESPONSE(
         unified_io_push(UNIFIED_IO_ERROR, "ERROR: request descriptor NOT FOUND!");
         return;
     }
+    /* dei worker stanno ancora fondendo delle risposte:
+     * lo farà l'ultimo di essi (FLOODINGdescriptor_settle) */
+    if (des->pendingWork != 0)
+    {
+        unified_io_push(UNIFIED_IO_NORMAL, "Response delayed: [%ld] merges pending", (long)des->pendingWork);
+        return;
+    }
     /* controllo di consistenza */
     if (set_size(des->socketSet) != 0)
         fatal("set_size");
@@ -2397,24 +4220,83 @@ static void handle_TCP_COMMAND_SEND_FLOOD_RESPONSE(
     }
     else
     {
-        /* insieme delle firme da evitare */
-        toSkip = make_set_from_uint32_t(des->signatures, des->numSignatures);
-        if (toSkip == NULL)
-            fatal("make_set_from_uint32_t");
-        /* invia il messaggio di risposta */
-        if (getNsRegisterData(&des->date, &entries, &entryNum, toSkip) != 0)
+        /* la risposta è preparata da un worker e inviata
+         * da handle_TCP_COMMAND_WORK_DONE */
+        task = WORKtask_create(WORK_FLOOD_RESPONSE, &reachedPeers[i]);
+        task->des = des;
+        task->hash = hash;
+        WORKsubmit(task);
+    }
+}
+
+/** Funzione ausiliaria che gestisce il comando
+ * TCP_COMMAND_WORK_DONE completando sulla rete gli
+ * effetti del lavoro svolto da un worker, purché la
+ * connessione a cui si riferisce sia ancora attiva.
+ */
+static void handle_TCP_COMMAND_WORK_DONE(
+            const struct TCPcommand* command,
+            struct peer_tcp reachedPeers[],
+            size_t* reachedNumber
+            )
+{
+    struct WORKtask* task;
+    struct FLOODINGdescriptor* des;
+    struct peer_tcp* conn;
+    size_t i;
+
+    if (TCPcommand_body(command, (void*)&task, sizeof(task)) != 0)
+        fatal("Error reading work from command");
+
+    /* cerca la connessione */
+    conn = NULL;
+    for (i = 0; i != *reachedNumber; ++i)
+        if (reachedPeers[i].status == PCS_READY
+            && reachedPeers[i].sockfd == task->sockfd
+            && reachedPeers[i].creation_time == task->creation_time)
+        {
+            conn = &reachedPeers[i];
+            break;
+        }
+
+    switch (task->type)
+    {
+    case WORK_MERGE:
+        if (task->sync)
+        {
+            if (task->result == -1)
+                unified_io_push(UNIFIED_IO_ERROR, "SYNC: no register for received entries!");
+            break;
+        }
+        if (task->result == -1)
+            fatal("mergeRegisterContent");
+        if (!task->counted)
+            break;
+        des = FLOODINGdescriptor_findByHash(task->hash);
+        if (des == NULL)
+            fatal("FLOODINGdescriptor_findByHash");
+        --des->pendingWork;
+        /* potrebbe terminare l'istanza */
+        FLOODINGdescriptor_settle(des);
+        break;
+
+    case WORK_FLOOD_RESPONSE:
+        if (task->result != 0)
             fatal("getNsRegisterData");
+        des = task->des;
         /* Quanti ne ha trovati? */
-        unified_io_push(UNIFIED_IO_NORMAL, "Found [%ld] entries!", entryNum);
-        /* distrugge l'insieme */
-        set_destroy(toSkip);    toSkip = NULL;
+        unified_io_push(UNIFIED_IO_NORMAL, "Found [%ld] entries!", (long)task->entryNum);
+        if (conn == NULL)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "ERROR: sender disconnected!");
+        }
         /* invia il messaggio di risposta */
-        if (messages_send_flood_ack(sender, des->authorID, des->reqID,
-            &des->date, entries, entryNum) != 0)
+        else if (messages_send_flood_ack(conn->sockfd, des->authorID, des->reqID,
+            &des->date, task->entries, task->entryNum) != 0)
         {
             unified_io_push(UNIFIED_IO_NORMAL, "Error occurred while sending FLOODING response!");
             /* chiude la connessione */
-            closeConnection(&reachedPeers[i]);
+            closeConnection(conn);
             /* avvia la procedura di ripristino */
             sendCheckRequest();
         }
@@ -2423,38 +4305,319 @@ static void handle_TCP_COMMAND_SEND_FLOOD_RESPONSE(
             /* inviata con successo */
             unified_io_push(UNIFIED_IO_NORMAL, "FLOODING RESPONSE SENT!");
         }
-        /* libera sempre la memoria allocata */
-        free(entries);
         /* distrugge il descrittore */
         FLOODINGdescriptor_remove(des);
+        break;
+    }
+
+    WORKtask_destroy(task);
+}
+
+/** Funzione ausiliaria che gestisce il comando
+ * TCP_COMMAND_RELAY_QUERY inoltrando la richiesta a
+ * tutti i vicini non ancora raggiunti oppure, se non
+ * ce ne sono o non possono più rispondere, inviando
+ * al mittente una risposta negativa.
+ */
+static void handle_TCP_COMMAND_RELAY_QUERY(
+            const struct TCPcommand* command,
+            struct peer_tcp reachedPeers[],
+            size_t* reachedNumber
+            )
+{
+    struct REQ_DATArelay* relay;
+    size_t i, limit = *reachedNumber;
+    struct set* skip;
+    uint32_t* visited;
+
+    if (TCPcommand_body(command, (void*)&relay, sizeof(relay)) != 0)
+        fatal("Error reading relay data from command");
+
+    --relay->queued;
+    /* già conclusa, per esempio perché scaduta */
+    if (relay->done)
+    {
+        list_eliminate(CTX->REQ_DATArelays, &REQ_DATArelay_isDone);
+        return;
+    }
+    if (relay->forwarded || relay->source == NULL)
+    {
+        unified_io_push(UNIFIED_IO_NORMAL, "REQ_DATA: no answer for relayed query");
+        REQ_DATArelay_answer(relay, NULL);
+        return;
+    }
+
+    /* i vicini contattati si aggiungono a quelli già
+     * raggiunti così che non si inoltrino la richiesta
+     * a vicenda */
+    skip = make_set_from_uint32_t(relay->visited, relay->length);
+    visited = realloc(relay->visited, (relay->length+1+limit)*sizeof(uint32_t));
+    if (visited == NULL)
+        fatal("realloc");
+    relay->visited = visited;
+    if (relay->length < REQ_DATA_MAX_VISITED)
+        visited[relay->length++] = CTX->peerID;
+    for (i = 0; i != limit; ++i)
+        if (reachedPeers[i].status == PCS_READY && reachedPeers[i].sockfd != relay->sourceFd
+            && !set_has(skip, peer_data_extract_ID(&reachedPeers[i].data))
+            && relay->length < REQ_DATA_MAX_VISITED)
+            visited[relay->length++] = peer_data_extract_ID(&reachedPeers[i].data);
+
+    for (i = 0; i != limit; ++i)
+    {
+        if (reachedPeers[i].status != PCS_READY || reachedPeers[i].sockfd == relay->sourceFd
+            || set_has(skip, peer_data_extract_ID(&reachedPeers[i].data))
+            || !mayHoldAnswer(&reachedPeers[i], hashQuery(&relay->query), relay->ttl))
+            continue;
+
+        unified_io_push(UNIFIED_IO_NORMAL, "Relaying query to peer [%u] via socket (%d)",
+            peer_data_extract_ID(&reachedPeers[i].data), reachedPeers[i].sockfd);
+        if (messages_send_req_data(reachedPeers[i].sockfd, relay->authorID, &relay->query,
+                relay->ttl, relay->length, relay->visited) == -1)
+        {
+            closeConnection(&reachedPeers[i]);
+            sendCheckRequest();
+            continue;
+        }
+        if (set_add(relay->pending, reachedPeers[i].sockfd) != 0)
+            fatal("set_add");
+    }
+    set_destroy(skip);
+
+    relay->forwarded = 1;
+    if (set_size(relay->pending) == 0)
+        REQ_DATArelay_answer(relay, NULL);
+}
+
+/** Funzione ausiliaria che gestisce il comando
+ * TCP_COMMAND_PUSH inviando le entry a tutti i
+ * vicini pronti tranne quello da cui sono state
+ * eventualmente ricevute.
+ */
+static void handle_TCP_COMMAND_PUSH(
+            const struct TCPcommand* command,
+            struct peer_tcp reachedPeers[],
+            size_t* reachedNumber
+            )
+{
+    struct PUSHdata* push;
+    size_t i, limit = *reachedNumber;
+    char dateStr[16];
+
+    /* legge il puntatore ai dati */
+    if (TCPcommand_body(command, (void*)&push, sizeof(push)) != 0)
+        fatal("Error reading push data from command");
+
+    if (time_serialize_date(dateStr, &push->date) == NULL)
+        fatal("time_serialize_date");
+    unified_io_push(UNIFIED_IO_NORMAL, "PUSH: [Auth:%lu] %s [%ld] entries",
+        (unsigned long)push->authorID, dateStr, (long)push->length);
+
+    for (i = 0; i != limit; ++i)
+    {
+        if (reachedPeers[i].status != PCS_READY
+            || reachedPeers[i].sockfd == push->sourceFd) /* salta il mittente */
+            continue;
+
+        if (messages_send_flood_ack(reachedPeers[i].sockfd,
+                push->authorID, PUSH_REQ_ID, &push->date,
+                push->entries, push->length) == -1)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "ERROR: error occurred while "
+                "pushing entries via socket (%d)", reachedPeers[i].sockfd);
+            closeConnection(&reachedPeers[i]);
+            sendCheckRequest();
+        }
+        else
+        {
+            unified_io_push(UNIFIED_IO_NORMAL, "Entries pushed via socket (%d)",
+                reachedPeers[i].sockfd);
+        }
+    }
+
+    free(push->entries);
+    free(push);
+}
+
+/** Invia al vicino in posizione dest il messaggio
+ * MESSAGES_CACHE_DIGEST: il livello 0 riassume la
+ * cache delle risposte del peer corrente e il livello
+ * i l'unione dei livelli i-1 ricevuti dagli altri
+ * vicini; i livelli di un vicino di cui non si sa
+ * nulla sono pieni, così da non escludere niente.
+ *
+ * Restituisce i byte inviati oppure -1 in caso di
+ * errore.
+ */
+static ssize_t sendCacheDigest(struct peer_tcp reachedPeers[], size_t reachedNumber, size_t dest)
+{
+    struct answer_cache_stats stats;
+    const struct peer_tcp* other;
+    uint32_t* data;
+    size_t words, needed, i, l;
+    ssize_t ans;
+
+    /* il livello 0 deve bastare per la propria cache,
+     * i successivi per l'unione dei filtri dei vicini */
+    getAnswerCacheStats(&stats);
+    needed = 0;
+    for (i = 0; i != reachedNumber; ++i)
+        if (i != dest && reachedPeers[i].status == PCS_READY && reachedPeers[i].cacheDigest != NULL)
+            needed += reachedPeers[i].cacheDigestWords;
+    words = bloom_words_pow2(stats.entries);
+    while (words < needed)
+        words <<= 1;
+    if (words < CACHE_DIGEST_MIN_WORDS)
+        words = CACHE_DIGEST_MIN_WORDS;
+    if (words > CACHE_DIGEST_LEVEL_WORDS)
+        words = CACHE_DIGEST_LEVEL_WORDS;
+
+    data = calloc(REQ_DATA_TTL*words, sizeof(uint32_t));
+    if (data == NULL)
+        fatal("calloc");
+    if (getAnswerCacheDigest(data, words, CACHE_DIGEST_SEED) != 0)
+        fatal("getAnswerCacheDigest");
+
+    for (i = 0; i != reachedNumber; ++i)
+    {
+        other = &reachedPeers[i];
+        if (i == dest || other->status != PCS_READY)
+            continue;
+        if (other->cacheDigest == NULL || other->cacheDigestLevels+1 < REQ_DATA_TTL
+            || (other->cacheDigestWords & (other->cacheDigestWords-1)) != 0)
+        {
+            memset(data+words, 0xFF, (REQ_DATA_TTL-1)*words*sizeof(uint32_t));
+            break;
+        }
+        for (l = 1; l < REQ_DATA_TTL; ++l)
+            if (bloom_merge(data+l*words, words,
+                    other->cacheDigest+(l-1)*other->cacheDigestWords, other->cacheDigestWords) != 0)
+                fatal("bloom_merge");
+    }
+
+    ans = messages_send_cache_digest(reachedPeers[dest].sockfd,
+            REQ_DATA_TTL, (uint32_t)words, data);
+    free(data);
+
+    return ans;
+}
+
+/** Se la cache delle risposte è cambiata molto
+ * dall'ultimo MESSAGES_CACHE_DIGEST, lo invia
+ * subito a tutti i vicini pronti così che non
+ * ignorino le risposte appena inserite; i byte
+ * sono addebitati alla sincronizzazione, come
+ * in syncRound non si invia nulla se questa è
+ * disattivata.
+ */
+static void cacheDigestRefresh(struct peer_tcp reachedPeers[], size_t reachedNumber)
+{
+    struct answer_cache_stats stats;
+    unsigned long threshold;
+    size_t i;
+    ssize_t sent;
+
+    if (CTX->SYNCbandwidth == 0)
+        return;
+
+    getAnswerCacheStats(&stats);
+    threshold = stats.entries/8;
+    if (threshold < CACHE_DIGEST_CHANGES)
+        threshold = CACHE_DIGEST_CHANGES;
+    if (stats.changes - CTX->DIGESTchanges < threshold)
+        return;
+    CTX->DIGESTchanges = stats.changes;
+
+    for (i = 0; i != reachedNumber; ++i)
+    {
+        if (reachedPeers[i].status != PCS_READY)
+            continue;
+        sent = sendCacheDigest(reachedPeers, reachedNumber, i);
+        if (sent == -1)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "Error while sending cache digest via (%d)", reachedPeers[i].sockfd);
+            closeConnection(&reachedPeers[i]);
+            sendCheckRequest();
+        }
+        else
+            CTX->SYNCspent += (size_t)sent;
     }
 }
 
-/** Funzione autiliaria per la gestione dei
- * comandi provenienti dalla pipe dei comandi.
+/** Esegue un turno della sincronizzazione in
+ * background inviando a tutti i vicini pronti
+ * la radice del proprio Merkle tree.
+ */
+static void syncRound(struct peer_tcp reachedPeers[], size_t reachedNumber)
+{
+    struct answer_cache_stats stats;
+    struct merkle_node root;
+    size_t i;
+    ssize_t sent;
+
+    /* nuovo turno */
+    CTX->SYNCspent = 0;
+    CTX->SYNCnext = time(NULL) + SYNC_PERIOD;
+
+    /* bootstrap interrotto: si riprova con un altro vicino */
+    for (i = 0; i != reachedNumber && CTX->BOOTSTRAPneeded && CTX->BOOTSTRAPfd == -1; ++i)
+        bootstrapRequest(&reachedPeers[i]);
+
+    if (CTX->SYNCbandwidth == 0)
+        return;
+
+    root.id = 1;
+    if (getMerkleNode(root.id, &root.hash) != 0)
+        return;
+
+    /* i filtri inviati in questo turno sono aggiornati */
+    getAnswerCacheStats(&stats);
+    CTX->DIGESTchanges = stats.changes;
+
+    for (i = 0; i != reachedNumber && SYNCallowed(); ++i)
+    {
+        if (reachedPeers[i].status != PCS_READY)
+            continue;
+        /* insieme alla radice si annunciano le risposte in cache */
+        sent = sendCacheDigest(reachedPeers, reachedNumber, i);
+        if (sent != -1)
+        {
+            CTX->SYNCspent += (size_t)sent;
+            sent = messages_send_sync_digest(reachedPeers[i].sockfd, &root, 1);
+        }
+        if (sent == -1)
+        {
+            unified_io_push(UNIFIED_IO_ERROR, "Error while sending digests via (%d)", reachedPeers[i].sockfd);
+            closeConnection(&reachedPeers[i]);
+            sendCheckRequest();
+        }
+        else
+            CTX->SYNCspent += (size_t)sent;
+    }
+}
+
+/** Funzione autiliaria per la gestione di
+ * un comando estratto dalla coda dei comandi.
  *
  * Restituisce -1 quando è richiesta la
  * terminazione del thread TCP e 0 in
  * tutti gli altri casi.
  */
-static int handle_pipe_command(
-            int cmdPipe,
+static int handle_command(
+            const struct TCPcommand* command,
             struct peer_tcp reachedPeers[],
             size_t* reachedNumber
             )
 {
-    uint8_t tmpCmd;
     enum tcp_commands cmd;
+    /* per TCP_COMMAND_TOPOLOGY */
+    struct peer_data currentNeighbours[MAX_NEIGHBOUR_NUMBER];
+    size_t numCurrentNeighbours;
+    /* per TCP_COMMAND_CHECK_PEER */
+    time_t now;
 
-    /* controlla che non abbia fatto disastri */
-    assert(sizeof(tmpCmd) == CMD_SIZE);
-
-    unified_io_push(UNIFIED_IO_NORMAL, "Handling pipe command...");
-    /* legge il comando */
-    if (read(cmdPipe, &tmpCmd, CMD_SIZE) != CMD_SIZE)
-        fatal("reading from command pipe");
-
-    cmd = tmpCmd;
+    unified_io_push(UNIFIED_IO_NORMAL, "Handling command...");
+    cmd = command->cmd;
     /* gestisce i comandi ricevuti */
     switch (cmd)
     {
@@ -2465,27 +4628,60 @@ static int handle_pipe_command(
 
     case TCP_COMMAND_CHECK_PEER:
         unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_CHECK_PEER");
-        tryToReachNeighbours(reachedPeers, reachedNumber);
+        /* un guasto locale fa interrogare subito il server,
+         * appena gestiti gli altri comandi in coda; se però
+         * il server ha appena annunciato un cambiamento il
+         * guasto ne è probabilmente l'effetto e si attende
+         * che completi l'annuncio */
+        now = time(NULL);
+        if (now < CTX->TOPOLOGYlast + TOPOLOGY_GRACE)
+            now = CTX->TOPOLOGYlast + TOPOLOGY_GRACE;
+        if (CTX->CHECKdeadline == 0 || now < CTX->CHECKdeadline)
+            CTX->CHECKdeadline = now;
+        break;
+
+    case TCP_COMMAND_TOPOLOGY:
+        unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_TOPOLOGY");
+        if (UDPneighbours(currentNeighbours, &numCurrentNeighbours) == 0)
+        {
+            CTX->CHECKdeadline = 0;
+            CTX->TOPOLOGYlast = time(NULL);
+            reconcileNeighbours(reachedPeers, reachedNumber,
+                    currentNeighbours, numCurrentNeighbours);
+        }
         break;
 
     case TCP_COMMAND_QUERY:
         unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_QUERY");
-        handle_TCP_COMMAND_QUERY(cmdPipe, reachedPeers, reachedNumber);
+        handle_TCP_COMMAND_QUERY(command, reachedPeers, reachedNumber);
         break;
 
     case TCP_COMMAND_FLOODING:
         unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_FLOODING");
-        handle_TCP_COMMAND_FLOODING(cmdPipe, reachedPeers, reachedNumber);
+        handle_TCP_COMMAND_FLOODING(command, reachedPeers, reachedNumber);
         break;
 
     case TCP_COMMAND_PROPAGATE:
         unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_PROPAGATE");
-        handle_TCP_COMMAND_PROPAGATE(cmdPipe, reachedPeers, reachedNumber);
+        handle_TCP_COMMAND_PROPAGATE(command, reachedPeers, reachedNumber);
         break;
 
     case TCP_COMMAND_SEND_FLOOD_RESPONSE:
         unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_SEND_FLOOD_RESPONSE");
-        handle_TCP_COMMAND_SEND_FLOOD_RESPONSE(cmdPipe, reachedPeers, reachedNumber);
+        handle_TCP_COMMAND_SEND_FLOOD_RESPONSE(command, reachedPeers, reachedNumber);
+        break;
+
+    case TCP_COMMAND_PUSH:
+        unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_PUSH");
+        handle_TCP_COMMAND_PUSH(command, reachedPeers, reachedNumber);
+        break;
+    case TCP_COMMAND_RELAY_QUERY:
+        unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_RELAY_QUERY");
+        handle_TCP_COMMAND_RELAY_QUERY(command, reachedPeers, reachedNumber);
+        break;
+    case TCP_COMMAND_WORK_DONE:
+        unified_io_push(UNIFIED_IO_NORMAL, "Cmd: TCP_COMMAND_WORK_DONE");
+        handle_TCP_COMMAND_WORK_DONE(command, reachedPeers, reachedNumber);
         break;
 
     default:
@@ -2496,6 +4692,45 @@ static int handle_pipe_command(
     return 0;
 }
 
+/** Svuota la pipe dei comandi e gestisce i comandi
+ * accodati fino a quel momento: quelli che il thread
+ * TCP accoda per sé nel frattempo hanno scritto nella
+ * pipe e sono gestiti al giro successivo.
+ *
+ * Restituisce -1 quando è richiesta la
+ * terminazione del thread TCP e 0 in
+ * tutti gli altri casi.
+ */
+static int handle_pipe_commands(
+            int cmdPipe,
+            struct peer_tcp reachedPeers[],
+            size_t* reachedNumber
+            )
+{
+    uint8_t wakeUps[64];
+    struct TCPcommand* command;
+    ssize_t got;
+    size_t n;
+    int ans;
+
+    /* i byte letti dopo l'accodamento dei comandi */
+    while ((got = read(cmdPipe, wakeUps, sizeof(wakeUps))) > 0)
+        ;
+    if (got == -1 && errno != EAGAIN && errno != EINTR)
+        fatal("reading from command pipe");
+
+    ans = 0;
+    for (n = queue_get_size(CTX->CMDqueue); n != 0 && ans == 0; --n)
+    {
+        if (queue_pop(CTX->CMDqueue, (void**)&command, 1) < 0)
+            fatal("queue_pop");
+        ans = handle_command(command, reachedPeers, reachedNumber);
+        free(command);
+    }
+
+    return ans;
+}
+
 /** Codice del thread TCP. Sarà attivato al
  * momento della connessione al network.
  */
@@ -2511,11 +4746,23 @@ static void* TCP(void* args)
     int connFd;
     sigset_t toBlock, originalSigMask;
     /* copia per accettare le connessioni */
-    int listeningSocketFd = tcpFd; /* per avere un alias con un nome utile */
-    /* per il monitoraggio dei socket */
-    int maxFdNumber; /* numero del massimo Fd da controllare */
-    fd_set readfd, writefd, exceptionfd; /* fd da controllare */
+    int listeningSocketFd = CTX->tcpFd; /* per avere un alias con un nome utile */
+    /* per il monitoraggio dei socket: a differenza di
+     * pselect, ppoll non limita i descrittori a
+     * FD_SETSIZE, che i molti peer di un solo
+     * processo supererebbero */
+    struct pollfd pollFds[MAX_TCP_CONNECTION+2];
+    nfds_t pollNumber;
+    /* posizione in pollFds del socket di ciascun vicino,
+     * -1 se non è controllato */
+    int pollIndex[MAX_TCP_CONNECTION];
+    size_t polledPeers;
+    short revents;
     int res; /* per non inserire chiamate a funzione dentro if */
+    /* timeout della ppoll */
+    struct timespec syncTimeout;
+    /* prossima scadenza di una richiesta inoltrata, 0 se nessuna */
+    time_t relayDeadline = 0;
 
     ts = thread_semaphore_form_args(args);
     if (ts == NULL)
@@ -2523,6 +4770,12 @@ static void* TCP(void* args)
 
     /* Azzera per questioni di leggibilità. */
     memset(reachedPeers, 0, sizeof(reachedPeers));
+    /* i messaggi per i vicini passano per le code di uscita */
+    CTX->OUTpeers = reachedPeers;
+    CTX->OUTpeersNumber = &reachedNumber;
+    messages_set_stream_writer(&OUTwriter);
+    /* il lavoro pesante per la CPU è svolto dai worker */
+    WORKstart();
 
     /* firma da assegnare a tutti i messaggi del thread */
     if (unified_io_set_thread_name("TCP") != 0)
@@ -2535,21 +4788,21 @@ static void* TCP(void* args)
             errExit("*** TCP ***\n");
 
     unified_io_push(UNIFIED_IO_NORMAL, "Starting thread TCP...");
-    unified_io_push(UNIFIED_IO_NORMAL, "Peer ID (%ld)", (long)peerID);
-    unified_io_push(UNIFIED_IO_NORMAL, "Num. Neighbours (%ld)", (long)neighboursNumber);
-    for (i = 0; i != neighboursNumber; ++i)
+    unified_io_push(UNIFIED_IO_NORMAL, "Peer ID (%ld)", (long)CTX->peerID);
+    unified_io_push(UNIFIED_IO_NORMAL, "Num. Neighbours (%ld)", (long)CTX->neighboursNumber);
+    for (i = 0; i != CTX->neighboursNumber; ++i)
     {
-        peer_data_as_string(&neighbours[i], buffer, sizeof(buffer));
+        peer_data_as_string(&CTX->neighbours[i], buffer, sizeof(buffer));
         unified_io_push(UNIFIED_IO_NORMAL, "%d)-> %s", i, buffer);
         /* prova a raggiungerli */
         unified_io_push(UNIFIED_IO_NORMAL, "Trying to connect to %s", buffer);
-        connFd = connectToPeer(&neighbours[i]);
+        connFd = connectToPeer(&CTX->neighbours[i]);
         if (connFd == -1)
         {
             unified_io_push(UNIFIED_IO_ERROR, "Connectiona attempt failed!");
         }
         /* invia il messaggio di HELLO */
-        else if (messages_send_hello_req(connFd, peerID, peer_data_extract_ID(&neighbours[i])) == -1)
+        else if (messages_send_hello_req(connFd, CTX->peerID, peer_data_extract_ID(&CTX->neighbours[i])) == -1)
         {
             if (connFd != -1) /* gestisce il fallimento della seconda condizione*/
                 close(connFd);
@@ -2559,7 +4812,7 @@ static void* TCP(void* args)
         {
             /* Successo! Aggiorna i dati del thread. */
             unified_io_push(UNIFIED_IO_NORMAL, "Successfully connected!");
-            reachedPeers[reachedNumber].data = neighbours[i];
+            reachedPeers[reachedNumber].data = CTX->neighbours[i];
             reachedPeers[reachedNumber].sockfd = connFd;
             reachedPeers[reachedNumber].status = PCS_NEW;
             reachedPeers[reachedNumber].creation_time = time(NULL);
@@ -2572,70 +4825,107 @@ static void* TCP(void* args)
         errExit("*** TCP ***\n");
 
     unified_io_push(UNIFIED_IO_NORMAL, "Thread TCP running.");
+    /* primo turno di sincronizzazione */
+    CTX->SYNCnext = time(NULL) + SYNC_PERIOD;
+    CTX->CHECKdeadline = 0;
+    CTX->TOPOLOGYlast = 0;
+    CTX->BOOTSTRAPneeded = needsBootstrap();
+    CTX->BOOTSTRAPfd = -1;
 
     /* ciclo infinito a gestione delle connessioni  */
     while (1)
     {
-        maxFdNumber = 0;
-        /* prepara le liste di fd da controllare */
-        FD_ZERO(&readfd); FD_ZERO(&writefd); FD_ZERO(&exceptionfd); /* azzera tutto */
+        /* prepara l'elenco dei fd da controllare */
+        memset(pollFds, 0, sizeof(pollFds));
         /* in lettura: listener e vicini */
-        FD_SET(listeningSocketFd, &readfd); /* socket da leggere */
-        maxFdNumber = max(maxFdNumber, listeningSocketFd);
+        pollFds[0].fd = listeningSocketFd; /* socket da leggere */
+        pollFds[0].events = POLLIN;
         /* si pone anche in ascolto della pipe dei comandi */
-        FD_SET(tcPipe_readEnd, &readfd);
-        maxFdNumber = max(maxFdNumber, tcPipe_readEnd);
+        pollFds[1].fd = CTX->tcPipe_readEnd;
+        pollFds[1].events = POLLIN;
+        pollNumber = 2;
         /* vicini - socket per i dati */
-        for (i = 0; i != reachedNumber; ++i)
+        polledPeers = reachedNumber;
+        for (i = 0; i != polledPeers; ++i)
         {
+            pollIndex[i] = -1;
             switch (reachedPeers[i].status)
             {
             case PCS_NEW:
             case PCS_WAITING:
             case PCS_READY:
-                /* aggiunge il socket a quelli da cui si possa leggere */
-                FD_SET(reachedPeers[i].sockfd, &readfd);
-                /* potrebbe capitare di gestire un errore */
-                FD_SET(reachedPeers[i].sockfd, &exceptionfd);
-                maxFdNumber = max(maxFdNumber, reachedPeers[i].sockfd);
+                pollIndex[i] = (int)pollNumber;
+                /* in lettura e, potrebbe capitare, per gestire un errore */
+                pollFds[pollNumber].fd = reachedPeers[i].sockfd;
+                pollFds[pollNumber].events = POLLIN | POLLPRI;
+                /* scrittura solo se c'è qualcosa in coda */
+                if (OUTpending(&reachedPeers[i]) != 0)
+                    pollFds[pollNumber].events |= POLLOUT;
+                ++pollNumber;
                 break;
             default:
                 /* non lo considera */
                 break;
             }
         }
+        /* si risveglia comunque per il turno di sincronizzazione
+         * e per l'eventuale verifica dei vicini in sospeso */
+        syncTimeout.tv_sec = max(0, (int)(CTX->SYNCnext - time(NULL)));
+        if (CTX->CHECKdeadline != 0)
+            syncTimeout.tv_sec = min((int)syncTimeout.tv_sec, max(0, (int)(CTX->CHECKdeadline - time(NULL))));
+        if (relayDeadline != 0)
+            syncTimeout.tv_sec = min((int)syncTimeout.tv_sec, max(0, (int)(relayDeadline - time(NULL))));
+        syncTimeout.tv_nsec = 0;
         /* attesa sui messaggi e gestione della teminazione */
         errno = 0;
-        res = pselect(maxFdNumber+1, &readfd, &writefd, &exceptionfd, NULL, &originalSigMask);
+        res = ppoll(pollFds, pollNumber, &syncTimeout, &originalSigMask);
         if (res == -1) /* controlla che sia tutto a posto */
         {
             if (errno == EINTR)
                 break;
-            fatal("*** TCP:pselect ***");
+            fatal("*** TCP:ppoll ***");
         }
         unified_io_push(UNIFIED_IO_NORMAL, "TCP thread awoken!");
         if (res > 0) /* controlla che ci sia qualcosa ga gestire */
         {
             /* gestisce i vicini */
-            for (i = 0; i != reachedNumber; ++i)
+            for (i = 0; i != polledPeers; ++i)
             {
+                if (pollIndex[i] == -1)
+                    continue;
+                revents = pollFds[pollIndex[i]].revents;
                 switch (reachedPeers[i].status)
                 {
                 case PCS_NEW:
                 case PCS_WAITING:
                 case PCS_READY:
-                    /* lettura */
-                    if (FD_ISSET(reachedPeers[i].sockfd, &readfd))
+                    /* lettura, anche della chiusura o di un errore */
+                    if (revents & (POLLIN | POLLHUP | POLLERR))
                     {
                         unified_io_push(UNIFIED_IO_NORMAL, "Read event on socket (%d)", reachedPeers[i].sockfd);
                         handleNeighbour(&reachedPeers[i]);
                     }
                     /* gestisce eventuali errori */
-                    if (FD_ISSET(reachedPeers[i].sockfd, &exceptionfd))
+                    if (revents & POLLPRI)
                     {
                         unified_io_push(UNIFIED_IO_NORMAL, "Exceptional event on socket (%d)", reachedPeers[i].sockfd);
                         handleNeighbourSocketException(&reachedPeers[i]);
                     }
+                    /* la lettura potrebbe aver chiuso la connessione */
+                    if (reachedPeers[i].status == PCS_CLOSED)
+                        break;
+                    /* scrittura della coda di uscita */
+                    if (revents & POLLOUT)
+                    {
+                        if (OUTflush(&reachedPeers[i]) == -1)
+                        {
+                            unified_io_push(UNIFIED_IO_ERROR, "Error while flushing output queue of socket (%d)", reachedPeers[i].sockfd);
+                            closeConnection(&reachedPeers[i]);
+                            sendCheckRequest();
+                            break;
+                        }
+                        (void)bootstrapContinue(&reachedPeers[i]);
+                    }
                     break;
                 default:
                     /* non lo considera */
@@ -2643,19 +4933,32 @@ static void* TCP(void* args)
                 }
             }
             /* gestisce la ricezione di eventuali comandi */
-            if (FD_ISSET(tcPipe_readEnd, &readfd))
+            if (pollFds[1].revents & POLLIN)
             {
-                if (handle_pipe_command(tcPipe_readEnd,
+                if (handle_pipe_commands(CTX->tcPipe_readEnd,
                     reachedPeers, &reachedNumber) == -1)
                     break;
             }
             /* gestisce l'accettazione di nuovi peer */
-            if (FD_ISSET(listeningSocketFd, &readfd))
+            if (pollFds[0].revents & POLLIN)
             {
                 /* nuova connessione in arrivo */
                 acceptPeer(listeningSocketFd, reachedPeers, &reachedNumber);
             }
         }
+        /* richieste inoltrate rimaste senza risposta */
+        relayDeadline = REQ_DATArelay_expire();
+        /* verifica dei vicini dovuta: interroga il server */
+        if (CTX->CHECKdeadline != 0 && time(NULL) >= CTX->CHECKdeadline)
+        {
+            CTX->CHECKdeadline = 0;
+            tryToReachNeighbours(reachedPeers, &reachedNumber);
+        }
+        /* a bassa priorità: dopo aver servito tutto il resto */
+        if (time(NULL) >= CTX->SYNCnext)
+            syncRound(reachedPeers, reachedNumber);
+        else
+            cacheDigestRefresh(reachedPeers, reachedNumber);
     }
 
     unified_io_push(UNIFIED_IO_NORMAL, "Terminating TCP thread...");
@@ -2668,6 +4971,7 @@ static void* TCP(void* args)
         case PCS_NEW:
         case PCS_WAITING:
             /* chiusura di un socket inattivo - non serve fare niente */
+            OUTclear(&reachedPeers[i]);
             if (close(connFd) != 0)
                 unified_io_push(UNIFIED_IO_ERROR, "Unexpected error while closing socket (%d)", connFd);
             break;
@@ -2678,6 +4982,7 @@ static void* TCP(void* args)
                 unified_io_push(UNIFIED_IO_ERROR, "Unexpected error while sending [MESSAGES_DETATCH] via socket (%d)", connFd);
             unified_io_push(UNIFIED_IO_NORMAL, "Closing socket (%d)", connFd);
             /* in questa versione non si inviano gli ultimi dati ai vicini */
+            OUTclear(&reachedPeers[i]);
             if (close(connFd) != 0)
                 unified_io_push(UNIFIED_IO_ERROR, "Unexpected error while closing socket (%d)", connFd);
             break;
@@ -2686,6 +4991,9 @@ static void* TCP(void* args)
             break;
         }
     }
+    WORKstop();
+    messages_set_stream_writer(NULL);
+    CTX->OUTpeers = NULL;
     unified_io_push(UNIFIED_IO_NORMAL, "Terminated TCP thread!");
 
     return NULL;
@@ -2696,61 +5004,66 @@ int TCPrun(uint32_t ID, struct peer_data* initNeighbours, size_t N)
 {
     int i;
 
-    if (running)
+    if (CTX->running)
         return -1;
 
     if (N > MAX_NEIGHBOUR_NUMBER)
         errExit("*** TCPrun(N > MAX_NEIGHBOUR_NUMBER) ***\n");
 
     /* rende i dati disponibili al nuovo thread */
-    peerID = ID; /* l'ID del peer */
+    CTX->peerID = ID; /* l'ID del peer */
     for (i = 0; i != (int)N; ++i) /* i dati per raggiungere i vicini */
-        neighbours[i] = initNeighbours[i];
+        CTX->neighbours[i] = initNeighbours[i];
 
-    neighboursNumber = N; /* il numero iniziale di vicini */
+    CTX->neighboursNumber = N; /* il numero iniziale di vicini */
 
-    if (start_long_life_thread(&TCP_tid, &TCP, NULL, NULL) == -1)
+    if (peer_context_start_thread(&CTX->TCP_tid, &TCP, NULL, NULL) == -1)
         return -1;
 
-    running = 1;
+    CTX->running = 1;
     return 0;
 }
 
 int TCPclose(void)
 {
     /* controlla se era stato attivato */
-    if (!activated)
+    if (!CTX->activated)
         return -1;
 
-    if (running)
+    if (CTX->running)
     {
         /* abbiamo un thread da fermare */
         /* invia il comando di EXIT */
         sendShutdownRequest();
         /* esegue una join */
-        if (pthread_join(TCP_tid, NULL) != 0)
+        if (pthread_join(CTX->TCP_tid, NULL) != 0)
             errExit("*** TCPclose:pthread_join ***\n");
-        running = 0;
+        CTX->running = 0;
     }
 
-    if (close(tcpFd) != 0)
+    if (close(CTX->tcpFd) != 0)
         return -1;
 
     /* chiude la pipe usata per mandare comandi al thread */
-    if (close(tcPipe[0]) != 0 || close(tcPipe[1]) != 0)
+    if (close(CTX->tcPipe[0]) != 0 || close(CTX->tcPipe[1]) != 0)
         return -1;
-
-    set_destroy(REQ_DATAsocket);
-    REQ_DATAsocket = NULL;
-    rb_tree_destroy(FLOODINGinstances);
-    FLOODINGinstances = NULL;
-
-    tcpFd = 0;
-    activated = 0;
+    /* i comandi rimasti sono scartati */
+    queue_destroy(CTX->CMDqueue);
+    CTX->CMDqueue = NULL;
+
+    set_destroy(CTX->REQ_DATAsocket);
+    CTX->REQ_DATAsocket = NULL;
+    list_destroy(CTX->REQ_DATArelays);
+    CTX->REQ_DATArelays = NULL;
+    rb_tree_destroy(CTX->FLOODINGinstances);
+    CTX->FLOODINGinstances = NULL;
+
+    CTX->tcpFd = 0;
+    CTX->activated = 0;
     return 0;
 }
 
 int TCPgetSocket(void)
 {
-    return activated ? tcpFd : -1;
+    return CTX->activated ? CTX->tcpFd : -1;
 }
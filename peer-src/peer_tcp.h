@@ -8,6 +8,126 @@
 
 #include "../messages.h"
 
+/** Intervallo, in secondi, tra due turni della
+ * sincronizzazione in background dei registri
+ * con i vicini (anti-entropy).
+ */
+#ifndef SYNC_PERIOD
+#define SYNC_PERIOD 30
+#endif
+
+/** Limite predefinito ai byte che la
+ * sincronizzazione in background può inviare
+ * in un turno. Modificabile a runtime con
+ * TCPsetSyncBandwidth.
+ */
+#ifndef SYNC_BANDWIDTH
+#define SYNC_BANDWIDTH (32*1024)
+#endif
+
+/** Se non nullo le richieste del protocollo
+ * FLOODING non elencano le firme già note ma
+ * ne inviano un filtro di Bloom, molto più
+ * piccolo. Modificabile a runtime con
+ * TCPsetFloodBloom.
+ */
+#ifndef FLOOD_BLOOM
+#define FLOOD_BLOOM 0
+#endif
+
+/** Numero massimo di salti compiuti da una
+ * richiesta REQ_DATA: con 1 sono interrogati
+ * solo i vicini diretti.
+ */
+#ifndef REQ_DATA_TTL
+#define REQ_DATA_TTL 3
+#endif
+
+/** Limiti alle parole di ciascun livello del
+ * filtro di Bloom con cui i vicini si comunicano
+ * quali risposte hanno in cache; i livelli sono
+ * REQ_DATA_TTL, uno per ogni salto che una
+ * richiesta REQ_DATA può compiere. Entro questi
+ * limiti il filtro è dimensionato, a potenze di
+ * due, sul numero di risposte che riassume.
+ */
+#ifndef CACHE_DIGEST_MIN_WORDS
+#define CACHE_DIGEST_MIN_WORDS 8
+#endif
+
+#ifndef CACHE_DIGEST_LEVEL_WORDS
+#define CACHE_DIGEST_LEVEL_WORDS 4096
+#endif
+
+/** Risposte inserite o rimosse dalla cache dopo
+ * le quali il filtro è inviato subito ai vicini,
+ * senza attendere il turno di sincronizzazione
+ * (purché questa non sia disattivata).
+ * Con molte risposte in cache la soglia sale a
+ * un ottavo di quelle presenti.
+ */
+#ifndef CACHE_DIGEST_CHANGES
+#define CACHE_DIGEST_CHANGES 16
+#endif
+
+/** Secondi che seguono un aggiornamento spontaneo
+ * della topologia dal server (MESSAGES_TOPOLOGY_UPDATE)
+ * durante i quali i vicini non più raggiungibili
+ * sono attribuiti al cambiamento annunciato: il
+ * server è interrogato con MESSAGES_CHECK_REQ solo
+ * allo scadere, se non ne annuncia altri.
+ * Fuori da questa finestra lo si interroga subito.
+ */
+#ifndef TOPOLOGY_GRACE
+#define TOPOLOGY_GRACE 2
+#endif
+
+/** Secondi dopo cui, se il server non ha risposto
+ * alla verifica dei vicini, lo si interroga di nuovo.
+ */
+#ifndef CHECK_RETRY
+#define CHECK_RETRY 1
+#endif
+
+/** Dimensione indicativa, in byte, dei blocchi
+ * in cui un vicino invia i registri dei giorni
+ * conclusi a un peer appena entrato nel network.
+ */
+#ifndef BOOTSTRAP_CHUNK
+#define BOOTSTRAP_CHUNK (256*1024)
+#endif
+
+/** Massima attesa, in secondi, perché tutte le
+ * istanze del protocollo FLOODING terminino.
+ * È grande poiché il protocollo è particolarmente
+ * complesso e potrebbe richiedere molto tempo per
+ * venire completato. In un contesto reale potrebbe
+ * non essere sufficiente nemmeno questo limite.
+ */
+#ifndef FLOODING_TIMEOUT
+#define FLOODING_TIMEOUT 60
+#endif
+
+/** Massimo numero di byte che possono restare in
+ * attesa nella coda di uscita verso un vicino: un
+ * vicino che non riesce a smaltirli è disconnesso.
+ * Deve poter contenere qualche BOOTSTRAP_CHUNK.
+ */
+#ifndef OUTQUEUE_LIMIT
+#define OUTQUEUE_LIMIT (4*1024*1024)
+#endif
+
+/** Numero di worker a cui il thread TCP affida
+ * il lavoro pesante per la CPU: la fusione delle
+ * entry ricevute con i registri e la preparazione
+ * delle risposte del protocollo FLOODING.
+ * I worker sono condivisi da tutti i peer dello
+ * stesso processo.
+ */
+#ifndef TCP_WORKERS
+#define TCP_WORKERS 2
+#endif
+
 /** Prepara il sottosistema TCP all'avvio ma non
  * lo avvia!
  * Sarà avviato solo dopo che il peer si sarà
@@ -49,9 +169,21 @@ int TCPgetSocket(void);
 /** Invia ai vicini un messaggio di tipo
  * REQ_DATA per chiedere loro se hanno
  * già calcolato la query fornita.
+ * Chi non ha la risposta inoltra la
+ * richiesta ai propri vicini, fino a
+ * REQ_DATA_TTL salti dal peer corrente,
+ * e la risposta trovata torna indietro
+ * lungo lo stesso cammino.
+ * Sono contattati solo i vicini che, in
+ * base all'ultimo MESSAGES_CACHE_DIGEST
+ * ricevuto, potrebbero trovare la risposta:
+ * se non ce ne sono termina subito.
  *
  * Se non si riceve una risposta entro 5
- * secondi termina con un errore.
+ * secondi per ogni salto consentito, cioè
+ * più a lungo di quanto aspetti ciascun
+ * peer che la inoltra, termina con un
+ * errore.
  *
  * Restituisce 0 in caso di successo e -1
  * in caso di errore.
@@ -80,4 +212,64 @@ int TCPstartFlooding(const struct tm* date);
  */
 int TCPendFlooding(void);
 
+/** Invia ai vicini, senza che ne abbiano fatto
+ * richiesta, tutte le entry firmate dal peer
+ * corrente presenti nel registro della data
+ * indicata. I vicini le aggiungono ai propri
+ * registri e le inoltrano a loro volta.
+ *
+ * Restituisce 0 in caso di successo e -1
+ * in caso di errore.
+ */
+int TCPpushEntries(const struct tm* date);
+
+/** Imposta il numero massimo di byte che la
+ * sincronizzazione in background può inviare
+ * ogni SYNC_PERIOD secondi; con 0 la
+ * sincronizzazione è disattivata.
+ */
+void TCPsetSyncBandwidth(size_t);
+
+/** Attiva (valore non nullo) o disattiva
+ * l'uso dei filtri di Bloom nelle richieste
+ * FLOODING iniziate da ora in poi.
+ *
+ * Le firme che un vicino scarta per un falso
+ * positivo del filtro sono recuperate subito
+ * dopo confrontando con lui la foglia del
+ * Merkle tree del giorno richiesto.
+ */
+void TCPsetFloodBloom(int);
+
+/** Contatori dei messaggi, e dei relativi
+ * byte, inviati dal peer ai suoi vicini.
+ */
+struct tcp_traffic_stats
+{
+    /* tutti i messaggi */
+    unsigned long messages, bytes;
+    /* protocollo FLOODING: richieste e risposte */
+    unsigned long floodMessages, floodBytes;
+    /* protocollo REQ_DATA: richieste e risposte */
+    unsigned long reqDataMessages, reqDataBytes;
+    /* replica proattiva (push) */
+    unsigned long pushMessages, pushBytes;
+    /* sincronizzazione in background: digest del
+     * Merkle tree e scambio delle entry mancanti */
+    unsigned long syncMessages, syncBytes;
+};
+
+/** Fornisce una copia dei contatori del
+ * traffico inviato dal peer corrente.
+ */
+void TCPgetTrafficStats(struct tcp_traffic_stats*);
+
+/** Avvisa il thread TCP che il server ha
+ * comunicato nuovi vicini, disponibili con
+ * UDPneighbours, così che si connetta ai nuovi
+ * e si stacchi da chi non lo è più.
+ * Non fa niente se il thread non è attivo.
+ */
+void TCPtopologyChanged(void);
+
 #endif
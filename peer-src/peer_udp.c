@@ -3,6 +3,7 @@
 
 #include "peer_udp.h"
 #include "peer_tcp.h"
+#include "peer_context.h"
 #include <pthread.h>
 #include "../socket_utils.h"
 #include "../thread_semaphore.h"
@@ -18,113 +19,505 @@
 #include <time.h>
 #include <errno.h>
 #include <setjmp.h>
-#include <sys/time.h>
 
 /* segnale utilizzato per terminare il
  * ciclo del peer */
 #define INTERRUPT_SIGNAL SIGUSR1
 
 /* Una richiesta di boot viene
- * inviata al più 5 volte con un
- * timeout di più 2 secondi prima
- * di inviarne una nuova  */
+ * inviata al più 5 volte, il
+ * timeout prima di inviarne una
+ * nuova è stabilito da rttTimeout */
 #define MAX_BOOT_ATTEMPT 5
-#define BOOT_TIMEOUT 2000 /* in millisecondi */
 
-/** Tentativi e timeouto per
- * la disconnessione, per semplicità
+/** Tentativi per la disconnessione e per
+ * UDPcheck, per semplicità; UDPcheck blocca
+ * il thread TCP perciò smette comunque di
+ * ritentare dopo CHECK_BUDGET microsecondi.
  */
 #define MAX_STOP_ATTEMPT MAX_BOOT_ATTEMPT
-#define STOP_TIMEOUT BOOT_TIMEOUT
+#define MAX_CHECK_ATTEMPT MAX_BOOT_ATTEMPT
+#define CHECK_BUDGET 2000000
 
-/** ID del main thread, per gestire
- * lo spegnimento del peer in modo
- * "forzato ma non distruttivo"
+/** Timeout di ritrasmissione (RTO), in
+ * microsecondi: iniziale, prima di avere
+ * misurato il tempo di andata e ritorno,
+ * minimo e massimo.
  */
-pthread_t mainThreadID;
+#define RTO_INITIAL 250000
+#define RTO_MIN 10000
+#define RTO_MAX 4000000
 
-/** Serve a memorizzare la porta sulla
- * quale ascolta il thread UDP
+/** Numero di destinatari di cui si tiene
+ * la stima del tempo di andata e ritorno:
+ * oltre si dimentica il meno recente.
  */
-static int UDP_port;
-
-/** Questo mutex e questo flag servono
- * per risolvere il problema che si
- * ha quando sia il main thread sia
- * il thread UDP si inviano a vicenda
- * un segnale di terminazione in
- * particolare si ottiene la seguente
- * sequenza di operazioni:
- *
- * 1) thread UDP invia un segnale al
- *      main thread e termina
- * 2) il main thread inizia ad
- *      eseguire il comando di stop
- * 3) il main thread invia un segnale
- *      al thread UDP per farlo
- *      terminare ma fallisce
- * 3) BUM!
- *
- * In particolare questo mutex
- * serve a invocare la primitiva
- * per scambiare messaggi tra i
- * thread in maniera atomica.
+#define RTT_DESTINATIONS 4
+
+/** Stima del tempo di andata e ritorno verso
+ * un destinatario, secondo l'RFC 6298.
+ * Tutti i tempi sono in microsecondi.
  */
-static pthread_mutex_t termUDPguard = PTHREAD_MUTEX_INITIALIZER;
-static int termUDPflag; /* messo a 1 da chi prende il mutex per primo */
+struct rtt_estimator
+{
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    /* media e varianza smussate */
+    long int srtt, rttvar;
+    /* timeout corrente */
+    long int rto;
+    /* non nullo se c'è almeno un campione */
+    int measured;
+    /* ultimo utilizzo, per la sostituzione */
+    long int lastUse;
+};
+
+/** Stato del sottosistema UDP di un peer,
+ * raggiunto tramite il contesto del thread
+ * chiamante (vedere peer_context.h).
+ */
+struct udp_state
+{
+    /* stime del tempo di andata e ritorno, per destinatario */
+    pthread_mutex_t RTTguard;
+    struct rtt_estimator RTTtable[RTT_DESTINATIONS];
+    unsigned int RTTseed;
+
+    /** ID del thread principale del peer, per
+     * gestire lo spegnimento del peer in modo
+     * "forzato ma non distruttivo", e del
+     * thread che gestisce il socket UDP.
+     */
+    pthread_t mainThreadID;
+    pthread_t UDP_tid;
+
+    /* fd del socket, condiviso da più thread */
+    int socketfd;
+    /* porta sulla quale ascolta il thread UDP */
+    int UDP_port;
+
+    /** Questo mutex e questo flag servono
+     * per risolvere il problema che si
+     * ha quando sia il main thread sia
+     * il thread UDP si inviano a vicenda
+     * un segnale di terminazione in
+     * particolare si ottiene la seguente
+     * sequenza di operazioni:
+     *
+     * 1) thread UDP invia un segnale al
+     *      main thread e termina
+     * 2) il main thread inizia ad
+     *      eseguire il comando di stop
+     * 3) il main thread invia un segnale
+     *      al thread UDP per farlo
+     *      terminare ma fallisce
+     * 3) BUM!
+     *
+     * In particolare questo mutex
+     * serve a invocare la primitiva
+     * per scambiare messaggi tra i
+     * thread in maniera atomica.
+     */
+    pthread_mutex_t termUDPguard;
+    int termUDPflag; /* messo a 1 da chi prende il mutex per primo */
+
+    /** Insieme di variabili che permettono
+     * di ricordare se il peer è attualmente
+     * connesso a una rete e quale sia il suo
+     * ID nella rete.
+     */
+    volatile uint32_t peerID; /* ID del peer nella rete */
+    volatile int ISPeerConnected; /* flag che indica la validità dell'altro parametro */
+    pthread_mutex_t IDguard;
+
+    /** Informazioni per raggiungere il
+     * discovery server per le operazioni
+     * di shutdown
+     */
+    struct sockaddr_storage DSaddr;
+    socklen_t DSaddrLen;
+
+    /** Variabili che servono a garantire la corretta
+     * temporizzazione nell'utilizzo di UDPcheck.
+     *
+     * Protocollo:
+     *  All'inizio di ogni giro:
+     *      CHECKnumber=0
+     *      CHECKflag=0
+     *  1) il chiamante:
+     *      prende il mutex
+     *      imposta CHECKflag a 1
+     *      invia un messaggio con un nuovo identificativo,
+     *      che diventa CHECKlastID
+     *      si mette in attesa sulla cond.var. per al più
+     *      rttTimeout, ripetendo se scade fino a
+     *      MAX_CHECK_ATTEMPT volte
+     *  2) il thread UDP (eventualmente):
+     *      riceve la risposta
+     *      controlla che sia corretta
+     *          altrimenti lascia perdere
+     *      cattura il mutex
+     *      verifica CHECKflag!=0 && CHECKnumber==0 e che
+     *      l'identificativo sia tra CHECKfirstID e CHECKlastID
+     *          altrimenti rilascia il mutex senza far nulla
+     *      memorizza identificativo e istante di arrivo
+     *      riempie CHECKneighbours e imposta opportunamente CHECKnumber
+     *      spegne il CHECKflag
+     *      segnala la cond.var.
+     *  3) il chiamante:
+     *      acquisisce il mutex
+     *      controlla che non sia passato il timeout
+     *      verifica CHECKflag==0
+     *          altrimenti pone CHECKflag=0, rilascia il mutex e termina
+     *      utilizza i dati in CHECKneighbours e CHECKflag per rispondere
+     *      rilascia il mutex e termina
+     */
+    pthread_mutex_t CHECKguard;
+    pthread_cond_t CHECKcond;
+    struct peer_data CHECKneighbours[MAX_NEIGHBOUR_NUMBER];
+    size_t CHECKnumber; /* se non 0 non bisogna scrivere */
+    int CHECKflag; /* se c'è un thread in attesa */
+    int CHECKerror; /* se la risposta ha status anomalo */
+    /* identificativi del primo e dell'ultimo tentativo */
+    uint32_t CHECKfirstID, CHECKlastID;
+    /* tentativo a cui si è risposto e istante di arrivo */
+    uint32_t CHECKansweredID;
+    long int CHECKanswerTime;
+    /* un solo UDPcheck per volta e ultimo identificativo usato */
+    pthread_mutex_t CHECKcaller;
+    uint32_t CHECKsentID;
+
+    /** Ultimi vicini del peer comunicati dal server,
+     * con MESSAGES_BOOT_ACK, MESSAGES_CHECK_ACK o
+     * MESSAGES_TOPOLOGY_UPDATE, epoch (esecuzione
+     * del server) e numero di sequenza dell'ultimo
+     * MESSAGES_TOPOLOGY_UPDATE accettato.
+     * TOPOvalid è nullo se il peer non è connesso.
+     */
+    pthread_mutex_t TOPOguard;
+    struct peer_data TOPOneighbours[MAX_NEIGHBOUR_NUMBER];
+    size_t TOPOnumber;
+    uint32_t TOPOepoch, TOPOseq;
+    int TOPOvalid;
+
+    /** Per lo scambio e la gestione dei messaggi
+     * di boot da parte del server sarà utilizzato
+     * un protocollo produttore consumatore
+     * usando le seguenti strutture dati per
+     * lavorare in mutua esclusione.
+     */
+    pthread_mutex_t BOOTguard;
+    pthread_cond_t BOOTcond;
+    volatile int BOOTflag; /* se a uno il pid è valido */
+    volatile uint32_t BOOTpid;
+    volatile struct boot_ack* BOOTack;
+    /* pid da associare alla prossima richiesta, valido se BOOTseeded */
+    int BOOTseeded;
+    uint32_t BOOTnextPid;
+};
+
+/* stato UDP del peer del thread chiamante */
+#define CTX (peer_context_get()->udp)
+
+struct udp_state* UDPstate_create(void)
+{
+    struct udp_state* state;
+
+    state = malloc(sizeof(struct udp_state));
+    if (state == NULL)
+        return NULL;
+    memset(state, 0, sizeof(struct udp_state));
+
+    if (pthread_mutex_init(&state->RTTguard, NULL) != 0
+        || pthread_mutex_init(&state->termUDPguard, NULL) != 0
+        || pthread_mutex_init(&state->IDguard, NULL) != 0
+        || pthread_mutex_init(&state->CHECKguard, NULL) != 0
+        || pthread_cond_init(&state->CHECKcond, NULL) != 0
+        || pthread_mutex_init(&state->CHECKcaller, NULL) != 0
+        || pthread_mutex_init(&state->TOPOguard, NULL) != 0
+        || pthread_mutex_init(&state->BOOTguard, NULL) != 0
+        || pthread_cond_init(&state->BOOTcond, NULL) != 0)
+        fatal("UDPstate_create");
+    state->socketfd = -1;
+
+    return state;
+}
 
-/** Insieme di variabili che permettono
- * di ricordare se il peer è attualmente
- * connesso a una rete e quale sia il suo
- * ID nella rete.
+void UDPstate_destroy(struct udp_state* state)
+{
+    pthread_mutex_destroy(&state->RTTguard);
+    pthread_mutex_destroy(&state->termUDPguard);
+    pthread_mutex_destroy(&state->IDguard);
+    pthread_mutex_destroy(&state->CHECKguard);
+    pthread_cond_destroy(&state->CHECKcond);
+    pthread_mutex_destroy(&state->CHECKcaller);
+    pthread_mutex_destroy(&state->TOPOguard);
+    pthread_mutex_destroy(&state->BOOTguard);
+    pthread_cond_destroy(&state->BOOTcond);
+    free(state);
+}
+
+/** Istante corrente, in microsecondi,
+ * secondo un orologio monotono.
  */
-static volatile uint32_t peerID; /* ID del peer nella rete */
-static volatile int ISPeerConnected; /* flag che indica la validità dell'altro parametro */
-static pthread_mutex_t IDguard = PTHREAD_MUTEX_INITIALIZER;
-
-/** Variabili globali che tengono
- * le informazioni per raggiungere
- * il discovery server per le
- * operazioni di shutdown
+static long int rttNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        errExit("*** UDP:clock_gettime ***\n");
+
+    return (long int)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/** Trova la stima relativa al destinatario
+ * oppure la crea, al posto di quella usata
+ * meno di recente.
+ * Va invocata possedendo RTTguard.
  */
-static struct sockaddr_storage DSaddr;
-static socklen_t DSaddrLen;
+static struct rtt_estimator* rttFind(const struct sockaddr* addr, socklen_t addrLen)
+{
+    struct rtt_estimator* ans;
+    int i;
 
-/** Variabili che servono a garantire la corretta
- * temporizzazione nell'utilizzo di UDPcheck.
+    ans = &CTX->RTTtable[0];
+    for (i = 0; i != RTT_DESTINATIONS; ++i)
+    {
+        if (CTX->RTTtable[i].addrLen == addrLen
+            && memcmp(&CTX->RTTtable[i].addr, addr, (size_t)addrLen) == 0)
+        {
+            ans = &CTX->RTTtable[i];
+            break;
+        }
+        if (CTX->RTTtable[i].lastUse < ans->lastUse)
+            ans = &CTX->RTTtable[i];
+    }
+    if (i == RTT_DESTINATIONS)
+    {
+        memset(ans, 0, sizeof(struct rtt_estimator));
+        memcpy(&ans->addr, addr, (size_t)addrLen);
+        ans->addrLen = addrLen;
+        ans->rto = RTO_INITIAL;
+    }
+    ans->lastUse = rttNow();
+
+    return ans;
+}
+
+/** Fornisce, in microsecondi, quanto attendere
+ * la risposta al tentativo attempt (contando da
+ * 0) di una richiesta al destinatario: il
+ * timeout raddoppia ad ogni tentativo ed è
+ * allungato di una quota casuale, fino a un
+ * quarto, perché i peer che hanno perso la
+ * risposta nello stesso momento non ripetano
+ * le richieste tutti insieme.
+ */
+static long int rttTimeout(const struct sockaddr* addr, socklen_t addrLen, int attempt)
+{
+    long int ans;
+
+    if (pthread_mutex_lock(&CTX->RTTguard) != 0)
+        errExit("*** UDP:pthread_mutex_lock ***\n");
+    if (CTX->RTTseed == 0)
+        CTX->RTTseed = (unsigned int)rttNow() ^ (unsigned int)getpid();
+    ans = rttFind(addr, addrLen)->rto;
+    while (attempt-- > 0 && ans < RTO_MAX)
+        ans <<= 1;
+    if (ans > RTO_MAX)
+        ans = RTO_MAX;
+    ans += (long int)(rand_r(&CTX->RTTseed) % (ans/4 + 1));
+    if (pthread_mutex_unlock(&CTX->RTTguard) != 0)
+        errExit("*** UDP:pthread_mutex_unlock ***\n");
+
+    return ans;
+}
+
+/** Aggiorna la stima con il tempo di andata e
+ * ritorno, in microsecondi, di una richiesta a
+ * cui si è certi di associare la risposta.
+ */
+static void rttSample(const struct sockaddr* addr, socklen_t addrLen, long int rtt)
+{
+    struct rtt_estimator* est;
+    long int err;
+
+    if (rtt < 0)
+        return;
+
+    if (pthread_mutex_lock(&CTX->RTTguard) != 0)
+        errExit("*** UDP:pthread_mutex_lock ***\n");
+    est = rttFind(addr, addrLen);
+    if (!est->measured)
+    {
+        est->srtt = rtt;
+        est->rttvar = rtt/2;
+        est->measured = 1;
+    }
+    else
+    {
+        err = est->srtt - rtt;
+        if (err < 0)
+            err = -err;
+        est->rttvar = (3*est->rttvar + err)/4;
+        est->srtt = (7*est->srtt + rtt)/8;
+    }
+    est->rto = est->srtt + 4*est->rttvar;
+    if (est->rto < RTO_MIN)
+        est->rto = RTO_MIN;
+    if (est->rto > RTO_MAX)
+        est->rto = RTO_MAX;
+    if (pthread_mutex_unlock(&CTX->RTTguard) != 0)
+        errExit("*** UDP:pthread_mutex_unlock ***\n");
+}
+
+/** Calcola l'istante assoluto, secondo
+ * CLOCK_REALTIME come richiesto da
+ * pthread_cond_timedwait, che si trova
+ * usec microsecondi nel futuro.
+ */
+static void rttDeadline(struct timespec* deadline, long int usec)
+{
+    if (clock_gettime(CLOCK_REALTIME, deadline) != 0)
+        errExit("*** UDP:clock_gettime ***\n");
+    deadline->tv_sec += usec/1000000;
+    deadline->tv_nsec += (usec%1000000)*1000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_nsec -= 1000000000;
+        ++deadline->tv_sec;
+    }
+}
+
+/** Sostituisce i vicini noti con quelli forniti.
+ * Se seq non è NULL aggiorna anche epoch e numero
+ * di sequenza, altrimenti li lascia invariati.
+ */
+static void
+setTopology(
+            const struct peer_data* neighbours,
+            size_t length,
+            uint32_t epoch,
+            const uint32_t* seq)
+{
+    size_t i;
+
+    if (pthread_mutex_lock(&CTX->TOPOguard) != 0)
+        abort();
+    for (i = 0; i != length; ++i)
+        CTX->TOPOneighbours[i] = neighbours[i];
+    CTX->TOPOnumber = length;
+    if (seq != NULL)
+    {
+        CTX->TOPOepoch = epoch;
+        CTX->TOPOseq = *seq;
+    }
+    CTX->TOPOvalid = 1;
+    if (pthread_mutex_unlock(&CTX->TOPOguard) != 0)
+        abort();
+}
+
+/** Gestisce un messaggio MESSAGES_TOPOLOGY_UPDATE
+ * con cui il server comunica, senza che sia stato
+ * richiesto, che i vicini del peer sono cambiati.
+ * Gli aggiornamenti giunti in ritardo (numero di
+ * sequenza non superiore all'ultimo) sono scartati;
+ * ciascuno contiene tutti i vicini perciò la
+ * perdita di uno dei precedenti non è un problema.
+ *
+ * Ogni aggiornamento marcato dal server come
+ * da confermare, anche se scartato perché
+ * superato, riceve in risposta un
+ * MESSAGES_CHECK_REQ: così il server sa che il
+ * peer, ricaricato da file dopo un riavvio, è
+ * ancora attivo. Il server continua a marcare
+ * gli aggiornamenti finché la conferma non gli
+ * arriva.
  *
- * Protocollo:
- *  All'inizio di ogni giro:
- *      CHECKnumber=0
- *      CHECKflag=0
- *  1) il chiamante:
- *      prende il mutex
- *      invia un messaggio
- *      imposta CHECKflag a 1
- *      si mette in attesa sulla cond.var. per al più 2s
- *  2) il thread UDP (eventualmente):
- *      riceve la risposta
- *      controlla che sia corretta
- *          altrimenti lascia perdere
- *      cattura il mutex
- *      verifica CHECKflag!=0 && CHECKnumber==0
- *          altrimenti rilascia il mutex senza far nulla
- *      riempie CHECKneighbours e imposta opportunamente CHECKnumber
- *      spegne il CHECKflag
- *      segnala la cond.var.
- *  3) il chiamante:
- *      acquisisce il mutex
- *      controlla che non sia passato il timeout
- *      verifica CHECKflag==0
- *          altrimenti pone CHECKflag=0, rilascia il mutex e termina
- *      utilizza i dati in CHECKneighbours e CHECKflag per rispondere
- *      rilascia il mutex e termina
+ * Restituisce 0 se l'aggiornamento è stato
+ * accettato e -1 altrimenti.
  */
-static pthread_mutex_t CHECKguard = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t CHECKcond = PTHREAD_COND_INITIALIZER;
-static struct peer_data CHECKneighbours[MAX_NEIGHBOUR_NUMBER];
-static size_t CHECKnumber; /* se non 0 non bisogna scrivere */
-static int CHECKflag; /* se c'è un thread in attesa */
+static int
+handle_MESSAGES_TOPOLOGY_UPDATE(
+            int socketfd,
+            const void* buffer,
+            size_t bufLen,
+            const struct sockaddr* source,
+            socklen_t sourceLen)
+{
+    uint32_t ID, epoch, seq;
+    int newEpoch, confirm;
+    struct peer_data neighbours[MAX_NEIGHBOUR_NUMBER];
+    size_t length;
+    struct ns_host_addr srcAddr, dsAddr;
+    int ans;
+
+    if (messages_check_topology_update(buffer, bufLen) != 0)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "\tMalformed Message!");
+        return -1;
+    }
+
+    if (messages_get_topology_update_body((const struct topology_update*)buffer,
+        &ID, &epoch, &seq, &confirm, neighbours, &length) != 0)
+        errExit("*** UDP:messages_get_topology_update_body ***\n");
+
+    /* deve provenire dal server a cui si è connessi */
+    if (!CTX->ISPeerConnected || ID != CTX->peerID)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "\tUnexpected message for ID [%ld]! Discarded.", (long)ID);
+        return -1;
+    }
+    /* indirizzo e porta, non basta la sola porta */
+    if (ns_host_addr_from_sockaddr(&srcAddr, source) == -1
+        || ns_host_addr_from_sockaddr(&dsAddr, (struct sockaddr*)&CTX->DSaddr) == -1
+        || ns_host_addr_equal(&srcAddr, &dsAddr) != 1)
+    {
+        unified_io_push(UNIFIED_IO_ERROR, "\tTopology update not sent by the server! Discarded.");
+        return -1;
+    }
+
+    ans = -1;
+    newEpoch = 0;
+    if (pthread_mutex_lock(&CTX->TOPOguard) != 0)
+        abort();
+    if (CTX->TOPOvalid && epoch > CTX->TOPOepoch)
+    {
+        /* il server è ripartito, la numerazione anche */
+        newEpoch = 1;
+        ans = 0;
+    }
+    else if (CTX->TOPOvalid && epoch == CTX->TOPOepoch && seq > CTX->TOPOseq)
+    {
+        if (seq != CTX->TOPOseq+1)
+            unified_io_push(UNIFIED_IO_NORMAL, "\tMissed (%ld) topology updates", (long)(seq-CTX->TOPOseq-1));
+        ans = 0;
+    }
+    if (pthread_mutex_unlock(&CTX->TOPOguard) != 0)
+        abort();
+
+    if (confirm)
+    {
+        /* nessuna attesa: la risposta è scartata e, se
+         * la richiesta va persa, il server marca anche
+         * l'aggiornamento successivo */
+        if (messages_send_check_req(socketfd, source, sourceLen, (uint16_t)CTX->UDP_port, 0) != 0)
+            unified_io_push(UNIFIED_IO_ERROR, "\tUnable to confirm presence to the server");
+    }
+
+    if (ans == -1)
+    {
+        unified_io_push(UNIFIED_IO_NORMAL, "\tStale topology update [seq:%ld] discarded", (long)seq);
+        return -1;
+    }
+
+    if (newEpoch)
+        unified_io_push(UNIFIED_IO_NORMAL, "\tNew server epoch [%ld]", (long)epoch);
+    unified_io_push(UNIFIED_IO_NORMAL, "\tTopology update [seq:%ld]: (%d) neighbours", (long)seq, (int)length);
+    setTopology(neighbours, length, epoch, &seq);
+
+    return 0;
+}
 
 /** Funzione ausiliaria che collabora con
  * UDPcheck per la ricezione delle informazioni
@@ -138,6 +531,7 @@ handle_MESSAGES_CHECK_ACK(
 {
     const struct check_ack* ack;
     uint16_t port;
+    uint32_t reqID;
     uint8_t status;
     struct peer_data peer; /* infomazioni sul peer */
     /* vicini */
@@ -157,31 +551,36 @@ handle_MESSAGES_CHECK_ACK(
     /* casta di controllo */
     ack = (const struct check_ack*)buffer;
 
-    if (messages_get_check_ack_body(ack, &port, &status,
+    if (messages_get_check_ack_body(ack, &port, &reqID, &status,
         &peer, neighbours, &length) != 0)
         errExit("*** UDP:messages_get_check_ack_body ***\n");
 
     /* controlla se le porta è diversa da quella del peer */
-    if ((int)port != UDP_port)
+    if ((int)port != CTX->UDP_port)
     {
         /* questo messaggio non era per noi */
         unified_io_push(UNIFIED_IO_ERROR,  "\tUnexpected message,"
             " specified port is (%d) instead of (%d)! Discarded.",
-            (int)port, UDP_port);
+            (int)port, CTX->UDP_port);
         return;
     }
     /* INIZIO SEZIONE CRITICA */
-    if (pthread_mutex_lock(&CHECKguard) != 0)
+    if (pthread_mutex_lock(&CTX->CHECKguard) != 0)
         abort();
-    /* controlla che fosse richiesto di operare */
-    if (CHECKflag && CHECKnumber == 0)
+    /* controlla che fosse richiesto di operare
+     * e che risponda a uno dei tentativi correnti */
+    if (CTX->CHECKflag && CTX->CHECKnumber == 0 && !CTX->CHECKerror
+        && reqID - CTX->CHECKfirstID <= CTX->CHECKlastID - CTX->CHECKfirstID)
     {
+        CTX->CHECKansweredID = reqID;
+        CTX->CHECKanswerTime = rttNow();
         /* controlla lo status */
         if (status) /* caso di errore */
         {
             unified_io_push(UNIFIED_IO_ERROR, "\tBad response status!");
             /* segnala senza spegnere il flag: */
-            pthread_cond_signal(&CHECKcond);
+            CTX->CHECKerror = 1;
+            pthread_cond_signal(&CTX->CHECKcond);
         }
         else
         {
@@ -192,16 +591,16 @@ handle_MESSAGES_CHECK_ACK(
             {
                 peer_data_as_string(&neighbours[i], neigStr, sizeof(neigStr));
                 unified_io_push(UNIFIED_IO_NORMAL, "\t%d)-> %s", (int)i, neigStr);
-                CHECKneighbours[i] = neighbours[i];
+                CTX->CHECKneighbours[i] = neighbours[i];
             }
             /* segnala */
-            pthread_cond_signal(&CHECKcond);
-            CHECKnumber = length; /* numero di vicini */
-            CHECKflag = 0; /* spegne il flag, richiesta servita */
+            pthread_cond_signal(&CTX->CHECKcond);
+            CTX->CHECKnumber = length; /* numero di vicini */
+            CTX->CHECKflag = 0; /* spegne il flag, richiesta servita */
         }
     }
     /* TERMINE SEZIONE CRITICA */
-    if (pthread_mutex_unlock(&CHECKguard) != 0)
+    if (pthread_mutex_unlock(&CTX->CHECKguard) != 0)
         abort();
 }
 
@@ -245,34 +644,21 @@ handle_MESSAGES_CHECK_ACK(
  * uso di segnali, risulta quindi thread safe.
  */
 
-/** Per lo scambio e la gestione dei messaggi
- * di boot da parte del server sarà utilizzato
- * un protocollo produttore consumatore
- * usando le seguenti strutture dati per
- * lavorare in mutua esclusione.
- */
-static pthread_mutex_t BOOTguard = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t BOOTcond = PTHREAD_COND_INITIALIZER;
-static volatile int BOOTflag; /* se a uno il pid è valido */
-static volatile uint32_t BOOTpid;
-static volatile struct boot_ack* BOOTack;
 //int startPipe[2];
 
-/** Id del thead che gestisce il socket
- * UDP
- */
-pthread_t UDP_tid;
-
 /** Fino a che questa variabile
  * non sarà azzerata il ciclo del
- * sottosistema UDP
+ * sottosistema UDP.
+ * Come il checkpoint è propria di ogni
+ * thread UDP, poiché il segnale è inviato
+ * al thread del peer da terminare.
  */
-volatile sig_atomic_t UDPloop = 1;
+static __thread volatile sig_atomic_t UDPloop = 1;
 
 /* serve a gestire la terminazione del
  * ciclo del thread UDP */
-sigset_t toBlock; /* per ignorare il segnale */
-sigjmp_buf sigSetJmp; /* bellissimo */
+static sigset_t toBlock; /* per ignorare il segnale */
+static __thread sigjmp_buf sigSetJmp; /* bellissimo */
 static void sigHandler(int sigNum)
 {
     (void)sigNum;
@@ -280,12 +666,6 @@ static void sigHandler(int sigNum)
     siglongjmp(sigSetJmp, 1); /* magia */
 }
 
-/* fd del socket
- * è globale poiché deve essere
- * potenzialmente condiviso da
- * più thread */
-int socketfd;
-
 /** Funzione ausiliaria che si occupa
  * di gestire la ricezione di un messaggio
  * di tipo MESSAGES_SHUTDOWN_REQ.
@@ -326,16 +706,16 @@ handle_MESSAGES_SHUTDOWN_REQ(
 
     /* ora deve controllare se l'ID coincide con quello del peer */
     /* in maniera sicura */
-    if (pthread_mutex_lock(&IDguard) != 0)
+    if (pthread_mutex_lock(&CTX->IDguard) != 0)
         errExit("*** UDP:pthread_mutex_lock ***\n");
 
     /* se il peer è connesso al network e il
      * messaggio è effettivamente per lui */
-    if (ISPeerConnected != 0 && peerID == msgPeerID)
+    if (CTX->ISPeerConnected != 0 && CTX->peerID == msgPeerID)
         terminate = 1;
 
     /* rilascia il mutex */
-    if (pthread_mutex_unlock(&IDguard) != 0)
+    if (pthread_mutex_unlock(&CTX->IDguard) != 0)
         errExit("*** UDP:pthread_mutex_unlock ***\n");
 
     if (terminate == 0)
@@ -381,19 +761,19 @@ handle_MESSAGES_BOOT_ACK(
     ack = (struct boot_ack*)buffer;
 
     /* sezione critica */
-    if (pthread_mutex_lock(&BOOTguard) != 0)
+    if (pthread_mutex_lock(&CTX->BOOTguard) != 0)
         errExit("*** UDP:pthread_mutex_lock ***\n");
 
     /* se c'è una richiesta in coda */
     ans = -1; /* di default si fallisce */
-    if (BOOTflag)
+    if (CTX->BOOTflag)
     {
         if (messages_get_pid(ack, &pid) == -1)
             errExit("*** UDP:messages_get_pid ***\n");
 
         /* controlla che la richiesta coincida
          * con il messaggio inviato */
-        if (pid == BOOTpid)
+        if (pid == CTX->BOOTpid)
         {
             /* clona il messaggio */
             copy = (struct boot_ack*)messages_clone((void*)buffer);
@@ -401,10 +781,10 @@ handle_MESSAGES_BOOT_ACK(
                 errExit("*** UDP:messages_clone ***");
             /* mette la copia dove il main thread
              * lo leggerà */
-            BOOTack = (volatile struct boot_ack*)copy;
+            CTX->BOOTack = (volatile struct boot_ack*)copy;
             ans = 0;
             /* segnala il main thread */
-            if (pthread_cond_signal(&BOOTcond) != 0)
+            if (pthread_cond_signal(&CTX->BOOTcond) != 0)
                 errExit("*** UDP:pthread_cond_signal ***");
             unified_io_push(UNIFIED_IO_NORMAL, "\tReceived requested response!");
         }
@@ -413,7 +793,7 @@ handle_MESSAGES_BOOT_ACK(
     }
 
     /* termine della sezione critica */
-    if (pthread_mutex_unlock(&BOOTguard) != 0)
+    if (pthread_mutex_unlock(&CTX->BOOTguard) != 0)
         errExit("*** UDP:pthread_mutex_unlock ***\n");
 
     return ans;
@@ -436,7 +816,7 @@ static void UDPReadLoop()
     {
         /* bisogna inizializzare questa variabile prima di invocare recvfrom */
         ssLen = sizeof(struct sockaddr_storage);
-        msgLen = recvfrom(socketfd, (void*)buffer, sizeof(buffer), 0, (struct sockaddr*)&ss, &ssLen);
+        msgLen = recvfrom(CTX->socketfd, (void*)buffer, sizeof(buffer), 0, (struct sockaddr*)&ss, &ssLen);
         /* controllo per errore */
         if (msgLen == -1)
             errExit("*** UDP ***\n");
@@ -466,12 +846,12 @@ static void UDPReadLoop()
         case MESSAGES_BOOT_ACK:
             unified_io_push(UNIFIED_IO_NORMAL, "\tMessage MESSAGES_BOOT_ACK!");
             /* messaggi */
-            if (handle_MESSAGES_BOOT_ACK(socketfd, buffer, (size_t)msgLen) == 0)
+            if (handle_MESSAGES_BOOT_ACK(CTX->socketfd, buffer, (size_t)msgLen) == 0)
             {
                 /* ricevuta la risposta attesa */
                 /* memorizza globalmente l'indirizzo del server */
-                DSaddr = ss;
-                DSaddrLen = ssLen;
+                CTX->DSaddr = ss;
+                CTX->DSaddrLen = ssLen;
             }
 
             /* ora sarà l'altro thread a gestire il dato */
@@ -480,25 +860,25 @@ static void UDPReadLoop()
         case MESSAGES_SHUTDOWN_REQ:
             unified_io_push(UNIFIED_IO_NORMAL, "\tMessage MESSAGES_SHUTDOWN_REQ!", sendName);
             /* verifica se bisogna morire */
-            if (handle_MESSAGES_SHUTDOWN_REQ(socketfd, buffer, (size_t)msgLen, (struct sockaddr*)&ss, ssLen) == 0)
+            if (handle_MESSAGES_SHUTDOWN_REQ(CTX->socketfd, buffer, (size_t)msgLen, (struct sockaddr*)&ss, ssLen) == 0)
             {
                 unified_io_push(UNIFIED_IO_NORMAL, "\tMessage MESSAGES_SHUTDOWN_REQ!", sendName);
                 /** gestione del problema descritto prima
                  * della dichiarazione del mutex
                  */
                 /* INIZIO SEZIONE CRITICA */
-                if (pthread_mutex_lock(&termUDPguard) != 0)
+                if (pthread_mutex_lock(&CTX->termUDPguard) != 0)
                     errExit("*** UDP:pthread_mutex_lock ***\n");
-                if (termUDPflag == 0)
+                if (CTX->termUDPflag == 0)
                 {
-                    termUDPflag = 1;
-                    if (pthread_kill(mainThreadID, MAIN_LOOP_TERMINATION_SIGNAL) != 0)
+                    CTX->termUDPflag = 1;
+                    if (pthread_kill(CTX->mainThreadID, MAIN_LOOP_TERMINATION_SIGNAL) != 0)
                         errExit("*** UDP:pthread_kill ***\n"); /*scoppia*/
                 }
                 /* TERMINE SEZIONE CRITICA */
-                if (pthread_mutex_unlock(&termUDPguard) != 0)
+                if (pthread_mutex_unlock(&CTX->termUDPguard) != 0)
                     errExit("*** UDP:pthread_mutex_unlock ***\n");
-                if (close(socketfd) != 0)
+                if (close(CTX->socketfd) != 0)
                     errExit("*** UDP:close ***\n");
                 pthread_exit(NULL); /* fine */
                 errExit("*** UDP:shutdown ***\n");
@@ -509,11 +889,18 @@ static void UDPReadLoop()
             /* normale, il messaggio era farlocco, si va avanti */
             break;
 
+        case MESSAGES_TOPOLOGY_UPDATE:
+            unified_io_push(UNIFIED_IO_NORMAL, "\tMessage MESSAGES_TOPOLOGY_UPDATE!");
+            /* il thread TCP si riconcilia con i nuovi vicini */
+            if (handle_MESSAGES_TOPOLOGY_UPDATE(CTX->socketfd, buffer, (size_t)msgLen, (struct sockaddr*)&ss, ssLen) == 0)
+                TCPtopologyChanged();
+            break;
+
         case MESSAGES_CHECK_ACK:
             unified_io_push(UNIFIED_IO_NORMAL, "\tMessage MESSAGES_CHECK_ACK!");
             /* leggere la descrizione sopra la definizione di CHECKguard
              * per capire il ruolo */
-            handle_MESSAGES_CHECK_ACK(socketfd, buffer, (size_t)msgLen);
+            handle_MESSAGES_CHECK_ACK(CTX->socketfd, buffer, (size_t)msgLen);
             break;
 
         default:
@@ -538,6 +925,7 @@ handle_peer_close(int sockfd)
     /* per il polling */
     struct pollfd fd;
     int timeout;
+    long int sentAt;
     /* messaggio */
     char buffer[256];
     ssize_t msgLen;
@@ -547,11 +935,11 @@ handle_peer_close(int sockfd)
     /* usa messaggi di tipo MESSAGES_SHUTDOWN_REQ */
     /* e aspetta una risposta di tipo MESSAGES_SHUTDOWN_ACK */
     /* sezione critica */
-    if (pthread_mutex_lock(&IDguard) != 0)
+    if (pthread_mutex_lock(&CTX->IDguard) != 0)
         errExit("*** UDP:pthread_mutex_lock ***\n");
 
     /* deve essere connesso per disconnettersi */
-    if (ISPeerConnected)
+    if (CTX->ISPeerConnected)
     {
         /* al più MAX_STOP_ATTEMPT tentativi */
         for (i = 0;  i < MAX_STOP_ATTEMPT; ++i)
@@ -561,13 +949,15 @@ handle_peer_close(int sockfd)
                 i+1, MAX_STOP_ATTEMPT);
 
             /* invia il messaggio di risposta */
-            if (messages_send_shutdown_req(sockfd, (struct sockaddr*)&DSaddr, DSaddrLen, peerID) == -1)
+            sentAt = rttNow();
+            if (messages_send_shutdown_req(sockfd, (struct sockaddr*)&CTX->DSaddr, CTX->DSaddrLen, CTX->peerID) == -1)
                 errExit("*** UDP:messages_send_shutdown_req ***\n");
 
             unified_io_push(UNIFIED_IO_NORMAL, "\tSent messages [MESSAGES_SHUTDOWN_REQ]");
             /* si mette in attesa del messaggio */
             /* assunzione semplicistica di non ricevere messaggi farlocchi spuri */
-            timeout = STOP_TIMEOUT; /* imposta il timeout */
+            /* imposta il timeout, in millisecondi */
+            timeout = (int)((rttTimeout((struct sockaddr*)&CTX->DSaddr, CTX->DSaddrLen, i) + 999)/1000);
             /* prepara la struttura per il polling */
             memset(&fd, 0, sizeof(fd));
             fd.fd = sockfd;
@@ -615,11 +1005,11 @@ handle_peer_close(int sockfd)
                         errExit("*** UDP:messages_get_shutdown_ack_body ***\n");
 
                     /* il messaggio era per questo peer */
-                    if (msgID != peerID)
+                    if (msgID != CTX->peerID)
                     {
                         unified_io_push(UNIFIED_IO_NORMAL,
                             "\tWrong ID in msg Body: [%ld] instead of [%ld]",
-                            msgID, peerID);
+                            msgID, CTX->peerID);
                         continue; /* passa al prossimo */
                     }
 
@@ -639,11 +1029,23 @@ handle_peer_close(int sockfd)
             }
             /* se è vero significa che abbiamo ricevuto una risposta dal DS */
             if (msgLen != -1)
+            {
+                /* come per il boot solo il primo tentativo è misurabile */
+                if (i == 0)
+                    rttSample((struct sockaddr*)&CTX->DSaddr, CTX->DSaddrLen, rttNow() - sentAt);
                 break;
+            }
         }
     }
 
-    if (pthread_mutex_unlock(&IDguard) != 0)
+    /* i vicini noti non valgono più */
+    if (pthread_mutex_lock(&CTX->TOPOguard) != 0)
+        errExit("*** UDP:pthread_mutex_lock ***\n");
+    CTX->TOPOvalid = 0;
+    if (pthread_mutex_unlock(&CTX->TOPOguard) != 0)
+        errExit("*** UDP:pthread_mutex_unlock ***\n");
+
+    if (pthread_mutex_unlock(&CTX->IDguard) != 0)
         errExit("*** UDP:pthread_mutex_unlock ***\n");
 }
 
@@ -718,15 +1120,15 @@ static void* UDP(void* args)
     /* codice per gestire l'apertura del socket */
     requestedPort = *data;
     /* crea il socket UDP */
-    socketfd = initUDPSocket(requestedPort);
-    if (socketfd == -1)
+    CTX->socketfd = initUDPSocket(requestedPort);
+    if (CTX->socketfd == -1)
     {
         if (thread_semaphore_signal(ts, -1, NULL) == -1)
             errExit("*** UDP ***\n");
         pthread_exit(NULL);
     }
     /* verifica la porta */
-    usedPort = getSocketPort(socketfd);
+    usedPort = getSocketPort(CTX->socketfd);
     if (usedPort == -1 || (requestedPort != 0 && requestedPort != usedPort))
     {
         if (thread_semaphore_signal(ts, -1, NULL) == -1)
@@ -765,10 +1167,10 @@ static void* UDP(void* args)
 
     /* gestisce il distacco del
      * peer dal network */
-    handle_peer_close(socketfd);
+    handle_peer_close(CTX->socketfd);
 
     /* chiude il socket */
-    if (close(socketfd) != 0)
+    if (close(CTX->socketfd) != 0)
         errExit("*** UDP:close ***\n");
 
     return NULL;
@@ -780,17 +1182,17 @@ int UDPstart(int port)
 
     listeningOn = port;
     /* si mette in attesa dell'avvio del thread UDP */
-    if (start_long_life_thread(&UDP_tid, &UDP, (void*)&listeningOn, NULL) == -1)
+    if (peer_context_start_thread(&CTX->UDP_tid, &UDP, (void*)&listeningOn, NULL) == -1)
         return -1;
 
-    UDP_port = listeningOn;
+    CTX->UDP_port = listeningOn;
 
     return listeningOn;
 }
 
 int UDPisConnected()
 {
-    return ISPeerConnected;
+    return CTX->ISPeerConnected;
 }
 
 /* utilizza startPipe */
@@ -809,34 +1211,32 @@ int UDPconnect(const char* hostname, const char* portname)
     struct boot_ack* ack; /* puntatore alla risposta */
     int err;
     /* per la gestione della risposta */
-    uint32_t offeredID;
+    uint32_t offeredID, epoch;
     struct peer_data peersAddrs[MAX_NEIGHBOUR_NUMBER];
     size_t peersNum;
+    uint32_t seq;
     /* per il timeout di attesa della risposta */
-    struct timeval now;
     struct timespec waitTime;
+    long int sentAt;
     int i;
     char neigbourStr[64];
 
+    /* pid da associare a ciascuna nuova richiesta */
+    uint32_t pid;
+    unsigned int seed;
+
     /* codice per assegnare il pseudo id ai messaggi
      * inviati */
-    static int once = 1; /* per usare il tutto solo la prima volta */
-    static uint32_t pid; /* pid da associare a ciascuna nuova richiesta */
-
-    if (once) /* solo la prima volta */
+    if (!CTX->BOOTseeded) /* solo la prima volta */
     {
-        once = 0;
-        srand(time(NULL));
-        /* primo valore casuale */
-        pid = (uint32_t)rand();
-
-        /* salva il thread ID del main thread */
-        mainThreadID = pthread_self();
-    }
-    else
-    {
-        ++pid;
+        CTX->BOOTseeded = 1;
+        /* primo valore casuale, diverso per ogni peer del processo */
+        seed = (unsigned int)time(NULL) ^ (unsigned int)CTX->UDP_port;
+        CTX->BOOTnextPid = (uint32_t)rand_r(&seed);
     }
+    pid = CTX->BOOTnextPid++;
+    /* salva il thread ID del main thread */
+    CTX->mainThreadID = pthread_self();
 
     ans = -1; /* errore di default */
 
@@ -851,21 +1251,22 @@ int UDPconnect(const char* hostname, const char* portname)
          * protocollo produttore consumatore per comunicare
          * tra i thread */
         /* inizio sezione critica */
-        if (pthread_mutex_lock(&BOOTguard) != 0)
+        if (pthread_mutex_lock(&CTX->BOOTguard) != 0)
             errExit("*** main:pthread_mutex_lock ***\n");
         /* accende il flag - richiesta pendente */
-        BOOTflag = 1;
+        CTX->BOOTflag = 1;
         /* imposta il pid della richiesta che ci si aspetta */
-        BOOTpid = pid;
+        CTX->BOOTpid = pid;
 
         /* controllo di consistenza */
-        if (BOOTack != NULL)
+        if (CTX->BOOTack != NULL)
             errExit("*** main:inconsistenza-BOOTack ***\n");
 
         /* prova a inviare il messaggio */
         /* se fallisce qui c'è proprio un problema
          * di invio */
-        if (messages_send_boot_req(socketfd, (struct sockaddr*)&ss, sl, socketfd, pid, &ns_addr_send) != 0)
+        sentAt = rttNow();
+        if (messages_send_boot_req(CTX->socketfd, (struct sockaddr*)&ss, sl, CTX->socketfd, pid, &ns_addr_send) != 0)
             goto endBoot;
 
         /* resoconto di cosa è stato inviato a chi */
@@ -880,21 +1281,21 @@ int UDPconnect(const char* hostname, const char* portname)
         /* sarà il thread secondario a controllare
          * l'integrità del messaggio di risposta */
         /* imposta l'attesa massima sulla variabile di condizione */
-        /* copiato dalla sezione EXAMPLE di pthread_cond_timedwait */
-        gettimeofday(&now, NULL);
-        waitTime.tv_nsec = now.tv_usec*1000;
-        waitTime.tv_sec =  now.tv_sec + BOOT_TIMEOUT/1000;
-        /* per ora ignoro wake up improvvisi */
+        rttDeadline(&waitTime, rttTimeout((struct sockaddr*)&ss, sl, attempt));
+        /* i wake up improvvisi rimettono in attesa */
         /* pthread_cond_timedwait non usa errno */
-        if ((err = pthread_cond_timedwait(&BOOTcond, &BOOTguard, &waitTime)) != 0 && BOOTack == NULL)
+        err = 0;
+        while (CTX->BOOTack == NULL && err == 0)
+            err = pthread_cond_timedwait(&CTX->BOOTcond, &CTX->BOOTguard, &waitTime);
+        if (CTX->BOOTack == NULL)
         {
             if (err != ETIMEDOUT)
                 errExit("*** main:pthread_cond_timedwait ***\n");
 
             /* spegne il flag, non aspettiamo più nulla */
-            BOOTflag = 0;
+            CTX->BOOTflag = 0;
 
-            if (pthread_mutex_unlock(&BOOTguard) != 0)
+            if (pthread_mutex_unlock(&CTX->BOOTguard) != 0)
                 errExit("*** main:pthread_cond_timedwait ***\n");
             /* niente in questo ciclo, andiamo oltre */
             continue;
@@ -902,13 +1303,18 @@ int UDPconnect(const char* hostname, const char* portname)
 
         /* se arriva qui il messaggio è arrivato entro il
          * timeout */
-        ack = (struct boot_ack*)BOOTack;
-        BOOTack = NULL;
-        BOOTflag = 0; /* spegne il flag */
+        ack = (struct boot_ack*)CTX->BOOTack;
+        CTX->BOOTack = NULL;
+        CTX->BOOTflag = 0; /* spegne il flag */
+        /* tutti i tentativi hanno lo stesso pid, così il
+         * server riconosce i duplicati: solo la risposta
+         * al primo è associabile con certezza all'invio */
+        if (attempt == 0)
+            rttSample((struct sockaddr*)&ss, sl, rttNow() - sentAt);
 
         /* fine sezione critica, così da evitare che
          * il secondo thread si impunti */
-        if (pthread_mutex_unlock(&BOOTguard) != 0)
+        if (pthread_mutex_unlock(&CTX->BOOTguard) != 0)
             errExit("*** main:pthread_cond_timedwait ***\n");
 
         /* si mette in attesa di un risultato o del timeout */
@@ -925,22 +1331,27 @@ int UDPconnect(const char* hostname, const char* portname)
         /* prende il messaggio e lo gestisce,
             * siamo già certi della sia consistenza */
         peersNum = MAX_NEIGHBOUR_NUMBER; /* non necessario ma non si sa mai */
-        if (messages_get_boot_ack_body_cp(ack, &offeredID, peersAddrs, &peersNum) == -1)
+        if (messages_get_boot_ack_body_cp(ack, &offeredID, &epoch, peersAddrs, &peersNum) == -1)
             errExit("*** main:messages_get_boot_ack_body ***\n");
 
         /* imposta l'ID del peer */
-        if (pthread_mutex_lock(&IDguard) != 0)
+        if (pthread_mutex_lock(&CTX->IDguard) != 0)
             errExit("*** main:pthread_mutex_lock ***\n");
         /* controlla che non sia già connesso */
-        if (ISPeerConnected)
+        if (CTX->ISPeerConnected)
             errExit("*** ALREADY CONNECTED! ***\n");
         /* imposta l'ID del peer */
-        peerID = offeredID;
+        CTX->peerID = offeredID;
         /* accende il flag */
-        ISPeerConnected = 1;
-        if (pthread_mutex_unlock(&IDguard) != 0)
+        CTX->ISPeerConnected = 1;
+        if (pthread_mutex_unlock(&CTX->IDguard) != 0)
             errExit("*** main:pthread_mutex_unlock ***\n");
 
+        /* i primi vicini, gli aggiornamenti della
+         * stessa epoch partiranno da 1 */
+        seq = 0;
+        setTopology(peersAddrs, peersNum, epoch, &seq);
+
         unified_io_push(UNIFIED_IO_NORMAL, "Peer connesso a una rete con ID [%ld]\n", (long)offeredID);
 
         /* libera la memoria del messaggio */
@@ -972,132 +1383,179 @@ endBoot:
 int UDPstop(void)
 {
     /* controlla che fosse partito */
-    if (UDP_tid == 0)
+    if (CTX->UDP_tid == 0)
         return -1;
 
     /** gestisco il problema evidenziato sopra
      * la descrizione del mutex
      */
     /* INIZIO SEZIONE CRITICA */
-    if (pthread_mutex_lock(&termUDPguard) != 0)
+    if (pthread_mutex_lock(&CTX->termUDPguard) != 0)
         errExit("*** UDP:pthread_mutex_lock ***\n");
 
-    if (termUDPflag == 0)
+    if (CTX->termUDPflag == 0)
     {
-        termUDPflag = 1;
+        CTX->termUDPflag = 1;
         /* invia il segnale di terminazione */
-        if (pthread_kill(UDP_tid, INTERRUPT_SIGNAL) != 0)
+        if (pthread_kill(CTX->UDP_tid, INTERRUPT_SIGNAL) != 0)
             errExit("*** UDP:pthread_kill ***\n");
     }
 
     /* TERMINE SEZIONE CRITICA */
-    if (pthread_mutex_unlock(&termUDPguard) != 0)
+    if (pthread_mutex_unlock(&CTX->termUDPguard) != 0)
         errExit("*** main:pthread_mutex_unlock ***\n");
 
     /* alla fine bisogna sempre rilasciare
      * le risorse allocate per il thread */
-    if (pthread_join(UDP_tid, NULL) != 0)
+    if (pthread_join(CTX->UDP_tid, NULL) != 0)
         return -1;
 
-    UDP_port = 0;
+    CTX->UDP_port = 0;
 
     return 0;
 }
 
 int UDPport(void)
 {
-    return UDP_port;
+    return CTX->UDP_port;
 }
 
-/** Quanti secondi al più può aspettare
- * per la risoluzione della chiamata?
- */
-#define UDPcheckTIMEOUT 2
-
 int UDPcheck(
             struct peer_data* neighbours,
             size_t* length)
 {
-    /* per garantire la mutua esclusione nell'uso
-     * di questa funzionalità */
-    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
     /* per l'attesa sulla cond.var. */
-    struct timeval now;
     struct timespec timeout;
+    /* istante di invio di ciascun tentativo */
+    long int sentAt[MAX_CHECK_ATTEMPT];
+    long int wait;
     int retcode;
     int ans = 0; /* ottimista */
-    int i;
+    int i, attempt;
 
     /* controllo validità degli argomenti */
     if (neighbours == NULL || length == NULL)
         return -1;
 
     /* se non si è connessi ritorna immediatamente */
-    if (pthread_mutex_lock(&mutex) != 0)
+    if (pthread_mutex_lock(&CTX->CHECKcaller) != 0)
         abort();
-    if (!ISPeerConnected)
+    if (!CTX->ISPeerConnected)
     {
-        pthread_mutex_unlock(&mutex);
+        pthread_mutex_unlock(&CTX->CHECKcaller);
         return -1;
     }
-    if (pthread_mutex_unlock(&mutex) != 0)
+    if (pthread_mutex_unlock(&CTX->CHECKcaller) != 0)
         abort();
     /* OK: la funzionalità è disponibile */
     /* solo un thread per volta può invocare questa
      * funzione */
     /* SEZIONE CRITICA ESTERNA */
-    if (pthread_mutex_lock(&mutex) != 0)
+    if (pthread_mutex_lock(&CTX->CHECKcaller) != 0)
         abort();
 
     /* SEZIONE CRITICA INTERNA - vedere descrizione
      * sopra la dichiarazione del mutex */
-    if(pthread_mutex_lock(&CHECKguard) != 0)
+    if(pthread_mutex_lock(&CTX->CHECKguard) != 0)
         abort();
     /* vale: CHECKnumber==0&&CHECKflag==0 */
 
-    /* invia il messaggio */
-    if (messages_send_check_req(socketfd, (struct sockaddr*)&DSaddr,
-        DSaddrLen, (uint16_t)UDP_port) != 0)
-        abort();
     /* accende il flag */
-    CHECKflag = 1;
-    /* pausa temporizzata - vedi man pthread_cond_timedwait */
-    gettimeofday(&now, NULL);
-    timeout.tv_sec = now.tv_sec + UDPcheckTIMEOUT; /* imposta il timeout */
-    timeout.tv_nsec = now.tv_usec * 1000;
+    CTX->CHECKflag = 1;
+    CTX->CHECKerror = 0;
+    CTX->CHECKfirstID = CTX->CHECKsentID+1;
     retcode = 0;
-    while (CHECKflag && retcode != ETIMEDOUT)
+    for (attempt = 0; attempt != MAX_CHECK_ATTEMPT; ++attempt)
     {
-        retcode = pthread_cond_timedwait(&CHECKcond, &CHECKguard, &timeout);
+        /* ogni tentativo ha il proprio identificativo,
+         * così la risposta indica a quale si riferisce */
+        sentAt[attempt] = rttNow();
+        if (attempt != 0 && sentAt[attempt] - sentAt[0] >= CHECK_BUDGET)
+            break;
+        CTX->CHECKlastID = ++CTX->CHECKsentID;
+        if (messages_send_check_req(CTX->socketfd, (struct sockaddr*)&CTX->DSaddr,
+            CTX->DSaddrLen, (uint16_t)CTX->UDP_port, CTX->CHECKlastID) != 0)
+        {
+            /* es. il socket è stato chiuso in chiusura:
+             * la verifica fallisce come per timeout */
+            unified_io_push(UNIFIED_IO_ERROR, "\tUnable to send [MESSAGES_CHECK_REQ]");
+            break;
+        }
+        /* pausa temporizzata - vedi man pthread_cond_timedwait */
+        wait = rttTimeout((struct sockaddr*)&CTX->DSaddr, CTX->DSaddrLen, attempt);
+        if (wait > CHECK_BUDGET - (sentAt[attempt] - sentAt[0]))
+            wait = CHECK_BUDGET - (sentAt[attempt] - sentAt[0]);
+        rttDeadline(&timeout, wait);
+        retcode = 0;
+        while (CTX->CHECKflag && !CTX->CHECKerror && retcode != ETIMEDOUT)
+        {
+            retcode = pthread_cond_timedwait(&CTX->CHECKcond, &CTX->CHECKguard, &timeout);
+        }
+        if (!CTX->CHECKflag || CTX->CHECKerror)
+            break;
+        unified_io_push(UNIFIED_IO_NORMAL, "\tNo [MESSAGES_CHECK_ACK]: attempt [%d] of [%d]",
+            attempt+1, MAX_CHECK_ATTEMPT);
     }
     /* Perché si è sbloccato? */
-    if (retcode == ETIMEDOUT && CHECKflag)
+    if (CTX->CHECKerror) /* errore prematuro - status della risposta anomalo */
+    {
+        CTX->CHECKflag = 0;
+        ans = 1;
+    }
+    else if (CTX->CHECKflag)
     {
         ans = -1; /* andata male */
         errno = ETIMEDOUT; /* casomai interessi */
-        CHECKflag = 0; /* ripristina lo stato */
+        CTX->CHECKflag = 0; /* ripristina lo stato */
     }
-    else if (CHECKflag == 0)/* ci sono dei dati */
+    else /* ci sono dei dati */
     {
+        /* l'identificativo dice a quale invio si riferisce */
+        rttSample((struct sockaddr*)&CTX->DSaddr, CTX->DSaddrLen,
+            CTX->CHECKanswerTime - sentAt[CTX->CHECKansweredID - CTX->CHECKfirstID]);
+
         /* copia i risultati per renderli disponibili al chiamante */
-        for (i = 0; i != (int)CHECKnumber; ++i) /* passa le info sui vicini */
-            neighbours[i] = CHECKneighbours[i];
+        for (i = 0; i != (int)CTX->CHECKnumber; ++i) /* passa le info sui vicini */
+            neighbours[i] = CTX->CHECKneighbours[i];
 
-        *length = CHECKnumber; /* passa il numero di vicini  */
-        CHECKnumber = 0; /* alla fine ripristina lo stato */
-    }
-    else /* errore prematuro - status della risposta anomalo */
-    {
-        CHECKflag = 0;
-        ans = 1;
+        *length = CTX->CHECKnumber; /* passa il numero di vicini  */
+        CTX->CHECKnumber = 0; /* alla fine ripristina lo stato */
+        /* risposta fresca: sostituisce i vicini noti */
+        setTopology(neighbours, *length, 0, NULL);
     }
+    CTX->CHECKerror = 0;
 
     /* TERMINE SEZIONE CRITICA INTERNA */
-    if (pthread_mutex_unlock(&CHECKguard) != 0)
+    if (pthread_mutex_unlock(&CTX->CHECKguard) != 0)
         abort();
 
     /* TERMINE SEZIONE CRITICA ESTERNA */
-    if (pthread_mutex_unlock(&mutex) != 0)
+    if (pthread_mutex_unlock(&CTX->CHECKcaller) != 0)
+        abort();
+
+    return ans;
+}
+
+int UDPneighbours(
+            struct peer_data* neighbours,
+            size_t* length)
+{
+    size_t i;
+    int ans;
+
+    if (neighbours == NULL || length == NULL)
+        return -1;
+
+    if (pthread_mutex_lock(&CTX->TOPOguard) != 0)
+        abort();
+    ans = CTX->TOPOvalid ? 0 : -1;
+    if (CTX->TOPOvalid)
+    {
+        for (i = 0; i != CTX->TOPOnumber; ++i)
+            neighbours[i] = CTX->TOPOneighbours[i];
+        *length = CTX->TOPOnumber;
+    }
+    if (pthread_mutex_unlock(&CTX->TOPOguard) != 0)
         abort();
 
     return ans;
@@ -69,4 +69,18 @@ int UDPport(void);
  */
 int UDPcheck(struct peer_data* neighbours, size_t* length);
 
+/** Fornisce, senza contattare il server, gli
+ * ultimi vicini che questo ha comunicato al
+ * peer: all'avvio, in risposta a UDPcheck o
+ * spontaneamente con un messaggio di tipo
+ * MESSAGES_TOPOLOGY_UPDATE.
+ *
+ * L'array neighbours deve avere almeno
+ * MAX_NEIGHBOUR_NUMBER elementi.
+ *
+ * Restituisce 0 in caso di successo e
+ * -1 se il peer non è connesso.
+ */
+int UDPneighbours(struct peer_data* neighbours, size_t* length);
+
 #endif
@@ -37,7 +37,7 @@ int main(int argc, char* argv[])
     struct main_loop_command commands[] = {
         { "start", &start, "<DS_addr DS_port> connette il peer al DS" },
         { "add", &add, "{" ADD_SWAB "|" ADD_NEW_CASE "} <quantity> crea e inserisce una nuova entry nel registo di oggi" },
-        { "get", &get, "{totale|variazione} {" ADD_SWAB "|" ADD_NEW_CASE "} [period] calcola l'aggregazione sull'intervallo specificato" },
+        { "get", &get, "{totale|variazione} {" ADD_SWAB "|" ADD_NEW_CASE "} [period] [progressivo] calcola l'aggregazione sull'intervallo specificato, con progressivo mostra subito un risultato provvisorio e lo aggiorna" },
         { "!", &shell, "esegue il comando passato con la shell di sistema" },
         { "stop", &stop, "termina il peer" }
     };
@@ -0,0 +1,193 @@
+/** Avvia più peer all'interno dello stesso
+ * processo, così da poter simulare network
+ * molto densi su una sola macchina.
+ *
+ * Ciascun peer conserva i propri thread UDP,
+ * TCP ed ENTRIES mentre i worker del
+ * sottosistema TCP sono condivisi da tutti.
+ */
+#include "peer-src/peer_instance.h"
+#include "peer-src/peer_add.h"
+#include "peer-src/peer_get.h"
+#include "peer-src/peer_stop.h"
+#include "common-src/cmd_shell.h"
+#include "commons.h"
+#include "repl.h"
+#include "main_loop.h"
+#include "unified_io.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define ARGNAMES "DS_addr> <DS_port> <prima_porta> <numero_peer> [-q]"
+
+/* massimo numero di peer avviabili */
+#define PEERS_MAX 4096
+
+/** Tentativi di avvio di un peer con porta scelta
+ * dal sistema: la porta UDP ottenuta potrebbe non
+ * essere libera per il TCP.
+ */
+#define PEERS_START_ATTEMPTS 5
+
+/* peer avviati */
+static struct peer_instance** INSTANCES;
+static int INSTANCESnumber;
+
+void usageHelp(const char* p)
+{
+    printf("Usage:\n\t%s <" ARGNAMES ">\n", p);
+    printf("\tCon <prima_porta> pari a 0 le porte sono scelte dal sistema.\n");
+    printf("\tCon -q sono mostrati solo i messaggi di errore dei peer.\n");
+
+    exit(EXIT_FAILURE);
+}
+
+/** Cerca il peer in ascolto sulla porta indicata.
+ *
+ * Restituisce NULL se non c'è.
+ */
+static struct peer_instance* findInstance(int port)
+{
+    int i;
+
+    for (i = 0; i < INSTANCESnumber; ++i)
+        if (INSTANCES[i] != NULL && peer_instance_port(INSTANCES[i]) == port)
+            return INSTANCES[i];
+
+    return NULL;
+}
+
+/** Comando "peer": esegue add o get per conto
+ * del peer in ascolto sulla porta indicata.
+ */
+static int peerCmd(const char* args)
+{
+    struct peer_instance* inst;
+    char cmd[REPL_CMD_MAX_L+1] = "";
+    int port, offset, ans;
+
+    offset = 0;
+    if (sscanf(args, "%d %20s %n", &port, cmd, &offset) < 2)
+    {
+        fprintf(stderr, "Wrong sintax: peer <porta> {add|get} ...\n");
+        return ERR_PARAMS;
+    }
+
+    inst = findInstance(port);
+    if (inst == NULL)
+    {
+        printf("Nessun peer in ascolto sulla porta %d\n", port);
+        return WRN_CONTINUE;
+    }
+    if (!peer_instance_running(inst))
+    {
+        printf("Il peer [%d] è stato spento dal server\n", port);
+        return WRN_CONTINUE;
+    }
+
+    /* il thread principale lavora per il peer scelto */
+    peer_context_set(peer_instance_context(inst));
+    if (strcmp(cmd, "add") == 0)
+        ans = add(args + offset);
+    else if (strcmp(cmd, "get") == 0)
+        ans = get(args + offset);
+    else
+    {
+        fprintf(stderr, "Comando sconosciuto: %s\n", cmd);
+        ans = ERR_PARAMS;
+    }
+    peer_context_set(NULL);
+
+    return ans;
+}
+
+/* comando "list": mostra i peer avviati */
+static int listCmd(const char* args)
+{
+    int i, active;
+
+    (void)args;
+
+    active = 0;
+    for (i = 0; i < INSTANCESnumber; ++i)
+    {
+        if (INSTANCES[i] == NULL)
+            continue;
+        printf("[%d]%s\n", peer_instance_port(INSTANCES[i]),
+            peer_instance_running(INSTANCES[i]) ? "" : " spento dal server");
+        if (peer_instance_running(INSTANCES[i]))
+            ++active;
+    }
+    printf("%d peer attivi su %d\n", active, INSTANCESnumber);
+
+    return OK_CONTINUE;
+}
+
+int main(int argc, char* argv[])
+{
+    struct main_loop_command commands[] = {
+        { "peer", &peerCmd, "<porta> {add|get} ... esegue add o get per conto del peer indicato" },
+        { "list", &listCmd, "mostra i peer avviati" },
+        { "!", &shell, "esegue il comando passato con la shell di sistema" },
+        { "stop", &stop, "termina tutti i peer" }
+    };
+
+    int commandNumber = sizeof(commands)/sizeof(struct main_loop_command);
+    int firstPort, i, attempt;
+
+    printf("PROCESS ID [%lu]\n", (unsigned long)getpid());
+
+    if (argc < 5 || argc > 6 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+        usageHelp(argv[0]);
+    if (argc == 6 && strcmp(argv[5], "-q") != 0)
+        usageHelp(argv[0]);
+
+    /* parsing degli argomenti */
+    firstPort = argParseIntRange(argv[3], "prima_porta", 0, (1<<16)-1);
+    INSTANCESnumber = argParseIntRange(argv[4], "numero_peer", 1, PEERS_MAX);
+    if (firstPort != 0 && firstPort + INSTANCESnumber > (1<<16))
+        errExit("*** Porte insufficienti per %d peer ***\n", INSTANCESnumber);
+
+    peer_instance_reserve(INSTANCESnumber);
+
+    INSTANCES = calloc((size_t)INSTANCESnumber, sizeof(struct peer_instance*));
+    if (INSTANCES == NULL)
+        errExit("*** calloc ***\n");
+
+    if (unified_io_init() == -1)
+        errExit("*** Errore attivazione sottosistema di I/O ***\n");
+    unified_io_set_quiet(argc == 6);
+
+    for (i = 0; i < INSTANCESnumber; ++i)
+    {
+        if (firstPort != 0)
+            INSTANCES[i] = peer_instance_start(firstPort + i, argv[1], argv[2]);
+        else
+            for (attempt = 0; attempt != PEERS_START_ATTEMPTS && INSTANCES[i] == NULL; ++attempt)
+                INSTANCES[i] = peer_instance_start(0, argv[1], argv[2]);
+        if (INSTANCES[i] == NULL)
+            errExit("*** Errore avvio del peer %d ***\n", i);
+        /* evita che i messaggi si accumulino */
+        while (unified_io_print(1) == 0)
+            ;
+    }
+
+    printf("Avviati %d peer connessi a [%s:%s]\n", INSTANCESnumber, argv[1], argv[2]);
+
+    main_loop("[peers]", commands, commandNumber);
+
+    for (i = 0; i < INSTANCESnumber; ++i)
+        if (peer_instance_stop(INSTANCES[i]) == -1)
+            errExit("*** Errore terminazione del peer [%d] ***\n", peer_instance_port(INSTANCES[i]));
+    free(INSTANCES);
+
+    if (unified_io_close() == -1)
+        errExit("*** Errore terminazione sottosistema IO ***\n");
+
+    printf("Peer terminati correttamente.\n");
+
+    return EXIT_SUCCESS;
+}
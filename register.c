@@ -121,8 +121,31 @@ struct e_register
      * presenti nel register.
      */
     struct set* allSignature;
+    /** Insieme delle firme di cui il register
+     * possiede almeno una entry e relativo
+     * digest, aggiornato a ogni nuova firma
+     * (vedi register_digest).
+     */
+    struct set* entrySignatures;
+    uint32_t digest;
 };
 
+/** Mescola i bit di una firma in modo che il
+ * digest, ottenuto come XOR dei valori di tutte
+ * le firme, non dipenda dall'ordine di arrivo
+ * delle entry ma distingua comunque insiemi
+ * diversi (finalizzatore di MurmurHash3).
+ */
+static uint32_t register_mix_signature(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x;
+}
+
 struct entry*
 register_new_entry(struct entry* E,
                 enum entry_type type,
@@ -510,6 +533,15 @@ struct e_register* register_create(struct e_register* r, int defaultSignature)
 
         return NULL;
     }
+    ans->entrySignatures = set_init(NULL);
+    if (ans->entrySignatures == NULL)
+    {
+        set_destroy(ans->allSignature);
+        if (r == NULL)
+            free(ans);
+
+        return NULL;
+    }
     /* un elemento già ci deve finire */
     if (defaultSignature)
         set_add(ans->allSignature, (long)defaultSignature);
@@ -519,6 +551,7 @@ struct e_register* register_create(struct e_register* r, int defaultSignature)
     if (ans->l == NULL)
     {
         set_destroy(ans->allSignature);
+        set_destroy(ans->entrySignatures);
         if (r == NULL)
             free(ans);
 
@@ -569,6 +602,8 @@ void register_destroy(struct e_register* r)
     r->l = NULL;
     set_destroy(r->allSignature);
     r->allSignature = NULL;
+    set_destroy(r->entrySignatures);
+    r->entrySignatures = NULL;
     free(r);
 }
 
@@ -610,6 +645,12 @@ int register_add_entry(struct e_register* R, const struct entry* E)
     /* bisogna inserire un nuova entry? */
     if (E2->signature != 0)
         set_add(R->allSignature, (long)E2->signature);
+    /* prima entry con questa firma: aggiorna il digest */
+    if (E2->signature != 0 && set_has(R->entrySignatures, (long)E2->signature) == 0)
+    {
+        set_add(R->entrySignatures, (long)E2->signature);
+        R->digest ^= register_mix_signature((uint32_t)E2->signature);
+    }
 
     /* segna l'aggiunta */
     R->modified = 1;
@@ -1444,3 +1485,8 @@ int register_owned_signatures(
     *lenght = (size_t)ansLen;
     return 0;
 }
+
+uint32_t register_digest(const struct e_register* R)
+{
+    return R == NULL ? 0 : R->digest;
+}
@@ -470,4 +470,16 @@ int register_print(const struct e_register*);
  */
 int register_owned_signatures(const struct e_register*, int **, size_t*);
 
+/** Fornisce il digest dell'insieme delle firme
+ * di cui il registro possiede almeno una entry.
+ * Registri con le stesse firme hanno lo stesso
+ * digest, indipendentemente dall'ordine con cui
+ * le entry sono state aggiunte, e un registro
+ * vuoto ha digest 0.
+ *
+ * È aggiornato in maniera incrementale da
+ * register_add_entry e register_merge.
+ */
+uint32_t register_digest(const struct e_register*);
+
 #endif
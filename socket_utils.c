@@ -26,7 +26,10 @@ int initTCPSocket(int port, int backlog)
     return fd;
 }
 
-int initSocket(int port, int family)
+/** Implementazione di initSocket: se reusePort
+ * non è nullo imposta anche SO_REUSEPORT.
+ */
+static int initSocketOpt(int port, int family, int reusePort)
 {
     int sckt, err;
     int sockOpt; /* Per setsockopt */
@@ -73,6 +76,13 @@ int initSocket(int port, int family)
             return -1;
         }
 
+        if (reusePort && setsockopt(sckt, SOL_SOCKET, SO_REUSEPORT, &sockOpt, sizeof(sockOpt)) != 0)
+        {
+            close(sckt);
+            freeaddrinfo(res);
+            return -1;
+        }
+
         if (bind(sckt, iter->ai_addr, iter->ai_addrlen) == 0)
             break;  /* È riuscito a connettere il socket */
 
@@ -88,6 +98,16 @@ int initSocket(int port, int family)
     return sckt;
 }
 
+int initSocket(int port, int family)
+{
+    return initSocketOpt(port, family, 0);
+}
+
+int initSharedUDPSocket(int port)
+{
+    return initSocketOpt(port, SOCK_DGRAM, 1);
+}
+
 int getSocketPort(int socket)
 {
     struct sockaddr_storage ss;
@@ -22,6 +22,17 @@
  */
 int initUDPSocket(int);
 
+/** Come initUDPSocket ma imposta anche
+ * SO_REUSEPORT, così che più socket possano
+ * essere ancorati alla stessa porta e il
+ * kernel distribuisca tra questi i
+ * datagrammi in arrivo.
+ *
+ * Tutti i socket che condividono la porta
+ * vanno creati con questa funzione.
+ */
+int initSharedUDPSocket(int);
+
 /** Crea e "ancora" un socket TCP passivo
  * alla porta specificata - oppure su una
  * porta casuale disponibile se viene
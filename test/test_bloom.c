@@ -0,0 +1,243 @@
+/** Test del filtro di Bloom: nessun falso
+ * negativo, falsi positivi vicini alla stima,
+ * unione di filtri di dimensioni diverse e
+ * trasferimento delle parole in network order
+ * come avviene nei messaggi MESSAGES_FLOOD_BLOOM.
+ */
+#include "../bloom.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ELEMENTS 1000
+#define SEED 0x2545F491u
+
+/* elementi inseriti: dispari, quelli assenti pari */
+static uint32_t inserted(int i)
+{
+    return 2*(uint32_t)i*0x9e3779b9u + 1;
+}
+
+static uint32_t missing(int i)
+{
+    return 2*(uint32_t)i*0x9e3779b9u;
+}
+
+static uint32_t* fill(size_t nWords, int n)
+{
+    uint32_t* words;
+    int i;
+
+    words = calloc(nWords, sizeof(uint32_t));
+    if (words == NULL)
+    {
+        fprintf(stderr, "ERRORE calloc\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i != n; ++i)
+        if (bloom_add(words, nWords, SEED, inserted(i)) != 0)
+        {
+            fprintf(stderr, "ERRORE bloom_add(): elemento %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+
+    return words;
+}
+
+static void noFalseNegatives(const uint32_t* words, size_t nWords, int n, const char* what)
+{
+    int i;
+
+    for (i = 0; i != n; ++i)
+        if (bloom_has(words, nWords, SEED, inserted(i)) != 1)
+        {
+            fprintf(stderr, "ERRORE %s: falso negativo sull'elemento %d\n", what, i);
+            exit(EXIT_FAILURE);
+        }
+}
+
+static void testAddHas(void)
+{
+    uint32_t* words;
+    size_t nWords;
+    int i, fp;
+    double rate;
+
+    printf("Test bloom_add e bloom_has:\n");
+
+    nWords = bloom_words(ELEMENTS);
+    if (nWords*32 < ELEMENTS*BLOOM_BITS_PER_ELEMENT)
+    {
+        fprintf(stderr, "ERRORE bloom_words(): filtro troppo piccolo\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* filtro vuoto: nessun elemento presente */
+    words = fill(nWords, 0);
+    for (i = 0; i != ELEMENTS; ++i)
+        if (bloom_has(words, nWords, SEED, inserted(i)) != 0)
+        {
+            fprintf(stderr, "ERRORE bloom_has(): elemento in un filtro vuoto\n");
+            exit(EXIT_FAILURE);
+        }
+    if (bloom_fp_rate(words, nWords) != 0)
+    {
+        fprintf(stderr, "ERRORE bloom_fp_rate(): filtro vuoto\n");
+        exit(EXIT_FAILURE);
+    }
+    free(words);
+
+    words = fill(nWords, ELEMENTS);
+    noFalseNegatives(words, nWords, ELEMENTS, "bloom_has()");
+
+    /* con un altro seme le posizioni cambiano */
+    fp = 0;
+    for (i = 0; i != ELEMENTS; ++i)
+        fp += bloom_has(words, nWords, SEED+1, inserted(i));
+    if (fp == ELEMENTS)
+    {
+        fprintf(stderr, "ERRORE bloom_has(): il seme è ignorato\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* circa 1% di falsi positivi, si accetta fino al 3% */
+    fp = 0;
+    for (i = 0; i != 10*ELEMENTS; ++i)
+        fp += bloom_has(words, nWords, SEED, missing(i));
+    rate = bloom_fp_rate(words, nWords);
+    printf("\tfalsi positivi: %d su %d, stima %.4f\n", fp, 10*ELEMENTS, rate);
+    if (fp > 10*ELEMENTS*3/100 || rate <= 0 || rate > 0.03)
+    {
+        fprintf(stderr, "ERRORE: troppi falsi positivi\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bloom_add(NULL, nWords, SEED, 1) != -1 || bloom_has(words, 0, SEED, 1) != -1)
+    {
+        fprintf(stderr, "ERRORE: parametri non validi accettati\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(words);
+    printf("OK bloom_add e bloom_has!\n");
+}
+
+static void testMerge(void)
+{
+    uint32_t *big, *small, *dst;
+    size_t bigWords, smallWords;
+
+    printf("Test bloom_merge:\n");
+
+    bigWords = bloom_words_pow2(ELEMENTS);
+    smallWords = bigWords/4;
+    if ((bigWords & (bigWords-1)) != 0 || bigWords < bloom_words(ELEMENTS))
+    {
+        fprintf(stderr, "ERRORE bloom_words_pow2()\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* un filtro più grande ripiegato su uno più piccolo */
+    big = fill(bigWords, ELEMENTS);
+    dst = fill(smallWords, 0);
+    if (bloom_merge(dst, smallWords, big, bigWords) != 0)
+    {
+        fprintf(stderr, "ERRORE bloom_merge(): ripiegamento\n");
+        exit(EXIT_FAILURE);
+    }
+    noFalseNegatives(dst, smallWords, ELEMENTS, "bloom_merge() ripiegato");
+    free(dst);
+
+    /* uno più piccolo replicato su uno più grande */
+    small = fill(smallWords, ELEMENTS/4);
+    dst = fill(bigWords, 0);
+    if (bloom_merge(dst, bigWords, small, smallWords) != 0)
+    {
+        fprintf(stderr, "ERRORE bloom_merge(): replica\n");
+        exit(EXIT_FAILURE);
+    }
+    noFalseNegatives(dst, bigWords, ELEMENTS/4, "bloom_merge() replicato");
+
+    /* le dimensioni devono essere potenze di due */
+    if (bloom_merge(dst, bigWords-1, small, smallWords) != -1)
+    {
+        fprintf(stderr, "ERRORE bloom_merge(): dimensione non potenza di due\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(big);
+    free(small);
+    free(dst);
+    printf("OK bloom_merge!\n");
+}
+
+static void testByteOrder(void)
+{
+    uint32_t *words, *received;
+    uint32_t* wire;
+    const unsigned char* bytes;
+    size_t nWords, i;
+
+    printf("Test trasferimento in network order:\n");
+
+    nWords = bloom_words(ELEMENTS);
+    words = fill(nWords, ELEMENTS);
+
+    /* come messages_make_flood_req */
+    wire = calloc(nWords, sizeof(uint32_t));
+    received = calloc(nWords, sizeof(uint32_t));
+    if (wire == NULL || received == NULL)
+    {
+        fprintf(stderr, "ERRORE calloc\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i != nWords; ++i)
+        wire[i] = htonl(words[i]);
+
+    /* sulla rete il byte più significativo viene
+     * per primo, qualunque sia l'ordine dell'host */
+    bytes = (const unsigned char*)wire;
+    for (i = 0; i != nWords; ++i)
+        if (bytes[4*i] != (words[i] >> 24)
+            || bytes[4*i+1] != ((words[i] >> 16) & 0xFF)
+            || bytes[4*i+2] != ((words[i] >> 8) & 0xFF)
+            || bytes[4*i+3] != (words[i] & 0xFF))
+        {
+            fprintf(stderr, "ERRORE: parola %ld non in network order\n", (long)i);
+            exit(EXIT_FAILURE);
+        }
+
+    /* ricostruzione dai soli byte, come farebbe un
+     * host con ordine dei byte diverso */
+    for (i = 0; i != nWords; ++i)
+        received[i] = (uint32_t)bytes[4*i] << 24 | (uint32_t)bytes[4*i+1] << 16
+            | (uint32_t)bytes[4*i+2] << 8 | (uint32_t)bytes[4*i+3];
+    if (memcmp(received, words, nWords*sizeof(uint32_t)) != 0)
+    {
+        fprintf(stderr, "ERRORE: filtro ricostruito diverso\n");
+        exit(EXIT_FAILURE);
+    }
+    noFalseNegatives(received, nWords, ELEMENTS, "filtro ricostruito");
+
+    /* come messages_get_flood_req_body */
+    for (i = 0; i != nWords; ++i)
+        received[i] = ntohl(wire[i]);
+    noFalseNegatives(received, nWords, ELEMENTS, "ntohl");
+
+    free(words);
+    free(wire);
+    free(received);
+    printf("OK trasferimento in network order!\n");
+}
+
+int main()
+{
+    testAddHas();
+    testMerge();
+    testByteOrder();
+
+    printf("DONE!\n");
+    return 0;
+}
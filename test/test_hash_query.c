@@ -0,0 +1,311 @@
+/** Test della chiave delle query usata dalla
+ * cache delle risposte: date ai limiti della
+ * codifica, assenza di collisioni tra query
+ * che differiscono per date, aggregazione o
+ * categoria e stabilità della chiave dopo il
+ * passaggio per il file delle risposte.
+ */
+#include "../peer-src/peer_query.h"
+#include "../time_utils.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* giorni dell'intervallo su cui si cercano collisioni */
+#define DAYS 60
+/* come in peer_query.c */
+#define KEY_EPOCH_YEAR 1970
+#define KEY_DAY_BITS 27
+
+static void build(struct query* Q, enum aggregation_type type,
+            enum entry_type category, const struct tm* begin, const struct tm* end)
+{
+    if (buildQuery(Q, type, category, begin, end) != 0)
+    {
+        fprintf(stderr, "ERRORE buildQuery()\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void testBoundaries(void)
+{
+    struct tm epoch, before, last, after, d1, d2;
+    struct query Q1, Q2;
+    int64_t key;
+
+    printf("Test date ai limiti:\n");
+
+    epoch = time_date_init(KEY_EPOCH_YEAR, 1, 1);
+    before = time_date_add(&epoch, -1);
+    last = time_date_add(&epoch, (1 << KEY_DAY_BITS) - 1);
+    after = time_date_add(&last, 1);
+
+    /* il primo giorno rappresentabile */
+    build(&Q1, AGGREGATION_SUM, NEW_CASE, &epoch, &epoch);
+    key = hashQuery(&Q1);
+    if (key <= 0)
+    {
+        fprintf(stderr, "ERRORE hashQuery(): primo giorno non rappresentato\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* il giorno precedente non lo è */
+    build(&Q1, AGGREGATION_SUM, NEW_CASE, &before, &epoch);
+    if (hashQuery(&Q1) != 0)
+    {
+        fprintf(stderr, "ERRORE hashQuery(): data precedente all'epoca accettata\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* l'ultimo giorno rappresentabile e il successivo */
+    build(&Q1, AGGREGATION_DIFF, SWAB, &epoch, &last);
+    key = hashQuery(&Q1);
+    if (key <= 0)
+    {
+        fprintf(stderr, "ERRORE hashQuery(): ultimo giorno non rappresentato\n");
+        exit(EXIT_FAILURE);
+    }
+    build(&Q2, AGGREGATION_DIFF, SWAB, &epoch, &after);
+    if (hashQuery(&Q2) != 0)
+    {
+        fprintf(stderr, "ERRORE hashQuery(): giorno oltre la codifica accettato\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* giorni consecutivi a cavallo di anno e mese */
+    d1 = time_date_init(2020, 12, 31);
+    d2 = time_date_init(2021, 1, 1);
+    build(&Q1, AGGREGATION_SUM, SWAB, &d1, &d1);
+    build(&Q2, AGGREGATION_SUM, SWAB, &d2, &d2);
+    if (hashQuery(&Q1) == hashQuery(&Q2) || sameQuery(&Q1, &Q2))
+    {
+        fprintf(stderr, "ERRORE: 31/12 e 1/1 confusi\n");
+        exit(EXIT_FAILURE);
+    }
+    d1 = time_date_init(2020, 2, 29);
+    d2 = time_date_init(2020, 3, 1);
+    build(&Q1, AGGREGATION_DIFF, NEW_CASE, &d1, &d2);
+    build(&Q2, AGGREGATION_DIFF, NEW_CASE, &d1, &d1);
+    if (hashQuery(&Q1) == hashQuery(&Q2) || sameQuery(&Q1, &Q2))
+    {
+        fprintf(stderr, "ERRORE: 29/2 e 1/3 confusi\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* una data non normalizzata equivale a quella normalizzata */
+    d1 = time_date_init(2021, 1, 1);
+    d2 = time_date_init(2020, 12, 32);
+    build(&Q1, AGGREGATION_SUM, SWAB, &d1, &d1);
+    build(&Q2, AGGREGATION_SUM, SWAB, &d2, &d2);
+    if (hashQuery(&Q1) != hashQuery(&Q2) || !sameQuery(&Q1, &Q2))
+    {
+        fprintf(stderr, "ERRORE: 32/12/2020 diverso da 1/1/2021\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (hashQuery(NULL) != 0 || sameQuery(NULL, &Q1))
+    {
+        fprintf(stderr, "ERRORE: query NULL accettata\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("OK date ai limiti!\n");
+}
+
+static int cmpKeys(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void testCollisions(void)
+{
+    static const enum aggregation_type types[] = { AGGREGATION_SUM, AGGREGATION_DIFF };
+    static const enum entry_type categories[] = { SWAB, NEW_CASE };
+    struct tm first, begin, end;
+    struct query Q, R;
+    int64_t* keys;
+    size_t n, i;
+    int t, c, b, e;
+
+    printf("Test collisioni:\n");
+
+    keys = malloc(2*2*(DAYS+1)*(DAYS+1)*sizeof(int64_t));
+    if (keys == NULL)
+    {
+        fprintf(stderr, "ERRORE malloc\n");
+        exit(EXIT_FAILURE);
+    }
+
+    first = time_date_init(2020, 1, 1);
+    n = 0;
+    for (t = 0; t != 2; ++t)
+        for (c = 0; c != 2; ++c)
+            for (b = 0; b <= DAYS; ++b)
+                for (e = b; e <= DAYS; ++e)
+                {
+                    begin = time_date_add(&first, b);
+                    end = time_date_add(&first, e);
+                    build(&Q, types[t], categories[c], &begin, &end);
+                    keys[n] = hashQuery(&Q);
+                    if (keys[n] <= 0)
+                    {
+                        fprintf(stderr, "ERRORE hashQuery(): chiave non valida\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ++n;
+
+                    /* stesse date, aggregazione o categoria diversa */
+                    build(&R, types[1-t], categories[c], &begin, &end);
+                    if (hashQuery(&R) == keys[n-1] || sameQuery(&Q, &R))
+                    {
+                        fprintf(stderr, "ERRORE: aggregazioni diverse confuse\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    build(&R, types[t], categories[1-c], &begin, &end);
+                    if (hashQuery(&R) == keys[n-1] || sameQuery(&Q, &R))
+                    {
+                        fprintf(stderr, "ERRORE: categorie diverse confuse\n");
+                        exit(EXIT_FAILURE);
+                    }
+
+                    /* stessa query costruita di nuovo */
+                    build(&R, types[t], categories[c], &begin, &end);
+                    if (hashQuery(&R) != keys[n-1] || !sameQuery(&Q, &R))
+                    {
+                        fprintf(stderr, "ERRORE: query uguali distinte\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+
+    qsort(keys, n, sizeof(int64_t), &cmpKeys);
+    for (i = 1; i < n; ++i)
+        if (keys[i] == keys[i-1])
+        {
+            fprintf(stderr, "ERRORE: collisione sulla chiave %lld\n", (long long)keys[i]);
+            exit(EXIT_FAILURE);
+        }
+
+    printf("\t%ld query, nessuna collisione\n", (long)n);
+    free(keys);
+    printf("OK collisioni!\n");
+}
+
+/* scrive una risposta come ANSWERfile_write */
+static void writeAnswer(FILE* f, const struct answer* A)
+{
+    struct ns_answer* nsA;
+    size_t nsLen;
+    uint32_t len;
+
+    if (initNsAnswer(&nsA, &nsLen, A) != 0)
+    {
+        fprintf(stderr, "ERRORE initNsAnswer()\n");
+        exit(EXIT_FAILURE);
+    }
+    len = htonl((uint32_t)nsLen);
+    if (fwrite(&len, sizeof(len), 1, f) != 1 || fwrite(nsA, nsLen, 1, f) != 1)
+    {
+        fprintf(stderr, "ERRORE fwrite\n");
+        exit(EXIT_FAILURE);
+    }
+    free(nsA);
+}
+
+/* legge una risposta come ANSWERfile_load */
+static struct answer* readAnswer(FILE* f)
+{
+    struct ns_answer* nsA;
+    struct answer* A;
+    uint32_t len;
+    size_t nsLen;
+
+    if (fread(&len, sizeof(len), 1, f) != 1)
+    {
+        fprintf(stderr, "ERRORE fread\n");
+        exit(EXIT_FAILURE);
+    }
+    nsLen = (size_t)ntohl(len);
+    nsA = malloc(nsLen);
+    if (nsA == NULL || fread(nsA, nsLen, 1, f) != 1
+        || readNsAnswer(&A, nsA, nsLen) != 0)
+    {
+        fprintf(stderr, "ERRORE readNsAnswer()\n");
+        exit(EXIT_FAILURE);
+    }
+    free(nsA);
+
+    return A;
+}
+
+static void testAnswerFile(void)
+{
+    struct query Q[3];
+    struct answer* A[3];
+    struct answer* B;
+    struct tm begin, end;
+    int totals[DAYS+1];
+    FILE* f;
+    int i;
+
+    printf("Test file delle risposte:\n");
+
+    for (i = 0; i <= DAYS; ++i)
+        totals[i] = i*i;
+
+    begin = time_date_init(2020, 2, 27);
+    end = time_date_init(2020, 3, 2);
+    build(&Q[0], AGGREGATION_SUM, SWAB, &begin, &end);
+    build(&Q[1], AGGREGATION_DIFF, NEW_CASE, &begin, &end);
+    end = time_date_add(&begin, DAYS);
+    build(&Q[2], AGGREGATION_DIFF, SWAB, &begin, &end);
+
+    if (makeSumAnswer(&A[0], &Q[0], 42) != 0
+        || calcAnswerFromTotals(&A[1], &Q[1], totals, 5) != 0
+        || calcAnswerFromTotals(&A[2], &Q[2], totals, DAYS+1) != 0)
+    {
+        fprintf(stderr, "ERRORE: impossibile costruire le risposte\n");
+        exit(EXIT_FAILURE);
+    }
+
+    f = tmpfile();
+    if (f == NULL)
+    {
+        fprintf(stderr, "ERRORE tmpfile\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i != 3; ++i)
+        writeAnswer(f, A[i]);
+    rewind(f);
+
+    /* le chiavi sono ricalcolate dalle query lette */
+    for (i = 0; i != 3; ++i)
+    {
+        B = readAnswer(f);
+        if (hashQuery(answerQuery(B)) != hashQuery(&Q[i])
+            || !sameQuery(answerQuery(B), &Q[i])
+            || answerSize(B) != answerSize(A[i]))
+        {
+            fprintf(stderr, "ERRORE: risposta %d cambiata nel file\n", i);
+            exit(EXIT_FAILURE);
+        }
+        freeAnswer(B);
+        freeAnswer(A[i]);
+    }
+
+    fclose(f);
+    printf("OK file delle risposte!\n");
+}
+
+int main()
+{
+    testBoundaries();
+    testCollisions();
+    testAnswerFile();
+
+    printf("DONE!\n");
+    return 0;
+}
@@ -0,0 +1,305 @@
+/** Test del digest dei registri e del Merkle
+ * tree costruito su di essi dal sottosistema
+ * delle entry: il digest non dipende
+ * dall'ordine di inserimento, foglia e radice
+ * seguono le fusioni e peer con gli stessi
+ * registri hanno lo stesso hash.
+ *
+ * Il sottosistema salva i registri nella
+ * cartella corrente, perciò il test lavora
+ * in una cartella temporanea.
+ */
+#include "../peer-src/peer_entries_manager.h"
+#include "../peer-src/peer_context.h"
+#include "../register.h"
+#include "../time_utils.h"
+#include "../unified_io.h"
+#include "../commons.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* porte, usate solo per dare il nome ai file */
+#define PORT_A 40001
+#define PORT_B 40002
+
+static const int SIGNATURES[] = { 11, 22, 33, 44, 55 };
+#define SIGNATURES_NUM ((int)(sizeof(SIGNATURES)/sizeof(SIGNATURES[0])))
+
+/* crea un registro con le firme [first, last) */
+static struct e_register* makeRegister(const struct tm* date, int first, int last, int reverse)
+{
+    struct e_register* R;
+    struct entry* E;
+    struct tm d = *date;
+    int i, sig;
+
+    R = register_create_date(NULL, 0, date);
+    if (R == NULL)
+        errExit("*** register_create_date ***\n");
+
+    for (i = first; i != last; ++i)
+    {
+        sig = SIGNATURES[reverse ? last-1-(i-first) : i];
+        E = register_new_entry_date(NULL, NEW_CASE, sig, sig, &d);
+        if (E == NULL || register_add_entry(R, E) != 0)
+            errExit("*** register_add_entry ***\n");
+        register_free_entry(E);
+    }
+
+    return R;
+}
+
+static void testDigest(void)
+{
+    struct tm date;
+    struct e_register *R1, *R2, *R3, *R4;
+    struct entry* E;
+
+    printf("Test register_digest:\n");
+
+    date = time_date_init(2021, 3, 15);
+
+    R1 = makeRegister(&date, 0, 0, 0);
+    if (register_digest(R1) != 0)
+    {
+        fprintf(stderr, "ERRORE register_digest(): registro vuoto\n");
+        exit(EXIT_FAILURE);
+    }
+    register_destroy(R1);
+
+    /* stesse firme in ordine inverso */
+    R1 = makeRegister(&date, 0, SIGNATURES_NUM, 0);
+    R2 = makeRegister(&date, 0, SIGNATURES_NUM, 1);
+    if (register_digest(R1) == 0 || register_digest(R1) != register_digest(R2))
+    {
+        fprintf(stderr, "ERRORE register_digest(): dipende dall'ordine\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* una seconda entry con una firma già presente non conta */
+    E = register_new_entry_date(NULL, SWAB, 7, SIGNATURES[0], &date);
+    if (E == NULL || register_add_entry(R2, E) != 0)
+        errExit("*** register_add_entry ***\n");
+    register_free_entry(E);
+    if (register_digest(R1) != register_digest(R2))
+    {
+        fprintf(stderr, "ERRORE register_digest(): firma ripetuta contata\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* la fusione di due metà dà lo stesso digest */
+    R3 = makeRegister(&date, 0, 2, 0);
+    R4 = makeRegister(&date, 1, SIGNATURES_NUM, 1);
+    if (register_digest(R3) == register_digest(R1))
+    {
+        fprintf(stderr, "ERRORE register_digest(): sottoinsieme uguale al totale\n");
+        exit(EXIT_FAILURE);
+    }
+    if (register_merge(R3, R4) != 0)
+        errExit("*** register_merge ***\n");
+    if (register_digest(R3) != register_digest(R1))
+    {
+        fprintf(stderr, "ERRORE register_digest(): non aggiornato da register_merge\n");
+        exit(EXIT_FAILURE);
+    }
+
+    register_destroy(R1);
+    register_destroy(R2);
+    register_destroy(R3);
+    register_destroy(R4);
+    printf("OK register_digest!\n");
+}
+
+static uint32_t node(uint32_t n)
+{
+    uint32_t hash;
+
+    if (getMerkleNode(n, &hash) != 0)
+    {
+        fprintf(stderr, "ERRORE getMerkleNode(): nodo %ld\n", (long)n);
+        exit(EXIT_FAILURE);
+    }
+    return hash;
+}
+
+/* fonde nel registro del peer corrente quello fornito */
+static void merge(struct e_register* R)
+{
+    if (mergeRegisterContent(R) == -1)
+    {
+        fprintf(stderr, "ERRORE mergeRegisterContent()\n");
+        exit(EXIT_FAILURE);
+    }
+    register_destroy(R);
+}
+
+static void testMerkle(void)
+{
+    struct peer_context *A, *B;
+    struct tm date, next;
+    struct e_register* all;
+    uint32_t leaf, nextLeaf, i;
+    uint32_t before[32];
+    int depth, j;
+
+    printf("Test Merkle tree:\n");
+
+    A = peer_context_create();
+    B = peer_context_create();
+    if (A == NULL || B == NULL)
+        errExit("*** peer_context_create ***\n");
+
+    date = time_date_init(2021, 3, 15);
+    next = time_date_add(&date, 1);
+    all = makeRegister(&date, 0, SIGNATURES_NUM, 0);
+
+    peer_context_set(A);
+    if (startEntriesSubsystem(PORT_A) != 0)
+        errExit("*** startEntriesSubsystem ***\n");
+    if (getMerkleLeaf(&date, &leaf) != 0 || getMerkleLeaf(&next, &nextLeaf) != 0
+        || nextLeaf != leaf+1)
+    {
+        fprintf(stderr, "ERRORE getMerkleLeaf()\n");
+        exit(EXIT_FAILURE);
+    }
+    if (node(leaf) != 0 || node(1) != 0)
+    {
+        fprintf(stderr, "ERRORE: Merkle tree non vuoto\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* una fusione cambia la foglia e tutti i suoi antenati */
+    merge(makeRegister(&date, 0, 3, 0));
+    depth = 0;
+    for (i = leaf; i != 0; i /= 2)
+        before[depth++] = node(i);
+    if (before[0] == 0 || before[depth-1] == 0)
+    {
+        fprintf(stderr, "ERRORE: foglia o radice non aggiornate\n");
+        exit(EXIT_FAILURE);
+    }
+    if (node(nextLeaf) != 0)
+    {
+        fprintf(stderr, "ERRORE: aggiornata la foglia sbagliata\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* niente di nuovo: niente cambia */
+    merge(makeRegister(&date, 1, 3, 1));
+    if (node(leaf) != before[0] || node(1) != before[depth-1])
+    {
+        fprintf(stderr, "ERRORE: hash cambiati senza nuove firme\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* le firme mancanti aggiornano di nuovo il percorso */
+    merge(makeRegister(&date, 3, SIGNATURES_NUM, 0));
+    if (node(leaf) != register_digest(all))
+    {
+        fprintf(stderr, "ERRORE: foglia diversa dal digest del registro\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = leaf, j = 0; i != 0; i /= 2, ++j)
+        if (node(i) == before[j])
+        {
+            fprintf(stderr, "ERRORE: nodo %ld non aggiornato\n", (long)i);
+            exit(EXIT_FAILURE);
+        }
+
+    /* stesso contenuto in un altro peer, arrivato
+     * in un ordine diverso */
+    peer_context_set(B);
+    if (startEntriesSubsystem(PORT_B) != 0)
+        errExit("*** startEntriesSubsystem ***\n");
+    merge(makeRegister(&date, 2, SIGNATURES_NUM, 1));
+    merge(makeRegister(&date, 0, 2, 1));
+    if (node(leaf) != register_digest(all))
+    {
+        fprintf(stderr, "ERRORE: foglia diversa dal digest del registro\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = leaf; i != 0; i /= 2)
+    {
+        uint32_t hashB = node(i);
+
+        peer_context_set(A);
+        if (node(i) != hashB)
+        {
+            fprintf(stderr, "ERRORE: stesso contenuto, nodo %ld diverso\n", (long)i);
+            exit(EXIT_FAILURE);
+        }
+        peer_context_set(B);
+    }
+
+    /* basta un giorno diverso per cambiare la radice */
+    merge(makeRegister(&next, 0, 1, 0));
+    peer_context_set(A);
+    if (node(1) == before[depth-1])
+    {
+        fprintf(stderr, "ERRORE: radice invariata\n");
+        exit(EXIT_FAILURE);
+    }
+    i = node(1);
+    peer_context_set(B);
+    if (node(1) == i)
+    {
+        fprintf(stderr, "ERRORE: contenuti diversi, stessa radice\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (closeEntriesSubsystem() != 0)
+        errExit("*** closeEntriesSubsystem ***\n");
+    peer_context_set(A);
+    if (closeEntriesSubsystem() != 0)
+        errExit("*** closeEntriesSubsystem ***\n");
+    peer_context_set(NULL);
+    peer_context_destroy(A);
+    peer_context_destroy(B);
+    register_destroy(all);
+    printf("OK Merkle tree!\n");
+}
+
+/* elimina la cartella temporanea e i file salvati */
+static void removeDir(const char* path)
+{
+    DIR* dir;
+    struct dirent* d;
+
+    if (chdir(path) != 0)
+        errExit("*** chdir ***\n");
+    dir = opendir(".");
+    if (dir == NULL)
+        errExit("*** opendir ***\n");
+    while ((d = readdir(dir)) != NULL)
+        if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+            unlink(d->d_name);
+    closedir(dir);
+    if (chdir("/") != 0 || rmdir(path) != 0)
+        errExit("*** rmdir ***\n");
+}
+
+int main()
+{
+    char dir[] = "/tmp/test_merkle_XXXXXX";
+
+    testDigest();
+
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0)
+        errExit("*** mkdtemp ***\n");
+    if (unified_io_init() != 0)
+        errExit("*** unified_io_init ***\n");
+    unified_io_set_quiet(1);
+
+    testMerkle();
+
+    if (unified_io_close() != 0)
+        errExit("*** unified_io_close ***\n");
+    removeDir(dir);
+
+    printf("DONE!\n");
+    return 0;
+}
@@ -120,15 +120,15 @@ int start_long_life_thread(pthread_t *thread, void*(*t_fun)(void *), void* args,
     struct thread_semaphore* ts;
     int status;
     void* d;
-    void* argv[2];
+    struct thread_semaphore_args argv;
 
     ts = thread_semaphore_init();
     if (ts == NULL)
         return -1;
 
-    argv[0] = ts;
-    argv[1] = args;
-    if (pthread_create(&t, NULL, t_fun, (void*)argv) != 0)
+    argv.ts = ts;
+    argv.args = args;
+    if (pthread_create(&t, NULL, t_fun, (void*)&argv) != 0)
     {
         thread_semaphore_destroy(ts);
         return -1;
@@ -189,7 +189,7 @@ struct thread_semaphore* thread_semaphore_form_args(void* args)
     if (args == NULL)
         return NULL;
 
-    return (struct thread_semaphore*)((void**)args)[0];
+    return ((struct thread_semaphore_args*)args)->ts;
 }
 
 void* thread_semaphore_get_args(void* args)
@@ -198,5 +198,16 @@ void* thread_semaphore_get_args(void* args)
     if (args == NULL)
         return NULL;
 
-    return (struct thread_semaphore*)((void**)args)[1];
+    return ((struct thread_semaphore_args*)args)->args;
+}
+
+int thread_semaphore_set_args(void* args, void* value)
+{
+    /* argomenti mancanti */
+    if (args == NULL)
+        return -1;
+
+    ((struct thread_semaphore_args*)args)->args = value;
+
+    return 0;
 }
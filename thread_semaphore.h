@@ -20,6 +20,23 @@
  */
 struct thread_semaphore;
 
+/** Argomento che start_long_life_thread passa
+ * alla funzione del thread: il semaforo da
+ * segnalare e il parametro del chiamante.
+ *
+ * Chi avvia il thread senza passare per
+ * start_long_life_thread può costruirlo da sé,
+ * le funzioni thread_semaphore_form_args,
+ * thread_semaphore_get_args e
+ * thread_semaphore_set_args lo leggono e
+ * modificano.
+ */
+struct thread_semaphore_args
+{
+    struct thread_semaphore* ts;
+    void* args;
+};
+
 /** Crea e inzializza il semaforo.
  * Solo il padre deve invocare questa
  * funzione.
@@ -92,11 +109,11 @@ int thread_semaphore_signal(struct thread_semaphore*, int, void*);
  * Il penultimo argomento permette di passare alla
  * funzione un parametro come void*.
  * La funzione argomento riceverà come argomento
- * un puntatore a un void*[2] che però è locale
- * a start_long_life_thread e conterrà il valore
- * argomento nel suo secondo elemento, che andrà
- * copiato prima di segnalare il semaforo se lo
- * si vorrà utilizzare in seguito.
+ * un puntatore a una struct thread_semaphore_args
+ * che però è locale a start_long_life_thread e
+ * conterrà il valore argomento, che andrà copiato
+ * prima di segnalare il semaforo se lo si vorrà
+ * utilizzare in seguito.
  *
  * Utilizza l'ultimo argomento per fornire al
  * chiamante i dati passati dal thread creato,
@@ -123,4 +140,15 @@ struct thread_semaphore* thread_semaphore_form_args(void*);
  */
 void* thread_semaphore_get_args(void*);
 
+/** Sostituisce gli argomenti passati a un
+ * thread creato tramite start_long_life_thread,
+ * dato il parametro (void*) della sua funzione,
+ * con il secondo argomento: serve a chi avvolge
+ * la funzione del thread per passarle i propri.
+ *
+ * Restituisce 0 in caso di successo e -1 in
+ * caso di errore.
+ */
+int thread_semaphore_set_args(void*, void*);
+
 #endif
@@ -115,6 +115,9 @@ static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 static enum unified_io_mode mode = UNIFIED_IO_ASYNC_MODE;
 
+/* se non nullo scarta i messaggi "normali" */
+static volatile int quiet;
+
 int unified_io_init()
 {
     struct queue* Q;
@@ -186,6 +189,11 @@ enum unified_io_mode unified_io_get_mode(void)
     return mode;
 }
 
+void unified_io_set_quiet(int flag)
+{
+    quiet = !!flag;
+}
+
 int unified_io_close()
 {
     if (message_queue == NULL)
@@ -206,6 +214,10 @@ int unified_io_push(enum unified_io_type type, const char* format, ...)
     va_list al;
     int err;
 
+    /* nemmeno da formattare */
+    if (quiet && type == UNIFIED_IO_NORMAL)
+        return 0;
+
     /* assicura che funzioni tutto correttamente */
     msg[UNIFIED_IO_MAX_MSGLEN] = '\0';
 
@@ -70,6 +70,14 @@ int unified_io_set_mode(enum unified_io_mode);
  */
 enum unified_io_mode unified_io_get_mode(void);
 
+/** Se l'argomento non è nullo i messaggi di
+ * tipo UNIFIED_IO_NORMAL sono scartati senza
+ * essere stampati, quelli di errore no.
+ * Utile quando i thread sono tanti da rendere
+ * l'output illeggibile.
+ */
+void unified_io_set_quiet(int);
+
 /** Da chiamare alla fine dell'utilizzo.
  * Libera tutte le risorse utilizzate.
  *